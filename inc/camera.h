@@ -108,12 +108,16 @@ public:
   camera* active_camera = 0;
   // The camera is very important to the shaders, so
   // it has a uniform buffer object all to itself.
-  /** Dedicated 'camera' Uniform Buffer Object buffer index. */
+  /**
+   * Dedicated 'camera' Uniform Buffer Object binding point.
+   * See 'shader_ubo_blocks' in 'shaders.h'.
+   */
   int cam_ubo = 1;
-  /** Dedicated 'camera' Uniform Buffer Object block buffer ID. */
-  GLuint cam_block_buffer = 0;
-  /** Dedicated 'camera' Uniform Buffer Object index. */
-  GLuint cam_ubo_index = 0;
+  /**
+   * Offset of the active camera's values in the UBO ring buffer,
+   * or -1 if they have not been written yet.
+   */
+  GLintptr cam_ubo_offset = -1;
   /** Float buffer backing the 'camera' Uniform Buffer Object */
   float cam_ubo_buf[ CAM_UBO_SIZE ];
 
@@ -122,6 +126,7 @@ public:
 
   void update_cam_ubo();
   void init_cam_ubo();
+  void bind_cam_ubo();
 
   camera* add_camera(string name, camera* c);
   camera* add_camera(string name);
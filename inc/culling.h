@@ -0,0 +1,43 @@
+#ifndef BRLA_CULLING_H
+#define BRLA_CULLING_H
+
+#include <vector>
+
+#include "camera.h"
+#include "math3d.h"
+#include "unity.h"
+#include "util.h"
+
+using std::vector;
+
+class camera;
+class unity;
+
+/** Number of planes which bound a view frustum. */
+#define BRLA_FRUSTUM_PLANES 6
+
+/**
+ * View frustum, as six planes extracted from a combined
+ * perspective * view matrix. Each plane's normal points into
+ * the frustum, so a point is inside a plane if
+ * 'dot( normal, point ) + d' is not negative.
+ */
+class frustum {
+protected:
+  int test4( const float c[ 3 ][ 4 ], const float e[ 3 ][ 4 ] );
+
+public:
+  /** Plane coefficients; X / Y / Z normal, then 'd'. */
+  float planes[ BRLA_FRUSTUM_PLANES ][ 4 ];
+  /** Absolute values of each plane's normal. */
+  float abs_normals[ BRLA_FRUSTUM_PLANES ][ 3 ];
+
+  frustum();
+  frustum( m4 view_proj );
+  frustum( camera* cam );
+
+  void set( m4 view_proj );
+  void cull( const vector<unity*>& objs, vector<unity*>& visible );
+};
+
+#endif
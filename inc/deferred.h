@@ -0,0 +1,66 @@
+#ifndef BRLA_DEFERRED_H
+#define BRLA_DEFERRED_H
+
+#include <GL/glew.h>
+
+#include "game.h"
+#include "util.h"
+
+/**
+ * Offsets past the texture manager's units of the texture units
+ * which hold the G-buffer. The depth and albedo textures use the
+ * units reserved for the NPR depth / texture buffers, so that the
+ * post-processing shaders' 'depth_tex_sampler' reads the G-buffer.
+ */
+#define BRLA_GBUF_DEPTH_TEX_IND 1
+#define BRLA_GBUF_ALBEDO_TEX_IND 2
+#define BRLA_GBUF_NORMAL_TEX_IND 5
+
+class game;
+
+/**
+ * Deferred shading renderer: an alternative to shading objects
+ * as they are drawn, selected at startup with '-d'. The opaque
+ * pass writes each pixel's surface color and view-space normal
+ * into a 'G-buffer' with the G-buffer shader program, and then
+ * one full-screen pass lights every pixel once. The lighting pass
+ * rebuilds each pixel's position from its depth value, and shades
+ * only the lights in its light cluster, which is the screen tile
+ * split further by depth; see 'light_clusters.h'. So the lighting
+ * cost does not grow with overdraw, or with lights elsewhere.
+ *
+ * The G-buffer is not multisampled, so the lighting pass also
+ * writes the depth values to the window's framebuffer, for
+ * anything which is drawn after it.
+ */
+class deferred_renderer {
+protected:
+  void free_targets();
+
+public:
+  /** Width / height of the G-buffer textures, in pixels. */
+  int width = 0;
+  int height = 0;
+  /** OpenGL framebuffer which the opaque pass draws into. */
+  GLuint fbuf = 0;
+  /** RGBA8 surface colors. */
+  GLuint albedo_tex = 0;
+  /** RGBA16F view-space surface normals. */
+  GLuint normal_tex = 0;
+  /** 24-bit depth values. */
+  GLuint depth_tex = 0;
+  /**
+   * Empty vertex array object for the full-screen pass, which
+   * makes its triangle from the vertex IDs.
+   */
+  GLuint empty_vao = 0;
+
+  deferred_renderer();
+  ~deferred_renderer();
+
+  void resize( int w, int h );
+  void begin_geometry();
+  void draw_lighting();
+};
+
+#endif
@@ -17,10 +17,17 @@
 #include <stdlib.h>
 
 #include "camera.h"
+#include "deferred.h"
 #include "gui.h"
+#include "job_pool.h"
+#include "level_loader.h"
 #include "lighting.h"
 #include "math3d.h"
+#include "occlusion.h"
+#include "particles.h"
 #include "physics.h"
+#include "render_queue.h"
+#include "ring_buffer.h"
 #include "script.h"
 #include "shaders.h"
 #include "util.h"
@@ -38,7 +45,7 @@
 /** Number of floats in the 'game' Uniform Buffer Object. */
 #define BRLA_GAME_UBO_SIZE 8
 /** Size of the C-string buffer which holds the window title. */
-#define BRLA_TITLE_BUF_SIZE 128
+#define BRLA_TITLE_BUF_SIZE 256
 
 using std::mt19937;
 using std::string;
@@ -46,13 +53,21 @@ using std::unordered_map;
 using std::vector;
 
 // Forward declarations.
+class deferred_renderer;
+class job_pool;
+class level_loader;
+class occlusion_buffer;
+class particle_manager;
 class phong_light;
 class phys_debug_draw;
+class render_queue;
+class ring_buffer;
 class unity;
 // Manager classes.
 class camera_manager;
 class gui_manager;
 class lighting_manager;
+class mesh_manager;
 class physics_manager;
 class shader_manager;
 class texture_manager;
@@ -128,8 +143,21 @@ public:
   string particles_vert_shader_fn = "shaders/vert/particles.vert";
   /** File containing the 'particle effect' fragment shader. */
   string particles_frag_shader_fn = "shaders/frag/particles.frag";
+  /** File containing the 'particle simulation' vertex shader. */
+  string particles_update_vert_shader_fn =
+    "shaders/vert/particles_update.vert";
   /** File containing the 'depth mask' fragment shader. */
   string depth_frag_shader_fn = "shaders/frag/depth.frag";
+  /** File containing the 'full-screen triangle' vertex shader. */
+  string fullscreen_vert_shader_fn = "shaders/vert/fullscreen.vert";
+  /** File containing the 'G-buffer' fragment shader. */
+  string gbuffer_frag_shader_fn = "shaders/frag/gbuffer.frag";
+  /** File containing the 'deferred lighting' fragment shader. */
+  string deferred_light_frag_shader_fn = "shaders/frag/deferred_light.frag";
+  /** File containing the 'layered shadow map' vertex shader. */
+  string shadow_layered_vert_shader_fn = "shaders/vert/shadow_layered.vert";
+  /** File containing the 'layered shadow map' geometry shader. */
+  string shadow_layered_geom_shader_fn = "shaders/geom/shadow_layered.geom";
   /** String key for the 'normal' shader program. */
   string normal_shader_key = "normal shader";
   /** String key for the 'physics debug' shader program. */
@@ -146,13 +174,23 @@ public:
   string pp_img_shim_shader_key = "Image clearing shim";
   /** String key for the 'particle effect' shader program. */
   string particles_shader_key = "Particle effects";
+  /** String key for the 'particle simulation' shader program. */
+  string particles_update_shader_key = "Particle simulation";
   /** String key for the 'depth mask' shader program. */
   string depth_shader_key = "Depth buffer";
+  /** String key for the 'G-buffer' shader program. */
+  string gbuffer_shader_key = "G-buffer";
+  /** String key for the 'deferred lighting' shader program. */
+  string deferred_light_shader_key = "Deferred lighting";
+  /** String key for the 'layered shadow map' shader program. */
+  string shadow_layered_shader_key = "Layered shadow maps";
 
   /** Pointer to the global 'lighting manager' object. */
   lighting_manager* l_man = 0;
   /** Pointer to the global 'texture manager' object. */
   texture_manager* t_man = 0;
+  /** Pointer to the global 'mesh manager' object. */
+  mesh_manager* m_man = 0;
   /** Pointer to the global 'physics manager' object. */
   physics_manager* p_man = 0;
   /** Pointer to the global 'shader manager' object. */
@@ -163,6 +201,18 @@ public:
   unity_manager* u_man = 0;
   /** Pointer to the global 'GUI manager' object. */
   gui_manager* g_man = 0;
+  /** Pointer to the global render queue for game objects. */
+  render_queue* r_queue = 0;
+  /** Pointer to the global pool of worker threads. */
+  job_pool* jobs = 0;
+  /** Pointer to the loader which loads level files in the background. */
+  level_loader* loader = 0;
+  /** Pointer to the software occlusion buffer for the main view. */
+  occlusion_buffer* o_buf = 0;
+  /** Pointer to the deferred renderer, if deferred shading is used. */
+  deferred_renderer* d_rend = 0;
+  /** Pointer to the global 'particle manager' object. */
+  particle_manager* pt_man = 0;
 
   /** File containing a simple monospace font atlas. */
   string f_mono = "textures/png/fonts/monospace.png";
@@ -173,12 +223,20 @@ public:
    * the global game world.
    */
   float world_ubo_buf[ BRLA_GAME_UBO_SIZE ];
-  /** 'Game world' UBO ID. */
+  /** 'Game world' UBO binding point; see 'shader_ubo_blocks'. */
   int world_ubo = 0;
-  /** 'Game world' UBO block buffer index. */
-  GLuint world_block_buffer;
-  /** 'Game world' UBO index. */
-  GLuint world_ubo_index;
+  /**
+   * Ring buffer which every Uniform Buffer Object is written to,
+   * once per frame; each block is bound to its own sub-range.
+   */
+  ring_buffer* ubo_ring = 0;
+  /**
+   * Number of bytes written to Uniform Buffer Objects so far in
+   * the current frame. Shown in the window title with the FPS.
+   */
+  unsigned long frame_ubo_bytes = 0;
+  /** Number of bytes written to UBOs in the previous frame. */
+  unsigned long last_frame_ubo_bytes = 0;
 
   /** Array of global scripts to run during gameplay. */
   vector<script*> g_scripts;
@@ -196,6 +254,27 @@ public:
    * by the Bullet physics simulation.
    */
   bool draw_phys_debug = false;
+  /**
+   * Global state value: when set to true, the visible opaque
+   * objects are drawn into the depth buffer with the 'depth mask'
+   * shader before they are shaded, so that only the nearest
+   * fragment of each pixel runs the lighting shader. That pays off
+   * when there is a lot of overdraw; the window title shows the
+   * GPU time of each pass to compare. Disabled with '-z'.
+   */
+  bool depth_prepass = true;
+  /**
+   * Global state value: when set to true at startup, the world
+   * is drawn with the deferred renderer instead of being shaded
+   * as it is drawn. Enabled with '-d'. See 'deferred.h'.
+   */
+  bool deferred_shading = false;
+  /**
+   * Fraction of the level which is loading that has been loaded,
+   * from 0 to 1. Set by the level loader's progress callback, and
+   * shown as a bar along the bottom of the window.
+   */
+  float load_progress = 1.0f;
   /**
    * Global state value: when set to true, the application
    * will act as a 'level editor' instead of a game.
@@ -324,6 +403,7 @@ public:
   void init();
   int process_game_loop();
   void reload_file( string fn );
+  void draw_loading_bar( float progress );
 
   bool check_key_press( int glfw_key, const char c );
   bool check_key_press( int glfw_key, const char c, const char c2 );
@@ -331,7 +411,9 @@ public:
   void check_text_input( int glfw_key, const char c, const char c2 );
 
   void log_shader_errors( GLuint shader );
+  GLintptr write_ubo( GLuint binding, const void* data, GLsizeiptr size );
   void write_world_ubo();
+  void write_frame_ubos();
   v3 get_mouse_ray( int pix_x, int pix_y );
   void add_script_to_selected( string type );
   void pick_looking_at( v3 dir );
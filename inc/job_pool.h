@@ -0,0 +1,68 @@
+#ifndef BRLA_JOB_POOL_H
+#define BRLA_JOB_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using std::condition_variable;
+using std::deque;
+using std::function;
+using std::mutex;
+using std::thread;
+using std::vector;
+
+/** Upper limit on the number of worker threads in a job pool. */
+#define BRLA_MAX_WORKERS 15
+
+/**
+ * Pool of worker threads for splitting per-frame work into
+ * independent jobs. The threads are started once, and sleep
+ * while there is no work to do.
+ * 'parallel_for' should only be called from one thread at a time.
+ *
+ * Longer background tasks, like decoding a level's assets, can be
+ * queued with 'submit'; they run on whichever workers are free,
+ * and 'parallel_for' does not wait for them.
+ */
+class job_pool {
+protected:
+  /** The worker threads. */
+  vector<thread> workers;
+  /** Lock which protects the job counters below. */
+  mutex lock;
+  /** Signalled when a new set of jobs is available. */
+  condition_variable work_cv;
+  /** Signalled when the last job in a set finishes. */
+  condition_variable done_cv;
+  /** Function to call with each job's index. */
+  function<void( int )> job;
+  /** Number of jobs in the current set. */
+  int num_jobs = 0;
+  /** Index of the next job to hand out. */
+  int next_job = 0;
+  /** Number of jobs in the current set which have not finished. */
+  int remaining = 0;
+  /** Incremented each time a new set of jobs is started. */
+  unsigned long generation = 0;
+  /** Background tasks which have not been started yet. */
+  deque<function<void()>> tasks;
+  /** Set when the pool is being destroyed. */
+  bool stopping = false;
+
+  void worker_loop();
+  void run_jobs();
+
+public:
+  job_pool( int num_threads = 0 );
+  ~job_pool();
+
+  int num_workers();
+  void parallel_for( int count, function<void( int )> fn );
+  void submit( function<void()> task );
+};
+
+#endif
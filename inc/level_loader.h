@@ -0,0 +1,161 @@
+#ifndef BRLA_LEVEL_LOADER_H
+#define BRLA_LEVEL_LOADER_H
+
+#include <GL/glew.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "json.hpp"
+
+#include "game.h"
+#include "job_pool.h"
+#include "mesh.h"
+#include "physics.h"
+#include "texture.h"
+#include "unity.h"
+#include "util.h"
+
+/**
+ * Default time in milliseconds which the level loader may spend
+ * on the main thread in each frame, uploading assets and adding
+ * game objects. At least one step is taken per frame regardless.
+ */
+#define BRLA_LOAD_BUDGET_MS 4.0
+
+using json = nlohmann::json;
+
+using std::condition_variable;
+using std::deque;
+using std::function;
+using std::mutex;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+class game;
+class mesh;
+class texture;
+
+/** One mesh or texture which a level's game objects use. */
+struct level_asset {
+  /** Mesh or texture file path. */
+  string fn;
+  /** Whether this is a mesh, rather than a texture. */
+  bool is_mesh = false;
+  /** Vertex format of a mesh; see 'vertex_formats'. */
+  int v_format = BRLA_VERTEX_FULL;
+  /** Number of BVH collision shapes to build from a mesh. */
+  int num_shapes = 0;
+  /**
+   * Whether the mesh was already in the mesh manager when the
+   * level started loading, so it only needs its shapes built.
+   */
+  bool shared = false;
+  /** The mesh, once it has been loaded. */
+  mesh* m = 0;
+  /** The texture, once it has been decoded. */
+  texture* tex = 0;
+  /** Collision shapes built from the mesh. */
+  vector<btCollisionShape*> shapes;
+  /** Set once the asset has been handed to its manager. */
+  bool resident = false;
+};
+
+/** One game object in a level file, and the assets that it uses. */
+struct level_unity {
+  /** The game object's entry in the level file. */
+  json def;
+  /** Index of its mesh in the loader's assets, or -1. */
+  int mesh_asset = -1;
+  /** Index of its texture in the loader's assets, or -1. */
+  int texture_asset = -1;
+};
+
+/**
+ * Level loader, which loads a level file over several frames
+ * instead of freezing the window until it is done.
+ *
+ * When a level is started, every distinct mesh and texture that
+ * its game objects use is queued on the global 'job_pool': the
+ * worker threads import or map each mesh, quantize its vertices,
+ * build its BVH collision shapes, and decode each texture.
+ * Each frame, 'update' hands the finished assets to their managers
+ * on the main thread, which is the only one that can upload them
+ * to OpenGL, and then adds the game objects whose assets are all
+ * resident, in file order. That work stops once the frame's time
+ * budget is spent. Lights are added last.
+ *
+ * Game objects find their assets already loaded, and take their
+ * collision shapes from the physics manager's prebuilt shapes, so
+ * adding one is only a rigid body and some bookkeeping.
+ * 'on_progress' is called after every frame's step, to drive a
+ * loading screen.
+ */
+class level_loader {
+protected:
+  /** Every asset which the level uses. */
+  vector<level_asset> assets;
+  /** Asset indices, keyed by mesh manager / texture manager keys. */
+  unordered_map<string, int> asset_map;
+  /** Every game object in the level, except the light indicators. */
+  vector<level_unity> unities;
+  /** The level's lights. */
+  json lights;
+  /** Indices of the light indicators' mesh and texture, or -1. */
+  int light_mesh_asset = -1;
+  int light_texture_asset = -1;
+  /** Lock which protects 'decoded', 'in_flight' and 'cancelling'. */
+  mutex lock;
+  /** Signalled when the last worker task finishes. */
+  condition_variable done_cv;
+  /** Indices of assets which the workers have finished with. */
+  vector<int> decoded;
+  /** Number of worker tasks which have not finished. */
+  int in_flight = 0;
+  /** Set while a load is being cancelled, so tasks stop early. */
+  bool cancelling = false;
+  /** Decoded assets which are waiting to be uploaded. */
+  deque<int> ready;
+  /** Index of the next game object to add. */
+  int next_unity = 0;
+  /** Number of assets which have been handed to their managers. */
+  int num_resident = 0;
+  /** Time when the current level started loading, in seconds. */
+  double start_sec = 0.0;
+
+  int add_asset( string fn, bool is_mesh, int v_format );
+  void decode_assets( vector<int> inds );
+  void upload( int i );
+  bool assets_ready( int mesh_asset, int texture_asset );
+  void spawn_unity( json& u_j );
+  void spawn_lights();
+  void wait_for_tasks( bool cancel_tasks );
+  void finish();
+  void release_assets();
+
+public:
+  /** Whether a level is currently loading. */
+  bool active = false;
+  /** Path of the level file which is loading or was last loaded. */
+  string level_fn = "";
+  /** Main thread time to spend on loading each frame, in ms. */
+  double budget_ms = BRLA_LOAD_BUDGET_MS;
+  /** Called with the fraction loaded, from 0 to 1, each frame. */
+  function<void( float progress )> on_progress;
+
+  level_loader();
+  ~level_loader();
+
+  void start( string fn );
+  void update();
+  void cancel();
+  float progress();
+};
+
+#endif
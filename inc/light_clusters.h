@@ -0,0 +1,117 @@
+#ifndef BRLA_LIGHT_CLUSTERS_H
+#define BRLA_LIGHT_CLUSTERS_H
+
+#include <GL/glew.h>
+
+#include <stdint.h>
+#include <vector>
+
+#include "camera.h"
+#include "game.h"
+#include "job_pool.h"
+#include "math3d.h"
+#include "ring_buffer.h"
+
+using std::vector;
+
+class camera;
+class game;
+class phong_light;
+
+/** Number of screen-space cluster columns. */
+#define BRLA_CLUSTER_X 16
+/** Number of screen-space cluster rows. */
+#define BRLA_CLUSTER_Y 9
+/** Number of depth slices, spaced exponentially from near to far. */
+#define BRLA_CLUSTER_Z 24
+/** Total number of clusters in the view frustum. */
+#define BRLA_NUM_CLUSTERS \
+  ( BRLA_CLUSTER_X * BRLA_CLUSTER_Y * BRLA_CLUSTER_Z )
+/** Number of floats in the 'cluster_ubo' Uniform Buffer Object. */
+#define BRLA_CLUSTER_UBO_SIZE 16
+/**
+ * Offset past the texture manager's units of the texture unit
+ * which holds the cluster grid and light index list.
+ */
+#define BRLA_CLUSTER_TEX_IND 4
+/** Initial per-frame size of the cluster data buffer, in bytes. */
+#define BRLA_CLUSTER_BUFFER_SIZE ( 256 * 1024 )
+
+/**
+ * A light's bounds in view space, for assigning it to clusters.
+ * Spotlights also test their cone; the others are just spheres.
+ */
+struct cluster_light {
+  /** View-space position. */
+  v3 center;
+  /** Distance at which the light's linear falloff reaches 0. */
+  float radius;
+  /** Whether the light is a spotlight. */
+  bool spot;
+  /** View-space direction that a spotlight's cone opens towards. */
+  v3 axis;
+  /** Cosine and sine of the spotlight cone's half-angle. */
+  float cos_a;
+  float sin_a;
+};
+
+/**
+ * Clustered forward lighting. The view frustum is divided into
+ * a grid of screen tiles and exponential depth slices, and each
+ * frame every buffered light is assigned to the clusters that its
+ * falloff sphere (and spotlight cone) overlaps. The fragment shader
+ * finds its cluster from its screen position and depth, and only
+ * shades the lights in that cluster's list.
+ *
+ * The grid holds an offset / count pair per cluster, followed by
+ * the concatenated light index lists. Both are streamed through
+ * a ring buffer which the shaders read as one 'usamplerBuffer'.
+ */
+class light_clusters {
+protected:
+  void assign_slice( int z );
+  float slice_depth( int z );
+  bool light_hits( const cluster_light& l, v3 box_min, v3 box_max );
+
+public:
+  /** Buffered lights' view-space bounds, in 'phong_ubo' order. */
+  vector<cluster_light> lights;
+  /** Per-slice concatenated light indices for each cluster. */
+  vector<uint32_t> slice_indices[ BRLA_CLUSTER_Z ];
+  /** Per-slice light counts for each cluster. */
+  vector<uint32_t> slice_counts[ BRLA_CLUSTER_Z ];
+  /** Offset / count pairs for every cluster. */
+  vector<uint32_t> grid;
+  /** Every cluster's light indices, concatenated. */
+  vector<uint32_t> indices;
+  /** Projection scale factors of the camera being clustered. */
+  float proj_x = 1.0f;
+  float proj_y = 1.0f;
+  /** Near and far distances that the slices span. */
+  float near_d = 0.1f;
+  float far_d = 100.0f;
+  /** View and projection matrices that the grid was built for. */
+  m4 view;
+  m4 persp;
+  /** Whether the grid has been built at least once. */
+  bool built = false;
+  /** Ring buffer which the grid and index lists are written to. */
+  ring_buffer* ring = 0;
+  /** Buffer texture which exposes 'ring' to the shaders. */
+  GLuint tex = 0;
+  /** Float buffer backing the 'cluster_ubo' block. */
+  float cluster_ubo_buf[ BRLA_CLUSTER_UBO_SIZE ];
+  /** 'cluster_ubo' binding point; see 'shader_ubo_blocks'. */
+  GLuint cluster_ubo = 3;
+
+  light_clusters();
+  ~light_clusters();
+
+  void build( camera* cam,
+              phong_light** buffered,
+              int count,
+              bool lights_changed );
+  void upload();
+};
+
+#endif
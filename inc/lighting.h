@@ -3,23 +3,63 @@
 
 #include <GL/glew.h>
 
+#include <stdint.h>
 #include <stdio.h>
+#include <algorithm>
 #include <functional>
+#include <unordered_map>
+#include <vector>
 
 #include "camera.h"
 #include "game.h"
+#include "light_clusters.h"
+#include "shadow_atlas.h"
 #include "unity.h"
 #include "util.h"
 
 /**
  * Number of GLFloat values used to store data for one phong light.
+ * Shadowed lights refer to their slot in the shadow lights UBO.
  */
 #define BRLA_PHONG_LIGHT_SIZE 24
+/**
+ * Most lights which are given a shadow atlas tile each frame.
+ * Their shadow matrices and tiles are sent to the shaders in their
+ * own UBO, which this keeps well under the smallest allowed size.
+ */
+#define BRLA_MAX_SHADOWED_LIGHTS 64
+/**
+ * Number of GLFloat values used to store data for one shadowed
+ * light: its shadow matrix and shadow atlas rectangle.
+ */
+#define BRLA_SHADOW_LIGHT_SIZE 20
+/** Floats in the shadow lights UBO: options, then each light. */
+#define BRLA_SHADOW_LIGHTS_UBO_SIZE \
+  ( 4 + BRLA_SHADOW_LIGHT_SIZE * BRLA_MAX_SHADOWED_LIGHTS )
 /**
  * Maximum number of phong lights which can be sent to the shaders.
- * The size of the shader buffer is ( # of lights ) * ( light size ).
+ * The size of the shader buffer is ( # of lights ) * ( light size ),
+ * which must fit in 'GL_MAX_UNIFORM_BLOCK_SIZE'; that is only 16KB
+ * on some drivers, so the lighting manager lowers its 'max_lights'
+ * to fit. Fragments only shade the lights in their cluster, so
+ * this can be fairly large.
+ */
+#define BRLA_MAX_PHONG_LIGHTS 256
+/**
+ * Offset past the texture manager's units of the texture unit
+ * which holds the shadow atlas.
  */
-#define BRLA_MAX_PHONG_LIGHTS 100
+#define BRLA_SHADOW_DEPTH_TEX_IND 3
+/**
+ * Default width / height of the shadow atlas texture, in texels.
+ * Must be a power of two; see 'shadow_atlas.h'.
+ */
+#define BRLA_SHADOW_ATLAS_RES 4096
+/**
+ * Edge length of the cells in the lighting manager's spatial
+ * index, in world units.
+ */
+#define BRLA_LIGHT_CELL_SIZE 32.0f
 
 /**
  * Value indicating that a light is a point light which
@@ -33,23 +73,23 @@
 #define BRLA_LIGHT_PHONG_SPOT  1
 
 using std::function;
+using std::unordered_map;
+using std::vector;
 
 // Forward declarations.
 class camera;
 class game;
+class light_clusters;
+class shadow_atlas;
 class unity;
 
 /**
- * 'Depth pass' framebuffer object. Holds various OpenGL
- * IDs and a camera for drawing to a framebuffer instead
- * of the main display. Used for effects like casting
- * shadows from light sources.
+ * 'Depth pass' object. Holds a camera for drawing a depth map
+ * from a shadow-casting light's perspective, into the tile of
+ * the lighting manager's shadow atlas which the light was given
+ * this frame. See 'shadow_atlas.h'.
  */
 struct fb_depth_pass {
-  /** OpenGL framebuffer ID for the object. */
-  GLuint fbuf = 0;
-  /** OpenGL depth buffer texture ID for the object. */
-  GLuint fbuf_depth_tex = 0;
   // We usually will not want to draw the GUI(s) for retrieving a depth
   // or texture buffer. We may also want to avoid drawing certain unities,
   // like a light's indicator.
@@ -58,12 +98,11 @@ struct fb_depth_pass {
    * be drawn on this depth-pass framebuffer.
    */
   bool draw_gui = false;
-  /** OpenGL texture index to use for the depth-pass framebuffers. */
-  int depth_tex_ind = 3;
-  /** X-axis resolution of the depth map texture. */
-  int res_x;
-  /** Y-axis resolution of the depth map texture. */
-  int res_y;
+  /** Position of this frame's atlas tile, in texels. */
+  int tile_x = 0;
+  int tile_y = 0;
+  /** Width / height of this frame's atlas tile, or 0 if none. */
+  int tile_size = 0;
   /**
    * Array of game objects not to draw on the framebuffer.
    * For example, lights have small 'indicator' spheres to
@@ -79,26 +118,31 @@ struct fb_depth_pass {
    * draw the framebuffer from.
    */
   camera* shadow_cam = 0;
-  /** OpenGL shadow UBO ID for this framebuffer. */
-  GLuint shadow_ubo = 0;
-  /** OpenGL shadow block buffer ID for this framebuffer. */
-  GLuint shadow_block_buffer = 0;
-  /** OpenGL shadow UBO index for this framebuffer. */
-  GLuint shadow_ubo_index = 0;
   /**
-   * Buffer for the shadow UBO. TODO: Use a constant for the array
-   * length, but g++ seemed to dislike that last time I tried it.
+   * Set to draw the depth map again next frame, even if nothing
+   * seems to have changed.
    */
-  float shadow_ubo_buf[ 48 ];
+  bool dirty = true;
+  /** Whether a shadow caster in view was awake last frame. */
+  bool casters_were_active = false;
+  /** Shadow casters in view when last checked, in culling order. */
+  vector<unity*> drawn_casters;
+  /** World bounds of each of 'drawn_casters' when last checked. */
+  vector<aabb> drawn_bounds;
+  /** Shadow camera view / projection when last checked. */
+  m4 drawn_view;
+  m4 drawn_persp;
+  /** Atlas tile position / size when last checked. */
+  int drawn_tile[ 3 ];
+  /** Scratch array of shadow casters inside the camera's view. */
+  vector<unity*> visible_casters;
 
-  fb_depth_pass( int map_res_x, int map_res_y, float falloff );
-  fb_depth_pass( int map_res_x, int map_res_y,
-                 float falloff, unity* first_ignore );
+  fb_depth_pass( float falloff );
+  fb_depth_pass( float falloff, unity* first_ignore );
   ~fb_depth_pass();
 
-  void gen_self( int map_res_x, int map_res_y,
-                 float falloff, unity* first_ignore );
-  void draw();
+  void gen_self( float falloff, unity* first_ignore );
+  bool needs_redraw( vector<unity*>& casters );
 };
 
 /**
@@ -142,6 +186,15 @@ public:
   bool cast_shadows = false;
   /** Pointer to the shadow depth map framebuffer. */
   fb_depth_pass* shadow_depth_fb = 0;
+  /**
+   * Position that the light was last placed in the lighting
+   * manager's spatial index at; the index is rebuilt if it moves.
+   */
+  v3 index_pos;
+  /** Slot in the phong light UBO which holds this light, or -1. */
+  int ubo_slot = -1;
+  /** Last light selection pass which picked this light. */
+  unsigned int select_gen = 0;
 
   phong_light( v4 position, v4 amb, v4 dif, v4 spec );
   phong_light( v4 position, v4 amb, v4 dif, v4 spec,
@@ -157,19 +210,77 @@ public:
  * coordinates sending teh relevant data to the shaders.
  */
 class lighting_manager {
+protected:
+  void rebuild_index();
+  void select_nearest( v3 c_pos );
+  void assign_slots();
+  void pack_light( phong_light* l, int shadow_slot, GLfloat* out );
+  void pack_shadow( phong_light* l, GLfloat* out );
+  void collect_shadow_casters();
+
 public:
+  /**
+   * Number of phong lights which fit in the phong light UBO, at
+   * most 'BRLA_MAX_PHONG_LIGHTS'. The shaders are compiled with
+   * 'MAX_PHONG_LIGHTS' set to this value.
+   */
+  int max_lights = BRLA_MAX_PHONG_LIGHTS;
   /** Size of the phong light Uniform Buffer Object. */
   int phong_ubo_size;
   /** GLfloat array backing the phong light Uniform Buffer Object. */
   GLfloat* phong_ubo_buf = 0;
   /** Array of active phong lights. */
   vector<phong_light*> phong_lights;
-  /** Phong light UBO ID number. */
+  /** Phong light UBO binding point; see 'shader_ubo_blocks'. */
   GLuint phong_ubo = 2;
-  /** Phong light block buffer index. */
-  GLuint phong_block_buffer = 0;
-  /** Phong light UBO index. */
-  GLuint phong_ubo_index = 0;
+  /**
+   * Buffer object backing the phong light UBO. Lights keep their
+   * slot while they stay selected, so only changed slots are
+   * re-uploaded; it is not streamed through the UBO ring buffer.
+   */
+  GLuint phong_ubo_buffer = 0;
+  /** Shadow lights UBO binding point; see 'shader_ubo_blocks'. */
+  GLuint shadow_lights_ubo = 6;
+  /**
+   * Buffer for the shadow lights UBO values. The shadow matrices
+   * change whenever a light or its tile moves, so this is streamed
+   * through the UBO ring buffer each frame.
+   */
+  GLfloat shadow_lights_ubo_buf[ BRLA_SHADOW_LIGHTS_UBO_SIZE ];
+  /** The light buffered in each phong light UBO slot. */
+  phong_light* slots[ BRLA_MAX_PHONG_LIGHTS ];
+  /** Number of phong light UBO slots in use. */
+  int num_slots = 0;
+  /**
+   * Spatial index of the phong lights: a uniform grid of cells,
+   * keyed by their packed X / Y / Z cell coordinates.
+   */
+  unordered_map<int64_t, vector<phong_light*>> light_grid;
+  /** Smallest and largest cell coordinates in 'light_grid'. */
+  int grid_min[ 3 ];
+  int grid_max[ 3 ];
+  /** Whether a light was added, removed, or moved. */
+  bool index_dirty = true;
+  /** Whether the nearest lights need to be selected again. */
+  bool selection_dirty = true;
+  /** Camera position that the nearest lights were selected from. */
+  v3 select_pos;
+  /** Counter identifying the latest light selection pass. */
+  unsigned int select_gen = 0;
+  /** Scratch array holding the selected nearest lights. */
+  vector<phong_light*> nearest;
+  /** Shared depth texture which shadow maps are drawn into. */
+  shadow_atlas* atlas = 0;
+  /** Width / height of the shadow atlas; set before it is created. */
+  int shadow_atlas_res = BRLA_SHADOW_ATLAS_RES;
+  /** Per-cluster light lists for the active camera's view. */
+  light_clusters* clusters = 0;
+  /** Scratch array of game objects which cast shadows. */
+  vector<unity*> shadow_casters;
+  /** Scratch array of shadow maps which need to be drawn again. */
+  vector<fb_depth_pass*> dirty_views;
+  /** Scratch array of the casters seen by one layered pass's views. */
+  vector<unity*> layered_casters;
 
   lighting_manager();
   ~lighting_manager();
@@ -184,7 +295,7 @@ public:
   void update();
   void draw();
   void draw_shadow_casters();
-  void write_lighting_ubo();
+  void write_lighting_ubo( int start, int count );
 };
 
 #endif
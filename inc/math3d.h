@@ -119,7 +119,11 @@ struct quat {
   void r_u();
 };
 
-/** Struct representing an axis-aligned bounding box. */
+/**
+ * Struct representing an axis-aligned bounding box.
+ * Boxes built from only a width / height / depth are
+ * centered on the origin.
+ */
 struct aabb {
   /** width along the X-axis. */
   float x_w;
@@ -127,9 +131,16 @@ struct aabb {
   float y_h;
   /** Depth along the Z-axis. */
   float z_d;
+  /** Minimum X / Y / Z corner. */
+  v3 min_pt;
+  /** Maximum X / Y / Z corner. */
+  v3 max_pt;
 
   aabb();
   aabb( float x_width, float y_height, float z_depth );
+  aabb( v3 min_point, v3 max_point );
+  v3 center() const;
+  v3 half_extents() const;
 };
 
 string print( v3 vec );
@@ -162,12 +173,15 @@ m4 rotate_z( float degrees );
 m4 rotate_z_rads( float rads );
 m4 translation_matrix( float x, float y, float z );
 m4 translation_matrix( v3 t );
+m4 scale_matrix( float x, float y, float z );
+m4 scale_matrix( v3 s );
 m4 quaternion_to_rotation( quat q );
 m4 view_matrix( m4 translation, m4 rotation );
 m4 perspective( float near,
                 float far,
                 float fov,
                 float aspect_ratio );
+aabb transform_aabb( m4 mat, aabb box );
 
 float dot( quat q1, quat q2 );
 float norm( quat q );
@@ -3,36 +3,132 @@
 
 #include <GL/glew.h>
 
+#include <algorithm>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "game.h"
 #include "math3d.h"
+#include "mesh_cache.h"
+#include "mesh_opt.h"
+#include "ring_buffer.h"
 #include "util.h"
 
 using std::string;
+using std::unordered_map;
+using std::vector;
 
 class game;
+class mapped_file;
+class ring_buffer;
 
+/** Number of floats in each per-instance model matrix. */
+#define BRLA_INSTANCE_FLOATS 16
+/**
+ * Initial per-frame capacity of the shared instance buffer,
+ * in matrices.
+ */
+#define BRLA_INSTANCE_BUFFER_SIZE 4096
+/** First vertex attribute location of the per-instance matrix. */
+#define BRLA_INSTANCE_ATTRIB 3
+
+/**
+ * Indexed triangle mesh. Vertices are interleaved as
+ * position / normal / texture coordinates; see 'mesh_opt.h'.
+ */
 class mesh {
 public:
+  /** Number of unique vertices in the vertex buffer. */
   int num_vertices;
-  GLfloat* points = 0;
-  GLfloat* normals = 0;
-  GLfloat* tex_coords = 0;
-  GLuint points_vbo = 0;
-  GLuint normals_vbo = 0;
-  GLuint tex_coords_vbo = 0;
+  /** Number of indices in the index buffer; 3 per triangle. */
+  int num_indices;
+  /** Index type; 'GL_UNSIGNED_SHORT' or 'GL_UNSIGNED_INT'. */
+  GLenum index_type;
+  /** Interleaved vertex data; 'BRLA_VERTEX_FLOATS' per vertex. */
+  GLfloat* vertices = 0;
+  /** Index data, either 16-bit or 32-bit per 'index_type'. */
+  void* indices = 0;
+  GLuint vbo = 0;
+  GLuint ibo = 0;
   GLuint vao = 0;
+  /**
+   * Local-space bounds of the mesh, in the same units as
+   * the imported vertex positions (before any quantization).
+   */
   aabb bounding_box;
-  m4 transform;
-  v3 local_pos;
+  /**
+   * 'bounding_box', grown to include the origin. Physics shapes
+   * are centered on the mesh's origin, so they are sized from this.
+   */
+  aabb phys_bounds;
+  /** Format of the vertex data on the GPU; see 'vertex_formats'. */
+  int vertex_format = BRLA_VERTEX_FULL;
+  /**
+   * Matrix which maps the GPU's vertex positions back to mesh space.
+   * This is the identity for full-precision vertices; it should be
+   * applied before a game object's model transformation.
+   */
+  m4 dequant;
+  /**
+   * Number of game objects currently sharing this mesh.
+   * Managed by the 'mesh_manager' class; per-instance state such
+   * as the model transform and scale lives on each game object.
+   */
+  int ref_count = 0;
+  /**
+   * Quantized vertex data for the 'compact' format, waiting to
+   * be uploaded by 'init_buffers'. Empty once it has been.
+   */
+  vector<unsigned char> compact;
+  /**
+   * Memory-mapped cache file which backs the vertex arrays,
+   * if the mesh was loaded from one. Null if the mesh owns
+   * heap-allocated arrays instead.
+   */
+  mapped_file* cache_file = 0;
 
-  mesh(int num_verts, GLfloat* p, GLfloat* n, GLfloat* t,
-       aabb baa, m4 t_m);
+  mesh(int num_verts, GLfloat* verts,
+       int num_inds, GLenum ind_type, void* inds,
+       aabb baa, int v_format = BRLA_VERTEX_FULL,
+       mapped_file* backing = 0);
   ~mesh();
 
+  void quantize();
   void init_buffers();
-  void scale_by(v3 s);
+  v3 vertex_pos( int i );
+  unsigned int index( int i );
+};
+
+/**
+ * Mesh manager class. Meshes are keyed by file name and vertex
+ * format, and shared between every game object which uses them,
+ * so each distinct mesh is buffered on the GPU only once.
+ */
+class mesh_manager {
+public:
+  /** Hash map of loaded meshes, keyed by file name and format. */
+  unordered_map<string, mesh*> mesh_fn_map;
+  /**
+   * Ring buffer of per-instance model matrices, shared by every
+   * mesh. Each mesh's VAO reads it at 'BRLA_INSTANCE_ATTRIB', and
+   * draws select their matrices with a 'base instance' offset.
+   */
+  ring_buffer* instances = 0;
+
+  mesh_manager();
+  ~mesh_manager();
+
+  void add_mapping( string key, mesh* m );
+  void evict_mapping( string key );
+  mesh* get( string key );
+  mesh* add_mapping_by_fn( string fn, int v_format );
+  mesh* acquire( string fn, int v_format = BRLA_VERTEX_FULL );
+  void release( string fn, int v_format = BRLA_VERTEX_FULL );
+  string key( string fn, int v_format );
+
+  void bind_instance_attribs();
+  int write_instances( const GLfloat* mats, int count );
 };
 
 #endif
@@ -0,0 +1,104 @@
+#ifndef BRLA_MESH_CACHE_H
+#define BRLA_MESH_CACHE_H
+
+#include <GL/glew.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+#include <sys/stat.h>
+#ifndef _WIN32
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <unistd.h>
+#endif
+
+#include "math3d.h"
+#include "mesh_opt.h"
+#include "util.h"
+
+using std::string;
+
+class mesh;
+
+/** Magic number at the start of a mesh cache file; 'BRLM'. */
+#define BRLA_MESH_CACHE_MAGIC 0x4D4C5242
+/**
+ * Mesh cache format version. Bump this whenever the layout
+ * or contents of the cache change, to invalidate old files.
+ */
+#define BRLA_MESH_CACHE_VERSION 3
+/** File extension which is appended to a mesh's cache file. */
+#define BRLA_MESH_CACHE_EXT ".brlm"
+/** Alignment of each data stream in a mesh cache file, in bytes. */
+#define BRLA_MESH_CACHE_ALIGN 16
+
+/**
+ * Header at the start of a binary mesh cache file.
+ * It is followed by aligned vertex and index data streams, which
+ * can be passed directly to OpenGL from a memory-mapped file.
+ * The source file's size / modification time / hash are
+ * stored so that stale caches can be detected and rebuilt.
+ */
+struct mesh_cache_header {
+  /** Magic number; should equal 'BRLA_MESH_CACHE_MAGIC'. */
+  uint32_t magic;
+  /** Format version; should equal 'BRLA_MESH_CACHE_VERSION'. */
+  uint32_t version;
+  /** Number of vertices in the vertex stream. */
+  uint32_t num_vertices;
+  /** Number of indices in the index stream; 3 per triangle. */
+  uint32_t num_indices;
+  /** Size of each index in bytes; 2 or 4. */
+  uint32_t index_size;
+  /** Size of each interleaved vertex in bytes. */
+  uint32_t vertex_size;
+  /** Modification time of the source mesh file. */
+  uint64_t src_mtime;
+  /** Size of the source mesh file, in bytes. */
+  uint64_t src_size;
+  /** 64-bit FNV-1a hash of the source mesh file's contents. */
+  uint64_t src_hash;
+  /** Minimum X / Y / Z extents of the mesh's vertices. */
+  float aabb_min[ 3 ];
+  /** Maximum X / Y / Z extents of the mesh's vertices. */
+  float aabb_max[ 3 ];
+  /** Byte offset of the interleaved vertex stream. */
+  uint64_t vertices_offset;
+  /** Byte offset of the index stream. */
+  uint64_t indices_offset;
+};
+
+/**
+ * Read-only view of a whole file in memory. This uses 'mmap'
+ * where it is available, and falls back to reading the file
+ * into a heap buffer otherwise.
+ */
+class mapped_file {
+public:
+  /** Pointer to the start of the file's contents. */
+  const char* data = 0;
+  /** Length of the file's contents, in bytes. */
+  size_t len = 0;
+
+  mapped_file();
+  ~mapped_file();
+
+  bool open( const char* fn );
+  void close();
+};
+
+bool stat_file( const char* fn, uint64_t& mtime, uint64_t& size );
+uint64_t hash_file( const char* fn );
+bool cache_source_current( const char* src_fn, const char* cache_fn,
+                           void* hdr, size_t hdr_len,
+                           uint64_t& src_mtime,
+                           uint64_t src_size, uint64_t src_hash );
+string mesh_cache_fn( const char* mesh_fn );
+bool write_mesh_cache( const char* mesh_fn, mesh_geometry& geo );
+mesh* load_mesh_cache( const char* mesh_fn, int v_format );
+bool cook_mesh( const char* mesh_fn );
+
+#endif
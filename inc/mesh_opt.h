@@ -0,0 +1,85 @@
+#ifndef BRLA_MESH_OPT_H
+#define BRLA_MESH_OPT_H
+
+#include <GL/glew.h>
+
+#include <algorithm>
+#include <cstring>
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+
+#include "math3d.h"
+
+using std::vector;
+
+/**
+ * Vertex formats which a mesh's GPU buffers can be stored in.
+ * 'Full' vertices use 32-bit floats for every attribute (32 bytes).
+ * 'Compact' vertices are quantized to 16 bytes.
+ */
+enum vertex_formats {
+  BRLA_VERTEX_FULL = 0,
+  BRLA_VERTEX_COMPACT = 1
+};
+
+/**
+ * Number of floats in each interleaved mesh vertex:
+ * 3 for position, 3 for the surface normal, and 2 for the
+ * texture coordinates. (32 bytes per vertex.)
+ */
+#define BRLA_VERTEX_FLOATS 8
+/** Offset of the surface normal in an interleaved vertex, in floats. */
+#define BRLA_VERTEX_NORMAL_OFFSET 3
+/** Offset of the texture coordinates in an interleaved vertex. */
+#define BRLA_VERTEX_UV_OFFSET 6
+/**
+ * Size of each 'compact' quantized vertex, in bytes:
+ * 4 x 16-bit normalized position components (the 4th is padding),
+ * a 2_10_10_10 signed normalized normal, and 2 half-float UVs.
+ */
+#define BRLA_COMPACT_VERTEX_SIZE 16
+/** Offset of the normal in a compact vertex, in bytes. */
+#define BRLA_COMPACT_NORMAL_OFFSET 8
+/** Offset of the texture coordinates in a compact vertex, in bytes. */
+#define BRLA_COMPACT_UV_OFFSET 12
+/**
+ * Post-transform vertex cache size to optimize meshes for.
+ * Modern GPUs don't really have a simple FIFO cache, but
+ * optimizing for a small one works well across the board.
+ */
+#define BRLA_VERTEX_CACHE_SIZE 16
+
+/**
+ * Indexed triangle list with interleaved vertices, used while
+ * building and optimizing meshes before they are cached.
+ */
+struct mesh_geometry {
+  /** Interleaved vertex data; 'BRLA_VERTEX_FLOATS' per vertex. */
+  vector<GLfloat> vertices;
+  /** Triangle list indices into the vertex array. */
+  vector<uint32_t> indices;
+
+  int num_vertices() const {
+    return vertices.size() / BRLA_VERTEX_FLOATS;
+  }
+};
+
+void weld_vertices( int num_verts,
+                    GLfloat* p, GLfloat* n, GLfloat* t,
+                    mesh_geometry& geo );
+void optimize_vertex_cache( mesh_geometry& geo, int cache_size );
+void optimize_vertex_fetch( mesh_geometry& geo );
+int index_size_for( int num_verts );
+void pack_indices( const vector<uint32_t>& indices,
+                   int index_size, void* out );
+uint16_t float_to_half( float f );
+uint32_t pack_snorm_2_10_10_10( float x, float y, float z );
+float quantize_extent( float min_ext, float max_ext );
+void quantize_vertices( const GLfloat* vertices, int num_verts,
+                        const float* min_ext, const float* max_ext,
+                        vector<unsigned char>& out );
+float calc_acmr( const vector<uint32_t>& indices,
+                 int num_verts, int cache_size );
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef BRLA_OCCLUSION_H
+#define BRLA_OCCLUSION_H
+
+#include <float.h>
+#include <algorithm>
+#include <vector>
+
+#include "camera.h"
+#include "culling.h"
+#include "game.h"
+#include "job_pool.h"
+#include "math3d.h"
+#include "mesh.h"
+#include "unity.h"
+
+using std::vector;
+
+class camera;
+class game;
+class unity;
+class unity_manager;
+
+/** Width of the software occlusion depth buffer, in pixels. */
+#define BRLA_OCCLUSION_RES_X 256
+/** Height of the software occlusion depth buffer, in pixels. */
+#define BRLA_OCCLUSION_RES_Y 128
+/** Number of horizontal bands to rasterize occluders in. */
+#define BRLA_OCCLUSION_BANDS 8
+/** Number of candidate objects to test in each job. */
+#define BRLA_OCCLUSION_TEST_BATCH 64
+/**
+ * Minimum clip-space W of an occluder triangle's vertices.
+ * Triangles which cross the near plane are skipped rather than
+ * clipped, which only makes the buffer less complete.
+ */
+#define BRLA_OCCLUSION_MIN_W 0.01f
+
+/**
+ * An occluder triangle in screen space: pixel X / Y coordinates
+ * and 1 / W for each vertex, and the range of rows it touches.
+ */
+struct occluder_tri {
+  float x[ 3 ];
+  float y[ 3 ];
+  float iw[ 3 ];
+  int min_y;
+  int max_y;
+};
+
+/**
+ * Low-resolution software depth buffer for occlusion culling.
+ * Game objects marked as occluders are rasterized into it from the
+ * active camera's view each frame, and other objects are only drawn
+ * if their screen-space bounds are not hidden behind that depth.
+ *
+ * Each pixel holds 1 / W of the nearest occluder, which is linear
+ * in screen space and larger for nearer surfaces; 0 means that no
+ * occluder covers the pixel. Rasterizing and testing are split
+ * into jobs on the global 'job_pool'.
+ */
+class occlusion_buffer {
+protected:
+  void transform_occluder( unity* u, vector<occluder_tri>& tris );
+  void raster_band( int y0, int y1 );
+  void raster_tri( const occluder_tri& t, int y0, int y1 );
+  bool is_visible( const aabb& box );
+
+public:
+  /** Per-pixel depth values; see above. */
+  vector<float> depth;
+  /** Perspective * view matrix that the buffer was drawn with. */
+  m4 view_proj;
+  /** Occluders in view for the current frame. */
+  vector<unity*> occluders;
+  /** Screen-space triangles of each occluder in view. */
+  vector< vector<occluder_tri> > occluder_tris;
+  /** Scratch array of every game object marked as an occluder. */
+  vector<unity*> all_occluders;
+  /** Scratch array of per-object visibility results. */
+  vector<unsigned char> results;
+  /** Number of triangles rasterized in the last 'build' call. */
+  int num_tris = 0;
+
+  occlusion_buffer();
+
+  void build( camera* cam, unity_manager* um );
+  void cull( const vector<unity*>& objs, vector<unity*>& visible );
+};
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef BRLA_PARTICLES_H
+#define BRLA_PARTICLES_H
+
+#include <GL/glew.h>
+
+#include <stdio.h>
+#include <vector>
+
+#include "game.h"
+#include "math3d.h"
+#include "unity.h"
+#include "util.h"
+
+using std::vector;
+
+class game;
+class unity;
+
+/**
+ * Number of emitters in the particle manager's pool. The particle
+ * UBO holds the options and then each emitter's settings, which
+ * must fit in the 16KB block size that every driver allows.
+ */
+#define BRLA_MAX_EMITTERS 255
+/** Default number of particles which each emitter has room for. */
+#define BRLA_PARTICLES_PER_EMITTER 1024
+/** Floats of simulation state per particle: 'vec4 pos_age, vel_tag'. */
+#define BRLA_PARTICLE_FLOATS 8
+/** Floats of settings per emitter in the particle UBO. */
+#define BRLA_EMITTER_FLOATS 16
+/** Number of floats in the 'particles_ubo' Uniform Buffer Object. */
+#define BRLA_PARTICLE_UBO_SIZE \
+  ( 4 + BRLA_EMITTER_FLOATS * BRLA_MAX_EMITTERS )
+
+/**
+ * Particle emitter: one slot of the particle manager's pool. Its
+ * particles are born at an even rate, so that 'count' of them are
+ * alive at once, each one living for 'lifetime' seconds. An emitter
+ * which is attached to a game object follows it, at 'offset' in
+ * the object's local space.
+ */
+struct particle_emitter {
+  /** Index of this emitter's slot in the pool. */
+  int slot = 0;
+  /** Whether this emitter is in use. */
+  bool active = false;
+  /**
+   * Incremented each time the slot is given out, so that
+   * particles left over from its last emitter are replaced.
+   */
+  int gen = 0;
+  /** Game object which this emitter follows, if any. */
+  unity* parent = 0;
+  /** Position relative to 'parent', or in world space if none. */
+  v3 offset;
+  /** Current world-space position. */
+  v3 pos;
+  /** Average starting velocity of new particles. */
+  v3 velocity = v3( 0.0f, 1.0f, 0.0f );
+  /** Random variation added to the starting velocity. */
+  float spread = 0.5f;
+  /** Seconds which each particle lives for. */
+  float lifetime = 3.5f;
+  /** Downwards acceleration of the particles. */
+  float gravity = 1.0f;
+  /** Size of each particle's point sprite, at a distance of 1. */
+  float size = 15.0f;
+  /** Particle color. */
+  v4 color = v4( 0.2f, 1.0f, 0.4f, 1.0f );
+  /** Number of particles alive at once; at most the slot size. */
+  int count = 0;
+  /** Time when this emitter was started, in seconds. */
+  double start_time = 0.0;
+};
+
+/**
+ * Particle manager: a fixed pool of emitters, whose particles are
+ * simulated and drawn entirely on the GPU. Every emitter has a
+ * slot of 'per_emitter' particles in one pair of buffers. Each
+ * frame, a transform feedback pass reads every particle from one
+ * buffer, moves or re-spawns it, and writes it to the other one;
+ * then the buffers swap roles. The particles are then drawn as
+ * point sprites, with one draw call for every emitter.
+ *
+ * The CPU only writes the emitters' settings to the particle UBO,
+ * and nothing is allocated after the pool is created.
+ */
+class particle_manager {
+public:
+  /** Number of particles which each emitter has room for. */
+  int per_emitter;
+  /** Ping-pong particle state buffers. */
+  GLuint buffers[ 2 ];
+  /** Vertex Array Objects which read each particle buffer. */
+  GLuint vaos[ 2 ];
+  /** Index of the buffer holding the current particle state. */
+  int cur = 0;
+  /** Pool of emitters. */
+  particle_emitter emitters[ BRLA_MAX_EMITTERS ];
+  /** Stack of unused emitter slots. */
+  vector<int> free_slots;
+  /** One past the highest slot in use; only these are simulated. */
+  int num_slots = 0;
+  /** Seconds of simulated time. */
+  double sim_time = 0.0;
+  /** Particle UBO binding point; see 'shader_ubo_blocks'. */
+  GLuint particles_ubo = 5;
+  /** Buffer for the particle UBO values. */
+  float particles_ubo_buf[ BRLA_PARTICLE_UBO_SIZE ];
+
+  particle_manager( int particles_per_emitter );
+  ~particle_manager();
+
+  particle_emitter* add_emitter( v3 pos, int count );
+  particle_emitter* add_emitter( unity* parent, v3 offset, int count );
+  void remove_emitter( particle_emitter* e );
+  void detach( unity* u );
+  void write_particles_ubo();
+  void update( float dt );
+  void draw();
+};
+
+void bench_particles();
+
+#endif
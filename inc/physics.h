@@ -321,6 +321,8 @@ public:
                  btQuaternion rot = btQuaternion( 0, 0, 0, 1 ) );
 };
 
+btCollisionShape* build_bvh_shape( mesh* m );
+
 /**
  * Physics manager class, which manages the Bullet physics
  * simulation. It keeps track of the core simulation pointers,
@@ -374,6 +376,11 @@ public:
    * Set to track ongoing collisions in the physics simulation.
    */
   set<collision_pair> col_manifolds;
+  /**
+   * Collision shapes which the level loader built on worker
+   * threads, keyed by the mesh that they were built from.
+   */
+  unordered_map<mesh*, vector<btCollisionShape*>> prebuilt_shapes;
 
   physics_manager();
   ~physics_manager();
@@ -381,6 +388,10 @@ public:
   void update();
   void draw();
 
+  void add_prebuilt_shape( mesh* m, btCollisionShape* shape );
+  btCollisionShape* take_prebuilt_shape( mesh* m );
+  void clear_prebuilt_shapes();
+
   // TODO: Should these 'physics event' methods be in the unity class?
   void collision_event( collision_pair p );
   void separation_event( collision_pair p );
@@ -0,0 +1,142 @@
+#ifndef BRLA_RENDER_QUEUE_H
+#define BRLA_RENDER_QUEUE_H
+
+#include <GL/glew.h>
+
+#include <stdint.h>
+#include <vector>
+
+#include "culling.h"
+#include "game.h"
+#include "mesh.h"
+#include "occlusion.h"
+#include "unity.h"
+
+using std::vector;
+
+class frustum;
+class game;
+class occlusion_buffer;
+class unity;
+
+/**
+ * Render passes, in the order that they sort in a draw key.
+ * Each pass is drawn from one view, with one framebuffer.
+ * The depth pass is the optional depth pre-pass; see
+ * 'render_queue::add_depth_prepass'. The lighting pass is the
+ * deferred renderer's full-screen pass, which is only timed.
+ */
+enum render_passes {
+  BRLA_PASS_SHADOW   = 0,
+  BRLA_PASS_DEPTH    = 1,
+  BRLA_PASS_OPAQUE   = 2,
+  BRLA_PASS_LIGHTING = 3,
+  BRLA_NUM_PASSES    = 4
+};
+
+/**
+ * Draw key bit layout, from the most significant bit down:
+ *   63 - 60: render pass.
+ *   59 - 52: shader program.
+ *   51 - 40: texture.
+ *   39 - 28: vertex array object.
+ *   27 -  0: view depth, front-to-back.
+ * OpenGL object names are masked to fit; that only affects the
+ * order of the draws, since each packet keeps the real objects.
+ */
+#define BRLA_KEY_PASS_SHIFT    60
+#define BRLA_KEY_PROGRAM_SHIFT 52
+#define BRLA_KEY_TEXTURE_SHIFT 40
+#define BRLA_KEY_VAO_SHIFT     28
+#define BRLA_KEY_PASS_MASK    0xFull
+#define BRLA_KEY_PROGRAM_MASK 0xFFull
+#define BRLA_KEY_TEXTURE_MASK 0xFFFull
+#define BRLA_KEY_VAO_MASK     0xFFFull
+#define BRLA_KEY_DEPTH_MASK   0xFFFFFFFull
+
+/**
+ * Frames of GPU pass timer queries kept in flight, so that each
+ * frame's timers are only read once the GPU has finished them.
+ */
+#define BRLA_TIMER_FRAMES 3
+
+/** One queued draw: a sort key and the game object to draw. */
+struct draw_packet {
+  uint64_t key;
+  GLuint program;
+  unity* u;
+};
+
+/** Per-frame counts of the work done by the render queue. */
+struct render_stats {
+  int draws = 0;
+  int program_switches = 0;
+  int texture_binds = 0;
+  int vao_binds = 0;
+  int culled = 0;
+  int occluded = 0;
+  int shadows_cached = 0;
+  /** GPU time spent drawing each render pass, in milliseconds. */
+  double pass_ms[ BRLA_NUM_PASSES ] = { 0.0 };
+};
+
+/**
+ * GPU timestamp queries issued around the passes drawn in one
+ * frame. They are read back 'BRLA_TIMER_FRAMES' frames later.
+ */
+struct pass_timers {
+  /** Pairs of start / end timestamp queries. */
+  vector<GLuint> queries;
+  /** Render pass timed by each pair of queries. */
+  vector<int> passes;
+  /** Number of query pairs issued this frame. */
+  int count = 0;
+};
+
+/**
+ * Render queue. Game objects are submitted as draw packets with
+ * a 64-bit key, radix-sorted, and then drawn with hardware
+ * instancing; consecutive packets which share a program, texture
+ * and mesh become one instanced draw call, and state which is
+ * already bound is not bound again.
+ */
+class render_queue {
+protected:
+  void sort();
+  void read_pass_timers( double* pass_ms );
+
+public:
+  /** Packets submitted since the last 'execute' call. */
+  vector<draw_packet> packets;
+  /** Scratch array for the radix sort. */
+  vector<draw_packet> sort_buf;
+  /** Scratch array of per-instance model matrices. */
+  vector<GLfloat> instance_buf;
+  /** Scratch arrays of objects which passed visibility tests. */
+  vector<unity*> visible_buf;
+  vector<unity*> unoccluded_buf;
+  /** Counts for the current frame. */
+  render_stats stats;
+  /** Counts for the previous frame. */
+  render_stats last_stats;
+  /** Per-pass GPU timers for each frame in flight. */
+  pass_timers timers[ BRLA_TIMER_FRAMES ];
+  /** Index into 'timers' for the current frame. */
+  int timer_frame = 0;
+
+  render_queue();
+  ~render_queue();
+
+  uint64_t make_key( int pass, GLuint program, unity* u );
+  void submit( int pass, unity* u );
+  void submit_visible( int pass, frustum view,
+                       const vector<unity*>& objs,
+                       occlusion_buffer* occ = 0 );
+  void add_depth_prepass( GLuint depth_program );
+  void begin_pass_timer( int pass );
+  void end_pass_timer();
+  void execute();
+  void end_frame();
+};
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef BRLA_RING_BUFFER_H
+#define BRLA_RING_BUFFER_H
+
+#include <GL/glew.h>
+
+#include <string.h>
+
+#include "util.h"
+
+/** Number of frames which a ring buffer keeps in flight. */
+#define BRLA_RING_FRAMES 3
+/** Per-frame size of the shared uniform ring buffer, in bytes. */
+#define BRLA_UBO_RING_SIZE ( 256 * 1024 )
+/** Nanoseconds to wait on a fence before checking it again. */
+#define BRLA_RING_WAIT_NS 1000000
+
+/**
+ * Streaming buffer for data which is rewritten every frame.
+ * The buffer holds 'BRLA_RING_FRAMES' regions; each frame writes
+ * into the next one, and a fence placed at the end of the frame
+ * keeps the CPU from overwriting a region until the GPU is done
+ * reading it. Writes are aligned sub-ranges of the current region,
+ * which can be bound with 'glBindBufferRange' or addressed with
+ * a base vertex / instance.
+ *
+ * Where 'ARB_buffer_storage' is available the buffer is mapped
+ * once, persistently and coherently. Otherwise each write maps its
+ * own range unsynchronized, which the fences make safe.
+ */
+class ring_buffer {
+protected:
+  void create( GLsizeiptr frame_bytes );
+  void destroy();
+  void wait( int region );
+  unsigned char* map_range( GLsizeiptr size, GLintptr& buf_offset );
+  void unmap_range();
+
+public:
+  /** Buffer binding target, e.g. 'GL_UNIFORM_BUFFER'. */
+  GLenum target;
+  /** OpenGL buffer object. */
+  GLuint buffer = 0;
+  /** Size of each frame's region, in bytes. */
+  GLsizeiptr region_size = 0;
+  /** Required alignment of each write's offset, in bytes. */
+  GLint alignment = 1;
+  /** Persistently-mapped pointer to the buffer, if any. */
+  unsigned char* mapped = 0;
+  /** Fences marking the end of each region's last frame. */
+  GLsync fences[ BRLA_RING_FRAMES ];
+  /** Index of the region being written this frame. */
+  int region = 0;
+  /** Next unused byte in the current region. */
+  GLsizeiptr offset = 0;
+
+  ring_buffer( GLenum buf_target, GLsizeiptr frame_bytes, GLint align );
+  ~ring_buffer();
+
+  GLintptr write( const void* data, GLsizeiptr size );
+  GLintptr write_rows_flipped( const unsigned char* data,
+                               GLsizeiptr row_size,
+                               int rows );
+  void advance_frame();
+  void grow( GLsizeiptr frame_bytes );
+};
+
+#endif
@@ -3,6 +3,9 @@
 
 #include <GL/glew.h>
 
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include <fstream>
 #include <string>
 #include <unordered_map>
@@ -11,8 +14,22 @@
 #include "game.h"
 #include "util.h"
 
+#include <sys/stat.h>
+#ifdef _WIN32
+  #include <direct.h>
+#endif
+
 // Max length in chars of OpenGL Shader logs to record.
 #define GL_SHADER_LOG_LEN 2048
+/** Magic number at the start of a program binary cache file; 'BRLP'. */
+#define BRLA_PROGRAM_CACHE_MAGIC 0x504C5242
+/**
+ * Program binary cache format version. Bump this whenever the
+ * layout of the cache files changes, to invalidate old ones.
+ */
+#define BRLA_PROGRAM_CACHE_VERSION 1
+/** File extension of program binary cache files. */
+#define BRLA_PROGRAM_CACHE_EXT ".brlp"
 
 using std::string;
 using std::unordered_map;
@@ -20,23 +37,161 @@ using std::vector;
 
 class game;
 
+/**
+ * Handles for the uniforms which are looked up in each shader
+ * program when it is linked. See 'uniform_names' in 'shaders.cpp'.
+ */
+enum shader_uniforms {
+  BRLA_UNIFORM_TEXTURE_SAMPLER     = 0,
+  BRLA_UNIFORM_SHADOW_SAMPLER      = 1,
+  BRLA_UNIFORM_DEPTH_SAMPLER       = 2,
+  BRLA_UNIFORM_PX_SCALE            = 3,
+  BRLA_UNIFORM_CLUSTER_SAMPLER     = 4,
+  BRLA_UNIFORM_GBUF_ALBEDO_SAMPLER = 5,
+  BRLA_UNIFORM_GBUF_NORMAL_SAMPLER = 6,
+  BRLA_NUM_UNIFORMS                = 7
+};
+
+/**
+ * Handles for the Uniform Buffer Object blocks which are looked
+ * up in each shader program when it is linked. Each handle is
+ * also the block's 'layout(binding = N)' in the GLSL, so values
+ * are bound to these indices with 'glBindBufferRange' when they
+ * are written, no matter which program is in use.
+ * See 'ubo_block_names' in 'shaders.cpp'.
+ */
+enum shader_ubo_blocks {
+  BRLA_UBO_WORLD         = 0,
+  BRLA_UBO_CAM           = 1,
+  BRLA_UBO_PHONG         = 2,
+  BRLA_UBO_CLUSTER       = 3,
+  BRLA_UBO_SHADOW_VIEWS  = 4,
+  BRLA_UBO_PARTICLES     = 5,
+  BRLA_UBO_SHADOW_LIGHTS = 6,
+  BRLA_NUM_UBO_BLOCKS    = 7
+};
+
+/**
+ * Header at the start of a program binary cache file, which is
+ * followed by the binary that 'glGetProgramBinary' returned.
+ */
+struct program_cache_header {
+  /** Magic number; should equal 'BRLA_PROGRAM_CACHE_MAGIC'. */
+  uint32_t magic;
+  /** Format version; should equal 'BRLA_PROGRAM_CACHE_VERSION'. */
+  uint32_t version;
+  /** Hash of the driver, sources and feedback outputs. */
+  uint64_t hash;
+  /** Driver-specific binary format. */
+  uint32_t format;
+  /** Length of the binary, in bytes. */
+  uint32_t length;
+};
+
+/** One stage of a shader program, and its source code. */
+struct shader_stage {
+  /** Shader type, like 'GL_VERTEX_SHADER'. */
+  GLenum type;
+  /** Source file name. */
+  string fn;
+  /** Source code. */
+  string src;
+};
+
+/**
+ * A shader program which has been submitted to the driver, but
+ * whose compile / link status has not been checked yet.
+ */
+struct pending_program {
+  /** OpenGL program ID. */
+  GLuint prog = 0;
+  /** Hash of the driver, sources and feedback outputs. */
+  uint64_t hash = 0;
+  /** Whether the program was loaded from a cached binary. */
+  bool from_binary = false;
+  /** Stages and their source code. */
+  vector<shader_stage> stages;
+  /** Compiled shaders, one per stage; empty if from a binary. */
+  vector<GLuint> shaders;
+  /** Transform feedback outputs, if any. */
+  vector<string> varyings;
+};
+
+/**
+ * Uniform locations and block indices for one shader program,
+ * queried once when the program is linked.
+ * Entries are -1 if the program does not use that uniform / block.
+ */
+struct shader_reflection {
+  /** Uniform locations, indexed by 'shader_uniforms' handles. */
+  GLint uniforms[ BRLA_NUM_UNIFORMS ];
+  /** Block indices, indexed by 'shader_ubo_blocks' handles. */
+  GLint blocks[ BRLA_NUM_UBO_BLOCKS ];
+};
+
 class shader_manager {
 protected:
-  void load_shader( const char* s_fn, GLuint s );
+  bool load_source( shader_stage& stage );
+  void check_compile( const shader_stage& stage, GLuint s );
+  void add_prog( string key,
+                 vector<shader_stage>& stages,
+                 const vector<string>* varyings );
+  void submit_compile( pending_program& p );
+  void release_shaders( pending_program& p );
+  bool program_ready( GLuint shader_prog );
+  void finish_program( GLuint shader_prog );
+  string binary_path( uint64_t hash );
+  GLuint load_program_binary( uint64_t hash );
+  void save_program_binary( GLuint shader_prog, uint64_t hash );
+  void reflect( GLuint shader_prog );
 
 public:
   unordered_map<string, GLuint> shader_map;
+  /** Reflected uniform / block tables, keyed by program ID. */
+  unordered_map<GLuint, shader_reflection> reflections;
   GLuint cur_shader = 0;
+  /** Reflection table for 'cur_shader'; null if there is none. */
+  shader_reflection* cur_reflection = 0;
+  /**
+   * Whether linked programs are saved to / loaded from the
+   * program binary cache; false if the driver cannot save them.
+   */
+  bool binary_cache = false;
+  /** Directory holding the program binary cache files. */
+  string binary_cache_dir = "shaders/cache/";
+  /** Hash of the renderer and driver version strings. */
+  uint64_t driver_hash = 0;
+  /** Whether the driver can build programs on background threads. */
+  bool parallel_compile = false;
+  /** Programs whose status has not been checked yet, keyed by ID. */
+  unordered_map<GLuint, pending_program> pending;
+  /** Programs loaded from the cache / compiled from source. */
+  int binary_hits = 0;
+  int binary_misses = 0;
+  /** '#define' lines inserted into every shader stage's source. */
+  string defines;
 
   shader_manager();
   ~shader_manager();
 
+  void add_define( string name, int value );
   void add_shader_prog( string key, string vert_fn, string frag_fn );
+  void add_shader_prog( string key,
+                        string vert_fn,
+                        string geom_fn,
+                        string frag_fn );
+  void add_feedback_prog( string key,
+                          string vert_fn,
+                          const vector<string>& varyings );
+  void finish_programs();
   void evict_mapping( string key );
   GLuint get( string key );
 
   void swap_shader( GLuint shader );
   void swap_shader( string key );
+
+  GLint uniform( int handle );
+  bool has_block( int handle );
 };
 
 #endif
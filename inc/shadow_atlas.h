@@ -0,0 +1,78 @@
+#ifndef BRLA_SHADOW_ATLAS_H
+#define BRLA_SHADOW_ATLAS_H
+
+#include <GL/glew.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "game.h"
+#include "math3d.h"
+#include "util.h"
+
+using std::vector;
+
+struct fb_depth_pass;
+class game;
+class phong_light;
+
+/** Largest shadow tile which one light can be given. */
+#define BRLA_SHADOW_TILE_MAX 1024
+/** Smallest shadow tile; lights which cannot fit one get none. */
+#define BRLA_SHADOW_TILE_MIN 128
+/**
+ * Most shadow maps drawn in one layered pass. Must match
+ * 'MAX_SHADOW_VIEWS' in the layered shadow geometry shader.
+ */
+#define BRLA_MAX_SHADOW_VIEWS 16
+/** Floats in the shadow views UBO: options, then one matrix each. */
+#define BRLA_SHADOW_VIEWS_UBO_SIZE ( 4 + 16 * BRLA_MAX_SHADOW_VIEWS )
+
+/**
+ * Shadow atlas: one depth texture which every shadow-casting light
+ * draws its depth map into a square tile of. Tiles are given out
+ * each frame to the buffered shadow casters, sized by how much of
+ * the screen their light can cover, so nearby lights get sharper
+ * shadows. If the tiles do not fit, the least important lights get
+ * smaller tiles, and then none. Only the 'BRLA_MAX_SHADOWED_LIGHTS'
+ * most important lights can get a tile at all; see 'lighting.h'.
+ * The total memory is fixed by the atlas resolution.
+ *
+ * Tile sizes are powers of two, so placing them largest-first along
+ * a Z-order curve packs them without any gaps or overlaps.
+ *
+ * Out-of-date tiles are drawn together in layered passes: each
+ * tile gets its own viewport, and a geometry shader copies every
+ * triangle into each tile's view. So the casters are submitted
+ * once for up to 'max_views' lights, rather than once per light.
+ */
+class shadow_atlas {
+public:
+  /** Width / height of the atlas texture, in texels. */
+  int res;
+  /** OpenGL framebuffer which the tiles are drawn with. */
+  GLuint fbuf = 0;
+  /** OpenGL depth texture holding every tile. */
+  GLuint depth_tex = 0;
+  /** Most tiles drawn in one pass; limited by the driver's viewports. */
+  int max_views = BRLA_MAX_SHADOW_VIEWS;
+  /** Binding point of the shadow views UBO. */
+  GLuint shadow_views_ubo = 4;
+  /** Buffer for the shadow views UBO values. */
+  float shadow_views_ubo_buf[ BRLA_SHADOW_VIEWS_UBO_SIZE ];
+  /** Scratch array of the lights which are asking for a tile. */
+  vector<phong_light*> requests;
+  /** Scratch array of the tile size given to each request. */
+  vector<int> sizes;
+  /** Scratch array of request indices, sorted by tile size. */
+  vector<int> order;
+
+  shadow_atlas( int atlas_res );
+  ~shadow_atlas();
+
+  void allocate( phong_light** lights, int count, v3 c_pos );
+  void begin_views( fb_depth_pass** views, int count );
+  void end_views();
+};
+
+#endif
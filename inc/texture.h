@@ -9,17 +9,28 @@
 
 #include "game.h"
 #include "math2d.h"
+#include "ring_buffer.h"
 #include "stb_image.h"
+#include "texture_cache.h"
 #include "util.h"
 
 #define BRLA_TEX_DEBUG false
 #define BRLA_TEX_CAP_ATLAS 1
+/**
+ * Initial per-frame size of the texture upload staging buffer, in
+ * bytes. It grows to fit the largest texture uploaded in one frame.
+ */
+#define BRLA_TEX_STAGING_SIZE ( 8 * 1024 * 1024 )
+/** Alignment of each texture's pixels in the staging buffer. */
+#define BRLA_TEX_STAGING_ALIGN 16
 
 using std::string;
 using std::unordered_map;
 using std::vector;
 
 class game;
+class mapped_file;
+class ring_buffer;
 
 struct atlas_px_range {
   int x, y, w, h;
@@ -52,31 +63,60 @@ public:
   GLfloat tex_sampler;
   int tex_x, tex_y, tex_n;
   int tex_channels = 4; // RGBA
+  /**
+   * Decoded pixels, top row first, as returned by stb_image.
+   * Freed once they are uploaded, unless 'keep_pixels' is set.
+   */
   unsigned char* tex_buffer = 0;
+  /**
+   * Whether to keep 'tex_buffer' after the texture is uploaded,
+   * for textures which are also read on the CPU, like font atlases.
+   */
+  bool keep_pixels = false;
+  /** Format of 'levels', and of the OpenGL texture; see 'texture_formats'. */
+  int tex_format = BRLA_TEX_FORMAT_RGBA8;
+  /**
+   * Decoded mip chain, full-size level first. It is empty until the
+   * texture is decoded, and is released once it has been uploaded.
+   */
+  vector<texture_level> levels;
+  /** Smaller mip levels, when they were built instead of cached. */
+  vector<unsigned char> mip_buffer;
+  /** Mapped texture cache which 'levels' point into, if any. */
+  mapped_file* cache = 0;
 
   // Extra capabilities, e.g. if it's a sprite atlas.
   // 0 is a default texture.
   int capabilities = 0;
   unordered_map<string, atlas_px_range> tex_atlas;
 
-  texture( const char* filename, GLenum gl_tex_slot );
+  texture( const char* filename, GLenum gl_tex_slot, bool upload = true,
+           bool keep = false );
   ~texture();
 
+  bool decode_texture( const char* filename );
   void load_texture( const char* filename );
   void load_uniform_font_atlas();
   void bind();
+  void release_levels();
 };
 
 class texture_manager {
 public:
   unordered_map<string, texture*> tex_fn_map;
   int num_textures = 0;
+  /**
+   * Pixel buffer ring which decoded textures are copied into, so
+   * that OpenGL can upload them without stalling the CPU.
+   */
+  ring_buffer* staging = 0;
 
   texture_manager();
   ~texture_manager();
 
+  void upload_level( int format, int level, const texture_level& lvl );
   void add_mapping( string key, texture* tex );
-  texture* add_mapping_by_fn( string fn );
+  texture* add_mapping_by_fn( string fn, bool keep_pixels = false );
   void evict_mapping( string key );
   texture* get( string key );
 };
@@ -0,0 +1,102 @@
+#ifndef BRLA_TEXTURE_CACHE_H
+#define BRLA_TEXTURE_CACHE_H
+
+#include <GL/glew.h>
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "stb_image.h"
+#include "texture_compress.h"
+
+using std::string;
+using std::vector;
+
+class mapped_file;
+
+/** Magic number at the start of a texture cache file; 'BRLT'. */
+#define BRLA_TEX_CACHE_MAGIC 0x544C5242
+/**
+ * Texture cache format version. Bump this whenever the layout
+ * or contents of the cache change, to invalidate old files.
+ */
+#define BRLA_TEX_CACHE_VERSION 2
+/** File extension which is appended to a texture's cache file. */
+#define BRLA_TEX_CACHE_EXT ".brlt"
+/** Alignment of each mip level in a texture cache file, in bytes. */
+#define BRLA_TEX_CACHE_ALIGN 16
+/** Most mip levels a texture can have; enough for 32768 pixels. */
+#define BRLA_TEX_MAX_LEVELS 16
+/** Entries in the table which encodes linear values as sRGB. */
+#define BRLA_SRGB_LUT_SIZE 16384
+/**
+ * Largest channel error which 'check_texture_compress' allows in a
+ * round-tripped two-color block; a little over BC1's 5-bit step.
+ */
+#define BRLA_TEX_CHECK_TOLERANCE 8
+
+/**
+ * One mip level of a texture, in one of the 'texture_formats'.
+ * 'data' points into memory which is owned by someone else:
+ * a decoded image, a mip chain buffer, or a mapped cache file.
+ */
+struct texture_level {
+  /** Width / height of the level, in pixels. */
+  int w, h;
+  /** Pixel / block data; see 'texture_level_size'. */
+  const unsigned char* data;
+  /** Length of 'data', in bytes. */
+  size_t size;
+};
+
+/**
+ * Header at the start of a binary texture cache file.
+ * It is followed by each mip level's data, from the full-size
+ * level down to 1x1, at aligned offsets, so they can be copied to
+ * OpenGL directly from a memory-mapped file. The levels are either
+ * RGBA8 pixels, which the engine writes when it first loads a
+ * texture, or compressed blocks, which only the asset cooker
+ * writes. The source file's size / modification time / hash are
+ * stored so that stale caches can be detected and rebuilt, the
+ * same way as mesh caches.
+ */
+struct texture_cache_header {
+  /** Magic number; should equal 'BRLA_TEX_CACHE_MAGIC'. */
+  uint32_t magic;
+  /** Format version; should equal 'BRLA_TEX_CACHE_VERSION'. */
+  uint32_t version;
+  /** Width / height of the full-size level, in pixels. */
+  uint32_t width;
+  uint32_t height;
+  /** Format of every level; see 'texture_formats'. */
+  uint32_t format;
+  /** Number of mip levels, including the full-size one. */
+  uint32_t num_levels;
+  /** Modification time of the source image file. */
+  uint64_t src_mtime;
+  /** Size of the source image file, in bytes. */
+  uint64_t src_size;
+  /** 64-bit FNV-1a hash of the source image file's contents. */
+  uint64_t src_hash;
+  /** Byte offset of each mip level's pixels. */
+  uint64_t level_offsets[ BRLA_TEX_MAX_LEVELS ];
+};
+
+int mip_level_count( int w, int h );
+void build_mip_chain( const unsigned char* pixels, int w, int h,
+                      vector<unsigned char>& mip_buffer,
+                      vector<texture_level>& levels );
+string texture_cache_fn( const char* tex_fn );
+bool write_texture_cache( const char* tex_fn, int format,
+                          const vector<texture_level>& levels );
+mapped_file* load_texture_cache( const char* tex_fn,
+                                 vector<texture_level>& levels,
+                                 int& format );
+bool cook_texture( const char* tex_fn, bool bc7 );
+bool check_texture_compress();
+
+#endif
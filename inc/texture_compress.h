@@ -0,0 +1,43 @@
+#ifndef BRLA_TEXTURE_COMPRESS_H
+#define BRLA_TEXTURE_COMPRESS_H
+
+#include <GL/glew.h>
+
+#include <algorithm>
+#include <cstring>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * Pixel formats which a texture's mip levels can be stored in.
+ * 'RGBA8' levels are plain sRGB pixels, top row first. The block
+ * compressed formats hold 4x4 pixel blocks, bottom row first, so
+ * that they can be passed to OpenGL without being flipped:
+ * 'BC1' is opaque RGB at 8 bytes per block (DXT1),
+ * 'BC3' adds a separate alpha channel at 16 bytes per block (DXT5),
+ * 'BC7' is higher-quality RGBA at 16 bytes per block (BPTC).
+ */
+enum texture_formats {
+  BRLA_TEX_FORMAT_RGBA8 = 0,
+  BRLA_TEX_FORMAT_BC1   = 1,
+  BRLA_TEX_FORMAT_BC3   = 2,
+  BRLA_TEX_FORMAT_BC7   = 3,
+  BRLA_NUM_TEX_FORMATS  = 4
+};
+
+/** Width / height of a compressed block, in pixels. */
+#define BRLA_TEX_BLOCK_DIM 4
+
+bool texture_format_compressed( int format );
+GLenum texture_gl_format( int format );
+bool texture_format_supported( int format );
+size_t texture_level_size( int format, int w, int h );
+bool has_alpha( const unsigned char* pixels, int num_px );
+void compress_level( int format, const unsigned char* pixels,
+                     int w, int h, unsigned char* out );
+void decompress_level( int format, const unsigned char* in,
+                       int w, int h, unsigned char* pixels );
+
+#endif
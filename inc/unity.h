@@ -3,6 +3,7 @@
 
 #include <GL/glew.h>
 
+#include <algorithm>
 #include <functional>
 #include <string>
 #include <unordered_map>
@@ -11,6 +12,7 @@
 #include "game.h"
 #include "math3d.h"
 #include "mesh.h"
+#include "mesh_opt.h"
 #include "physics.h"
 #include "script.h"
 
@@ -23,6 +25,28 @@ class game;
 class mesh;
 class phys_obj;
 class script;
+class texture;
+
+/**
+ * Asset files and collision shape of a built-in game object type.
+ * These are listed in one table, rather than set in each type's
+ * constructor, so that the level loader can start decoding a
+ * level's assets before any of its game objects are created.
+ */
+struct unity_assets {
+  /** Game object type, like 'u_flowerpot'. */
+  const char* type;
+  /** File path to import the mesh data from. */
+  const char* mesh_fn;
+  /** File path to import the texture data from. */
+  const char* texture_fn;
+  /** Collision shape; see 'physics_primitives'. */
+  int phys_type;
+  /** Vertex format on the GPU; see 'vertex_formats'. */
+  int v_format;
+};
+
+const unity_assets* find_unity_assets( string type );
 
 /**
  * A 'unity' is a game object.
@@ -47,6 +71,7 @@ class script;
  */
 class unity {
 protected:
+  void use_assets( string u_type );
   void gen_unity( v3 u_pos, quat u_rot );
 
 public:
@@ -54,8 +79,43 @@ public:
   string mesh_fn = "";
   /** File path to import the game object's texture data from. */
   string texture_fn = "";
-  /** Pointer to this object's 3D mesh in the game world. */
+  /**
+   * Vertex format to store this object's mesh in on the GPU.
+   * See 'vertex_formats' in 'mesh_opt.h' for options.
+   */
+  int v_format = BRLA_VERTEX_FULL;
+  /**
+   * Pointer to this object's 3D mesh in the game world.
+   * Meshes are shared between game objects by the 'mesh_manager',
+   * so per-object state like scale belongs in 'transform' instead.
+   */
   mesh* m = 0;
+  /** Pointer to this object's texture, if any. */
+  texture* tex = 0;
+  /**
+   * 4x4 model matrix for this object, including its scale and
+   * its mesh's vertex dequantization. Derived from the
+   * physics simulation in the 'update' step.
+   */
+  m4 transform;
+  /**
+   * 'transform' without the mesh's vertex dequantization: the
+   * physics transform and this object's scale. Use this for
+   * model-space data which is not quantized, like the mesh's
+   * CPU-side vertices or an attached emitter's offset.
+   */
+  m4 scaled_transform;
+  /**
+   * World-space bounds of this object's mesh, updated
+   * along with 'transform'. Used for visibility culling.
+   */
+  aabb world_bounds;
+  /**
+   * Whether this object is large and solid enough to hide the
+   * objects behind it. Occluders are drawn into the software
+   * occlusion buffer each frame; see 'occlusion.h'.
+   */
+  bool occluder = false;
   /**
    * This variable determines which sort of collision shape
    * should be used for the game object's physics object.
@@ -92,6 +152,7 @@ public:
   void run_scripts();
   void update();
   void draw();
+  void bind_texture();
 
   void make_use_script( script* s );
   void set_phys_velocity( btVector3 vel );
@@ -17,8 +17,19 @@
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
 
+// SSE is always available on x86-64, and on 32-bit x86 when
+// the compiler is allowed to use it. This is defined before the
+// project headers are included, since some of them include this.
+#if defined( __SSE__ ) || defined( _M_X64 ) || \
+    ( defined( _M_IX86_FP ) && _M_IX86_FP >= 1 )
+#define BRLA_USE_SSE
+#include <xmmintrin.h>
+#endif
+
 #include "game.h"
 #include "mesh.h"
+#include "mesh_cache.h"
+#include "mesh_opt.h"
 
 using std::ifstream;
 using std::memcpy;
@@ -28,6 +39,7 @@ using std::to_string;
 
 class game;
 class mesh;
+struct mesh_geometry;
 
 // File path to use for logging information during gameplay.
 #define BRLA_LOG_FILE "log/berilia.log"
@@ -38,7 +50,13 @@ class mesh;
 unsigned long get_file_length( ifstream& file );
 void fill_float_buffer( float* dest, float* dat,
                         int start_index, int len );
-mesh* load_mesh( const char* filename );
+bool import_mesh( const char* filename, int& num_verts,
+                  GLfloat*& points, GLfloat*& normals,
+                  GLfloat*& tex_coords );
+void mesh_extents( int num_verts, GLfloat* points, int stride,
+                   float* min_ext, float* max_ext );
+bool build_mesh_geometry( const char* filename, mesh_geometry& geo );
+mesh* load_mesh( const char* filename, int v_format );
 void export_mesh_json( const char* mesh_fn, const char* json_fn );
 float str_to_f( string s );
 
@@ -49,8 +67,8 @@ string framebuffer_error_to_string( GLenum err );
 // TODO: Move to the 'mesh' header/source files?
 int count_vertices( const aiNode* cur_node,
                     const aiScene* scene, int c );
-void import_node( const aiNode* cur_node, const aiScene* scene,
-                  GLfloat* p, GLfloat* n, GLfloat* t, int index );
+int import_node( const aiNode* cur_node, const aiScene* scene,
+                 GLfloat* p, GLfloat* n, GLfloat* t, int index );
 
 // Logging functions.
 void log_gl_errors();
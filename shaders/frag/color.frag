@@ -4,7 +4,7 @@ in vec3 pos_E, norm_E, pos_W;
 in vec2 tex_coords;
 out vec4 frag_color;
 
-layout (std140) uniform world_ubo {
+layout (std140, binding = 0) uniform world_ubo {
 	vec4 opts;
 	vec4 color;
 };
@@ -0,0 +1,179 @@
+#version 420
+
+// 'MAX_PHONG_LIGHTS' and 'MAX_SHADOWED_LIGHTS' are defined by the
+// shader manager; see 'lighting.h'.
+
+// Same lights as 'normal.frag'.
+struct phong {
+	vec4 light_pos_W;
+	vec4 light_amb;
+	vec4 light_dif;
+	vec4 light_spec;
+	vec4 light_vals; // 0 = specular exponent, 1 = falloff, 2 = type,
+	                 // 3 = index in 'shadows', or -1 if not shadowed.
+	vec4 light_vals2; // if type is directional, (0,1,2) = direction, 3 = angle.
+};
+
+layout (std140, binding = 2) uniform phong_ubo {
+	vec4 light_opts;
+	phong lights[MAX_PHONG_LIGHTS];
+};
+
+// Shadow values, only for the lights which have an atlas tile.
+struct shadow_light {
+	mat4 shadow_mat; // World space to the shadow camera's clip space.
+	vec4 shadow_rect; // Shadow atlas tile: (0,1) = offset, (2,3) = size.
+};
+
+layout (std140, binding = 6) uniform shadow_lights_ubo {
+	vec4 shadow_opts;
+	shadow_light shadows[MAX_SHADOWED_LIGHTS];
+};
+
+// Layout of the light cluster grid; see 'light_clusters.h'.
+layout (std140, binding = 3) uniform cluster_ubo {
+	vec4 cluster_dims; // X / Y / Z cluster counts.
+	vec4 cluster_bases; // 0 = grid offset, 1 = index list offset.
+	vec4 cluster_z; // 0 = near, 1 = far, 2 = Z / log(far / near).
+	vec4 cluster_px; // Viewport width / height, in pixels.
+};
+
+layout (std140, binding = 1) uniform cam_ubo {
+	mat4 T;
+	mat4 V;
+	mat4 P;
+};
+
+// G-buffer; see 'deferred.h'.
+uniform sampler2D gbuf_albedo_sampler;
+uniform sampler2D gbuf_normal_sampler;
+uniform sampler2D depth_tex_sampler;
+// Shadow atlas; each shadowed light samples its own tile.
+uniform sampler2D shadow_depth_map_sampler;
+// Per-cluster offset / count pairs, then the light index lists.
+uniform usamplerBuffer cluster_sampler;
+
+// Surface properties.
+vec3 Ka = vec3(1.0, 1.0, 1.0);
+vec3 Kd = vec3(1.0, 1.0, 1.0);
+vec3 Ks = vec3(1.0, 1.0, 1.0);
+
+out vec4 frag_color;
+
+void main() {
+	ivec2 px = ivec2(gl_FragCoord.xy);
+	float frag_depth = texelFetch(depth_tex_sampler, px, 0).r;
+	// Nothing was drawn here; keep the clear color.
+	if (frag_depth >= 1.0) { discard; }
+	vec4 texel = texelFetch(gbuf_albedo_sampler, px, 0);
+	vec3 norm_E = texelFetch(gbuf_normal_sampler, px, 0).xyz;
+
+	// Rebuild the view-space position from the depth value, with
+	// the (symmetric) perspective matrix. The view matrix is rigid,
+	// so its inverse is its transposed rotation.
+	vec3 ndc = vec3(gl_FragCoord.xy / cluster_px.xy, frag_depth) * 2.0 - 1.0;
+	vec3 pos_E;
+	pos_E.z = -P[3][2] / (ndc.z + P[2][2]);
+	pos_E.x = ndc.x * -pos_E.z / P[0][0];
+	pos_E.y = ndc.y * -pos_E.z / P[1][1];
+	vec3 pos_W = transpose(mat3(V)) * (pos_E - V[3].xyz);
+
+	// Lighting calculations. Find this pixel's cluster, and
+	// only shade the lights which can reach it.
+	vec3 lighting_color = vec3(0,0,0);
+	ivec3 dims = ivec3(cluster_dims.xyz);
+	ivec2 tile = ivec2(gl_FragCoord.xy / cluster_px.xy * vec2(dims.xy));
+	tile = clamp(tile, ivec2(0, 0), dims.xy - 1);
+	float depth = max(-pos_E.z, cluster_z.x);
+	int slice = int(floor(log(depth / cluster_z.x) * cluster_z.z));
+	slice = clamp(slice, 0, dims.z - 1);
+	int cluster = (slice * dims.y + tile.y) * dims.x + tile.x;
+	int grid_ind = int(cluster_bases.x) + cluster * 2;
+	int list_start = int(cluster_bases.y) +
+	                 int(texelFetch(cluster_sampler, grid_ind).r);
+	int num_lights = int(texelFetch(cluster_sampler, grid_ind + 1).r);
+	for (int k = 0; k < num_lights; k++) {
+		int i = int(texelFetch(cluster_sampler, list_start + k).r);
+		float spot_factor = 1.0f;
+		vec3 light_pos_E = vec3(V * lights[i].light_pos_W);
+		vec3 to_surface = normalize(-pos_E);
+		vec3 dist_to_light_E = light_pos_E - pos_E;
+		vec3 dist_to_light_W = lights[i].light_pos_W.xyz - pos_W;
+		vec3 dir_to_light_E = normalize(dist_to_light_E);
+		vec3 dir_to_light_W = normalize(dist_to_light_W);
+		vec3 spot_dir_W = normalize(lights[i].light_vals2.rgb);
+		vec3 spot_dir_E = vec3(V * vec4(spot_dir_W, 1.0));
+
+		// If it's not a point light, check if the light hits.
+		if (lights[i].light_vals[2] == 1) {
+			float ang = lights[i].light_vals2[3];
+			float spotlight_edge = cos(ang);
+			float spot_dot = dot(spot_dir_W, dir_to_light_W);
+			if (spot_dot < spotlight_edge) {
+				spot_factor = 0.0f;
+			}
+			else {
+				spot_factor = (spot_dot - spotlight_edge) / (1.0 - spotlight_edge);
+				spot_factor = clamp(spot_factor, 0.0, 1.0);
+			}
+		}
+
+		if (spot_factor > 0.0f) {
+			float specular_exponent = lights[i].light_vals.x;
+			float falloff = lights[i].light_vals.y;
+
+			vec3 Ia = lights[i].light_amb.rgb * Ka;
+
+			float diffuse_dot = dot(dir_to_light_E, norm_E);
+			//diffuse_dot = max(diffuse_dot, 0.0);
+			diffuse_dot = abs(diffuse_dot);
+			Kd = texel.rgb;
+			vec3 Id = lights[i].light_dif.rgb * Kd * diffuse_dot;
+
+			// Use Blinn-Phong for specular calculations.
+			vec3 half_way = normalize(to_surface + dir_to_light_E);
+			float specular_dot = dot(half_way, norm_E);
+			specular_dot = max(specular_dot, 0.0);
+			float specular_factor = pow(specular_dot, specular_exponent);
+			vec3 Is = lights[i].light_spec.rgb * Ks * specular_factor;
+
+			vec3 light_color = (Ia + Id + Is) * spot_factor;
+			// Linear light falloff.
+			float light_str = falloff - length(light_pos_E - pos_E);
+			if (light_str <= 0.0) {
+				light_str = 0.0;
+			}
+			else {
+				light_str = light_str / falloff;
+			}
+			int sh = int(lights[i].light_vals[3]);
+			if (sh >= 0) {
+				float epsilon = 0.0;
+				float sh_val = 1.0;
+				// Shadow depth coords, mapped into this light's atlas tile.
+				vec4 st_shadow = shadows[sh].shadow_mat * vec4(pos_W, 1.0);
+				st_shadow.xyz /= st_shadow.w;
+				st_shadow.xyz += 1.0;
+				st_shadow.xyz *= 0.5;
+				if (st_shadow.w > 0 &&
+				    all(greaterThanEqual(st_shadow.xyz, vec3(0.0))) &&
+				    all(lessThanEqual(st_shadow.xyz, vec3(1.0)))) {
+					vec2 st_atlas = shadows[sh].shadow_rect.xy +
+					                st_shadow.xy * shadows[sh].shadow_rect.zw;
+					float shadow = texture(shadow_depth_map_sampler, st_atlas).r;
+					if (shadow + epsilon < st_shadow.z) {
+						sh_val = 0.2;
+					}
+				}
+				light_color *= sh_val;
+			}
+			light_color = light_color * light_str;
+			lighting_color = lighting_color + light_color;
+		}
+	}
+
+	frag_color = texel * vec4((lighting_color), 1.0);
+	// The window's framebuffer is multisampled, so it cannot share
+	// the G-buffer's depth values; write them for later passes.
+	gl_FragDepth = frag_depth;
+}
@@ -0,0 +1,14 @@
+#version 420
+
+uniform sampler2D texture_sampler;
+
+in vec3 pos_E, norm_E, pos_W, norm_W;
+in vec2 tex_coords;
+// G-buffer outputs; see 'deferred.h'.
+layout(location = 0) out vec4 gbuf_albedo;
+layout(location = 1) out vec4 gbuf_normal;
+
+void main() {
+	gbuf_albedo = texture(texture_sampler, tex_coords);
+	gbuf_normal = vec4(normalize(norm_E), 0.0);
+}
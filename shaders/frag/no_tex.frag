@@ -1,13 +1,13 @@
 #version 420
 
 //uniform mat4 view, proj;
-layout (std140) uniform cam_ubo {
+layout (std140, binding = 1) uniform cam_ubo {
 	mat4 T;
 	mat4 V;
 	mat4 P;
 };
 
-layout(std140) uniform world_ubo {
+layout (std140, binding = 0) uniform world_ubo {
 	vec4 opts;
 	vec4 color;
 };
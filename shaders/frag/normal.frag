@@ -1,6 +1,7 @@
 #version 420
 
-#define MAX_PHONG_LIGHTS 100
+// 'MAX_PHONG_LIGHTS' and 'MAX_SHADOWED_LIGHTS' are defined by the
+// shader manager; see 'lighting.h'.
 #define INT_MAX_M1 2147483646
 
 struct phong {
@@ -8,28 +9,51 @@ struct phong {
 	vec4 light_amb;
 	vec4 light_dif;
 	vec4 light_spec;
-	vec4 light_vals; // 0 = specular exponent, 1 = falloff, 2 = type.
+	vec4 light_vals; // 0 = specular exponent, 1 = falloff, 2 = type,
+	                 // 3 = index in 'shadows', or -1 if not shadowed.
 	vec4 light_vals2; // if type is directional, (0,1,2) = direction, 3 = angle.
 };
 
-layout (std140) uniform phong_ubo {
+layout (std140, binding = 2) uniform phong_ubo {
 	vec4 light_opts;
 	phong lights[MAX_PHONG_LIGHTS];
 };
 
-layout (std140) uniform cam_ubo {
+// Shadow values, only for the lights which have an atlas tile.
+struct shadow_light {
+	mat4 shadow_mat; // World space to the shadow camera's clip space.
+	vec4 shadow_rect; // Shadow atlas tile: (0,1) = offset, (2,3) = size.
+};
+
+layout (std140, binding = 6) uniform shadow_lights_ubo {
+	vec4 shadow_opts;
+	shadow_light shadows[MAX_SHADOWED_LIGHTS];
+};
+
+// Layout of the light cluster grid; see 'light_clusters.h'.
+layout (std140, binding = 3) uniform cluster_ubo {
+	vec4 cluster_dims; // X / Y / Z cluster counts.
+	vec4 cluster_bases; // 0 = grid offset, 1 = index list offset.
+	vec4 cluster_z; // 0 = near, 1 = far, 2 = Z / log(far / near).
+	vec4 cluster_px; // Viewport width / height, in pixels.
+};
+
+layout (std140, binding = 1) uniform cam_ubo {
 	mat4 T;
 	mat4 V;
 	mat4 P;
 };
 
-layout(std140) uniform world_ubo {
+layout (std140, binding = 0) uniform world_ubo {
 	vec4 opts;
 	vec4 color;
 };
 
 uniform sampler2D texture_sampler;
+// Shadow atlas; each shadowed light samples its own tile.
 uniform sampler2D shadow_depth_map_sampler;
+// Per-cluster offset / count pairs, then the light index lists.
+uniform usamplerBuffer cluster_sampler;
 coherent restrict uniform layout(r32i, binding = 0) iimage2D surface_normal_image;
 uniform vec2 px_scale;
 
@@ -43,7 +67,6 @@ vec3 Ks = vec3(1.0, 1.0, 1.0);
 
 in vec3 pos_E, norm_E, pos_W, norm_W;
 in vec2 tex_coords;
-in vec4 st_shadow;
 out vec4 frag_color;
 
 void main() {
@@ -86,10 +109,22 @@ void main() {
 	memoryBarrier();
 	*/
 
-	// Lighting calculations.
+	// Lighting calculations. Find this fragment's cluster, and
+	// only shade the lights which can reach it.
 	vec3 lighting_color = vec3(0,0,0);
-	int num_lights = int(light_opts[0]);
-	for (int i = 0; i < num_lights; i++) {
+	ivec3 dims = ivec3(cluster_dims.xyz);
+	ivec2 tile = ivec2(gl_FragCoord.xy / cluster_px.xy * vec2(dims.xy));
+	tile = clamp(tile, ivec2(0, 0), dims.xy - 1);
+	float depth = max(-pos_E.z, cluster_z.x);
+	int slice = int(floor(log(depth / cluster_z.x) * cluster_z.z));
+	slice = clamp(slice, 0, dims.z - 1);
+	int cluster = (slice * dims.y + tile.y) * dims.x + tile.x;
+	int grid_ind = int(cluster_bases.x) + cluster * 2;
+	int list_start = int(cluster_bases.y) +
+	                 int(texelFetch(cluster_sampler, grid_ind).r);
+	int num_lights = int(texelFetch(cluster_sampler, grid_ind + 1).r);
+	for (int k = 0; k < num_lights; k++) {
+		int i = int(texelFetch(cluster_sampler, list_start + k).r);
 		float spot_factor = 1.0f;
 		vec3 light_pos_E = vec3(V * lights[i].light_pos_W);
 		vec3 to_surface = normalize(-pos_E);
@@ -142,19 +177,26 @@ void main() {
 			else {
 				light_str = light_str / falloff;
 			}
-			if (lights[i].light_vals[3] > 0) {
+			int sh = int(lights[i].light_vals[3]);
+			if (sh >= 0) {
 				float epsilon = 0.0;
 				float sh_val = 1.0;
-				float shadow = texture(shadow_depth_map_sampler, st_shadow.xy).r;
-				if (shadow + epsilon < st_shadow.z) {
-					sh_val = 0.2;
-				}
-				//light_color *= sh_val;
-				//light_color *= shadow;
-				if (st_shadow.z > 0) {
-					light_color = vec3(shadow, shadow, shadow);
+				// Shadow depth coords, mapped into this light's atlas tile.
+				vec4 st_shadow = shadows[sh].shadow_mat * vec4(pos_W, 1.0);
+				st_shadow.xyz /= st_shadow.w;
+				st_shadow.xyz += 1.0;
+				st_shadow.xyz *= 0.5;
+				if (st_shadow.w > 0 &&
+				    all(greaterThanEqual(st_shadow.xyz, vec3(0.0))) &&
+				    all(lessThanEqual(st_shadow.xyz, vec3(1.0)))) {
+					vec2 st_atlas = shadows[sh].shadow_rect.xy +
+					                st_shadow.xy * shadows[sh].shadow_rect.zw;
+					float shadow = texture(shadow_depth_map_sampler, st_atlas).r;
+					if (shadow + epsilon < st_shadow.z) {
+						sh_val = 0.2;
+					}
 				}
-				//light_str *= shadow;
+				light_color *= sh_val;
 			}
 			light_color = light_color * light_str;
 			lighting_color = lighting_color + light_color;
@@ -166,11 +208,8 @@ void main() {
 	//frag_color = vec4(0.5, 1.0, 0.5, 1.0);
 	//frag_color = V[2];
 	frag_color = texel * vec4((lighting_color), 1.0);
-	//frag_color = texture(shadow_depth_map_sampler, st_shadow.xy);
 	//frag_color = texture(shadow_depth_map_sampler, tex_coords);
 	//frag_color = frag_color * vec4(sh_val, sh_val, sh_val, 1.0);
-	//frag_color = frag_color * vec4(st_shadow.z, st_shadow.z, st_shadow.z, 1.0);
 	//frag_color = vec4(0.2, 0.2, 0.2, 1.0);
 	//frag_color = frag_color * vec4(gs, gs, gs, 1.0);
-	//frag_color = st_shadow;
 }
@@ -1,16 +1,15 @@
 #version 420 core
 
 in float opacity;
-uniform sampler2D texture_sampler;
+in vec3 particle_color;
 out vec4 frag_color;
 
-vec4 particle_color = vec4(0.2, 1.0, 0.4, 1.0);
-
 void main() {
-	vec4 texel = texture(texture_sampler, gl_PointCoord);
-	frag_color.a = opacity * texel.a;
+	// Round point sprites, which fade out towards their edges.
+	float r = length(gl_PointCoord - vec2(0.5, 0.5)) * 2.0;
+	frag_color.a = opacity * (1.0 - r);
 	if (frag_color.a <= 0.1) {
 		discard;
 	}
-	frag_color.rgb = particle_color.rgb * texel.rgb;
+	frag_color.rgb = particle_color;
 }
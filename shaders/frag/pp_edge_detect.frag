@@ -7,7 +7,7 @@ coherent restrict uniform layout(r32i, binding = 0) iimage2D surface_normal_imag
 uniform vec2 px_scale;
 
 // world ubo values.
-layout (std140) uniform world_ubo {
+layout (std140, binding = 0) uniform world_ubo {
 	vec4 opts;
 	vec4 color;
 };
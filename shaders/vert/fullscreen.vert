@@ -0,0 +1,8 @@
+#version 420
+
+// One triangle which covers the whole screen,
+// made from the vertex IDs without any vertex buffers.
+void main() {
+	vec2 xy = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2) * 2.0 - 1.0;
+	gl_Position = vec4(xy.x, xy.y, 0.0, 1.0);
+}
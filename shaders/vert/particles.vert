@@ -1,29 +1,45 @@
 #version 420 core
 
-layout(location = 0) in vec3 iv;
-layout(location = 1) in float it;
+// Must match 'BRLA_MAX_EMITTERS'.
+#define MAX_EMITTERS 255
 
-layout (std140) uniform cam_ubo {
+// Particle state, simulated by 'particles_update.vert'.
+layout(location = 0) in vec4 pos_age;
+layout(location = 1) in vec4 vel_tag;
+
+layout (std140, binding = 1) uniform cam_ubo {
 	mat4 T;
 	mat4 V;
 	mat4 P;
 };
 
-uniform vec3 ipos_W;
-uniform float cur_time;
+struct emitter {
+	vec4 pos_count; // (0,1,2) = position, 3 = live particles.
+	vec4 vel_life; // (0,1,2) = velocity, 3 = lifetime.
+	vec4 vals; // 0 = spread, 1 = gravity, 2 = seconds since start, 3 = generation.
+	vec4 color_size; // (0,1,2) = color, 3 = point sprite size.
+};
+
+layout (std140, binding = 5) uniform particles_ubo {
+	vec4 particle_opts; // 0 = time step, 1 = particles per emitter.
+	emitter emitters[MAX_EMITTERS];
+};
 
 out float opacity;
+out vec3 particle_color;
 
 void main() {
-	float t = cur_time - it;
-	t = mod(t, 3.5);
-
-	vec3 pos_W = ipos_W;
-	// gravity (x + dx*dt + dv*dt^2)
-	vec3 g = vec3(0.0, -1.0, 0.0);
-	pos_W += iv * t + 0.5 * g * t * t;
-	opacity = 1.0 - (t / 3.5);
+	int slot = gl_VertexID / int(particle_opts.y);
+	particle_color = emitters[slot].color_size.rgb;
+	if (pos_age.w < 0.0) {
+		// Not alive; put it outside of the view to clip it.
+		opacity = 0.0;
+		gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+		gl_PointSize = 1.0;
+		return;
+	}
+	opacity = 1.0 - (pos_age.w / emitters[slot].vel_life.w);
 
-	gl_Position = P * V * vec4(pos_W, 1.0);
-	gl_PointSize = 15.0 / gl_Position.z;
+	gl_Position = P * V * vec4(pos_age.xyz, 1.0);
+	gl_PointSize = emitters[slot].color_size.w / gl_Position.w;
 }
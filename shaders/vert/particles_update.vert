@@ -0,0 +1,81 @@
+#version 420 core
+
+// Must match 'BRLA_MAX_EMITTERS'.
+#define MAX_EMITTERS 255
+
+// Particle state, from the previous frame.
+layout(location = 0) in vec4 pos_age;
+layout(location = 1) in vec4 vel_tag;
+
+struct emitter {
+	vec4 pos_count; // (0,1,2) = position, 3 = live particles.
+	vec4 vel_life; // (0,1,2) = velocity, 3 = lifetime.
+	vec4 vals; // 0 = spread, 1 = gravity, 2 = seconds since start, 3 = generation.
+	vec4 color_size; // (0,1,2) = color, 3 = point sprite size.
+};
+
+layout (std140, binding = 5) uniform particles_ubo {
+	vec4 particle_opts; // 0 = time step, 1 = particles per emitter.
+	emitter emitters[MAX_EMITTERS];
+};
+
+// Particle state, for this frame; captured with transform feedback.
+out vec4 tf_pos_age;
+out vec4 tf_vel_tag;
+
+// Integer hash, for per-particle random numbers.
+uint hash(uint x) {
+	x ^= x >> 16;
+	x *= 0x7feb352dU;
+	x ^= x >> 15;
+	x *= 0x846ca68bU;
+	x ^= x >> 16;
+	return x;
+}
+
+// Random number in [-1, 1].
+float rand(uint seed) {
+	return float(hash(seed) & 0xFFFFFFU) / 8388607.5 - 1.0;
+}
+
+void main() {
+	int per_emitter = int(particle_opts.y);
+	int slot = gl_VertexID / per_emitter;
+	int ind = gl_VertexID - slot * per_emitter;
+	int count = int(emitters[slot].pos_count.w);
+	float life = emitters[slot].vel_life.w;
+	vec3 grav = vec3(0.0, -emitters[slot].vals.y, 0.0);
+
+	// Particles are born evenly over one lifetime,
+	// and are born again each time that they die.
+	float t = emitters[slot].vals.z - float(ind) * life / float(max(count, 1));
+	if (ind >= count || t < 0.0) {
+		// Not born yet, or not in use; a negative age hides it.
+		tf_pos_age = vec4(pos_age.xyz, -1.0);
+		tf_vel_tag = vel_tag;
+		return;
+	}
+	float cycle = floor(t / life);
+	float age = t - cycle * life;
+	// Each life of each particle is tagged, so a particle is born
+	// again when its tag changes; the emitter's generation is part
+	// of the tag, so a reused slot starts with new particles.
+	float tag = mod(cycle, 4096.0) + 4096.0 * mod(emitters[slot].vals.w, 4096.0);
+
+	if (tag != vel_tag.w) {
+		uint seed = uint(gl_VertexID) * 3U + uint(tag) * 2654435761U;
+		vec3 jitter = vec3(rand(seed), rand(seed + 1U), rand(seed + 2U));
+		vec3 vel = emitters[slot].vel_life.xyz + jitter * emitters[slot].vals.x;
+		// It was born 'age' seconds ago, so catch up to now.
+		// (x + dx*dt + dv*dt^2)
+		vec3 pos = emitters[slot].pos_count.xyz + vel * age + 0.5 * grav * age * age;
+		tf_pos_age = vec4(pos, age);
+		tf_vel_tag = vec4(vel + grav * age, tag);
+		return;
+	}
+
+	float dt = particle_opts.x;
+	vec3 vel = vel_tag.xyz + grav * dt;
+	tf_pos_age = vec4(pos_age.xyz + vel * dt, age);
+	tf_vel_tag = vec4(vel, tag);
+}
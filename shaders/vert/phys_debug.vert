@@ -4,14 +4,14 @@ layout(location = 0) in vec3 vp;
 layout(location = 1) in vec3 vc;
 
 //uniform mat4 view, proj;
-layout (std140) uniform cam_ubo {
+layout (std140, binding = 1) uniform cam_ubo {
 	mat4 T;
 	mat4 V;
 	mat4 P;
 };
 
 // world ubo values.
-layout (std140) uniform world_ubo {
+layout (std140, binding = 0) uniform world_ubo {
 	vec4 opts;
 	vec4 color;
 };
@@ -0,0 +1,11 @@
+#version 420
+
+layout(location = 0) in vec3 vp;
+// Per-instance model matrix; takes up locations 3-6.
+layout(location = 3) in mat4 model;
+
+void main() {
+	// World-space position; the geometry shader
+	// projects it into each shadow map's view.
+	gl_Position = model * vec4(vp.x, vp.y, vp.z, 1.0);
+}
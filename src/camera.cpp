@@ -290,14 +290,12 @@ camera_manager::~camera_manager() {
 
 /**
  * Helper method to update the 'camera' Uniform Buffer Object
- * in the current shader program to match the active camera.
+ * to match the active camera.
  */
 void camera_manager::update_cam_ubo() {
-  // This method only makes sense if there is an active camera
-  // and an active shader; return early if there isn't.
-  if ( !active_camera || !g->s_man || !g->s_man->cur_shader ) {
-    return;
-  }
+  // This method only makes sense if there is an active camera;
+  // return early if there isn't.
+  if ( !active_camera ) { return; }
 
   // Setup the UBO. Layout:
   //   0  - 16: T - model translation matrix.
@@ -311,56 +309,30 @@ void camera_manager::update_cam_ubo() {
                      transpose( active_camera->persp_matrix ).m,
                      32, 16 );
 
-  // Bind the camera UBO and get a reference to it.
-  GLuint cur_shader = g->s_man->cur_shader;
-  glBindBuffer( GL_UNIFORM_BUFFER, cam_block_buffer );
-  glBindBufferBase( GL_UNIFORM_BUFFER, cam_ubo, cam_block_buffer );
-  cam_ubo_index = glGetUniformBlockIndex( cur_shader, "cam_ubo" );
-  // Usually 0 does not seem to be a valid index for OpenGL values.
-  // But I guess with UBO indices it is. Go figure.
-  // Anyways, if the UBO index exists, buffer the new camera data.
-  if ( ( ( int )cam_ubo_index ) >= 0 ) {
-    glUniformBlockBinding( cur_shader, cam_ubo_index, cam_ubo );
-    glBufferSubData( GL_UNIFORM_BUFFER,
-                     0,
-                     sizeof( float ) * CAM_UBO_SIZE,
-                     cam_ubo_buf );
-  }
+  // Buffer the new camera data, and bind it to the 'cam_ubo'
+  // binding point, which every shader program shares.
+  cam_ubo_offset = g->write_ubo( cam_ubo,
+                                 cam_ubo_buf,
+                                 sizeof( float ) * CAM_UBO_SIZE );
 }
 
 /**
- * Initialize the camera Uniform Buffer Object in the
- * current shader program.
+ * Bind the active camera's most recent values back to the
+ * 'cam_ubo' binding point, after another view borrowed it.
  */
-void camera_manager::init_cam_ubo() {
-  // Return early if there is no active shader program.
-  if ( !g->s_man || !g->s_man->cur_shader ) {
-    log_error( "[ERROR] Could not initialize Camera UBO: "
-               "no active shader\n" );
-    return;
-  }
-  GLuint cur_shader = g->s_man->cur_shader;
-
-  // If the current camera already has an OpenGL block buffer,
-  // delete it before creating a new one.
-  if ( cam_block_buffer ) {
-    glDeleteBuffers( 1, &cam_block_buffer );
-  }
+void camera_manager::bind_cam_ubo() {
+  if ( cam_ubo_offset < 0 ) { return; }
+  glBindBufferRange( GL_UNIFORM_BUFFER, cam_ubo,
+                     g->ubo_ring->buffer, cam_ubo_offset,
+                     sizeof( float ) * CAM_UBO_SIZE );
+}
 
-  // Create the OpenGL buffer, and bind it as the active buffer.
-  glGenBuffers( 1, &cam_block_buffer );
-  glBindBuffer( GL_UNIFORM_BUFFER, cam_block_buffer );
-  // Set the size of the buffer to the required number of elements.
-  glBufferData( GL_UNIFORM_BUFFER,
-                sizeof( float ) * CAM_UBO_SIZE,
-                NULL,
-                GL_DYNAMIC_DRAW );
-  // Bind the buffer to the 'cam_ubo' index in the current
-  // shader program. TODO: Verify that 'cam_ubo_index' is valid?
-  cam_ubo_index = glGetUniformBlockIndex( cur_shader, "cam_ubo" );
-  glUniformBlockBinding( cur_shader, cam_ubo_index, cam_ubo );
-
-  // Call 'update_cam_ubo()' to apply the current camera settings.
+/**
+ * Initialize the camera Uniform Buffer Object. Its values are
+ * streamed through the global UBO ring buffer, so this just
+ * writes and binds the current camera settings.
+ */
+void camera_manager::init_cam_ubo() {
   update_cam_ubo();
 }
 
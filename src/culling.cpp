@@ -0,0 +1,128 @@
+#include "culling.h"
+
+/**
+ * Default frustum constructor. Every plane is left empty,
+ * so nothing is culled until 'set' is called.
+ */
+frustum::frustum() {
+  for ( int p = 0; p < BRLA_FRUSTUM_PLANES; ++p ) {
+    for ( int i = 0; i < 4; ++i ) { planes[ p ][ i ] = 0.0f; }
+    for ( int i = 0; i < 3; ++i ) { abs_normals[ p ][ i ] = 0.0f; }
+  }
+}
+
+/** Frustum constructor, from a perspective * view matrix. */
+frustum::frustum( m4 view_proj ) { set( view_proj ); }
+
+/** Frustum constructor, from a camera's current matrices. */
+frustum::frustum( camera* cam ) {
+  set( cam->persp_matrix * cam->c_view_matrix );
+}
+
+/**
+ * Extract the frustum's planes from a perspective * view matrix.
+ * Clip-space X / Y / Z are each within [ -W, W ] inside the
+ * frustum, so each plane is the matrix's W row plus or minus
+ * its X / Y / Z row. The planes are not normalized, since only
+ * the signs of the distances to them are needed.
+ */
+void frustum::set( m4 view_proj ) {
+  float* m = view_proj.m;
+  for ( int i = 0; i < 4; ++i ) {
+    planes[ 0 ][ i ] = m[ 12 + i ] + m[ i ];
+    planes[ 1 ][ i ] = m[ 12 + i ] - m[ i ];
+    planes[ 2 ][ i ] = m[ 12 + i ] + m[ 4 + i ];
+    planes[ 3 ][ i ] = m[ 12 + i ] - m[ 4 + i ];
+    planes[ 4 ][ i ] = m[ 12 + i ] + m[ 8 + i ];
+    planes[ 5 ][ i ] = m[ 12 + i ] - m[ 8 + i ];
+  }
+  for ( int p = 0; p < BRLA_FRUSTUM_PLANES; ++p ) {
+    for ( int i = 0; i < 3; ++i ) {
+      abs_normals[ p ][ i ] = fabs( planes[ p ][ i ] );
+    }
+  }
+}
+
+/**
+ * Test four boxes, given as X / Y / Z rows of their centers and
+ * half-extents, against the frustum's planes. A box is outside
+ * of a plane if even its corner furthest along the plane's normal
+ * is behind it. Returns a bitmask with bit N set if box N is
+ * entirely outside of the frustum.
+ */
+int frustum::test4( const float c[ 3 ][ 4 ], const float e[ 3 ][ 4 ] ) {
+#ifdef BRLA_USE_SSE
+  __m128 cx = _mm_loadu_ps( c[ 0 ] );
+  __m128 cy = _mm_loadu_ps( c[ 1 ] );
+  __m128 cz = _mm_loadu_ps( c[ 2 ] );
+  __m128 ex = _mm_loadu_ps( e[ 0 ] );
+  __m128 ey = _mm_loadu_ps( e[ 1 ] );
+  __m128 ez = _mm_loadu_ps( e[ 2 ] );
+  __m128 zero = _mm_setzero_ps();
+  __m128 outside = zero;
+  for ( int p = 0; p < BRLA_FRUSTUM_PLANES; ++p ) {
+    __m128 d = _mm_set1_ps( planes[ p ][ 3 ] );
+    d = _mm_add_ps( d, _mm_mul_ps( _mm_set1_ps( planes[ p ][ 0 ] ), cx ) );
+    d = _mm_add_ps( d, _mm_mul_ps( _mm_set1_ps( planes[ p ][ 1 ] ), cy ) );
+    d = _mm_add_ps( d, _mm_mul_ps( _mm_set1_ps( planes[ p ][ 2 ] ), cz ) );
+    d = _mm_add_ps( d,
+      _mm_mul_ps( _mm_set1_ps( abs_normals[ p ][ 0 ] ), ex ) );
+    d = _mm_add_ps( d,
+      _mm_mul_ps( _mm_set1_ps( abs_normals[ p ][ 1 ] ), ey ) );
+    d = _mm_add_ps( d,
+      _mm_mul_ps( _mm_set1_ps( abs_normals[ p ][ 2 ] ), ez ) );
+    outside = _mm_or_ps( outside, _mm_cmplt_ps( d, zero ) );
+  }
+  return _mm_movemask_ps( outside );
+#else
+  int outside = 0;
+  for ( int b = 0; b < 4; ++b ) {
+    for ( int p = 0; p < BRLA_FRUSTUM_PLANES; ++p ) {
+      float d = planes[ p ][ 3 ];
+      for ( int i = 0; i < 3; ++i ) {
+        d += planes[ p ][ i ] * c[ i ][ b ] +
+             abs_normals[ p ][ i ] * e[ i ][ b ];
+      }
+      if ( d < 0.0f ) {
+        outside |= ( 1 << b );
+        break;
+      }
+    }
+  }
+  return outside;
+#endif
+}
+
+/**
+ * Append the game objects whose world-space bounds are at least
+ * partly inside of the frustum to 'visible', four at a time.
+ * Empty entries and objects without a mesh are skipped.
+ */
+void frustum::cull( const vector<unity*>& objs,
+                    vector<unity*>& visible ) {
+  int n = objs.size();
+  float c[ 3 ][ 4 ];
+  float e[ 3 ][ 4 ];
+  unity* batch[ 4 ];
+  for ( int base = 0; base < n; base += 4 ) {
+    for ( int b = 0; b < 4; ++b ) {
+      unity* u = ( base + b < n ) ? objs[ base + b ] : 0;
+      batch[ b ] = ( u && u->m ) ? u : 0;
+      v3 center, half;
+      if ( batch[ b ] ) {
+        center = u->world_bounds.center();
+        half = u->world_bounds.half_extents();
+      }
+      for ( int i = 0; i < 3; ++i ) {
+        c[ i ][ b ] = center.v[ i ];
+        e[ i ][ b ] = half.v[ i ];
+      }
+    }
+    int outside = test4( c, e );
+    for ( int b = 0; b < 4; ++b ) {
+      if ( batch[ b ] && !( outside & ( 1 << b ) ) ) {
+        visible.push_back( batch[ b ] );
+      }
+    }
+  }
+}
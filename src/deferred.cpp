@@ -0,0 +1,112 @@
+#include "deferred.h"
+
+/**
+ * Create a screen-sized G-buffer texture, and leave it bound to
+ * its texture unit for the lighting pass to read.
+ */
+static GLuint gen_target( int unit_ind,
+                          GLint internal_fmt,
+                          GLenum fmt,
+                          GLenum type,
+                          int w,
+                          int h ) {
+  GLuint tex = 0;
+  glGenTextures( 1, &tex );
+  glActiveTexture( GL_TEXTURE0 + g->t_man->num_textures + unit_ind );
+  glBindTexture( GL_TEXTURE_2D, tex );
+  glTexImage2D( GL_TEXTURE_2D, 0, internal_fmt, w, h, 0, fmt, type, NULL );
+  // The lighting pass reads one texel per pixel.
+  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+  return tex;
+}
+
+/**
+ * Deferred renderer constructor. The G-buffer is created at the
+ * window's size when the first frame is drawn.
+ */
+deferred_renderer::deferred_renderer() {
+  glGenVertexArrays( 1, &empty_vao );
+}
+
+/** Deferred renderer destructor: delete the OpenGL objects. */
+deferred_renderer::~deferred_renderer() {
+  free_targets();
+  if ( empty_vao ) { glDeleteVertexArrays( 1, &empty_vao ); }
+}
+
+/** Delete the G-buffer framebuffer and textures, if any. */
+void deferred_renderer::free_targets() {
+  if ( fbuf ) { glDeleteFramebuffers( 1, &fbuf ); }
+  if ( albedo_tex ) { glDeleteTextures( 1, &albedo_tex ); }
+  if ( normal_tex ) { glDeleteTextures( 1, &normal_tex ); }
+  if ( depth_tex ) { glDeleteTextures( 1, &depth_tex ); }
+  fbuf = 0;
+  albedo_tex = 0;
+  normal_tex = 0;
+  depth_tex = 0;
+}
+
+/** (Re-)create the G-buffer at a new size. */
+void deferred_renderer::resize( int w, int h ) {
+  free_targets();
+  width = w;
+  height = h;
+
+  albedo_tex = gen_target( BRLA_GBUF_ALBEDO_TEX_IND,
+                           GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, w, h );
+  normal_tex = gen_target( BRLA_GBUF_NORMAL_TEX_IND,
+                           GL_RGBA16F, GL_RGBA, GL_FLOAT, w, h );
+  depth_tex = gen_target( BRLA_GBUF_DEPTH_TEX_IND,
+                          GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT,
+                          GL_UNSIGNED_INT, w, h );
+
+  glGenFramebuffers( 1, &fbuf );
+  glBindFramebuffer( GL_FRAMEBUFFER, fbuf );
+  glFramebufferTexture2D( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                          GL_TEXTURE_2D, albedo_tex, 0 );
+  glFramebufferTexture2D( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1,
+                          GL_TEXTURE_2D, normal_tex, 0 );
+  glFramebufferTexture2D( GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                          GL_TEXTURE_2D, depth_tex, 0 );
+  GLenum draw_bufs[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+  glDrawBuffers( 2, draw_bufs );
+  GLenum status = glCheckFramebufferStatus( GL_FRAMEBUFFER );
+  if ( GL_FRAMEBUFFER_COMPLETE != status ) {
+    log_error( "[ERROR (deferred_renderer)] Incomplete framebuffer. "
+               "Status code: %i\n",
+               status );
+  }
+  glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+}
+
+/**
+ * Bind and clear the G-buffer, so that the opaque pass draws into
+ * it. It is re-created first if the window has changed size.
+ */
+void deferred_renderer::begin_geometry() {
+  if ( width != g->g_win_w || height != g->g_win_h ) {
+    resize( g->g_win_w, g->g_win_h );
+  }
+  glBindFramebuffer( GL_FRAMEBUFFER, fbuf );
+  glViewport( 0, 0, width, height );
+  glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
+}
+
+/**
+ * Light the G-buffer into the window's framebuffer, with one
+ * full-screen triangle. Pixels which nothing was drawn on keep
+ * the window's clear color.
+ */
+void deferred_renderer::draw_lighting() {
+  glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+  g->r_queue->begin_pass_timer( BRLA_PASS_LIGHTING );
+  GLuint last_shader = g->s_man->cur_shader;
+  g->s_man->swap_shader( g->deferred_light_shader_key );
+  glBindVertexArray( empty_vao );
+  glDrawArrays( GL_TRIANGLES, 0, 3 );
+  g->s_man->swap_shader( last_shader );
+  g->r_queue->end_pass_timer();
+}
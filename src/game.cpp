@@ -64,13 +64,23 @@ game::game( int w, int h ) {
 
 /** Main 'game' object destructor. Delete each system manager. */
 game::~game() {
+  // Wait for any level loading tasks before the managers go away.
+  if (loader) { delete loader; }
   if (l_man) { delete l_man; }
   if (t_man) { delete t_man; }
   if (s_man) { delete s_man; }
   if (c_man) { delete c_man; }
   if (u_man) { delete u_man; }
   if (g_man) { delete g_man; }
+  if (r_queue) { delete r_queue; }
+  if (o_buf) { delete o_buf; }
+  if (jobs) { delete jobs; }
+  if (d_rend) { delete d_rend; }
+  if (pt_man) { delete pt_man; }
+  // Meshes are shared by game objects, so delete them afterwards.
+  if (m_man) { delete m_man; }
   if (p_man) { delete p_man; }
+  if (ubo_ring) { delete ubo_ring; }
 }
 
 /**
@@ -84,20 +94,37 @@ void game::init() {
   l_man = new lighting_manager();
   t_man = new texture_manager();
 
-  // Load the basic font atlas.
-  t_man->add_mapping_by_fn( f_mono );
+  // Load the basic font atlas. The GUI draws text from its pixels
+  // on the CPU, so they are kept after the upload.
+  t_man->add_mapping_by_fn( f_mono, true );
   texture* mono_font = t_man->get( f_mono );
-  flip_tex_V( mono_font->tex_buffer,
-              mono_font->tex_x,
-              mono_font->tex_y,
-              mono_font->tex_n );
   mono_font->load_uniform_font_atlas();
 
+  // Create the ring buffer which the Uniform Buffer Objects
+  // are streamed through.
+  GLint ubo_align = 256;
+  glGetIntegerv( GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &ubo_align );
+  ubo_ring = new ring_buffer( GL_UNIFORM_BUFFER,
+                              BRLA_UBO_RING_SIZE,
+                              ubo_align );
+
   // Continue initializing system managers.
   s_man = new shader_manager();
+  s_man->add_define( "MAX_PHONG_LIGHTS", l_man->max_lights );
+  s_man->add_define( "MAX_SHADOWED_LIGHTS", BRLA_MAX_SHADOWED_LIGHTS );
   c_man = new camera_manager();
+  m_man = new mesh_manager();
   u_man = new unity_manager();
   g_man = new gui_manager();
+  r_queue = new render_queue();
+  jobs = new job_pool();
+  loader = new level_loader();
+  loader->on_progress = []( float progress ) {
+    g->load_progress = progress;
+  };
+  o_buf = new occlusion_buffer();
+  if ( deferred_shading ) { d_rend = new deferred_renderer(); }
+  pt_man = new particle_manager( BRLA_PARTICLES_PER_EMITTER );
 
   // Load shaders.
   s_man->add_shader_prog( normal_shader_key,
@@ -124,9 +151,22 @@ void game::init() {
   s_man->add_shader_prog( particles_shader_key,
                           particles_vert_shader_fn,
                           particles_frag_shader_fn );
+  s_man->add_feedback_prog( particles_update_shader_key,
+                            particles_update_vert_shader_fn,
+                            { "tf_pos_age", "tf_vel_tag" } );
   s_man->add_shader_prog( depth_shader_key,
                           normal_vert_shader_fn,
                           depth_frag_shader_fn );
+  s_man->add_shader_prog( gbuffer_shader_key,
+                          normal_vert_shader_fn,
+                          gbuffer_frag_shader_fn );
+  s_man->add_shader_prog( deferred_light_shader_key,
+                          fullscreen_vert_shader_fn,
+                          deferred_light_frag_shader_fn );
+  s_man->add_shader_prog( shadow_layered_shader_key,
+                          shadow_layered_vert_shader_fn,
+                          shadow_layered_geom_shader_fn,
+                          depth_frag_shader_fn );
 
   // Setup the global 'world' UBO.
   float default_buf[ BRLA_GAME_UBO_SIZE ];
@@ -137,12 +177,6 @@ void game::init() {
                      BRLA_GAME_UBO_SIZE );
   world_ubo_buf[ 0 ] = near;
   world_ubo_buf[ 1 ] = far;
-  glGenBuffers( 1, &world_block_buffer );
-  glBindBuffer( GL_UNIFORM_BUFFER, world_block_buffer );
-  glBufferData( GL_UNIFORM_BUFFER,
-                sizeof( float ) * BRLA_GAME_UBO_SIZE,
-                NULL,
-                GL_DYNAMIC_DRAW );
   // Initial UBO update.
   write_world_ubo();
 
@@ -165,6 +199,10 @@ void game::init() {
 
   // Initialize the lighting Uniform Buffer Object.
   l_man->init_lighting_ubo();
+
+  // The shader programs have been building in the background;
+  // wait for any which are left, and check them for errors.
+  s_man->finish_programs();
 }
 
 /** Process the game loop's "input" / "update" / "draw" steps. */
@@ -172,6 +210,17 @@ int game::process_game_loop() {
   // Log any OpenGL errors that may have occurred recently.
   log_gl_errors();
 
+  // Start counting this frame's Uniform Buffer Object uploads
+  // and render queue work.
+  last_frame_ubo_bytes = frame_ubo_bytes;
+  frame_ubo_bytes = 0;
+  r_queue->end_frame();
+  // Move the streaming buffers on to the next frame's regions.
+  ubo_ring->advance_frame();
+  m_man->instances->advance_frame();
+  t_man->staging->advance_frame();
+  if ( l_man->clusters ) { l_man->clusters->ring->advance_frame(); }
+
   // Update inter-frame timers.
   static double prev_sec = glfwGetTime();
   double cur_sec = glfwGetTime();
@@ -493,8 +542,12 @@ int game::process_game_loop() {
     tab_key_down = false;
   }
 
+  // Add more of the level which is loading, if any. The physics
+  // simulation waits until it is done, so that nothing can fall
+  // through the ground before the ground has been added.
+  loader->update();
   // Step the physics simulation, if the game is not paused.
-  if ( !paused ) {  p_man->update(); }
+  if ( !paused && !loader->active ) {  p_man->update(); }
 
   // Perform a raycast to update the game's record of the object
   // that the player is currently looking at, if any.
@@ -525,10 +578,11 @@ int game::process_game_loop() {
     if ( c_man->active_camera->cam_obj ) {
       c_man->active_camera->cam_obj->update();
     }
-    // Update lights.
-    l_man->update();
   }
 
+  // Write this frame's world / camera / lighting UBOs.
+  write_frame_ubos();
+
   // Shadow casting: draw the shadow depth buffers.
   l_man->draw_shadow_casters();
 
@@ -536,20 +590,33 @@ int game::process_game_loop() {
   glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
   glViewport( 0, 0, g_win_w, g_win_h );
 
-  // Draw the world using the normal shader program.
-  s_man->swap_shader( normal_shader_key );
+  // Draw the occluders into the software depth buffer, so that
+  // objects hidden behind them can be skipped.
+  if ( c_man->active_camera ) {
+    o_buf->build( c_man->active_camera, u_man );
+  }
+
+  // Draw the world using the normal shader program, or into
+  // the G-buffer and then light it if deferred shading is used.
+  if ( d_rend ) {
+    d_rend->begin_geometry();
+    s_man->swap_shader( gbuffer_shader_key );
+  }
+  else { s_man->swap_shader( normal_shader_key ); }
   u_man->draw();
   l_man->draw();
+  if ( depth_prepass ) {
+    r_queue->add_depth_prepass( s_man->get( depth_shader_key ) );
+  }
+  r_queue->execute();
+  if ( d_rend ) {
+    d_rend->draw_lighting();
+    s_man->swap_shader( normal_shader_key );
+  }
+  // Simulate and draw the particle effects.
+  if ( !paused ) { pt_man->update( elapsed_sec ); }
+  pt_man->draw();
 
-  // Reset the camera translation matrix, for physics debugging.
-  glBindBuffer( GL_UNIFORM_BUFFER, c_man->cam_block_buffer );
-  glBindBufferBase( GL_UNIFORM_BUFFER,
-                    c_man->cam_ubo,
-                    c_man->cam_block_buffer );
-  glBufferSubData( GL_UNIFORM_BUFFER,
-                   0,
-                   sizeof(float) * 16,
-                   transpose( id4()).m );
   // Perform physics debug drawing if necessary.
   if ( draw_phys_debug ) {
     p_man->draw();
@@ -559,6 +626,8 @@ int game::process_game_loop() {
   glDepthFunc( GL_ALWAYS );
   g_man->draw();
   glDepthFunc( GL_LESS );
+  // Show how much of the level has loaded, if one is loading.
+  if ( loader->active ) { draw_loading_bar( load_progress ); }
 
   // Done drawing; ensure that the normal shader program is set.
   s_man->swap_shader( normal_shader_key );
@@ -573,10 +642,27 @@ int game::process_game_loop() {
   if ( elapsed_seconds > 0.25 ) {
     prev_seconds = cur_seconds;
     double fps = ( double )fps_frame_count / elapsed_seconds;
+    render_stats& rs = r_queue->last_stats;
     snprintf( win_title_buf,
               BRLA_TITLE_BUF_SIZE,
-              "Berilia - FPS: %.2f",
-              fps );
+              "Berilia - FPS: %.2f - UBO: %lu B/frame - "
+              "draws: %d, programs: %d, textures: %d, VAOs: %d, "
+              "culled: %d, occluded: %d, shadows cached: %d - "
+              "GPU ms shadow: %.2f, pre-pass: %.2f, opaque: %.2f, "
+              "lighting: %.2f",
+              fps,
+              last_frame_ubo_bytes,
+              rs.draws,
+              rs.program_switches,
+              rs.texture_binds,
+              rs.vao_binds,
+              rs.culled,
+              rs.occluded,
+              rs.shadows_cached,
+              rs.pass_ms[ BRLA_PASS_SHADOW ],
+              rs.pass_ms[ BRLA_PASS_DEPTH ],
+              rs.pass_ms[ BRLA_PASS_OPAQUE ],
+              rs.pass_ms[ BRLA_PASS_LIGHTING ] );
     glfwSetWindowTitle( window, win_title_buf );
     fps_frame_count = 0;
   }
@@ -586,75 +672,32 @@ int game::process_game_loop() {
   return 0;
 }
 
-/** Load a game world from a file. TODO: Comment this method. */
+/**
+ * Load a game world from a file. The current world is cleared
+ * right away, and the new one is loaded over the next frames by
+ * the level loader, while a progress bar is shown.
+ */
 void game::reload_file( string fn ) {
-  u_man->clear_unities();
-  l_man->clear_phong_lights();
-
-  string loaded_file = read_from_file( fn.c_str() );
-  json j = json::parse( loaded_file );
-  for ( int i = 0; i < (int)j["unities"].size(); ++i ) {
-    json u_j = j[ "unities" ][ i ];
-    if ( u_j[ "type" ] != "u_light_ind" ) {
-      v3 pos = v3( u_j[ "pos_x" ], u_j[ "pos_y" ], u_j[ "pos_z" ] );
-      quat rot = quat( rad_to_ang( u_j[ "rot_t" ] ), u_j[ "rot_x" ],
-                                   u_j[ "rot_y" ], u_j[ "rot_z" ] );
-      unity* loaded_unity = u_man->add_unity( u_j[ "type" ] );
-      if ( loaded_unity ) {
-        loaded_unity->name = u_j[ "name" ];
-        v3 u_sc = v3( u_j[ "scale_x" ],
-                      u_j[ "scale_y" ],
-                      u_j[ "scale_z" ] );
-        loaded_unity->scale( u_sc );
-        loaded_unity->translate( pos.v[ 0 ], pos.v[ 1 ], pos.v[ 2 ] );
-        loaded_unity->set_rotation( rot );
-
-        for ( int j = 0; j < ( int )u_j[ "scripts" ].size(); ++j ) {
-          selected_unity = loaded_unity;
-          add_script_to_selected( u_j[ "scripts" ][ j ][ "type" ] );
-          script* added = selected_unity->
-            scripts[ selected_unity->scripts.size() - 1 ];
-          if ( added && added->type == "s_test_use" ) {
-            if ( u_j[ "scripts" ][ j ].find( "txt" ) !=
-                 u_j[ "scripts" ][ j ].end() ) {
-              ( ( s_test_use* )added )->my_text =
-                u_j[ "scripts" ][ j ][ "txt" ];
-            }
-          }
-          if ( u_j[ "scripts" ][ j ].find( "on_use" ) !=
-               u_j[ "scripts" ][ j ].end() ) {
-            selected_unity->use_script = added;
-          }
-        }
-      }
-    }
-  }
+  loader->start( fn );
+}
 
-  for ( int i = 0; i < ( int )j[ "phong_lights" ].size(); ++i ) {
-    json j_pl = j[ "phong_lights" ][ i ];
-    v4 pl_pos = v4( j_pl[ "p_x" ], j_pl[ "p_y" ],
-                    j_pl[ "p_z" ], j_pl[ "p_a" ] );
-    v4 pl_amb = v4( j_pl[ "a_r" ], j_pl[ "a_g" ],
-                    j_pl[ "a_b" ], j_pl[ "a_a" ] );
-    v4 pl_dif = v4( j_pl[ "d_r" ], j_pl[ "d_g" ],
-                    j_pl[ "d_b" ], j_pl[ "d_a" ] );
-    v4 pl_spe = v4( j_pl[ "s_r" ], j_pl[ "s_g" ],
-                    j_pl[ "s_b" ], j_pl[ "s_a" ] );
-    phong_light* p_l = new phong_light( pl_pos, pl_amb,
-                                        pl_dif, pl_spe );
-    p_l->specular_exp = j_pl[ "s_e" ];
-    p_l->falloff = j_pl[ "f" ];
-    p_l->type = j_pl[ "l_type" ];
-    p_l->dir = v3( ( float )j_pl[ "sp_dir_x" ],
-            ( float )j_pl[ "sp_dir_y" ],
-            ( float )j_pl[ "sp_dir_z" ] );
-    p_l->spot_rads = ( float )j_pl[ "sp_dir_t" ];
-    p_l->indicator = u_man->add_unity( "u_light_ind" );
-    p_l->indicator->translate( pl_pos.v[ 0 ],
-                               pl_pos.v[ 1 ],
-                               pl_pos.v[ 2 ] );
-    l_man->add_phong_light( p_l );
-  }
+/**
+ * Draw a simple loading screen progress bar along the bottom of
+ * the window, with scissored clears so that no shader is needed.
+ */
+void game::draw_loading_bar( float progress ) {
+  int bar_h = g_win_h / 64;
+  if ( bar_h < 4 ) { bar_h = 4; }
+  glEnable( GL_SCISSOR_TEST );
+  glScissor( 0, 0, g_win_w, bar_h );
+  glClearColor( 0.1f, 0.1f, 0.1f, 1.0f );
+  glClear( GL_COLOR_BUFFER_BIT );
+  glScissor( 0, 0, ( int )( g_win_w * progress ), bar_h );
+  glClearColor( 0.9f, 0.9f, 0.9f, 1.0f );
+  glClear( GL_COLOR_BUFFER_BIT );
+  glDisable( GL_SCISSOR_TEST );
+  glScissor( 0, 0, g_win_w, g_win_h );
+  glClearColor( 0.5f, 0.5f, 0.6f, 1.0f );
 }
 
 /**
@@ -745,24 +788,49 @@ void game::log_shader_errors( GLuint shader ) {
   }
 }
 
+/**
+ * Write a Uniform Buffer Object's values to the current frame's
+ * region of the UBO ring buffer, and bind that sub-range to the
+ * given binding point. Returns the sub-range's offset, or -1 if
+ * the frame's region is full.
+ */
+GLintptr game::write_ubo( GLuint binding,
+                          const void* data,
+                          GLsizeiptr size ) {
+  GLintptr offset = ubo_ring->write( data, size );
+  if ( offset < 0 ) {
+    log_error( "[ERROR] UBO ring buffer is full; "
+               "skipped a %i byte write.\n", ( int )size );
+    return -1;
+  }
+  glBindBufferRange( GL_UNIFORM_BUFFER, binding,
+                     ubo_ring->buffer, offset, size );
+  frame_ubo_bytes += size;
+  return offset;
+}
+
 /**
  * Write up-to-date values to the 'game world' Uniform Buffer Object.
  */
 void game::write_world_ubo() {
-  glBindBuffer( GL_UNIFORM_BUFFER, world_block_buffer );
-  glBindBufferBase( GL_UNIFORM_BUFFER,
-                    world_ubo,
-                    world_block_buffer );
-  world_ubo_index =
-    glGetUniformBlockIndex( s_man->cur_shader, "world_ubo" );
-  if ( ( ( int )world_ubo_index ) >= 0 ) {
-    glUniformBlockBinding( s_man->cur_shader,
-                           world_ubo_index,
-                           world_ubo );
-    glBufferSubData( GL_UNIFORM_BUFFER,
-                     0,
-                     sizeof( float ) * BRLA_GAME_UBO_SIZE,
-                     world_ubo_buf );
+  write_ubo( world_ubo,
+             world_ubo_buf,
+             sizeof( float ) * BRLA_GAME_UBO_SIZE );
+}
+
+/**
+ * Write the Uniform Buffer Objects which every shader program
+ * shares, once per frame. They are bound to fixed binding points,
+ * so switching shader programs does not need to re-write them.
+ */
+void game::write_frame_ubos() {
+  write_world_ubo();
+  // Particles are drawn even while they are paused.
+  pt_man->write_particles_ubo();
+  // The camera and lighting values need an active camera.
+  if ( c_man->active_camera ) {
+    c_man->update_cam_ubo();
+    l_man->update();
   }
 }
 
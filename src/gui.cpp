@@ -1562,8 +1562,7 @@ void gui_t::draw() {
   draw_to_texture();
 
   // Set the GUI VAO and texture sampler.
-  int tex_loc = glGetUniformLocation( g->s_man->cur_shader,
-                                      "texture_sampler" );
+  int tex_loc = g->s_man->uniform( BRLA_UNIFORM_TEXTURE_SAMPLER );
   glUniform1i( tex_loc, gui_tex_index );
   glBindVertexArray( gui_vao );
   // Draw the GUI texture.
@@ -2183,6 +2182,7 @@ void gui_t::load_editor_gui() {
       saved_unity[ "scale_x" ] = u_scale.v[ 0 ];
       saved_unity[ "scale_y" ] = u_scale.v[ 1 ];
       saved_unity[ "scale_z" ] = u_scale.v[ 2 ];
+      saved_unity[ "occluder" ] = u->occluder;
 
       json u_scripts = json::array();
       for ( int j = 0; j < u->scripts.size(); ++j ) {
@@ -0,0 +1,129 @@
+#include "job_pool.h"
+
+/**
+ * Job pool constructor. Start the given number of worker threads,
+ * or one fewer than the number of hardware threads if that is 0.
+ * The thread which calls 'parallel_for' also runs jobs, so a
+ * single-core machine gets no workers and runs everything inline.
+ */
+job_pool::job_pool( int num_threads ) {
+  if ( num_threads <= 0 ) {
+    num_threads = ( int )thread::hardware_concurrency() - 1;
+  }
+  if ( num_threads > BRLA_MAX_WORKERS ) {
+    num_threads = BRLA_MAX_WORKERS;
+  }
+  for ( int i = 0; i < num_threads; ++i ) {
+    workers.push_back( thread( &job_pool::worker_loop, this ) );
+  }
+}
+
+/** Job pool destructor. Wake and join every worker thread. */
+job_pool::~job_pool() {
+  {
+    std::lock_guard<mutex> l( lock );
+    stopping = true;
+  }
+  work_cv.notify_all();
+  for ( int i = 0; i < workers.size(); ++i ) {
+    workers[ i ].join();
+  }
+}
+
+/** Return the number of worker threads in the pool. */
+int job_pool::num_workers() { return workers.size(); }
+
+/**
+ * Worker thread main loop: wait for a new set of jobs or a
+ * background task, run it, and repeat until the pool is destroyed.
+ * Sets of jobs go first, since the caller of 'parallel_for' is
+ * waiting for them.
+ */
+void job_pool::worker_loop() {
+  unsigned long seen = 0;
+  while ( true ) {
+    function<void()> task;
+    {
+      std::unique_lock<mutex> l( lock );
+      work_cv.wait( l, [ this, &seen ]() {
+        return stopping || generation != seen || !tasks.empty();
+      } );
+      if ( stopping ) { return; }
+      if ( generation == seen ) {
+        task = tasks.front();
+        tasks.pop_front();
+      }
+      seen = generation;
+    }
+    if ( task ) { task(); }
+    else { run_jobs(); }
+  }
+}
+
+/**
+ * Take jobs from the current set and run them until none are left.
+ * The last job to finish wakes the thread waiting in 'parallel_for'.
+ */
+void job_pool::run_jobs() {
+  while ( true ) {
+    int i;
+    {
+      std::lock_guard<mutex> l( lock );
+      if ( next_job >= num_jobs ) { return; }
+      i = next_job;
+      next_job += 1;
+    }
+    job( i );
+    {
+      std::lock_guard<mutex> l( lock );
+      remaining -= 1;
+      if ( remaining == 0 ) { done_cv.notify_all(); }
+    }
+  }
+}
+
+/**
+ * Call a function once for each index in [ 0, count ), spread
+ * across the worker threads and the calling thread, and return
+ * once every call has finished. Jobs should be coarse, since
+ * handing each one out takes a lock.
+ */
+void job_pool::parallel_for( int count, function<void( int )> fn ) {
+  if ( count <= 0 ) { return; }
+  if ( workers.empty() || count == 1 ) {
+    for ( int i = 0; i < count; ++i ) { fn( i ); }
+    return;
+  }
+  {
+    std::lock_guard<mutex> l( lock );
+    job = fn;
+    num_jobs = count;
+    next_job = 0;
+    remaining = count;
+    generation += 1;
+  }
+  work_cv.notify_all();
+  run_jobs();
+  std::unique_lock<mutex> l( lock );
+  done_cv.wait( l, [ this ]() { return remaining == 0; } );
+  job = nullptr;
+}
+
+/**
+ * Queue a task to run on a worker thread, and return without
+ * waiting for it. The task must not touch OpenGL, and whoever
+ * submits it is responsible for waiting for it to finish before
+ * anything that it uses is deleted. Without any workers, the
+ * task runs right away on the calling thread.
+ */
+void job_pool::submit( function<void()> task ) {
+  if ( workers.empty() ) {
+    task();
+    return;
+  }
+  {
+    std::lock_guard<mutex> l( lock );
+    tasks.push_back( task );
+  }
+  work_cv.notify_one();
+}
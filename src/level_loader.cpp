@@ -0,0 +1,370 @@
+#include "level_loader.h"
+
+/** Level loader constructor. Nothing is loaded until 'start'. */
+level_loader::level_loader() {}
+
+/**
+ * Level loader destructor: wait for any worker tasks which are
+ * still running, and delete the assets that were not used.
+ */
+level_loader::~level_loader() { cancel(); }
+
+/**
+ * Start loading a level file. The current game objects and lights
+ * are removed right away, and the level's assets are queued on the
+ * worker threads; 'update' adds the new ones over the next frames.
+ * A level which is still loading is cancelled first.
+ */
+void level_loader::start( string fn ) {
+  cancel();
+  g->u_man->clear_unities();
+  g->l_man->clear_phong_lights();
+
+  string loaded_file = read_from_file( fn.c_str() );
+  json j = json::parse( loaded_file );
+  level_fn = fn;
+  start_sec = glfwGetTime();
+
+  // Collect the distinct assets that each game object uses.
+  for ( int i = 0; i < ( int )j[ "unities" ].size(); ++i ) {
+    level_unity lu;
+    lu.def = j[ "unities" ][ i ];
+    string type = lu.def[ "type" ];
+    if ( type == "u_light_ind" ) { continue; }
+    const unity_assets* a = find_unity_assets( type );
+    if ( a ) {
+      lu.mesh_asset = add_asset( a->mesh_fn, true, a->v_format );
+      lu.texture_asset = add_asset( a->texture_fn, false, 0 );
+      if ( a->phys_type == BRLA_PHYS_BVH_TRI ||
+           a->phys_type == BRLA_PHYS_STATIC_BVH_TRI ) {
+        assets[ lu.mesh_asset ].num_shapes += 1;
+      }
+    }
+    unities.push_back( lu );
+  }
+  lights = j[ "phong_lights" ];
+  if ( lights.size() > 0 ) {
+    const unity_assets* a = find_unity_assets( "u_light_ind" );
+    light_mesh_asset = add_asset( a->mesh_fn, true, a->v_format );
+    light_texture_asset = add_asset( a->texture_fn, false, 0 );
+  }
+
+  // Queue one task per texture, and one per mesh file. Different
+  // vertex formats of one mesh share its cache file, so they are
+  // loaded one after another by the same task.
+  unordered_map<string, vector<int>> mesh_files;
+  vector<vector<int>> tasks;
+  for ( int i = 0; i < assets.size(); ++i ) {
+    if ( assets[ i ].resident ) { continue; }
+    if ( assets[ i ].is_mesh ) {
+      mesh_files[ assets[ i ].fn ].push_back( i );
+    }
+    else { tasks.push_back( vector<int>( 1, i ) ); }
+  }
+  for ( auto f_iter = mesh_files.begin();
+        f_iter != mesh_files.end();
+        ++f_iter ) {
+    tasks.push_back( f_iter->second );
+  }
+  active = true;
+  {
+    std::lock_guard<mutex> l( lock );
+    in_flight = tasks.size();
+  }
+  for ( int i = 0; i < tasks.size(); ++i ) {
+    vector<int> inds = tasks[ i ];
+    g->jobs->submit( [ this, inds ]() { decode_assets( inds ); } );
+  }
+}
+
+/**
+ * Helper method to add an asset to the current level, if it is
+ * not already part of it, and return its index. Textures which
+ * are already loaded are marked as resident right away.
+ */
+int level_loader::add_asset( string fn, bool is_mesh, int v_format ) {
+  string key = is_mesh ? g->m_man->key( fn, v_format ) : fn;
+  auto a_iter = asset_map.find( key );
+  if ( a_iter != asset_map.end() ) { return a_iter->second; }
+
+  level_asset a;
+  a.fn = fn;
+  a.is_mesh = is_mesh;
+  a.v_format = v_format;
+  if ( is_mesh ) {
+    // Loaded meshes still go to the workers, which build
+    // their collision shapes; they are only read from there.
+    a.m = g->m_man->get( key );
+    a.shared = ( a.m != 0 );
+  }
+  else if ( g->t_man->get( fn ) ) {
+    a.resident = true;
+    num_resident += 1;
+  }
+  assets.push_back( a );
+  asset_map[ key ] = assets.size() - 1;
+  return assets.size() - 1;
+}
+
+/**
+ * Worker task: load or decode the given assets, and build the
+ * collision shapes of each mesh. Nothing here may touch OpenGL,
+ * the physics world, or the managers' hash maps.
+ */
+void level_loader::decode_assets( vector<int> inds ) {
+  for ( int i = 0; i < inds.size(); ++i ) {
+    {
+      std::lock_guard<mutex> l( lock );
+      if ( cancelling ) { break; }
+    }
+    // The asset array is not resized while tasks are running.
+    level_asset& a = assets[ inds[ i ] ];
+    if ( a.is_mesh ) {
+      if ( !a.m ) { a.m = load_mesh( a.fn.c_str(), a.v_format ); }
+      if ( a.m ) {
+        for ( int k = 0; k < a.num_shapes; ++k ) {
+          a.shapes.push_back( build_bvh_shape( a.m ) );
+        }
+      }
+    }
+    else {
+      a.tex = new texture( a.fn.c_str(), GL_TEXTURE0, false );
+    }
+    std::lock_guard<mutex> l( lock );
+    decoded.push_back( inds[ i ] );
+  }
+  std::lock_guard<mutex> l( lock );
+  in_flight -= 1;
+  if ( in_flight == 0 ) { done_cv.notify_all(); }
+}
+
+/**
+ * Helper method to hand a decoded asset to its manager, uploading
+ * it to OpenGL, and to give its collision shapes to the physics
+ * manager for the game objects which are added later.
+ */
+void level_loader::upload( int i ) {
+  level_asset& a = assets[ i ];
+  if ( a.is_mesh ) {
+    if ( a.m && !a.shared ) {
+      a.m->init_buffers();
+      g->m_man->add_mapping( g->m_man->key( a.fn, a.v_format ), a.m );
+    }
+    for ( int k = 0; k < a.shapes.size(); ++k ) {
+      g->p_man->add_prebuilt_shape( a.m, a.shapes[ k ] );
+    }
+    a.shapes.clear();
+  }
+  else if ( a.tex ) {
+    if ( !a.tex->levels.empty() ) { a.tex->bind(); }
+    g->t_man->add_mapping( a.fn, a.tex );
+    a.tex = 0;
+  }
+  a.resident = true;
+  num_resident += 1;
+}
+
+/**
+ * Check whether a game object's mesh and texture have both been
+ * handed to their managers. Indices of -1 count as ready.
+ */
+bool level_loader::assets_ready( int mesh_asset, int texture_asset ) {
+  if ( mesh_asset >= 0 && !assets[ mesh_asset ].resident ) {
+    return false;
+  }
+  if ( texture_asset >= 0 && !assets[ texture_asset ].resident ) {
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Per-frame loading step, called from the game loop on the main
+ * thread. Upload the assets which the workers have finished, then
+ * add the game objects which are ready, until the frame's budget
+ * is spent; then report the progress.
+ */
+void level_loader::update() {
+  if ( !active ) { return; }
+  double budget_end = glfwGetTime() + budget_ms / 1000.0;
+  {
+    std::lock_guard<mutex> l( lock );
+    for ( int i = 0; i < decoded.size(); ++i ) {
+      ready.push_back( decoded[ i ] );
+    }
+    decoded.clear();
+  }
+  while ( !ready.empty() && glfwGetTime() < budget_end ) {
+    upload( ready.front() );
+    ready.pop_front();
+  }
+  while ( next_unity < unities.size() && glfwGetTime() < budget_end ) {
+    level_unity& lu = unities[ next_unity ];
+    if ( !assets_ready( lu.mesh_asset, lu.texture_asset ) ) { break; }
+    spawn_unity( lu.def );
+    next_unity += 1;
+  }
+  if ( next_unity == unities.size() &&
+       assets_ready( light_mesh_asset, light_texture_asset ) ) {
+    spawn_lights();
+    finish();
+  }
+  if ( on_progress ) { on_progress( progress() ); }
+}
+
+/**
+ * Get the fraction of the current level which has been loaded,
+ * from 0 to 1; counting assets uploaded and game objects added.
+ */
+float level_loader::progress() {
+  if ( !active ) { return 1.0f; }
+  int total = assets.size() + unities.size();
+  if ( total == 0 ) { return 1.0f; }
+  return ( float )( num_resident + next_unity ) / total;
+}
+
+/**
+ * Helper method to add one game object from its entry in a
+ * level file, along with its scripts.
+ */
+void level_loader::spawn_unity( json& u_j ) {
+  v3 pos = v3( u_j[ "pos_x" ], u_j[ "pos_y" ], u_j[ "pos_z" ] );
+  quat rot = quat( rad_to_ang( u_j[ "rot_t" ] ), u_j[ "rot_x" ],
+                               u_j[ "rot_y" ], u_j[ "rot_z" ] );
+  unity* loaded_unity = g->u_man->add_unity( u_j[ "type" ] );
+  if ( !loaded_unity ) { return; }
+  loaded_unity->name = u_j[ "name" ];
+  v3 u_sc = v3( u_j[ "scale_x" ],
+                u_j[ "scale_y" ],
+                u_j[ "scale_z" ] );
+  loaded_unity->scale( u_sc );
+  loaded_unity->translate( pos.v[ 0 ], pos.v[ 1 ], pos.v[ 2 ] );
+  loaded_unity->set_rotation( rot );
+  if ( u_j.find( "occluder" ) != u_j.end() ) {
+    loaded_unity->occluder = u_j[ "occluder" ];
+  }
+
+  for ( int j = 0; j < ( int )u_j[ "scripts" ].size(); ++j ) {
+    g->selected_unity = loaded_unity;
+    g->add_script_to_selected( u_j[ "scripts" ][ j ][ "type" ] );
+    unity* sel = g->selected_unity;
+    script* added = sel->scripts[ sel->scripts.size() - 1 ];
+    if ( added && added->type == "s_test_use" ) {
+      if ( u_j[ "scripts" ][ j ].find( "txt" ) !=
+           u_j[ "scripts" ][ j ].end() ) {
+        ( ( s_test_use* )added )->my_text =
+          u_j[ "scripts" ][ j ][ "txt" ];
+      }
+    }
+    if ( u_j[ "scripts" ][ j ].find( "on_use" ) !=
+         u_j[ "scripts" ][ j ].end() ) {
+      sel->use_script = added;
+    }
+  }
+}
+
+/**
+ * Helper method to add the level's lights, and their
+ * indicator game objects.
+ */
+void level_loader::spawn_lights() {
+  for ( int i = 0; i < ( int )lights.size(); ++i ) {
+    json j_pl = lights[ i ];
+    v4 pl_pos = v4( j_pl[ "p_x" ], j_pl[ "p_y" ],
+                    j_pl[ "p_z" ], j_pl[ "p_a" ] );
+    v4 pl_amb = v4( j_pl[ "a_r" ], j_pl[ "a_g" ],
+                    j_pl[ "a_b" ], j_pl[ "a_a" ] );
+    v4 pl_dif = v4( j_pl[ "d_r" ], j_pl[ "d_g" ],
+                    j_pl[ "d_b" ], j_pl[ "d_a" ] );
+    v4 pl_spe = v4( j_pl[ "s_r" ], j_pl[ "s_g" ],
+                    j_pl[ "s_b" ], j_pl[ "s_a" ] );
+    phong_light* p_l = new phong_light( pl_pos, pl_amb,
+                                        pl_dif, pl_spe );
+    p_l->specular_exp = j_pl[ "s_e" ];
+    p_l->falloff = j_pl[ "f" ];
+    p_l->type = j_pl[ "l_type" ];
+    p_l->dir = v3( ( float )j_pl[ "sp_dir_x" ],
+                   ( float )j_pl[ "sp_dir_y" ],
+                   ( float )j_pl[ "sp_dir_z" ] );
+    p_l->spot_rads = ( float )j_pl[ "sp_dir_t" ];
+    p_l->indicator = g->u_man->add_unity( "u_light_ind" );
+    p_l->indicator->translate( pl_pos.v[ 0 ],
+                               pl_pos.v[ 1 ],
+                               pl_pos.v[ 2 ] );
+    g->l_man->add_phong_light( p_l );
+  }
+}
+
+/**
+ * Helper method to wait until every worker task has returned. If
+ * 'cancel_tasks' is set, they skip the assets they have not begun.
+ */
+void level_loader::wait_for_tasks( bool cancel_tasks ) {
+  std::unique_lock<mutex> l( lock );
+  cancelling = cancel_tasks;
+  done_cv.wait( l, [ this ]() { return in_flight == 0; } );
+  cancelling = false;
+}
+
+/**
+ * Helper method to finish loading a level: drop anything which
+ * was not used, and restart the physics clock so that the first
+ * step does not cover the whole loading time. The last asset can
+ * be decoded before its task has returned, so that is waited for
+ * first; the loader's state must not be reset under a worker.
+ */
+void level_loader::finish() {
+  log( "Loaded level %s: %d assets, %d game objects, in %.2fs.\n",
+       level_fn.c_str(),
+       ( int )assets.size(),
+       ( int )unities.size(),
+       glfwGetTime() - start_sec );
+  wait_for_tasks( false );
+  release_assets();
+  g->p_man->phys_clock.reset();
+}
+
+/**
+ * Cancel the level which is loading, if any. This waits for the
+ * worker tasks which have already started; the game objects which
+ * were added so far stay in the world.
+ */
+void level_loader::cancel() {
+  if ( !active ) { return; }
+  wait_for_tasks( true );
+  release_assets();
+}
+
+/**
+ * Helper method to delete the assets and collision shapes which
+ * were never used, and reset the loader's state. Meshes which were
+ * uploaded, but which no game object took a reference to, are
+ * evicted from the mesh manager too.
+ */
+void level_loader::release_assets() {
+  g->p_man->clear_prebuilt_shapes();
+  for ( int i = 0; i < assets.size(); ++i ) {
+    level_asset& a = assets[ i ];
+    for ( int k = 0; k < a.shapes.size(); ++k ) { delete a.shapes[ k ]; }
+    if ( a.tex ) { delete a.tex; }
+    if ( !a.m || a.shared ) { continue; }
+    if ( !a.resident ) {
+      delete a.m;
+      continue;
+    }
+    string key = g->m_man->key( a.fn, a.v_format );
+    mesh* m = g->m_man->get( key );
+    if ( m && m->ref_count <= 0 ) { g->m_man->evict_mapping( key ); }
+  }
+  assets.clear();
+  asset_map.clear();
+  unities.clear();
+  lights = json();
+  light_mesh_asset = -1;
+  light_texture_asset = -1;
+  decoded.clear();
+  ready.clear();
+  next_unity = 0;
+  num_resident = 0;
+  active = false;
+}
@@ -0,0 +1,241 @@
+#include "light_clusters.h"
+
+/**
+ * Light cluster constructor: create the ring buffer which the
+ * cluster data is streamed through, and a buffer texture over it
+ * on the texture unit reserved for clustered lighting.
+ * Every cluster's light list starts out empty.
+ */
+light_clusters::light_clusters() {
+  memset( cluster_ubo_buf, 0, sizeof( float ) * BRLA_CLUSTER_UBO_SIZE );
+  grid.assign( BRLA_NUM_CLUSTERS * 2, 0 );
+  ring = new ring_buffer( GL_TEXTURE_BUFFER,
+                          BRLA_CLUSTER_BUFFER_SIZE,
+                          sizeof( uint32_t ) * 4 );
+  glGenTextures( 1, &tex );
+  glActiveTexture( GL_TEXTURE0 +
+                   g->t_man->num_textures +
+                   BRLA_CLUSTER_TEX_IND );
+  glBindTexture( GL_TEXTURE_BUFFER, tex );
+  glTexBuffer( GL_TEXTURE_BUFFER, GL_R32UI, ring->buffer );
+}
+
+/** Light cluster destructor: delete the texture and buffer. */
+light_clusters::~light_clusters() {
+  if ( tex ) { glDeleteTextures( 1, &tex ); }
+  if ( ring ) { delete ring; }
+}
+
+/**
+ * Return the view-space distance at which depth slice 'z' begins.
+ * Slices are spaced exponentially, so that they stay roughly
+ * cube-shaped as they get further from the camera.
+ */
+float light_clusters::slice_depth( int z ) {
+  return near_d * pow( far_d / near_d, ( float )z / BRLA_CLUSTER_Z );
+}
+
+/**
+ * Check whether a light can reach any point in a view-space box.
+ * Its falloff sphere must touch the box; a spotlight's cone must
+ * also touch the sphere which bounds the box.
+ */
+bool light_clusters::light_hits( const cluster_light& l,
+                                 v3 box_min, v3 box_max ) {
+  float d2 = 0.0f;
+  for ( int i = 0; i < 3; ++i ) {
+    float c = l.center.v[ i ];
+    if ( c < box_min.v[ i ] ) {
+      d2 += ( box_min.v[ i ] - c ) * ( box_min.v[ i ] - c );
+    }
+    else if ( c > box_max.v[ i ] ) {
+      d2 += ( c - box_max.v[ i ] ) * ( c - box_max.v[ i ] );
+    }
+  }
+  if ( d2 > l.radius * l.radius ) { return false; }
+  if ( !l.spot ) { return true; }
+
+  // Distance from the box's bounding sphere to the cone's surface.
+  v3 b_c = ( box_min + box_max ) * 0.5f;
+  v3 b_e = ( box_max - box_min ) * 0.5f;
+  float b_r = magnitude( b_e );
+  v3 to_box = b_c - l.center;
+  float len2 = magnitude2( to_box );
+  float along = to_box.v[ 0 ] * l.axis.v[ 0 ] +
+                to_box.v[ 1 ] * l.axis.v[ 1 ] +
+                to_box.v[ 2 ] * l.axis.v[ 2 ];
+  float across = sqrt( std::max( len2 - along * along, 0.0f ) );
+  float cone_dist = l.cos_a * across - along * l.sin_a;
+  return !( cone_dist > b_r || along < -b_r );
+}
+
+/**
+ * Assign the lights to every cluster in depth slice 'z'. Each
+ * slice writes only its own arrays, so slices can run as
+ * separate jobs.
+ */
+void light_clusters::assign_slice( int z ) {
+  vector<uint32_t>& out = slice_indices[ z ];
+  vector<uint32_t>& counts = slice_counts[ z ];
+  out.clear();
+  counts.assign( BRLA_CLUSTER_X * BRLA_CLUSTER_Y, 0 );
+
+  // Only consider lights which reach this slice's depth range.
+  float d0 = slice_depth( z );
+  float d1 = slice_depth( z + 1 );
+  vector<int> candidates;
+  for ( int i = 0; i < lights.size(); ++i ) {
+    float depth = -lights[ i ].center.v[ 2 ];
+    if ( depth + lights[ i ].radius >= d0 &&
+         depth - lights[ i ].radius <= d1 ) {
+      candidates.push_back( i );
+    }
+  }
+  if ( candidates.empty() ) { return; }
+
+  for ( int y = 0; y < BRLA_CLUSTER_Y; ++y ) {
+    float ny0 = -1.0f + 2.0f * y / BRLA_CLUSTER_Y;
+    float ny1 = -1.0f + 2.0f * ( y + 1 ) / BRLA_CLUSTER_Y;
+    for ( int x = 0; x < BRLA_CLUSTER_X; ++x ) {
+      float nx0 = -1.0f + 2.0f * x / BRLA_CLUSTER_X;
+      float nx1 = -1.0f + 2.0f * ( x + 1 ) / BRLA_CLUSTER_X;
+      // A tile's view-space X / Y at depth 'd' is NDC * d / scale;
+      // bound the tile's corners at both ends of the slice.
+      v3 box_min = v3( std::min( nx0 * d0, nx0 * d1 ) / proj_x,
+                       std::min( ny0 * d0, ny0 * d1 ) / proj_y,
+                       -d1 );
+      v3 box_max = v3( std::max( nx1 * d0, nx1 * d1 ) / proj_x,
+                       std::max( ny1 * d0, ny1 * d1 ) / proj_y,
+                       -d0 );
+      uint32_t count = 0;
+      for ( int c = 0; c < candidates.size(); ++c ) {
+        if ( light_hits( lights[ candidates[ c ] ], box_min, box_max ) ) {
+          out.push_back( candidates[ c ] );
+          count += 1;
+        }
+      }
+      counts[ y * BRLA_CLUSTER_X + x ] = count;
+    }
+  }
+}
+
+/**
+ * Assign the buffered lights to clusters for a camera's view.
+ * 'buffered' holds the lights in the same order as 'phong_ubo',
+ * since the index lists refer to them by that position.
+ * If neither the lights nor the view changed, the last grid
+ * is kept as-is.
+ */
+void light_clusters::build( camera* cam,
+                            phong_light** buffered,
+                            int count,
+                            bool lights_changed ) {
+  if ( built && !lights_changed &&
+       memcmp( view.m, cam->c_view_matrix.m, sizeof( view.m ) ) == 0 &&
+       memcmp( persp.m, cam->persp_matrix.m, sizeof( persp.m ) ) == 0 ) {
+    return;
+  }
+  built = true;
+  view = cam->c_view_matrix;
+  persp = cam->persp_matrix;
+  proj_x = persp.m[ 0 ];
+  proj_y = persp.m[ 5 ];
+  // Recover the near / far distances from the perspective matrix.
+  near_d = persp.m[ 11 ] / ( persp.m[ 10 ] - 1.0f );
+  far_d = persp.m[ 11 ] / ( persp.m[ 10 ] + 1.0f );
+
+  lights.resize( count );
+  for ( int i = 0; i < count; ++i ) {
+    phong_light* pl = buffered[ i ];
+    cluster_light& cl = lights[ i ];
+    cl.center = v3( view * v4( pl->pos.v[ 0 ],
+                               pl->pos.v[ 1 ],
+                               pl->pos.v[ 2 ],
+                               1.0f ) );
+    cl.radius = pl->falloff;
+    // Cones wider than a hemisphere are treated as spheres.
+    cl.spot = ( pl->type == BRLA_LIGHT_PHONG_SPOT &&
+                pl->spot_rads < PI * 0.5f );
+    if ( cl.spot ) {
+      // 'dir' points from lit surfaces back towards the light.
+      v3 dir_E = v3( view * v4( pl->dir.v[ 0 ],
+                                pl->dir.v[ 1 ],
+                                pl->dir.v[ 2 ],
+                                0.0f ) );
+      cl.axis = normalize( dir_E ) * -1.0f;
+      cl.cos_a = cos( pl->spot_rads );
+      cl.sin_a = sin( pl->spot_rads );
+    }
+  }
+
+  g->jobs->parallel_for( BRLA_CLUSTER_Z, [ this ]( int z ) {
+    assign_slice( z );
+  } );
+
+  // Concatenate the slices into one grid and index list.
+  int slice_clusters = BRLA_CLUSTER_X * BRLA_CLUSTER_Y;
+  grid.resize( BRLA_NUM_CLUSTERS * 2 );
+  indices.clear();
+  for ( int z = 0; z < BRLA_CLUSTER_Z; ++z ) {
+    uint32_t offset = indices.size();
+    for ( int c = 0; c < slice_clusters; ++c ) {
+      int cluster = z * slice_clusters + c;
+      grid[ cluster * 2 ] = offset;
+      grid[ cluster * 2 + 1 ] = slice_counts[ z ][ c ];
+      offset += slice_counts[ z ][ c ];
+    }
+    indices.insert( indices.end(),
+                    slice_indices[ z ].begin(),
+                    slice_indices[ z ].end() );
+  }
+}
+
+/**
+ * Write the cluster grid and index lists to this frame's region of
+ * the ring buffer, and the grid's layout to the 'cluster_ubo' block.
+ * If they do not fit, the ring buffer is replaced with a larger one.
+ */
+void light_clusters::upload() {
+  GLsizeiptr grid_bytes = grid.size() * sizeof( uint32_t );
+  GLsizeiptr index_bytes = indices.size() * sizeof( uint32_t );
+  GLintptr grid_off = ring->write( &grid[ 0 ], grid_bytes );
+  GLintptr index_off = grid_off;
+  if ( grid_off >= 0 && index_bytes > 0 ) {
+    index_off = ring->write( &indices[ 0 ], index_bytes );
+  }
+  if ( grid_off < 0 || index_off < 0 ) {
+    GLsizeiptr new_size = ring->region_size * 2;
+    while ( new_size < grid_bytes + index_bytes + 64 ) { new_size *= 2; }
+    ring->grow( new_size );
+    glActiveTexture( GL_TEXTURE0 +
+                     g->t_man->num_textures +
+                     BRLA_CLUSTER_TEX_IND );
+    glBindTexture( GL_TEXTURE_BUFFER, tex );
+    glTexBuffer( GL_TEXTURE_BUFFER, GL_R32UI, ring->buffer );
+    grid_off = ring->write( &grid[ 0 ], grid_bytes );
+    index_off = grid_off;
+    if ( index_bytes > 0 ) {
+      index_off = ring->write( &indices[ 0 ], index_bytes );
+    }
+  }
+  g->frame_ubo_bytes += grid_bytes + index_bytes;
+
+  // Cluster UBO layout:
+  //   0  - 4:  X / Y / Z cluster counts.
+  //   4  - 8:  grid and index list offsets, in texels.
+  //   8  - 12: near, far, and Z / log( far / near ).
+  //   12 - 16: viewport width / height, in pixels.
+  cluster_ubo_buf[ 0 ] = BRLA_CLUSTER_X;
+  cluster_ubo_buf[ 1 ] = BRLA_CLUSTER_Y;
+  cluster_ubo_buf[ 2 ] = BRLA_CLUSTER_Z;
+  cluster_ubo_buf[ 4 ] = ( float )( grid_off / sizeof( uint32_t ) );
+  cluster_ubo_buf[ 5 ] = ( float )( index_off / sizeof( uint32_t ) );
+  cluster_ubo_buf[ 8 ] = near_d;
+  cluster_ubo_buf[ 9 ] = far_d;
+  cluster_ubo_buf[ 10 ] = BRLA_CLUSTER_Z / log( far_d / near_d );
+  cluster_ubo_buf[ 12 ] = ( float )g->g_win_w;
+  cluster_ubo_buf[ 13 ] = ( float )g->g_win_h;
+  g->write_ubo( cluster_ubo,
+                cluster_ubo_buf,
+                sizeof( float ) * BRLA_CLUSTER_UBO_SIZE );
+}
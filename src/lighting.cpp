@@ -1,42 +1,33 @@
 #include "lighting.h"
 
 /**
- * Shadow 'depth pass' framebuffer constructor. Currently just
+ * Shadow 'depth pass' constructor. Currently just
  * calls an initialization method, which might be superfluous.
  */
-fb_depth_pass::fb_depth_pass( int map_res_x,
-                              int map_res_y,
-                              float falloff ) {
-  gen_self( map_res_x, map_res_y, falloff, 0 );
+fb_depth_pass::fb_depth_pass( float falloff ) {
+  gen_self( falloff, 0 );
 }
 
 /**
- * Shadow 'depth pass' framebuffer constructor, with an extra
+ * Shadow 'depth pass' constructor, with an extra
  * argument for adding a game object (probably a light's indicator)
  * to the 'do_not_draw' list.
  */
-fb_depth_pass::fb_depth_pass( int map_res_x, int map_res_y,
-                              float falloff, unity* first_ignore ) {
-  gen_self( map_res_x, map_res_y, falloff, first_ignore );
+fb_depth_pass::fb_depth_pass( float falloff, unity* first_ignore ) {
+  gen_self( falloff, first_ignore );
 }
 
 /**
- * Shadow 'depth pass' framebuffer destructor.
- * Delete the camera and OpenGL buffers.
- * TODO: Is this really all that needs to be deleted?
+ * Shadow 'depth pass' destructor. Delete the camera; the depth
+ * map itself belongs to the lighting manager's shadow atlas.
  */
 fb_depth_pass::~fb_depth_pass() {
   if ( shadow_cam ) { delete shadow_cam; }
-  if ( shadow_block_buffer ) {
-    glDeleteBuffers( 1, &shadow_block_buffer );
-  }
 }
 
-/** Method to initialize a 'depth map' framebuffer object. */
-void fb_depth_pass::gen_self( int map_res_x, int map_res_y,
-                              float falloff, unity* first_ignore ) {
-  res_x = map_res_x;
-  res_y = map_res_y;
+/** Method to initialize a 'depth pass' object. */
+void fb_depth_pass::gen_self( float falloff, unity* first_ignore ) {
+  for ( int i = 0; i < 3; ++i ) { drawn_tile[ i ] = 0; }
 
   // Delete the camera if one already exists.
   if ( shadow_cam ) { delete shadow_cam; }
@@ -44,74 +35,6 @@ void fb_depth_pass::gen_self( int map_res_x, int map_res_y,
   //shadow_cam = new camera( g->near, g->far, cam_fov, 1.0f );
   shadow_cam = new camera( 0.1f, 20.0f, cam_fov, 1.0f );
 
-  // Initialize the shadow / framebuffer UBO.
-  if ( shadow_block_buffer ) {
-    glDeleteBuffers( 1, &shadow_block_buffer );
-  }
-  glGenBuffers( 1, &shadow_block_buffer );
-  glBindBuffer( GL_UNIFORM_BUFFER, shadow_block_buffer );
-  glBufferData( GL_UNIFORM_BUFFER,
-                sizeof( float ) * CAM_UBO_SIZE,
-                NULL,
-                GL_DYNAMIC_DRAW );
-
-  // Generate the framebuffer and depth texture.
-  glGenFramebuffers( 1, &fbuf );
-  glBindFramebuffer( GL_FRAMEBUFFER, fbuf );
-
-  glGenTextures( 1, &fbuf_depth_tex );
-  glActiveTexture( GL_TEXTURE0 +
-                   g->t_man->num_textures +
-                   depth_tex_ind );
-  glBindTexture( GL_TEXTURE_2D, fbuf_depth_tex );
-  glTexParameteri( GL_TEXTURE_2D,
-                   GL_TEXTURE_COMPARE_FUNC,
-                   GL_LEQUAL );
-  glTexParameteri( GL_TEXTURE_2D,
-                   GL_TEXTURE_COMPARE_MODE,
-                   GL_NONE );
-  // This causes 0x0500 GL_INVALID_ENUM. Not sure why.
-  glTexParameteri( GL_TEXTURE_2D,
-                   GL_DEPTH_TEXTURE_MODE,
-                   GL_INTENSITY );
-  glTexImage2D( GL_TEXTURE_2D,
-                0,
-                GL_DEPTH24_STENCIL8,
-                map_res_x,
-                map_res_y,
-                0,
-                GL_DEPTH_STENCIL,
-                GL_UNSIGNED_INT_24_8,
-                NULL );
-  glTexParameteri( GL_TEXTURE_2D,
-                   GL_TEXTURE_MIN_FILTER,
-                   GL_LINEAR );
-  glTexParameteri( GL_TEXTURE_2D,
-                   GL_TEXTURE_MAG_FILTER,
-                   GL_LINEAR );
-  glTexParameteri( GL_TEXTURE_2D,
-                   GL_TEXTURE_WRAP_S,
-                   GL_CLAMP_TO_BORDER );
-  glTexParameteri( GL_TEXTURE_2D,
-                   GL_TEXTURE_WRAP_T,
-                   GL_CLAMP_TO_BORDER );
-
-  glFramebufferTexture2D( GL_FRAMEBUFFER,
-                          GL_DEPTH_STENCIL_ATTACHMENT,
-                          GL_TEXTURE_2D,
-                          fbuf_depth_tex,
-                          0 );
-  GLenum draw_bufs[] = { GL_NONE };
-  glDrawBuffers( 1, draw_bufs );
-  glReadBuffer( GL_NONE );
-  GLenum status = glCheckFramebufferStatus( GL_FRAMEBUFFER );
-  if ( GL_FRAMEBUFFER_COMPLETE != status ) {
-    log_error( "[ERROR (fb_depth_pass)] Incomplete framebuffer. "
-               "Status code: %i\n",
-               status );
-  }
-  glBindFramebuffer( GL_FRAMEBUFFER, 0 );
-
   // If a 'first_ignore' game object is provided, add it to the
   // 'do_not_draw' array. This is really just a convenience for
   // lights, which have debugging meshes blocking their views.
@@ -120,86 +43,62 @@ void fb_depth_pass::gen_self( int map_res_x, int map_res_y,
   }
 }
 
-/** Draw to the 'depth-pass' framebuffer. */
-void fb_depth_pass::draw() {
-  // Bind the object's framebuffer, and set its viewport size.
-  glBindFramebuffer( GL_FRAMEBUFFER, fbuf );
-  glViewport( 0, 0, res_x, res_y );
-  // Clear the framebuffer's depth mask.
-  //glClearColor( 0.0, 0.0, 0.0, 1.0 ); // TODO: Remove or uncomment?
-  glClear( GL_DEPTH_BUFFER_BIT );
-
-  // Store previous shader / camera states to restore
-  // after drawing to this framebuffer.
-  GLuint last_shader = g->s_man->cur_shader;
-  camera* last_cam = g->c_man->active_camera;
-  // Prepare shader / camera settings for drawing a shadow
-  // map from the light's perspective.
-  g->s_man->swap_shader( g->depth_shader_key );
-  g->c_man->active_camera = shadow_cam;
-  g->c_man->active_camera->update_cam_pos();
-
-  // Update the shadow UBO.
-  fill_float_buffer( shadow_ubo_buf, transpose( id4() ).m, 0, 16 );
-  fill_float_buffer(
-    shadow_ubo_buf,
-    transpose( g->c_man->active_camera->c_view_matrix ).m,
-    16,
-    16 );
-  fill_float_buffer(
-    shadow_ubo_buf,
-    transpose( g->c_man->active_camera->persp_matrix ).m,
-    32,
-    16 );
-
-  // Overwrite the normal camera UBO with the shadow map data,
-  // so the framebuffer is drawn from the light's perspective.
-  glBindBuffer( GL_UNIFORM_BUFFER, g->c_man->cam_block_buffer );
-  glBindBufferBase( GL_UNIFORM_BUFFER,
-                    g->c_man->cam_ubo,
-                    g->c_man->cam_block_buffer );
-  GLuint cam_ubo_index =
-    glGetUniformBlockIndex( g->s_man->cur_shader, "cam_ubo" );
-  if ( ( ( int )cam_ubo_index ) >= 0 ) {
-    glUniformBlockBinding( g->s_man->cur_shader,
-                           cam_ubo_index,
-                           shadow_ubo );
-    glBufferSubData( GL_UNIFORM_BUFFER,
-                     0,
-                     sizeof( float ) * CAM_UBO_SIZE,
-                     shadow_ubo_buf );
-  }
-
-  // Only draw game objects that should cast shadows.
-  // For now, that is everything except the contents
-  // of the 'do_not_draw' array.
-  // This function will be called once for each active 'unity'.
-  function<void( unity* u )> f = [ &dnd = do_not_draw ]( unity* u ) {
-    if ( u ) {
-      bool should_draw = true;
-      // Check whether the game object is in the 'do_not_draw' array.
-      for ( int j = 0; j < dnd.size(); ++j ) {
-        if ( u == dnd[ j ] ) {
-          should_draw = false;
-        }
-      }
-      // If it isn't in the 'do_not_draw' array, draw the object.
-      if ( should_draw ) { u->draw(); }
+/**
+ * Check whether the depth map needs to be drawn again. It is
+ * kept if the shadow camera has not moved, the same casters are
+ * in its view, and none of their physics bodies are awake; Bullet
+ * puts bodies to sleep once they stop moving. A caster which was
+ * awake last frame still counts, to draw its final position.
+ * Static bodies never wake up, so the casters' world bounds are
+ * also compared, in case one was placed somewhere else. A light
+ * which was given a different atlas tile always draws again, as
+ * does one which went without a tile; see 'update'.
+ * The casters in view are left in 'visible_casters'.
+ */
+bool fb_depth_pass::needs_redraw( vector<unity*>& casters ) {
+  visible_casters.clear();
+  frustum( shadow_cam ).cull( casters, visible_casters );
+  bool casters_changed = ( visible_casters.size() != drawn_casters.size() );
+  bool casters_active = false;
+  drawn_bounds.resize( visible_casters.size() );
+  for ( int i = 0; i < visible_casters.size(); ++i ) {
+    unity* u = visible_casters[ i ];
+    if ( !casters_changed &&
+         ( u != drawn_casters[ i ] ||
+           memcmp( u->world_bounds.min_pt.v,
+                   drawn_bounds[ i ].min_pt.v,
+                   sizeof( drawn_bounds[ i ].min_pt.v ) ) != 0 ||
+           memcmp( u->world_bounds.max_pt.v,
+                   drawn_bounds[ i ].max_pt.v,
+                   sizeof( drawn_bounds[ i ].max_pt.v ) ) != 0 ) ) {
+      casters_changed = true;
     }
-  };
-  // The 'unity_manager' object's 'for_each' method accepts
-  // a function, and calls that function once for each active
-  // 'unity' object in the game world.
-  g->u_man->for_each( f, true );
-
-  // Reset OpenGL stuff for normal drawing.
-  // Bind the regular framebuffer at index 0.
-  glBindFramebuffer( GL_FRAMEBUFFER, 0 );
-  // Restore the active camera and associated shader data.
-  g->c_man->active_camera = last_cam;
-  g->c_man->active_camera->update_cam_pos();
-  // Restore the previous shader program.
-  g->s_man->swap_shader( last_shader );
+    drawn_bounds[ i ] = u->world_bounds;
+    if ( u->p_obj && u->p_obj->rigid_body &&
+         u->p_obj->rigid_body->isActive() ) {
+      casters_active = true;
+    }
+  }
+  bool redraw = ( dirty || casters_active || casters_were_active ||
+                  casters_changed ||
+                  tile_x != drawn_tile[ 0 ] ||
+                  tile_y != drawn_tile[ 1 ] ||
+                  tile_size != drawn_tile[ 2 ] ||
+                  memcmp( drawn_view.m,
+                          shadow_cam->c_view_matrix.m,
+                          sizeof( drawn_view.m ) ) != 0 ||
+                  memcmp( drawn_persp.m,
+                          shadow_cam->persp_matrix.m,
+                          sizeof( drawn_persp.m ) ) != 0 );
+  casters_were_active = casters_active;
+  drawn_casters = visible_casters;
+  drawn_view = shadow_cam->c_view_matrix;
+  drawn_persp = shadow_cam->persp_matrix;
+  drawn_tile[ 0 ] = tile_x;
+  drawn_tile[ 1 ] = tile_y;
+  drawn_tile[ 2 ] = tile_size;
+  dirty = false;
+  return redraw;
 }
 
 /**
@@ -246,10 +145,7 @@ void phong_light::make_shadow_caster() {
   // Enable shadowcasting; populate the fb / camera if necessary.
   cast_shadows = true;
   if ( !shadow_depth_fb ) {
-    shadow_depth_fb = new fb_depth_pass( 1024,
-                                         1024,
-                                         falloff,
-                                         indicator );
+    shadow_depth_fb = new fb_depth_pass( falloff, indicator );
     // We want updates to the light to persist to the UBO, so
     // associate the shadow-map camera with the 'light indicator'
     // game object if both exist.
@@ -261,20 +157,33 @@ void phong_light::make_shadow_caster() {
 
 /** Lighting manager constructor: initialize the OpenGL buffers. */
 lighting_manager::lighting_manager() {
-  phong_ubo_size = BRLA_PHONG_LIGHT_SIZE * BRLA_MAX_PHONG_LIGHTS;
+  // Only buffer as many lights as fit in a uniform block, after
+  // the 4 floats of options. Drivers must allow at least 16KB.
+  GLint max_block_size = 16384;
+  glGetIntegerv( GL_MAX_UNIFORM_BLOCK_SIZE, &max_block_size );
+  int block_floats = max_block_size / ( int )sizeof( GLfloat );
+  max_lights = std::min( BRLA_MAX_PHONG_LIGHTS,
+                         ( block_floats - 4 ) / BRLA_PHONG_LIGHT_SIZE );
+  phong_ubo_size = BRLA_PHONG_LIGHT_SIZE * max_lights;
   // Extra space for options. Currently just used for telling
   // the shader how many lights were actually passed in.
   phong_ubo_size += 4;
   phong_ubo_buf = new GLfloat[ phong_ubo_size ];
   memset( phong_ubo_buf, 0, sizeof( GLfloat ) * phong_ubo_size );
+  memset( slots, 0, sizeof( phong_light* ) * BRLA_MAX_PHONG_LIGHTS );
+  memset( shadow_lights_ubo_buf, 0, sizeof( shadow_lights_ubo_buf ) );
+  for ( int i = 0; i < 3; ++i ) {
+    grid_min[ i ] = 0;
+    grid_max[ i ] = -1;
+  }
 }
 
 /** Lighting manager destructor: delete the OpenGL buffers. */
 lighting_manager::~lighting_manager() {
   if ( phong_ubo_buf ) { delete phong_ubo_buf; }
-  if ( phong_block_buffer ) {
-    glDeleteBuffers( 1, &phong_block_buffer );
-  }
+  if ( clusters ) { delete clusters; }
+  if ( atlas ) { delete atlas; }
+  if ( phong_ubo_buffer ) { glDeleteBuffers( 1, &phong_ubo_buffer ); }
 
   for ( int i = 0; i < phong_lights.size(); ++i ) {
     if ( phong_lights[ i ] ) {
@@ -289,6 +198,7 @@ lighting_manager::~lighting_manager() {
  */
 void lighting_manager::add_phong_light( phong_light* light ) {
   phong_lights.push_back( light );
+  index_dirty = true;
 }
 
 /**
@@ -313,8 +223,11 @@ void lighting_manager::evict_phong_light( phong_light* light ) {
     phong_light* l = *l_iter;
     // If a match is found, delete it and return.
     if ( l == light ) {
+      // Free its UBO slot; the slots are compacted next update.
+      if ( l->ubo_slot >= 0 ) { slots[ l->ubo_slot ] = 0; }
       delete l;
       phong_lights.erase( l_iter );
+      index_dirty = true;
       return;
     }
   }
@@ -345,206 +258,471 @@ void lighting_manager::clear_phong_lights() {
     }
   }
   phong_lights.clear();
+  memset( slots, 0, sizeof( phong_light* ) * BRLA_MAX_PHONG_LIGHTS );
+  num_slots = 0;
+  index_dirty = true;
 }
 
 /**
- * Initialize the phong light Uniform Buffer Object.
+ * Initialize the phong light Uniform Buffer Object, and bind it
+ * to the 'phong_ubo' binding point. Also create the light
+ * clusters, with every cluster's light list starting out empty,
+ * and the shadow atlas.
  */
 void lighting_manager::init_lighting_ubo() {
-  glGenBuffers( 1, &phong_block_buffer );
-  glBindBuffer( GL_UNIFORM_BUFFER, phong_block_buffer );
-  glBufferData( GL_UNIFORM_BUFFER,
-                phong_ubo_size * sizeof( GLfloat ),
-                NULL,
-                GL_DYNAMIC_DRAW );
-  phong_ubo_index = glGetUniformBlockIndex( g->s_man->cur_shader,
-                                            "phong_ubo" );
-  glUniformBlockBinding( g->s_man->cur_shader,
-                         phong_ubo_index,
-                         phong_ubo );
-  // Once the buffers are created, write initial values to them.
-  write_lighting_ubo();
+  if ( !phong_ubo_buffer ) {
+    glGenBuffers( 1, &phong_ubo_buffer );
+    glBindBuffer( GL_UNIFORM_BUFFER, phong_ubo_buffer );
+    glBufferData( GL_UNIFORM_BUFFER,
+                  phong_ubo_size * sizeof( GLfloat ),
+                  0,
+                  GL_DYNAMIC_DRAW );
+    glBindBufferBase( GL_UNIFORM_BUFFER, phong_ubo, phong_ubo_buffer );
+  }
+  write_lighting_ubo( 0, phong_ubo_size );
+  if ( !clusters ) { clusters = new light_clusters(); }
+  if ( !atlas ) { atlas = new shadow_atlas( shadow_atlas_res ); }
+  clusters->upload();
 }
 
 /**
- * Lighting manager 'update' step. Update the 'indicator' game
- * objects for active lights, buffer the lights closest to
- * the player in the lighting Uniform Buffer Object, update
- * shadow-mapping objects for lights with shadow-casting enabled,
- * and write the lighting UBO values.
- * TODO: Better comments throughout this method.
+ * Pack a grid cell's X / Y / Z coordinates into a 64-bit key
+ * for the lighting manager's spatial index, 21 bits each.
  */
-void lighting_manager::update() {
-  // Update the 'indicator' game objects.
+static int64_t light_cell_key( int x, int y, int z ) {
+  return ( ( ( int64_t )x & 0x1FFFFF ) << 42 ) |
+         ( ( ( int64_t )y & 0x1FFFFF ) << 21 ) |
+         ( ( int64_t )z & 0x1FFFFF );
+}
+
+/**
+ * Helper method to rebuild the spatial index of phong lights,
+ * placing each light in the grid cell which holds its position.
+ */
+void lighting_manager::rebuild_index() {
+  light_grid.clear();
+  for ( int i = 0; i < 3; ++i ) {
+    grid_min[ i ] = 0;
+    grid_max[ i ] = -1;
+  }
   for ( int i = 0; i < phong_lights.size(); ++i ) {
-    if ( phong_lights[ i ]->indicator ) {
-      phong_lights[ i ]->indicator->update();
+    phong_light* l = phong_lights[ i ];
+    if ( !l ) { continue; }
+    l->index_pos = v3( l->pos );
+    int cell[ 3 ];
+    for ( int j = 0; j < 3; ++j ) {
+      cell[ j ] = ( int )floor( l->index_pos.v[ j ] /
+                                BRLA_LIGHT_CELL_SIZE );
+      if ( light_grid.empty() || cell[ j ] < grid_min[ j ] ) {
+        grid_min[ j ] = cell[ j ];
+      }
+      if ( light_grid.empty() || cell[ j ] > grid_max[ j ] ) {
+        grid_max[ j ] = cell[ j ];
+      }
     }
+    light_grid[ light_cell_key( cell[ 0 ], cell[ 1 ], cell[ 2 ] ) ].
+      push_back( l );
   }
+  index_dirty = false;
+  selection_dirty = true;
+}
 
-  // Find the N closest lights to the player.
-  // TODO: Use a better data structure for sorting by distance. I
-  // can do this in log(n) instead of n for the closest lights.
-  if ( g->c_man->active_camera == NULL ) { return; }
-  v3 c_pos = g->c_man->active_camera->cam_pos;
-  // Create an array of N lights to buffer, and zero out
-  // its entries since there may end up being fewer lights.
-  phong_light* closest[ BRLA_MAX_PHONG_LIGHTS ];
-  memset( closest,
-          0,
-          sizeof( phong_light* ) * BRLA_MAX_PHONG_LIGHTS );
-  bool full_buffer = false, first_pass = false;
-  int max_ind = 0;
-  float max_dist2 = 0.0f;
-  for ( int i = 0; i < phong_lights.size(); ++i ) {
-    v3 light_pos = v3( phong_lights[ i ]->pos );
-    float light1_dist = distance2( c_pos, light_pos );
-    // TODO: Better sorting; this isn't ideal.
-    for ( int j = 0; j < BRLA_MAX_PHONG_LIGHTS; ++j ) {
-      if ( !closest[ j ] ) {
-        closest[ j ] = phong_lights[ i ];
-        if ( j == BRLA_MAX_PHONG_LIGHTS - 1 ) {
-          full_buffer = true;
-          first_pass = true;
+/**
+ * Helper method to find the 'max_lights' lights nearest
+ * to a position, in no particular order. Shells of grid cells are
+ * searched outwards from the position's cell until they hold
+ * enough lights, and no unsearched cell could hold a nearer light
+ * than the furthest of them. Then they are partially sorted.
+ */
+void lighting_manager::select_nearest( v3 c_pos ) {
+  nearest.clear();
+  int k = max_lights;
+  auto nearer = [ &c_pos ]( phong_light* l1, phong_light* l2 ) {
+    return distance2( c_pos, l1->index_pos ) <
+           distance2( c_pos, l2->index_pos );
+  };
+  if ( phong_lights.size() <= k ) {
+    for ( int i = 0; i < phong_lights.size(); ++i ) {
+      if ( phong_lights[ i ] ) { nearest.push_back( phong_lights[ i ] ); }
+    }
+    return;
+  }
+
+  int c[ 3 ];
+  for ( int i = 0; i < 3; ++i ) {
+    c[ i ] = ( int )floor( c_pos.v[ i ] / BRLA_LIGHT_CELL_SIZE );
+  }
+  for ( int r = 0; ; ++r ) {
+    // Add the lights in the cells exactly 'r' cells away.
+    int x0 = std::max( c[ 0 ] - r, grid_min[ 0 ] );
+    int x1 = std::min( c[ 0 ] + r, grid_max[ 0 ] );
+    int y0 = std::max( c[ 1 ] - r, grid_min[ 1 ] );
+    int y1 = std::min( c[ 1 ] + r, grid_max[ 1 ] );
+    int z0 = std::max( c[ 2 ] - r, grid_min[ 2 ] );
+    int z1 = std::min( c[ 2 ] + r, grid_max[ 2 ] );
+    for ( int x = x0; x <= x1; ++x ) {
+      for ( int y = y0; y <= y1; ++y ) {
+        bool inner = ( abs( x - c[ 0 ] ) < r && abs( y - c[ 1 ] ) < r );
+        // Inner columns only touch the shell at their two ends.
+        int z_step = inner ? 2 * r : 1;
+        for ( int z = inner ? c[ 2 ] - r : z0; z <= z1; z += z_step ) {
+          if ( z < z0 ) { continue; }
+          auto cell = light_grid.find( light_cell_key( x, y, z ) );
+          if ( cell != light_grid.end() ) {
+            nearest.insert( nearest.end(),
+                            cell->second.begin(),
+                            cell->second.end() );
+          }
         }
-        break;
       }
-      else if ( full_buffer ) {
-        float light2_dist = distance2( c_pos,
-                                       v3( closest[ j ]->pos ) );
-        if ( light2_dist > max_dist2 ) {
-          max_dist2 = light2_dist;
-          max_ind = j;
-        }
+    }
+
+    bool covers_grid = true;
+    for ( int i = 0; i < 3; ++i ) {
+      if ( c[ i ] - r > grid_min[ i ] || c[ i ] + r < grid_max[ i ] ) {
+        covers_grid = false;
       }
     }
-    if ( full_buffer ) {
-      if ( first_pass ) { first_pass = false; }
-      else if ( light1_dist < max_dist2 ) {
-        closest[ max_ind ] = phong_lights[ i ];
+    if ( covers_grid ) { break; }
+    if ( nearest.size() >= k ) {
+      std::nth_element( nearest.begin(),
+                        nearest.begin() + ( k - 1 ),
+                        nearest.end(),
+                        nearer );
+      // Unsearched cells are at least 'r' cells away.
+      float reach = r * BRLA_LIGHT_CELL_SIZE;
+      if ( reach * reach >=
+           distance2( c_pos, nearest[ k - 1 ]->index_pos ) ) {
+        break;
       }
     }
   }
+  if ( nearest.size() > k ) {
+    std::nth_element( nearest.begin(),
+                      nearest.begin() + ( k - 1 ),
+                      nearest.end(),
+                      nearer );
+    nearest.resize( k );
+  }
+}
 
-  // Buffer the lights.
-  int num_lights = 0;
-  int offset = 4;
-  for ( int i = 0; i < BRLA_MAX_PHONG_LIGHTS; ++i ) {
-    if ( closest[ i ] ) {
-      float l_type = ( float )( closest[ i ]->type );
-      fill_float_buffer( phong_ubo_buf, closest[ i ]->pos.v,
-                         offset, 4 );
-      fill_float_buffer( phong_ubo_buf, closest[ i ]->a.v,
-                         offset + 4, 4 );
-      fill_float_buffer( phong_ubo_buf, closest[ i ]->d.v,
-                         offset + 8, 4 );
-      fill_float_buffer( phong_ubo_buf, closest[ i ]->s.v,
-                         offset + 12, 4 );
-      fill_float_buffer( phong_ubo_buf, &closest[ i ]->specular_exp,
-                         offset + 16, 1 );
-      fill_float_buffer( phong_ubo_buf, &closest[ i ]->falloff,
-                         offset + 17, 1 );
-      fill_float_buffer( phong_ubo_buf, &l_type,
-                         offset + 18, 1 );
-      if ( closest[ i ]->cast_shadows ) {
-        phong_ubo_buf[ offset + 19 ] = 1.0f;
-      }
-      else {
-        phong_ubo_buf[ offset + 19 ] = 0.0f;
-      }
-      fill_float_buffer( phong_ubo_buf, closest[ i ]->dir.v,
-                         offset + 20, 3 );
-      fill_float_buffer( phong_ubo_buf, &closest[ i ]->spot_rads,
-                         offset + 23, 1 );
-      offset += BRLA_PHONG_LIGHT_SIZE;
-      num_lights += 1;
-
-      // Buffer the shadow UBO/uniform, if applicable.
-      fb_depth_pass* sfb = closest[ i ]->shadow_depth_fb;
-      if ( closest[ i ]->cast_shadows && sfb ) {
-        glBindBuffer( GL_UNIFORM_BUFFER, sfb->shadow_block_buffer );
-        glBindBufferBase( GL_UNIFORM_BUFFER,
-                          sfb->shadow_ubo,
-                          sfb->shadow_block_buffer );
-        sfb->shadow_ubo_index =
-          glGetUniformBlockIndex( g->s_man->cur_shader,
-                                  "shadow_cam_ubo" );
-        if ( ( ( int )sfb->shadow_ubo_index ) >= 0 ) {
-          glUniformBlockBinding( g->s_man->cur_shader,
-                                 sfb->shadow_ubo_index,
-                                 sfb->shadow_ubo );
-          glBufferSubData( GL_UNIFORM_BUFFER,
-                           0,
-                           sizeof( float ) * CAM_UBO_SIZE,
-                           sfb->shadow_ubo_buf );
+/**
+ * Helper method to give each newly-selected light a UBO slot.
+ * Lights which are still selected keep their slots, so their
+ * UBO values do not need to be uploaded again. The used slots
+ * are kept contiguous by moving the last ones into any gaps.
+ */
+void lighting_manager::assign_slots() {
+  select_gen += 1;
+  for ( int i = 0; i < nearest.size(); ++i ) {
+    nearest[ i ]->select_gen = select_gen;
+  }
+  // Free the slots whose lights were not selected again. They
+  // lose their atlas tiles, so their depth maps must be redrawn.
+  int free_slots[ BRLA_MAX_PHONG_LIGHTS ];
+  int num_free = 0;
+  for ( int s = 0; s < num_slots; ++s ) {
+    if ( !slots[ s ] || slots[ s ]->select_gen != select_gen ) {
+      if ( slots[ s ] ) {
+        slots[ s ]->ubo_slot = -1;
+        fb_depth_pass* sfb = slots[ s ]->shadow_depth_fb;
+        if ( sfb ) {
+          sfb->tile_size = 0;
+          sfb->dirty = true;
         }
+      }
+      slots[ s ] = 0;
+      free_slots[ num_free ] = s;
+      num_free += 1;
+    }
+  }
+  // Fill the free slots first, then append to the end.
+  int f = 0;
+  for ( int i = 0; i < nearest.size(); ++i ) {
+    phong_light* l = nearest[ i ];
+    if ( l->ubo_slot >= 0 ) { continue; }
+    int s = ( f < num_free ) ? free_slots[ f++ ] : num_slots++;
+    slots[ s ] = l;
+    l->ubo_slot = s;
+  }
+  // Move the last lights into any gaps which are left.
+  int count = nearest.size();
+  for ( ; f < num_free; ++f ) {
+    int gap = free_slots[ f ];
+    if ( gap >= count ) { continue; }
+    while ( !slots[ num_slots - 1 ] ) { num_slots -= 1; }
+    int last = num_slots - 1;
+    slots[ gap ] = slots[ last ];
+    slots[ gap ]->ubo_slot = gap;
+    slots[ last ] = 0;
+    num_slots -= 1;
+  }
+  num_slots = count;
+}
 
-        int shadow_sampler_loc =
-          glGetUniformLocation( g->s_man->cur_shader,
-                                "shadow_depth_map_sampler" );
-        if ( shadow_sampler_loc >= 0 ) {
-          int shadow_tex_sampler =
-            ( g->t_man->num_textures + sfb->depth_tex_ind );
-          glActiveTexture( GL_TEXTURE0 + shadow_tex_sampler );
-          glBindTexture( GL_TEXTURE_2D, sfb->fbuf_depth_tex );
-          glUniform1i( shadow_sampler_loc,
-                       ( float )shadow_tex_sampler );
-        }
+/**
+ * Helper method to pack a light's values into the layout of
+ * one phong light UBO slot; BRLA_PHONG_LIGHT_SIZE floats.
+ * 'shadow_slot' is the light's slot in the shadow lights UBO,
+ * or -1 if it has no shadow this frame.
+ */
+void lighting_manager::pack_light( phong_light* l,
+                                   int shadow_slot,
+                                   GLfloat* out ) {
+  float l_type = ( float )( l->type );
+  fill_float_buffer( out, l->pos.v, 0, 4 );
+  fill_float_buffer( out, l->a.v, 4, 4 );
+  fill_float_buffer( out, l->d.v, 8, 4 );
+  fill_float_buffer( out, l->s.v, 12, 4 );
+  fill_float_buffer( out, &l->specular_exp, 16, 1 );
+  fill_float_buffer( out, &l->falloff, 17, 1 );
+  fill_float_buffer( out, &l_type, 18, 1 );
+  out[ 19 ] = ( float )shadow_slot;
+  fill_float_buffer( out, l->dir.v, 20, 3 );
+  fill_float_buffer( out, &l->spot_rads, 23, 1 );
+}
+
+/**
+ * Helper method to pack a shadowed light's values into the layout
+ * of one shadow lights UBO slot; BRLA_SHADOW_LIGHT_SIZE floats.
+ * That is its shadow camera's view-projection matrix, and its
+ * tile's rectangle in the atlas.
+ */
+void lighting_manager::pack_shadow( phong_light* l, GLfloat* out ) {
+  fb_depth_pass* sfb = l->shadow_depth_fb;
+  camera* s_cam = sfb->shadow_cam;
+  fill_float_buffer( out,
+                     transpose( s_cam->persp_matrix *
+                                s_cam->c_view_matrix ).m,
+                     0,
+                     16 );
+  float inv_res = 1.0f / atlas->res;
+  out[ 16 ] = sfb->tile_x * inv_res;
+  out[ 17 ] = sfb->tile_y * inv_res;
+  out[ 18 ] = sfb->tile_size * inv_res;
+  out[ 19 ] = sfb->tile_size * inv_res;
+}
+
+/**
+ * Lighting manager 'update' step. Update the 'indicator' game
+ * objects for active lights, select the lights closest to the
+ * camera, and upload the phong light UBO slots whose values
+ * changed. The spatial index is only rebuilt when a light is
+ * added, removed or moved, and the selection only runs again
+ * when the index or the camera changes. The buffered shadow
+ * casters are given shadow atlas tiles, and the buffered lights
+ * are then assigned to the active camera's light clusters.
+ */
+void lighting_manager::update() {
+  // Update the 'indicator' game objects, and check for lights
+  // which have moved since they were indexed.
+  for ( int i = 0; i < phong_lights.size(); ++i ) {
+    if ( phong_lights[ i ]->indicator ) {
+      phong_lights[ i ]->indicator->update();
+    }
+    if ( distance2( v3( phong_lights[ i ]->pos ),
+                    phong_lights[ i ]->index_pos ) > 0.0f ) {
+      index_dirty = true;
+    }
+  }
+
+  camera* a_cam = g->c_man->active_camera;
+  if ( a_cam == NULL ) { return; }
+  // 'cam_pos' is stored negated.
+  v3 c_pos = a_cam->cam_pos * -1.0f;
+  if ( index_dirty ) { rebuild_index(); }
+  if ( selection_dirty || distance2( c_pos, select_pos ) > 0.0f ) {
+    select_nearest( c_pos );
+    assign_slots();
+    select_pos = c_pos;
+    selection_dirty = false;
+  }
+
+  // Give the buffered shadow casters atlas tiles, and move their
+  // cameras to where their depth maps will be drawn from. Another
+  // light can draw over the tile of a light which has none this
+  // frame, so it has to draw again even if it gets the same one.
+  atlas->allocate( slots, num_slots, c_pos );
+  for ( int s = 0; s < num_slots; ++s ) {
+    fb_depth_pass* sfb = slots[ s ]->shadow_depth_fb;
+    if ( sfb && sfb->tile_size > 0 ) { sfb->shadow_cam->update_cam_pos(); }
+    else if ( sfb ) { sfb->dirty = true; }
+  }
+
+  // Pack the buffered lights, and upload each run of
+  // consecutive slots whose values changed. The lights with
+  // a tile are packed into the shadow lights UBO in order.
+  bool lights_changed = false;
+  int run_start = -1;
+  int num_shadowed = 0;
+  GLfloat packed[ BRLA_PHONG_LIGHT_SIZE ];
+  for ( int s = 0; s <= num_slots; ++s ) {
+    bool changed = false;
+    if ( s < num_slots ) {
+      GLfloat* slot_buf = &phong_ubo_buf[ 4 + s * BRLA_PHONG_LIGHT_SIZE ];
+      fb_depth_pass* sfb = slots[ s ]->shadow_depth_fb;
+      int shadow_slot = -1;
+      if ( slots[ s ]->cast_shadows && sfb && sfb->tile_size > 0 &&
+           num_shadowed < BRLA_MAX_SHADOWED_LIGHTS ) {
+        shadow_slot = num_shadowed;
+        num_shadowed += 1;
+        pack_shadow( slots[ s ],
+                     &shadow_lights_ubo_buf[ 4 + shadow_slot *
+                                             BRLA_SHADOW_LIGHT_SIZE ] );
+      }
+      pack_light( slots[ s ], shadow_slot, packed );
+      if ( memcmp( slot_buf, packed, sizeof( packed ) ) != 0 ) {
+        memcpy( slot_buf, packed, sizeof( packed ) );
+        changed = true;
+        lights_changed = true;
       }
     }
+    if ( changed && run_start < 0 ) { run_start = s; }
+    else if ( !changed && run_start >= 0 ) {
+      write_lighting_ubo( 4 + run_start * BRLA_PHONG_LIGHT_SIZE,
+                          ( s - run_start ) * BRLA_PHONG_LIGHT_SIZE );
+      run_start = -1;
+    }
   }
 
   // Buffer the phong light options.
-  float f_num_lights = ( float )num_lights;
-  fill_float_buffer( phong_ubo_buf, &f_num_lights, 0, 1 );
-  fill_float_buffer( phong_ubo_buf, &f_num_lights, 1, 1 );
-  fill_float_buffer( phong_ubo_buf, &f_num_lights, 2, 1 );
-  fill_float_buffer( phong_ubo_buf, &f_num_lights, 3, 1 );
-  // Write to the phong light Uniform Buffer Object.
-  write_lighting_ubo();
+  float f_num_lights = ( float )num_slots;
+  if ( phong_ubo_buf[ 0 ] != f_num_lights ) {
+    for ( int i = 0; i < 4; ++i ) { phong_ubo_buf[ i ] = f_num_lights; }
+    write_lighting_ubo( 0, 4 );
+    lights_changed = true;
+  }
+  for ( int i = 0; i < 4; ++i ) {
+    shadow_lights_ubo_buf[ i ] = ( float )num_shadowed;
+  }
+  g->write_ubo( shadow_lights_ubo,
+                shadow_lights_ubo_buf,
+                sizeof( shadow_lights_ubo_buf ) );
+
+  // Assign the buffered lights to the clusters they can reach.
+  if ( clusters ) {
+    clusters->build( a_cam, slots, num_slots, lights_changed );
+    clusters->upload();
+  }
 }
 
 /**
- * Draw the game object indicators associated with the active
- * phong lights. TODO: If these are also tracked in the
- * 'unity_manager' object, do they get drawn twice?
+ * Queue the game object indicators associated with the active
+ * phong lights to be drawn, if they are in view. TODO: If these
+ * are also tracked in the 'unity_manager' object, do they get
+ * drawn twice?
  */
 void lighting_manager::draw() {
+  camera* a_cam = g->c_man->active_camera;
+  if ( !a_cam ) { return; }
+  // The indicators usually share one mesh, so the render
+  // queue will draw them together.
+  vector<unity*> indicators;
   for ( int i = 0; i < phong_lights.size(); ++i ) {
     if ( phong_lights[ i ]->indicator ) {
-      phong_lights[ i ]->indicator->draw();
+      indicators.push_back( phong_lights[ i ]->indicator );
     }
   }
+  g->r_queue->submit_visible( BRLA_PASS_OPAQUE,
+                              frustum( a_cam ),
+                              indicators );
 }
 
 /**
- * Draw the shadow depth framebuffers for lights that have
- * shadow-casting enabled.
+ * Collect the game objects which should cast shadows onto the
+ * buffered lights' depth maps. For now, that is everything except
+ * the contents of their 'do_not_draw' arrays, so a light's
+ * indicator is left out of every shadow map, not just its own.
+ */
+void lighting_manager::collect_shadow_casters() {
+  shadow_casters.clear();
+  // This function will be called once for each active 'unity'.
+  function<void( unity* u )> f = [ this ]( unity* u ) {
+    if ( !u || !u->m ) { return; }
+    // Check whether the game object is in a 'do_not_draw' array.
+    for ( int s = 0; s < num_slots; ++s ) {
+      fb_depth_pass* sfb = slots[ s ] ? slots[ s ]->shadow_depth_fb : 0;
+      if ( !sfb ) { continue; }
+      for ( int j = 0; j < sfb->do_not_draw.size(); ++j ) {
+        if ( u == sfb->do_not_draw[ j ] ) { return; }
+      }
+    }
+    // If it isn't in a 'do_not_draw' array, draw the object.
+    shadow_casters.push_back( u );
+  };
+  // The 'unity_manager' object's 'for_each' method accepts
+  // a function, and calls that function once for each active
+  // 'unity' object in the game world.
+  g->u_man->for_each( f, true );
+}
+
+/**
+ * Draw the out-of-date shadow atlas tiles of the buffered lights
+ * that have shadow-casting enabled. Lights which are not buffered
+ * are not shaded, so they do not need shadows. The scene is walked
+ * once for every light, and the tiles are drawn in layered passes
+ * of up to 'max_views' lights each: the casters seen by any of a
+ * pass's lights are submitted once, and a geometry shader draws
+ * each triangle into every light's tile.
  */
 void lighting_manager::draw_shadow_casters() {
-  for ( int i = 0; i < phong_lights.size(); ++i ) {
-    if ( phong_lights[ i ] && phong_lights[ i ]->shadow_depth_fb ) {
-      phong_lights[ i ]->shadow_depth_fb->draw();
+  if ( !atlas ) { return; }
+  collect_shadow_casters();
+
+  // Find the tiles which need to be drawn again.
+  dirty_views.clear();
+  for ( int s = 0; s < num_slots; ++s ) {
+    fb_depth_pass* sfb = slots[ s ] ? slots[ s ]->shadow_depth_fb : 0;
+    if ( !sfb || sfb->tile_size <= 0 ) { continue; }
+    if ( sfb->needs_redraw( shadow_casters ) ) {
+      dirty_views.push_back( sfb );
     }
+    else { g->r_queue->stats.shadows_cached += 1; }
   }
-}
+  if ( dirty_views.empty() ) { return; }
 
-/** Write values to the phong light Uniform Buffer Object. */
-void lighting_manager::write_lighting_ubo() {
-  // Bind and buffer the lighting UBO.
-  glBindBuffer( GL_UNIFORM_BUFFER, phong_block_buffer );
-  glBindBufferBase( GL_UNIFORM_BUFFER,
-                    phong_ubo,
-                    phong_block_buffer );
-  phong_ubo_index = glGetUniformBlockIndex( g->s_man->cur_shader,
-                                            "phong_ubo" );
-  if ( ( ( int )phong_ubo_index ) >= 0 ) {
-    glUniformBlockBinding( g->s_man->cur_shader,
-                           phong_ubo_index,
-                           phong_ubo );
-    glBufferSubData( GL_UNIFORM_BUFFER,
-                     0,
-                     phong_ubo_size * sizeof(GLfloat),
-                     phong_ubo_buf );
+  // Store the previous shader program, to restore after drawing.
+  GLuint last_shader = g->s_man->cur_shader;
+  g->s_man->swap_shader( g->shadow_layered_shader_key );
+
+  int num_views = dirty_views.size();
+  for ( int first = 0; first < num_views; first += atlas->max_views ) {
+    int count = std::min( atlas->max_views, num_views - first );
+    atlas->begin_views( &dirty_views[ first ], count );
+    // Queue the casters inside of any of this pass's views once;
+    // nothing outside of them can appear in the shadow maps.
+    layered_casters.clear();
+    for ( int i = 0; i < count; ++i ) {
+      vector<unity*>& vis = dirty_views[ first + i ]->visible_casters;
+      layered_casters.insert( layered_casters.end(),
+                              vis.begin(),
+                              vis.end() );
+    }
+    std::sort( layered_casters.begin(), layered_casters.end() );
+    layered_casters.erase( std::unique( layered_casters.begin(),
+                                        layered_casters.end() ),
+                           layered_casters.end() );
+    for ( int i = 0; i < layered_casters.size(); ++i ) {
+      g->r_queue->submit( BRLA_PASS_SHADOW, layered_casters[ i ] );
+    }
+    g->r_queue->execute();
   }
+
+  // Reset OpenGL stuff for normal drawing.
+  atlas->end_views();
+  g->s_man->swap_shader( last_shader );
+}
+
+/**
+ * Upload a range of floats from 'phong_ubo_buf' to the phong
+ * light Uniform Buffer Object.
+ */
+void lighting_manager::write_lighting_ubo( int start, int count ) {
+  GLsizeiptr size = count * sizeof( GLfloat );
+  glBindBuffer( GL_UNIFORM_BUFFER, phong_ubo_buffer );
+  glBufferSubData( GL_UNIFORM_BUFFER,
+                   start * sizeof( GLfloat ),
+                   size,
+                   &phong_ubo_buf[ start ] );
+  g->frame_ubo_bytes += size;
 }
@@ -46,10 +46,40 @@ int main( int argc, char** args ) {
       if ( !strcmp( args[ i ], "-e" ) ) {
         g->editor = true;
       }
+      // Use the deferred renderer.
+      if ( !strcmp( args[ i ], "-d" ) ) {
+        g->deferred_shading = true;
+      }
+      // Skip the depth pre-pass.
+      if ( !strcmp( args[ i ], "-z" ) ) {
+        g->depth_prepass = false;
+      }
       if ( !strcmp( args[ i ], "-c" ) ) {
         export_mesh_json( args[ i + 1 ], args[ i + 2 ] );
         return 0;
       }
+      // Build binary mesh caches for each following mesh file.
+      if ( !strcmp( args[ i ], "-m" ) ) {
+        int ret = 0;
+        for ( int j = i + 1; j < argc; ++j ) {
+          if ( !cook_mesh( args[ j ] ) ) { ret = 1; }
+        }
+        return ret;
+      }
+      // Check the block compressors against their decoders.
+      if ( !strcmp( args[ i ], "-tc" ) ) {
+        return check_texture_compress() ? 0 : 1;
+      }
+      // Build block compressed texture caches (with mip chains) for
+      // each following image file; BC1 / BC3, or BC7 with '-t7'.
+      if ( !strcmp( args[ i ], "-t" ) || !strcmp( args[ i ], "-t7" ) ) {
+        bool bc7 = !strcmp( args[ i ], "-t7" );
+        int ret = 0;
+        for ( int j = i + 1; j < argc; ++j ) {
+          if ( !cook_texture( args[ j ], bc7 ) ) { ret = 1; }
+        }
+        return ret;
+      }
     }
   }
 
@@ -57,6 +87,16 @@ int main( int argc, char** args ) {
   printf( "Init\r\n" );
   g->init();
 
+  // Run the particle benchmark, if requested.
+  for ( int i = 1; i < argc; ++i ) {
+    if ( !strcmp( args[ i ], "-p" ) ) {
+      bench_particles();
+      delete g;
+      glfwTerminate();
+      return 0;
+    }
+  }
+
   // Load a file if applicable.
   if ( argc >= 3 ) {
     for ( int i = 1; i < ( argc - 1 ); ++i ) {
@@ -664,6 +664,35 @@ aabb::aabb( float x_width, float y_height, float z_depth ) {
   x_w = x_width;
   y_h = y_height;
   z_d = z_depth;
+  max_pt = v3( x_w * 0.5f, y_h * 0.5f, z_d * 0.5f );
+  min_pt = max_pt * -1.0f;
+}
+
+/**
+ * Axis-aligned bounding box constructor,
+ * given its minimum and maximum corners.
+ */
+aabb::aabb( v3 min_point, v3 max_point ) {
+  min_pt = min_point;
+  max_pt = max_point;
+  x_w = max_pt.v[ 0 ] - min_pt.v[ 0 ];
+  y_h = max_pt.v[ 1 ] - min_pt.v[ 1 ];
+  z_d = max_pt.v[ 2 ] - min_pt.v[ 2 ];
+}
+
+/** Return the center point of an axis-aligned bounding box. */
+v3 aabb::center() const {
+  return v3( ( min_pt.v[ 0 ] + max_pt.v[ 0 ] ) * 0.5f,
+             ( min_pt.v[ 1 ] + max_pt.v[ 1 ] ) * 0.5f,
+             ( min_pt.v[ 2 ] + max_pt.v[ 2 ] ) * 0.5f );
+}
+
+/**
+ * Return the distance from an axis-aligned bounding box's
+ * center to its faces, along each axis.
+ */
+v3 aabb::half_extents() const {
+  return v3( x_w * 0.5f, y_h * 0.5f, z_d * 0.5f );
 }
 
 /** Print a 3-vector to a string. */
@@ -1037,6 +1066,25 @@ m4 translation_matrix( v3 t ) {
   return translation_matrix( t.v[ 0 ], t.v[ 1 ], t.v[ 2 ] );
 }
 
+/**
+ * Create a 4x4 scaling matrix, given X / Y / Z scale factors.
+ */
+m4 scale_matrix( float x, float y, float z ) {
+  m4 scale( x, 0, 0, 0,
+            0, y, 0, 0,
+            0, 0, z, 0,
+            0, 0, 0, 1 );
+  return scale;
+}
+
+/**
+ * Helper method to create a scaling matrix
+ * from a 3-vector instead of 3 floats.
+ */
+m4 scale_matrix( v3 s ) {
+  return scale_matrix( s.v[ 0 ], s.v[ 1 ], s.v[ 2 ] );
+}
+
 /**
  * Create the rotation part of a 4x4 transformation matrix
  * from a quaternion object.
@@ -1114,6 +1162,30 @@ m4 perspective( float near,
   return persp_mat;
 }
 
+/**
+ * Find the axis-aligned box which bounds another box after it
+ * is transformed by a 4x4 matrix. The box's center is transformed
+ * as a point, and each new half-extent is the sum of the old ones
+ * weighted by the absolute values of the matrix's rotation / scale.
+ */
+aabb transform_aabb( m4 mat, aabb box ) {
+  v3 c = box.center();
+  v3 e = box.half_extents();
+  v3 n_min, n_max;
+  for ( int i = 0; i < 3; ++i ) {
+    int row = i * 4;
+    float n_c = mat.m[ row + 3 ];
+    float n_e = 0.0f;
+    for ( int j = 0; j < 3; ++j ) {
+      n_c += mat.m[ row + j ] * c.v[ j ];
+      n_e += fabs( mat.m[ row + j ] ) * e.v[ j ];
+    }
+    n_min.v[ i ] = n_c - n_e;
+    n_max.v[ i ] = n_c + n_e;
+  }
+  return aabb( n_min, n_max );
+}
+
 /**
  * Calculate the dot product of two quaternions.
  */
@@ -1,33 +1,86 @@
 #include "mesh.h"
 
 /**
- * Constructor: populate the main mesh object attributes,
- * and initialize its OpenGL buffers.
+ * Constructor: populate the main mesh object attributes, and
+ * quantize its vertices if the GPU buffers use the compact
+ * format. This does not touch OpenGL, so meshes can be loaded on
+ * worker threads; 'init_buffers' must be called on the thread
+ * which owns the OpenGL context before the mesh is drawn.
+ * If 'backing' is set, the
+ * vertex / index arrays point into that file mapping and the mesh
+ * takes ownership of it instead of the arrays. Otherwise, the
+ * index array should be allocated as an array of bytes.
+ * The CPU-side arrays are always full-precision floats;
+ * 'v_format' only selects the layout of the GPU buffers.
  */
-mesh::mesh(int num_verts, GLfloat* p, GLfloat* n, GLfloat* t,
-           aabb baa, m4 t_m) {
+mesh::mesh(int num_verts, GLfloat* verts,
+           int num_inds, GLenum ind_type, void* inds,
+           aabb baa, int v_format, mapped_file* backing) {
   num_vertices = num_verts;
-  points = p;
-  normals = n;
-  tex_coords = t;
+  vertices = verts;
+  num_indices = num_inds;
+  index_type = ind_type;
+  indices = inds;
   bounding_box = baa;
-  transform = t_m;
+  v3 phys_min = baa.min_pt;
+  v3 phys_max = baa.max_pt;
+  for ( int i = 0; i < 3; ++i ) {
+    phys_min.v[ i ] = std::min( phys_min.v[ i ], 0.0f );
+    phys_max.v[ i ] = std::max( phys_max.v[ i ], 0.0f );
+  }
+  phys_bounds = aabb( phys_min, phys_max );
+  vertex_format = v_format;
+  dequant = id4();
+  cache_file = backing;
 
-  init_buffers();
+  quantize();
 }
 
 /**
  * Destructor: delete OpenGL buffers and the underlying
- * position / normal / texture coordinate arrays.
+ * vertex / index arrays, or the cache file mapping
+ * which holds them.
  */
 mesh::~mesh() {
-  if ( points_vbo ) { glDeleteBuffers( 1, &points_vbo ); }
-  if ( points ) { delete [] points; }
-  if ( normals_vbo ) { glDeleteBuffers( 1, &normals_vbo ); }
-  if ( normals ) { delete [] normals; }
-  if ( tex_coords_vbo ) { glDeleteBuffers( 1, &tex_coords_vbo ); }
-  if ( tex_coords ) { delete [] tex_coords; }
+  if ( vbo ) { glDeleteBuffers( 1, &vbo ); }
+  if ( ibo ) { glDeleteBuffers( 1, &ibo ); }
   if ( vao ) { glDeleteVertexArrays( 1, &vao ); }
+  if ( cache_file ) {
+    delete cache_file;
+  }
+  else {
+    if ( vertices ) { delete [] vertices; }
+    if ( indices ) { delete [] (char*)indices; }
+  }
+}
+
+/**
+ * Helper method to quantize a mesh's vertices into 'compact', if
+ * it uses the compact vertex format, and set its 'dequant' matrix.
+ */
+void mesh::quantize() {
+  if ( vertex_format != BRLA_VERTEX_COMPACT ) { return; }
+  // Quantize positions across the mesh's actual extents.
+  float min_ext[ 3 ];
+  float max_ext[ 3 ];
+  for ( int k = 0; k < 3; ++k ) {
+    min_ext[ k ] = max_ext[ k ] = vertices[ k ];
+  }
+  for ( int i = 1; i < num_vertices; ++i ) {
+    GLfloat* v = &vertices[ i * BRLA_VERTEX_FLOATS ];
+    for ( int k = 0; k < 3; ++k ) {
+      if ( v[ k ] < min_ext[ k ] ) { min_ext[ k ] = v[ k ]; }
+      if ( v[ k ] > max_ext[ k ] ) { max_ext[ k ] = v[ k ]; }
+    }
+  }
+  dequant = translation_matrix( min_ext[ 0 ],
+                                min_ext[ 1 ],
+                                min_ext[ 2 ] ) *
+            scale_matrix( quantize_extent( min_ext[ 0 ], max_ext[ 0 ] ),
+                          quantize_extent( min_ext[ 1 ], max_ext[ 1 ] ),
+                          quantize_extent( min_ext[ 2 ], max_ext[ 2 ] ) );
+  quantize_vertices( vertices, num_vertices,
+                     min_ext, max_ext, compact );
 }
 
 /**
@@ -37,47 +90,236 @@ void mesh::init_buffers() {
   // Create a VAO to store vertex attribute data.
   glGenVertexArrays( 1, &vao );
   glBindVertexArray( vao );
-  // Create and buffer the position values in a VBO.
-  glGenBuffers( 1, &points_vbo );
-  glBindBuffer( GL_ARRAY_BUFFER, points_vbo );
-  glBufferData( GL_ARRAY_BUFFER,
-                ( 3 * num_vertices * sizeof( GLfloat ) ),
-                points, GL_STATIC_DRAW );
-  glVertexAttribPointer(  0, 3, GL_FLOAT, GL_FALSE, 0, NULL );
-  glEnableVertexAttribArray( 0 );
-  // Create and buffer the normal values in a VBO.
-  glGenBuffers( 1, &normals_vbo );
-  glBindBuffer( GL_ARRAY_BUFFER, normals_vbo );
-  glBufferData( GL_ARRAY_BUFFER,
-                ( 3 * num_vertices * sizeof( GLfloat ) ),
-                normals, GL_STATIC_DRAW );
-  glVertexAttribPointer( 1, 3, GL_FLOAT, GL_FALSE, 0, NULL );
-  glEnableVertexAttribArray( 1 );
-  // Create and buffer the texture coordinate values in a VBO.
-  glGenBuffers( 1, &tex_coords_vbo );
-  glBindBuffer( GL_ARRAY_BUFFER, tex_coords_vbo );
-  glBufferData( GL_ARRAY_BUFFER,
-                ( 2 * num_vertices * sizeof( GLfloat ) ),
-                tex_coords, GL_STATIC_DRAW );
-  glVertexAttribPointer( 2, 2, GL_FLOAT, GL_FALSE, 0, NULL );
-  glEnableVertexAttribArray( 2 );
-}
-
-/**
- * Scale a mesh by X/Y/Z scalars stored in a 3-vector.
- */
-void mesh::scale_by( v3 s ) {
-  // TODO: SIMD candidate.
-  for ( int i = 0; i < num_vertices * 3; i += 3 ) {
-    points[ i ]   *= s.v[ 0 ];
-    points[ i+1 ] *= s.v[ 1 ];
-    points[ i+2 ] *= s.v[ 2 ];
+  // Create and buffer the interleaved vertex data in a VBO.
+  glGenBuffers( 1, &vbo );
+  glBindBuffer( GL_ARRAY_BUFFER, vbo );
+  if ( vertex_format == BRLA_VERTEX_COMPACT ) {
+    glBufferData( GL_ARRAY_BUFFER, compact.size(),
+                  &compact[ 0 ], GL_STATIC_DRAW );
+    // The quantized copy is only needed for the upload.
+    vector<unsigned char>().swap( compact );
+    GLsizei stride = BRLA_COMPACT_VERTEX_SIZE;
+    // Positions; 16-bit normalized, mapped back by 'dequant'.
+    glVertexAttribPointer( 0, 3, GL_UNSIGNED_SHORT, GL_TRUE,
+                           stride, NULL );
+    glEnableVertexAttribArray( 0 );
+    // Surface normals; 10 bits per component.
+    glVertexAttribPointer( 1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, stride,
+                           (void*)BRLA_COMPACT_NORMAL_OFFSET );
+    glEnableVertexAttribArray( 1 );
+    // Texture coordinates; half-floats.
+    glVertexAttribPointer( 2, 2, GL_HALF_FLOAT, GL_FALSE, stride,
+                           (void*)BRLA_COMPACT_UV_OFFSET );
+    glEnableVertexAttribArray( 2 );
   }
+  else {
+    glBufferData( GL_ARRAY_BUFFER,
+                  ( BRLA_VERTEX_FLOATS * num_vertices * sizeof( GLfloat ) ),
+                  vertices, GL_STATIC_DRAW );
+    GLsizei stride = BRLA_VERTEX_FLOATS * sizeof( GLfloat );
+    // Positions.
+    glVertexAttribPointer( 0, 3, GL_FLOAT, GL_FALSE, stride, NULL );
+    glEnableVertexAttribArray( 0 );
+    // Surface normals.
+    glVertexAttribPointer( 1, 3, GL_FLOAT, GL_FALSE, stride,
+      (void*)( BRLA_VERTEX_NORMAL_OFFSET * sizeof( GLfloat ) ) );
+    glEnableVertexAttribArray( 1 );
+    // Texture coordinates.
+    glVertexAttribPointer( 2, 2, GL_FLOAT, GL_FALSE, stride,
+      (void*)( BRLA_VERTEX_UV_OFFSET * sizeof( GLfloat ) ) );
+    glEnableVertexAttribArray( 2 );
+  }
+  // Create and buffer the index data. The element array binding
+  // is part of the VAO's state, so it stays bound with it.
+  int index_size = ( index_type == GL_UNSIGNED_SHORT ) ? 2 : 4;
+  glGenBuffers( 1, &ibo );
+  glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, ibo );
+  glBufferData( GL_ELEMENT_ARRAY_BUFFER,
+                num_indices * index_size,
+                indices, GL_STATIC_DRAW );
+  // Read per-instance model matrices from the shared buffer.
+  g->m_man->bind_instance_attribs();
+  glBindVertexArray( 0 );
+}
 
-  // Update the buffer objects.
-  // TODO: This should be baked into the mesh transformation matrix.
-  glBindVertexArray( vao );
-  glBindBuffer( GL_ARRAY_BUFFER, points_vbo );
-  glBufferSubData( GL_ARRAY_BUFFER, 0,
-                   3 * num_vertices * sizeof( GLfloat ), points );
+/**
+ * Get the position of a vertex in the mesh, by its index.
+ */
+v3 mesh::vertex_pos( int i ) {
+  GLfloat* v = &vertices[ i * BRLA_VERTEX_FLOATS ];
+  return v3( v[ 0 ], v[ 1 ], v[ 2 ] );
+}
+
+/**
+ * Get the value of an entry in the mesh's index buffer.
+ */
+unsigned int mesh::index( int i ) {
+  if ( index_type == GL_UNSIGNED_SHORT ) {
+    return ( (uint16_t*)indices )[ i ];
+  }
+  return ( (uint32_t*)indices )[ i ];
+}
+
+/**
+ * Mesh manager constructor: create the shared instance buffer.
+ * Its writes are aligned to whole matrices, so that each one
+ * starts at a valid base instance.
+ */
+mesh_manager::mesh_manager() {
+  GLsizeiptr mat_size = BRLA_INSTANCE_FLOATS * sizeof( GLfloat );
+  instances = new ring_buffer( GL_ARRAY_BUFFER,
+                               BRLA_INSTANCE_BUFFER_SIZE * mat_size,
+                               mat_size );
+}
+
+/**
+ * Mesh manager destructor: delete any stored meshes,
+ * whether or not they are still referenced.
+ */
+mesh_manager::~mesh_manager() {
+  for ( auto mesh_iter = mesh_fn_map.begin();
+        mesh_iter != mesh_fn_map.end();
+        ++mesh_iter ) {
+    if ( mesh_iter->second ) {
+      delete mesh_iter->second;
+      mesh_iter->second = 0;
+    }
+  }
+  if ( instances ) { delete instances; }
+}
+
+/**
+ * Add a mesh mapping to the mesh manager.
+ * Meshes are stored in a hash map by string key.
+ */
+void mesh_manager::add_mapping( string key, mesh* m ) {
+  evict_mapping( key );
+  mesh_fn_map[ key ] = m;
+}
+
+/**
+ * Add a mesh mapping to the mesh manager by filename.
+ * This method loads the mesh in the given vertex format, buffers
+ * it on the GPU, and adds it to the manager in one step,
+ * keyed by 'key'.
+ */
+mesh* mesh_manager::add_mapping_by_fn( string fn, int v_format ) {
+  mesh* m = load_mesh( fn.c_str(), v_format );
+  if ( !m ) { return 0; }
+  m->init_buffers();
+  add_mapping( key( fn, v_format ), m );
+  return m;
+}
+
+/**
+ * Evict a mesh from the mesh manager, and delete it.
+ */
+void mesh_manager::evict_mapping( string key ) {
+  auto mesh_iter = mesh_fn_map.find( key );
+  if ( mesh_iter != mesh_fn_map.end() ) {
+    if ( mesh_iter->second ) {
+      delete mesh_iter->second;
+      mesh_iter->second = 0;
+    }
+    mesh_fn_map.erase( mesh_iter );
+  }
+}
+
+/**
+ * Retrieve a mesh from the mesh manager by string key.
+ */
+mesh* mesh_manager::get( string key ) {
+  auto mesh_iter = mesh_fn_map.find( key );
+  if ( mesh_iter != mesh_fn_map.end() ) {
+    return mesh_iter->second;
+  }
+  return 0;
+}
+
+/**
+ * Get the string key for a mesh file in a given vertex format.
+ * Full-precision meshes are keyed by their file name alone.
+ */
+string mesh_manager::key( string fn, int v_format ) {
+  if ( v_format == BRLA_VERTEX_FULL ) { return fn; }
+  return fn + "#" + to_string( v_format );
+}
+
+/**
+ * Retrieve a shared mesh by filename and vertex format, loading
+ * it on first use, and take a reference to it. Every call should
+ * be paired with a call to 'release' once the caller is done.
+ */
+mesh* mesh_manager::acquire( string fn, int v_format ) {
+  mesh* m = get( key( fn, v_format ) );
+  if ( !m ) {
+    m = add_mapping_by_fn( fn, v_format );
+    if ( !m ) {
+      log_error( "Could not load mesh: %s\n", fn.c_str() );
+      return 0;
+    }
+  }
+  m->ref_count += 1;
+  return m;
+}
+
+/**
+ * Drop a reference to a shared mesh. The mesh is evicted and
+ * its GPU buffers are freed once nothing references it.
+ */
+void mesh_manager::release( string fn, int v_format ) {
+  string m_key = key( fn, v_format );
+  mesh* m = get( m_key );
+  if ( !m ) { return; }
+  m->ref_count -= 1;
+  if ( m->ref_count <= 0 ) {
+    evict_mapping( m_key );
+  }
+}
+
+/**
+ * Point the per-instance model matrix attributes of the currently
+ * bound VAO at the shared instance buffer. A 'mat4' attribute takes
+ * up 4 locations, one per column, which advance once per instance.
+ */
+void mesh_manager::bind_instance_attribs() {
+  glBindBuffer( GL_ARRAY_BUFFER, instances->buffer );
+  GLsizei stride = BRLA_INSTANCE_FLOATS * sizeof( GLfloat );
+  for ( int i = 0; i < 4; ++i ) {
+    GLuint loc = BRLA_INSTANCE_ATTRIB + i;
+    glVertexAttribPointer( loc, 4, GL_FLOAT, GL_FALSE, stride,
+                           (void*)( i * 4 * sizeof( GLfloat ) ) );
+    glVertexAttribDivisor( loc, 1 );
+    glEnableVertexAttribArray( loc );
+  }
+}
+
+/**
+ * Append column-major model matrices to this frame's region of
+ * the shared instance ring buffer, and return the index of the
+ * first one, to use as a draw's 'base instance'. If the region is
+ * full, the buffer is replaced with a larger one and every mesh's
+ * VAO is pointed at it; that waits for the GPU, but only happens
+ * until the buffer is big enough for a frame's instances.
+ */
+int mesh_manager::write_instances( const GLfloat* mats, int count ) {
+  GLsizeiptr mat_size = BRLA_INSTANCE_FLOATS * sizeof( GLfloat );
+  GLsizeiptr size = count * mat_size;
+  GLintptr offset = instances->write( mats, size );
+  if ( offset < 0 ) {
+    GLsizeiptr new_size = instances->region_size * 2;
+    while ( new_size < size ) { new_size *= 2; }
+    instances->grow( new_size );
+    for ( auto mesh_iter = mesh_fn_map.begin();
+          mesh_iter != mesh_fn_map.end();
+          ++mesh_iter ) {
+      if ( mesh_iter->second && mesh_iter->second->vao ) {
+        glBindVertexArray( mesh_iter->second->vao );
+        bind_instance_attribs();
+      }
+    }
+    glBindVertexArray( 0 );
+    offset = instances->write( mats, size );
+  }
+  return offset / mat_size;
 }
@@ -0,0 +1,315 @@
+#include "mesh_cache.h"
+
+/**
+ * Round a byte offset up to the mesh cache's stream alignment.
+ */
+static uint64_t align_cache_offset( uint64_t offset ) {
+  return ( offset + ( BRLA_MESH_CACHE_ALIGN - 1 ) ) &
+         ~( (uint64_t)BRLA_MESH_CACHE_ALIGN - 1 );
+}
+
+/**
+ * Mapped file constructor. The file is not opened until
+ * 'open' is called.
+ */
+mapped_file::mapped_file() {}
+
+/**
+ * Mapped file destructor: release the mapping, if any.
+ */
+mapped_file::~mapped_file() {
+  close();
+}
+
+/**
+ * Map an entire file into memory, read-only.
+ * Returns false if the file could not be opened or is empty.
+ */
+bool mapped_file::open( const char* fn ) {
+  close();
+#ifndef _WIN32
+  int fd = ::open( fn, O_RDONLY );
+  if ( fd < 0 ) { return false; }
+  struct stat st;
+  if ( fstat( fd, &st ) != 0 || st.st_size <= 0 ) {
+    ::close( fd );
+    return false;
+  }
+  void* addr = mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  // The mapping stays valid after its file descriptor is closed.
+  ::close( fd );
+  if ( addr == MAP_FAILED ) { return false; }
+  data = (const char*)addr;
+  len = st.st_size;
+#else
+  // No 'mmap' on Windows; read the file into a buffer instead.
+  FILE* file = fopen( fn, "rb" );
+  if ( !file ) { return false; }
+  fseek( file, 0, SEEK_END );
+  long file_len = ftell( file );
+  fseek( file, 0, SEEK_SET );
+  if ( file_len <= 0 ) {
+    fclose( file );
+    return false;
+  }
+  char* buf = new char[ file_len ];
+  if ( fread( buf, 1, file_len, file ) != (size_t)file_len ) {
+    delete [] buf;
+    fclose( file );
+    return false;
+  }
+  fclose( file );
+  data = buf;
+  len = file_len;
+#endif
+  return true;
+}
+
+/**
+ * Release the file mapping, if any.
+ */
+void mapped_file::close() {
+  if ( !data ) { return; }
+#ifndef _WIN32
+  munmap( (void*)data, len );
+#else
+  delete [] data;
+#endif
+  data = 0;
+  len = 0;
+}
+
+/**
+ * Get a file's modification time and size.
+ * Returns false if the file does not exist.
+ */
+bool stat_file( const char* fn, uint64_t& mtime, uint64_t& size ) {
+  struct stat st;
+  if ( stat( fn, &st ) != 0 ) { return false; }
+  mtime = (uint64_t)st.st_mtime;
+  size = (uint64_t)st.st_size;
+  return true;
+}
+
+/**
+ * Calculate a 64-bit FNV-1a hash of a file's contents.
+ * Returns 0 if the file could not be read.
+ */
+uint64_t hash_file( const char* fn ) {
+  FILE* file = fopen( fn, "rb" );
+  if ( !file ) { return 0; }
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  unsigned char buf[ 65536 ];
+  size_t read_len = 0;
+  while ( ( read_len = fread( buf, 1, sizeof( buf ), file ) ) > 0 ) {
+    for ( size_t i = 0; i < read_len; ++i ) {
+      hash ^= buf[ i ];
+      hash *= 0x100000001b3ULL;
+    }
+  }
+  fclose( file );
+  return hash;
+}
+
+/**
+ * Check whether a cache file's source file is unchanged, given the
+ * source state recorded in the cache's header. A cache is stale
+ * when its source file's size changes, or when its modification
+ * time changes and the contents hash does too. If only the
+ * modification time changed, 'src_mtime' (which lives inside of
+ * 'hdr') is updated and the header is rewritten, to skip hashing
+ * next run. If the source file is missing, the cache is current.
+ */
+bool cache_source_current( const char* src_fn, const char* cache_fn,
+                           void* hdr, size_t hdr_len,
+                           uint64_t& src_mtime,
+                           uint64_t src_size, uint64_t src_hash ) {
+  uint64_t cur_mtime = 0;
+  uint64_t cur_size = 0;
+  if ( !stat_file( src_fn, cur_mtime, cur_size ) ) { return true; }
+  if ( cur_size != src_size ) { return false; }
+  if ( cur_mtime != src_mtime ) {
+    if ( hash_file( src_fn ) != src_hash ) { return false; }
+    // Same contents; record the new time to skip hashing next run.
+    src_mtime = cur_mtime;
+    FILE* file = fopen( cache_fn, "r+b" );
+    if ( file ) {
+      fwrite( hdr, hdr_len, 1, file );
+      fclose( file );
+    }
+  }
+  return true;
+}
+
+/**
+ * Get the file path of the binary cache for a given mesh file.
+ * The cache lives next to the source file, with an extra extension.
+ */
+string mesh_cache_fn( const char* mesh_fn ) {
+  return string( mesh_fn ) + BRLA_MESH_CACHE_EXT;
+}
+
+/**
+ * Write a mesh's vertex and index data to its binary cache file.
+ * Indices are stored as 16-bit values when possible.
+ * The data is written to a temporary file first, so that an
+ * interrupted write never leaves a truncated cache behind.
+ * Returns false if the cache could not be written.
+ */
+bool write_mesh_cache( const char* mesh_fn, mesh_geometry& geo ) {
+  mesh_cache_header hdr;
+  memset( &hdr, 0, sizeof( hdr ) );
+  hdr.magic = BRLA_MESH_CACHE_MAGIC;
+  hdr.version = BRLA_MESH_CACHE_VERSION;
+  hdr.num_vertices = geo.num_vertices();
+  hdr.num_indices = geo.indices.size();
+  hdr.index_size = index_size_for( hdr.num_vertices );
+  hdr.vertex_size = BRLA_VERTEX_FLOATS * sizeof( GLfloat );
+  // Record the source file's state, to detect stale caches.
+  if ( !stat_file( mesh_fn, hdr.src_mtime, hdr.src_size ) ) {
+    log_error( "Couldn't read mesh file: %s\n", mesh_fn );
+    return false;
+  }
+  hdr.src_hash = hash_file( mesh_fn );
+  mesh_extents( hdr.num_vertices, &geo.vertices[ 0 ],
+                BRLA_VERTEX_FLOATS, hdr.aabb_min, hdr.aabb_max );
+
+  // Pack the indices down to their final size.
+  uint64_t v_len = (uint64_t)hdr.num_vertices * hdr.vertex_size;
+  uint64_t i_len = (uint64_t)hdr.num_indices * hdr.index_size;
+  vector<char> packed( i_len );
+  if ( i_len > 0 ) {
+    pack_indices( geo.indices, hdr.index_size, &packed[ 0 ] );
+  }
+
+  // Lay out each data stream at an aligned offset.
+  hdr.vertices_offset = align_cache_offset( sizeof( hdr ) );
+  hdr.indices_offset = align_cache_offset( hdr.vertices_offset + v_len );
+
+  // Write the header and streams, padding between them.
+  string cache_fn = mesh_cache_fn( mesh_fn );
+  string tmp_fn = cache_fn + ".tmp";
+  FILE* file = fopen( tmp_fn.c_str(), "wb" );
+  if ( !file ) {
+    log_error( "Couldn't open file for writing: %s\n", tmp_fn.c_str() );
+    return false;
+  }
+  const char zeros[ BRLA_MESH_CACHE_ALIGN ] = { 0 };
+  bool ok = true;
+  uint64_t pos = 0;
+  const void* streams[ 3 ] = { &hdr,
+                               v_len ? &geo.vertices[ 0 ] : 0,
+                               i_len ? &packed[ 0 ] : 0 };
+  uint64_t offsets[ 3 ] = { 0, hdr.vertices_offset, hdr.indices_offset };
+  uint64_t lens[ 3 ] = { sizeof( hdr ), v_len, i_len };
+  for ( int i = 0; i < 3 && ok; ++i ) {
+    if ( offsets[ i ] > pos ) {
+      ok = ( fwrite( zeros, 1, offsets[ i ] - pos, file ) ==
+             offsets[ i ] - pos );
+    }
+    if ( lens[ i ] > 0 ) {
+      ok = ok &&
+           ( fwrite( streams[ i ], 1, lens[ i ], file ) == lens[ i ] );
+    }
+    pos = offsets[ i ] + lens[ i ];
+  }
+  ok = ( fclose( file ) == 0 ) && ok;
+  if ( !ok ) {
+    log_error( "Couldn't write mesh cache: %s\n", tmp_fn.c_str() );
+    remove( tmp_fn.c_str() );
+    return false;
+  }
+  // Replace the old cache file, if any.
+  remove( cache_fn.c_str() );
+  if ( rename( tmp_fn.c_str(), cache_fn.c_str() ) != 0 ) {
+    log_error( "Couldn't write mesh cache: %s\n", cache_fn.c_str() );
+    remove( tmp_fn.c_str() );
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Load a mesh from its binary cache file, if the cache exists
+ * and is up-to-date. The cache is memory-mapped, and its streams
+ * are passed directly to OpenGL; the mesh keeps the mapping open
+ * for as long as it needs the vertex data on the CPU.
+ *
+ * A cache is stale when its source file's size changes, or when
+ * its modification time changes and the contents hash does too.
+ * If only the modification time changed, the cache is kept and
+ * its stored time is updated. If the source file is missing,
+ * the cache is used as-is.
+ *
+ * The cache always holds full-precision vertices; 'v_format'
+ * selects the layout they are uploaded to the GPU in.
+ *
+ * Returns null if there is no valid cache for the mesh file.
+ */
+mesh* load_mesh_cache( const char* mesh_fn, int v_format ) {
+  string cache_fn = mesh_cache_fn( mesh_fn );
+  mapped_file* cache = new mapped_file();
+  if ( !cache->open( cache_fn.c_str() ) ) {
+    delete cache;
+    return 0;
+  }
+
+  // Check the header.
+  mesh_cache_header hdr;
+  if ( cache->len < sizeof( hdr ) ) {
+    delete cache;
+    return 0;
+  }
+  memcpy( &hdr, cache->data, sizeof( hdr ) );
+  if ( hdr.magic != BRLA_MESH_CACHE_MAGIC ||
+       hdr.version != BRLA_MESH_CACHE_VERSION ) {
+    delete cache;
+    return 0;
+  }
+
+  // Check whether the source file has changed.
+  if ( !cache_source_current( mesh_fn, cache_fn.c_str(),
+                              &hdr, sizeof( hdr ), hdr.src_mtime,
+                              hdr.src_size, hdr.src_hash ) ) {
+    delete cache;
+    return 0;
+  }
+
+  // Make sure that every stream fits inside of the file.
+  uint64_t v_len = (uint64_t)hdr.num_vertices * hdr.vertex_size;
+  uint64_t i_len = (uint64_t)hdr.num_indices * hdr.index_size;
+  if ( hdr.num_vertices == 0 || hdr.num_indices == 0 ||
+       hdr.vertex_size != BRLA_VERTEX_FLOATS * sizeof( GLfloat ) ||
+       ( hdr.index_size != 2 && hdr.index_size != 4 ) ||
+       hdr.vertices_offset + v_len > cache->len ||
+       hdr.indices_offset + i_len > cache->len ) {
+    log_error( "Corrupt mesh cache: %s\n", cache_fn.c_str() );
+    delete cache;
+    return 0;
+  }
+
+  // Create the mesh directly from the mapped streams.
+  aabb bounding_box = aabb( v3( hdr.aabb_min[ 0 ],
+                                hdr.aabb_min[ 1 ],
+                                hdr.aabb_min[ 2 ] ),
+                            v3( hdr.aabb_max[ 0 ],
+                                hdr.aabb_max[ 1 ],
+                                hdr.aabb_max[ 2 ] ) );
+  GLfloat* vertices = (GLfloat*)( cache->data + hdr.vertices_offset );
+  void* indices = (void*)( cache->data + hdr.indices_offset );
+  GLenum index_type = ( hdr.index_size == 2 ) ? GL_UNSIGNED_SHORT :
+                                                GL_UNSIGNED_INT;
+  return new mesh( hdr.num_vertices, vertices,
+                   hdr.num_indices, index_type, indices,
+                   bounding_box, v_format, cache );
+}
+
+/**
+ * Import and optimize a mesh file, and write its binary cache,
+ * without creating any OpenGL objects. Returns false on failure.
+ */
+bool cook_mesh( const char* mesh_fn ) {
+  mesh_geometry geo;
+  if ( !build_mesh_geometry( mesh_fn, geo ) ) { return false; }
+  return write_mesh_cache( mesh_fn, geo );
+}
@@ -0,0 +1,427 @@
+#include "mesh_opt.h"
+
+/**
+ * Weld identical vertices in a flat, non-indexed triangle list.
+ * Vertices are interleaved and compared bit-for-bit, so only
+ * exact duplicates are merged. The result is written to 'geo'
+ * as an indexed triangle list in the original triangle order.
+ */
+void weld_vertices( int num_verts,
+                    GLfloat* p, GLfloat* n, GLfloat* t,
+                    mesh_geometry& geo ) {
+  geo.vertices.clear();
+  geo.indices.clear();
+  geo.vertices.reserve( num_verts * BRLA_VERTEX_FLOATS );
+  geo.indices.reserve( num_verts );
+
+  // Open-addressed hash table of vertex indices; -1 marks an
+  // empty slot. Keep it at most half full.
+  size_t table_size = 1;
+  while ( table_size < (size_t)num_verts * 2 ) { table_size <<= 1; }
+  size_t table_mask = table_size - 1;
+  vector<int32_t> table( table_size, -1 );
+
+  GLfloat v[ BRLA_VERTEX_FLOATS ];
+  for ( int i = 0; i < num_verts; ++i ) {
+    // Assemble the interleaved vertex.
+    memcpy( &v[ 0 ], &p[ i * 3 ], 3 * sizeof( GLfloat ) );
+    memcpy( &v[ BRLA_VERTEX_NORMAL_OFFSET ], &n[ i * 3 ],
+            3 * sizeof( GLfloat ) );
+    memcpy( &v[ BRLA_VERTEX_UV_OFFSET ], &t[ i * 2 ],
+            2 * sizeof( GLfloat ) );
+
+    // FNV-1a hash of the vertex's bytes.
+    const unsigned char* bytes = (const unsigned char*)v;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for ( size_t b = 0; b < sizeof( v ); ++b ) {
+      hash ^= bytes[ b ];
+      hash *= 0x100000001b3ULL;
+    }
+
+    // Find a matching vertex, or add a new one.
+    size_t slot = hash & table_mask;
+    while ( true ) {
+      int32_t existing = table[ slot ];
+      if ( existing < 0 ) {
+        existing = geo.num_vertices();
+        table[ slot ] = existing;
+        geo.vertices.insert( geo.vertices.end(),
+                             v, v + BRLA_VERTEX_FLOATS );
+        geo.indices.push_back( existing );
+        break;
+      }
+      if ( !memcmp( &geo.vertices[ existing * BRLA_VERTEX_FLOATS ],
+                    v, sizeof( v ) ) ) {
+        geo.indices.push_back( existing );
+        break;
+      }
+      slot = ( slot + 1 ) & table_mask;
+    }
+  }
+}
+
+/**
+ * Reorder a mesh's triangles for the post-transform vertex cache,
+ * and then to reduce overdraw.
+ *
+ * This uses the 'Tipsify' algorithm from Sander, Nehab, and
+ * Barczak's "Fast Triangle Reordering for Vertex Locality and
+ * Reduced Overdraw": triangles are emitted in fans around vertices
+ * which are likely to still be in the cache. Wherever it hits a
+ * dead end and has to jump elsewhere, a new cluster begins.
+ * Clusters are then sorted so that outward-facing parts of the
+ * mesh are drawn first, which lets the depth test reject more of
+ * the fragments behind them.
+ */
+void optimize_vertex_cache( mesh_geometry& geo, int cache_size ) {
+  int num_verts = geo.num_vertices();
+  int num_tris = geo.indices.size() / 3;
+  if ( num_tris == 0 ) { return; }
+  const vector<uint32_t>& in = geo.indices;
+
+  // Build vertex -> triangle adjacency lists, and count the
+  // number of not-yet-emitted triangles using each vertex.
+  vector<int> live( num_verts, 0 );
+  for ( size_t i = 0; i < in.size(); ++i ) { live[ in[ i ] ] += 1; }
+  vector<int> adj_offset( num_verts + 1, 0 );
+  for ( int v = 0; v < num_verts; ++v ) {
+    adj_offset[ v + 1 ] = adj_offset[ v ] + live[ v ];
+  }
+  vector<int> adj( in.size() );
+  vector<int> adj_fill( adj_offset.begin(), adj_offset.end() - 1 );
+  for ( int tri = 0; tri < num_tris; ++tri ) {
+    for ( int k = 0; k < 3; ++k ) {
+      adj[ adj_fill[ in[ tri * 3 + k ] ]++ ] = tri;
+    }
+  }
+
+  // Emit triangles in vertex fans.
+  vector<int> stamp( num_verts, 0 );
+  vector<bool> emitted( num_tris, false );
+  vector<uint32_t> dead_end;
+  vector<uint32_t> candidates;
+  vector<uint32_t> out;
+  out.reserve( in.size() );
+  vector<int> cluster_start;
+  cluster_start.push_back( 0 );
+  int time = cache_size + 1;
+  int cursor = 0;
+  int fan = in[ 0 ];
+  while ( fan >= 0 ) {
+    candidates.clear();
+    for ( int a = adj_offset[ fan ]; a < adj_offset[ fan + 1 ]; ++a ) {
+      int tri = adj[ a ];
+      if ( emitted[ tri ] ) { continue; }
+      for ( int k = 0; k < 3; ++k ) {
+        uint32_t v = in[ tri * 3 + k ];
+        out.push_back( v );
+        dead_end.push_back( v );
+        candidates.push_back( v );
+        live[ v ] -= 1;
+        // A vertex is only re-stamped on a cache miss.
+        if ( time - stamp[ v ] > cache_size ) {
+          stamp[ v ] = time;
+          time += 1;
+        }
+      }
+      emitted[ tri ] = true;
+    }
+
+    // Pick the next fanning vertex: prefer the oldest candidate
+    // which will still be in the cache after its fan is emitted.
+    int next = -1;
+    int best = -1;
+    for ( size_t c = 0; c < candidates.size(); ++c ) {
+      uint32_t v = candidates[ c ];
+      if ( live[ v ] <= 0 ) { continue; }
+      int priority = 0;
+      if ( time - stamp[ v ] + 2 * live[ v ] <= cache_size ) {
+        priority = time - stamp[ v ];
+      }
+      if ( priority > best ) {
+        best = priority;
+        next = v;
+      }
+    }
+    // Dead end; fall back to a recently-used vertex, or else
+    // the next vertex in input order with triangles left.
+    if ( next < 0 ) {
+      while ( !dead_end.empty() && next < 0 ) {
+        uint32_t v = dead_end.back();
+        dead_end.pop_back();
+        if ( live[ v ] > 0 ) { next = v; }
+      }
+      while ( next < 0 && cursor < num_verts ) {
+        if ( live[ cursor ] > 0 ) { next = cursor; }
+        else { cursor += 1; }
+      }
+      if ( next >= 0 && (int)out.size() / 3 > cluster_start.back() ) {
+        cluster_start.push_back( out.size() / 3 );
+      }
+    }
+    fan = next;
+  }
+  int num_clusters = cluster_start.size();
+  cluster_start.push_back( num_tris );
+
+  // Find the area-weighted centroid and normal of each cluster,
+  // as well as the centroid of the whole mesh.
+  const GLfloat* verts = &geo.vertices[ 0 ];
+  vector<float> cluster_info( num_clusters * 7, 0.0f );
+  float mesh_c[ 3 ] = { 0.0f, 0.0f, 0.0f };
+  float mesh_area = 0.0f;
+  for ( int c = 0; c < num_clusters; ++c ) {
+    float* info = &cluster_info[ c * 7 ];
+    for ( int tri = cluster_start[ c ];
+          tri < cluster_start[ c + 1 ];
+          ++tri ) {
+      const GLfloat* p0 = &verts[ out[ tri * 3 ] * BRLA_VERTEX_FLOATS ];
+      const GLfloat* p1 =
+        &verts[ out[ tri * 3 + 1 ] * BRLA_VERTEX_FLOATS ];
+      const GLfloat* p2 =
+        &verts[ out[ tri * 3 + 2 ] * BRLA_VERTEX_FLOATS ];
+      float e1[ 3 ] = { p1[ 0 ] - p0[ 0 ],
+                        p1[ 1 ] - p0[ 1 ],
+                        p1[ 2 ] - p0[ 2 ] };
+      float e2[ 3 ] = { p2[ 0 ] - p0[ 0 ],
+                        p2[ 1 ] - p0[ 1 ],
+                        p2[ 2 ] - p0[ 2 ] };
+      float nx = e1[ 1 ] * e2[ 2 ] - e1[ 2 ] * e2[ 1 ];
+      float ny = e1[ 2 ] * e2[ 0 ] - e1[ 0 ] * e2[ 2 ];
+      float nz = e1[ 0 ] * e2[ 1 ] - e1[ 1 ] * e2[ 0 ];
+      float area = sqrtf( nx * nx + ny * ny + nz * nz );
+      for ( int k = 0; k < 3; ++k ) {
+        float centroid = ( p0[ k ] + p1[ k ] + p2[ k ] ) / 3.0f;
+        info[ k ] += centroid * area;
+        mesh_c[ k ] += centroid * area;
+      }
+      info[ 3 ] += nx;
+      info[ 4 ] += ny;
+      info[ 5 ] += nz;
+      info[ 6 ] += area;
+      mesh_area += area;
+    }
+  }
+  if ( mesh_area > 0.0f ) {
+    for ( int k = 0; k < 3; ++k ) { mesh_c[ k ] /= mesh_area; }
+  }
+
+  // Sort clusters by how far they face away from the centroid.
+  vector<float> sort_key( num_clusters, 0.0f );
+  vector<int> order( num_clusters );
+  for ( int c = 0; c < num_clusters; ++c ) {
+    order[ c ] = c;
+    float* info = &cluster_info[ c * 7 ];
+    if ( info[ 6 ] <= 0.0f ) { continue; }
+    float n_len = sqrtf( info[ 3 ] * info[ 3 ] +
+                         info[ 4 ] * info[ 4 ] +
+                         info[ 5 ] * info[ 5 ] );
+    if ( n_len <= 0.0f ) { continue; }
+    for ( int k = 0; k < 3; ++k ) {
+      sort_key[ c ] += ( info[ k ] / info[ 6 ] - mesh_c[ k ] ) *
+                       ( info[ 3 + k ] / n_len );
+    }
+  }
+  std::stable_sort( order.begin(), order.end(),
+                    [ &sort_key ]( int a, int b ) {
+                      return sort_key[ a ] > sort_key[ b ];
+                    } );
+
+  // Write the triangles out in cluster order.
+  vector<uint32_t> sorted;
+  sorted.reserve( out.size() );
+  for ( int c = 0; c < num_clusters; ++c ) {
+    int cl = order[ c ];
+    sorted.insert( sorted.end(),
+                   out.begin() + cluster_start[ cl ] * 3,
+                   out.begin() + cluster_start[ cl + 1 ] * 3 );
+  }
+  geo.indices.swap( sorted );
+}
+
+/**
+ * Reorder a mesh's vertices in the order that they are first
+ * referenced by its indices, so that vertex fetches walk through
+ * memory roughly sequentially. Unreferenced vertices are dropped.
+ */
+void optimize_vertex_fetch( mesh_geometry& geo ) {
+  int num_verts = geo.num_vertices();
+  vector<int32_t> remap( num_verts, -1 );
+  vector<GLfloat> reordered;
+  reordered.reserve( geo.vertices.size() );
+  int next = 0;
+  for ( size_t i = 0; i < geo.indices.size(); ++i ) {
+    uint32_t v = geo.indices[ i ];
+    if ( remap[ v ] < 0 ) {
+      remap[ v ] = next++;
+      reordered.insert(
+        reordered.end(),
+        geo.vertices.begin() + v * BRLA_VERTEX_FLOATS,
+        geo.vertices.begin() + ( v + 1 ) * BRLA_VERTEX_FLOATS );
+    }
+    geo.indices[ i ] = remap[ v ];
+  }
+  geo.vertices.swap( reordered );
+}
+
+/**
+ * Pick the smallest index size, in bytes, which can address
+ * every vertex in a mesh: 16 bits if possible, else 32 bits.
+ */
+int index_size_for( int num_verts ) {
+  return ( num_verts <= 0x10000 ) ? 2 : 4;
+}
+
+/**
+ * Copy indices into a buffer using the given index size in bytes.
+ * The buffer must hold at least 'indices.size() * index_size' bytes.
+ */
+void pack_indices( const vector<uint32_t>& indices,
+                   int index_size, void* out ) {
+  if ( index_size == 2 ) {
+    uint16_t* out_16 = (uint16_t*)out;
+    for ( size_t i = 0; i < indices.size(); ++i ) {
+      out_16[ i ] = (uint16_t)indices[ i ];
+    }
+  }
+  else {
+    memcpy( out, &indices[ 0 ], indices.size() * sizeof( uint32_t ) );
+  }
+}
+
+/**
+ * Convert a 32-bit float to a 16-bit 'half' float, rounding to
+ * the nearest value. Values which are too large become infinity.
+ */
+uint16_t float_to_half( float f ) {
+  uint32_t x;
+  memcpy( &x, &f, sizeof( x ) );
+  uint16_t sign = ( x >> 16 ) & 0x8000;
+  int32_t exp_f = ( x >> 23 ) & 0xff;
+  uint32_t mant = x & 0x7fffff;
+  // Infinity or NaN.
+  if ( exp_f == 0xff ) {
+    return sign | 0x7c00 | ( mant ? 0x200 : 0 );
+  }
+  int32_t exp_h = exp_f - 127 + 15;
+  // Too large; overflow to infinity.
+  if ( exp_h >= 31 ) { return sign | 0x7c00; }
+  // Too small for a normal half; make a denormal, or zero.
+  if ( exp_h <= 0 ) {
+    if ( exp_h < -10 ) { return sign; }
+    mant |= 0x800000;
+    int shift = 14 - exp_h;
+    uint16_t h = mant >> shift;
+    if ( ( mant >> ( shift - 1 ) ) & 1 ) { h += 1; }
+    return sign | h;
+  }
+  uint16_t h = sign | ( exp_h << 10 ) | ( mant >> 13 );
+  // Round; a carry into the exponent is still correct.
+  if ( mant & 0x1000 ) { h += 1; }
+  return h;
+}
+
+/**
+ * Pack a 3-vector with components in [-1, 1] into the
+ * 'GL_INT_2_10_10_10_REV' signed normalized format.
+ * X is stored in the lowest 10 bits; W is left at 0.
+ */
+uint32_t pack_snorm_2_10_10_10( float x, float y, float z ) {
+  float comps[ 3 ] = { x, y, z };
+  uint32_t packed = 0;
+  for ( int i = 0; i < 3; ++i ) {
+    float c = comps[ i ];
+    if ( c > 1.0f ) { c = 1.0f; }
+    if ( c < -1.0f ) { c = -1.0f; }
+    int32_t q = (int32_t)floorf( c * 511.0f + 0.5f );
+    packed |= ( (uint32_t)q & 0x3ff ) << ( i * 10 );
+  }
+  return packed;
+}
+
+/**
+ * Get the scale used to quantize positions along one axis.
+ * Flat axes use a scale of 1 so that the dequantization matrix
+ * stays invertible and normals along that axis survive it.
+ */
+float quantize_extent( float min_ext, float max_ext ) {
+  float extent = max_ext - min_ext;
+  return ( extent > 0.0f ) ? extent : 1.0f;
+}
+
+/**
+ * Quantize interleaved float vertices into the 'compact' format.
+ * Positions are stored as 16-bit normalized values across the
+ * given extents, so the mesh must be drawn with a matrix which
+ * maps [0, 1] back to [min, max]. Since the shaders transform
+ * normals by the same matrix, normals are pre-multiplied by that
+ * matrix's inverse scale and re-normalized before they are packed.
+ */
+void quantize_vertices( const GLfloat* vertices, int num_verts,
+                        const float* min_ext, const float* max_ext,
+                        vector<unsigned char>& out ) {
+  out.resize( num_verts * BRLA_COMPACT_VERTEX_SIZE );
+  float extent[ 3 ];
+  for ( int k = 0; k < 3; ++k ) {
+    extent[ k ] = quantize_extent( min_ext[ k ], max_ext[ k ] );
+  }
+  for ( int i = 0; i < num_verts; ++i ) {
+    const GLfloat* v = &vertices[ i * BRLA_VERTEX_FLOATS ];
+    unsigned char* q = &out[ i * BRLA_COMPACT_VERTEX_SIZE ];
+
+    // Positions.
+    uint16_t pos[ 4 ] = { 0, 0, 0, 0 };
+    for ( int k = 0; k < 3; ++k ) {
+      float t = ( v[ k ] - min_ext[ k ] ) / extent[ k ];
+      if ( t < 0.0f ) { t = 0.0f; }
+      if ( t > 1.0f ) { t = 1.0f; }
+      pos[ k ] = (uint16_t)( t * 65535.0f + 0.5f );
+    }
+    memcpy( q, pos, sizeof( pos ) );
+
+    // Surface normals.
+    float n[ 3 ];
+    float n_len = 0.0f;
+    for ( int k = 0; k < 3; ++k ) {
+      n[ k ] = v[ BRLA_VERTEX_NORMAL_OFFSET + k ] / extent[ k ];
+      n_len += n[ k ] * n[ k ];
+    }
+    n_len = sqrtf( n_len );
+    if ( n_len > 0.0f ) {
+      for ( int k = 0; k < 3; ++k ) { n[ k ] /= n_len; }
+    }
+    uint32_t packed_n = pack_snorm_2_10_10_10( n[ 0 ], n[ 1 ], n[ 2 ] );
+    memcpy( q + BRLA_COMPACT_NORMAL_OFFSET, &packed_n, 4 );
+
+    // Texture coordinates.
+    uint16_t uv[ 2 ] = {
+      float_to_half( v[ BRLA_VERTEX_UV_OFFSET ] ),
+      float_to_half( v[ BRLA_VERTEX_UV_OFFSET + 1 ] )
+    };
+    memcpy( q + BRLA_COMPACT_UV_OFFSET, uv, sizeof( uv ) );
+  }
+}
+
+/**
+ * Calculate the average cache miss ratio of an index buffer:
+ * the number of vertex shader invocations per triangle, for a
+ * FIFO post-transform cache of the given size. This ranges from
+ * 3.0 (no reuse) down to about 0.5 for a regular grid.
+ */
+float calc_acmr( const vector<uint32_t>& indices,
+                 int num_verts, int cache_size ) {
+  int num_tris = indices.size() / 3;
+  if ( num_tris == 0 ) { return 0.0f; }
+  vector<int> stamp( num_verts, 0 );
+  int time = cache_size + 1;
+  int misses = 0;
+  for ( size_t i = 0; i < indices.size(); ++i ) {
+    uint32_t v = indices[ i ];
+    if ( time - stamp[ v ] > cache_size ) {
+      stamp[ v ] = time;
+      time += 1;
+      misses += 1;
+    }
+  }
+  return (float)misses / num_tris;
+}
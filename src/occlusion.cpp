@@ -0,0 +1,309 @@
+#include "occlusion.h"
+
+/** Occlusion buffer constructor. Allocate the depth buffer. */
+occlusion_buffer::occlusion_buffer() {
+  depth.resize( BRLA_OCCLUSION_RES_X * BRLA_OCCLUSION_RES_Y, 0.0f );
+}
+
+/**
+ * Rebuild the depth buffer from a camera's view: collect the game
+ * objects marked as occluders, keep the ones inside the camera's
+ * frustum, project their triangles in parallel, and then rasterize
+ * them in parallel horizontal bands.
+ */
+void occlusion_buffer::build( camera* cam, unity_manager* um ) {
+  view_proj = cam->persp_matrix * cam->c_view_matrix;
+
+  all_occluders.clear();
+  function<void( unity* u )> f =
+    [ &all = all_occluders ]( unity* u ) {
+    if ( u->occluder && u->m ) { all.push_back( u ); }
+  };
+  um->for_each( f, true );
+  occluders.clear();
+  frustum( cam ).cull( all_occluders, occluders );
+
+  occluder_tris.resize( occluders.size() );
+  g->jobs->parallel_for( occluders.size(), [ this ]( int i ) {
+    transform_occluder( occluders[ i ], occluder_tris[ i ] );
+  } );
+  num_tris = 0;
+  for ( int i = 0; i < occluders.size(); ++i ) {
+    num_tris += occluder_tris[ i ].size();
+  }
+
+  std::fill( depth.begin(), depth.end(), 0.0f );
+  if ( num_tris == 0 ) { return; }
+  int band_h = BRLA_OCCLUSION_RES_Y / BRLA_OCCLUSION_BANDS;
+  g->jobs->parallel_for( BRLA_OCCLUSION_BANDS, [ this, band_h ]( int b ) {
+    raster_band( b * band_h, ( b + 1 ) * band_h );
+  } );
+}
+
+/**
+ * Project an occluder's triangles into the depth buffer's pixel
+ * space. Triangles which cross the near plane or lie entirely
+ * off-screen are dropped.
+ */
+void occlusion_buffer::transform_occluder( unity* u,
+                                           vector<occluder_tri>& tris ) {
+  tris.clear();
+  mesh* m = u->m;
+  // The mesh's CPU-side vertices are not quantized, so leave
+  // the dequantization out of the model matrix.
+  m4 vp = view_proj;
+  m4 model_vp = vp * u->scaled_transform;
+  const float* mat = model_vp.m;
+
+  int nv = m->num_vertices;
+  vector<float> screen( nv * 3 );
+  vector<unsigned char> in_front( nv );
+  for ( int i = 0; i < nv; ++i ) {
+    v3 p = m->vertex_pos( i );
+    float c_x = mat[ 0 ] * p.v[ 0 ] + mat[ 1 ] * p.v[ 1 ] +
+                mat[ 2 ] * p.v[ 2 ] + mat[ 3 ];
+    float c_y = mat[ 4 ] * p.v[ 0 ] + mat[ 5 ] * p.v[ 1 ] +
+                mat[ 6 ] * p.v[ 2 ] + mat[ 7 ];
+    float c_w = mat[ 12 ] * p.v[ 0 ] + mat[ 13 ] * p.v[ 1 ] +
+                mat[ 14 ] * p.v[ 2 ] + mat[ 15 ];
+    in_front[ i ] = ( c_w >= BRLA_OCCLUSION_MIN_W );
+    if ( !in_front[ i ] ) { continue; }
+    float iw = 1.0f / c_w;
+    screen[ i * 3 ] = ( c_x * iw * 0.5f + 0.5f ) * BRLA_OCCLUSION_RES_X;
+    screen[ i * 3 + 1 ] = ( c_y * iw * 0.5f + 0.5f ) * BRLA_OCCLUSION_RES_Y;
+    screen[ i * 3 + 2 ] = iw;
+  }
+
+  for ( int t = 0; t + 2 < m->num_indices; t += 3 ) {
+    occluder_tri ot;
+    bool keep = true;
+    float min_x = FLT_MAX, max_x = -FLT_MAX;
+    float min_y = FLT_MAX, max_y = -FLT_MAX;
+    for ( int k = 0; k < 3; ++k ) {
+      unsigned int vi = m->index( t + k );
+      if ( !in_front[ vi ] ) {
+        keep = false;
+        break;
+      }
+      ot.x[ k ] = screen[ vi * 3 ];
+      ot.y[ k ] = screen[ vi * 3 + 1 ];
+      ot.iw[ k ] = screen[ vi * 3 + 2 ];
+      min_x = std::min( min_x, ot.x[ k ] );
+      max_x = std::max( max_x, ot.x[ k ] );
+      min_y = std::min( min_y, ot.y[ k ] );
+      max_y = std::max( max_y, ot.y[ k ] );
+    }
+    if ( !keep || max_x < 0.0f || min_x >= BRLA_OCCLUSION_RES_X ||
+         max_y < 0.0f || min_y >= BRLA_OCCLUSION_RES_Y ) {
+      continue;
+    }
+    ot.min_y = ( int )std::max( 0.0f, min_y );
+    ot.max_y = ( int )std::min( BRLA_OCCLUSION_RES_Y - 1.0f, max_y );
+    tris.push_back( ot );
+  }
+}
+
+/** Rasterize every occluder triangle into rows [ y0, y1 ). */
+void occlusion_buffer::raster_band( int y0, int y1 ) {
+  for ( int i = 0; i < occluder_tris.size(); ++i ) {
+    vector<occluder_tri>& tris = occluder_tris[ i ];
+    for ( int j = 0; j < tris.size(); ++j ) {
+      if ( tris[ j ].max_y >= y0 && tris[ j ].min_y < y1 ) {
+        raster_tri( tris[ j ], y0, y1 );
+      }
+    }
+  }
+}
+
+/**
+ * Rasterize one triangle into rows [ y0, y1 ), keeping the
+ * nearest depth at each pixel whose center it covers. Three edge
+ * functions and 1 / W are each linear in screen space, so they are
+ * stepped across each row four pixels at a time.
+ */
+void occlusion_buffer::raster_tri( const occluder_tri& t,
+                                   int y0, int y1 ) {
+  // Order the vertices counter-clockwise, so that every edge
+  // function is positive inside of the triangle.
+  int i1 = 1, i2 = 2;
+  float area = ( t.x[ 1 ] - t.x[ 0 ] ) * ( t.y[ 2 ] - t.y[ 0 ] ) -
+               ( t.y[ 1 ] - t.y[ 0 ] ) * ( t.x[ 2 ] - t.x[ 0 ] );
+  if ( fabs( area ) < 1e-6f ) { return; }
+  if ( area < 0.0f ) {
+    i1 = 2;
+    i2 = 1;
+    area = -area;
+  }
+  float vx[ 3 ] = { t.x[ 0 ], t.x[ i1 ], t.x[ i2 ] };
+  float vy[ 3 ] = { t.y[ 0 ], t.y[ i1 ], t.y[ i2 ] };
+  float viw[ 3 ] = { t.iw[ 0 ], t.iw[ i1 ], t.iw[ i2 ] };
+
+  // Edge 'k' is opposite vertex 'k': E = a * x + b * y + c.
+  float ea[ 3 ], eb[ 3 ], ec[ 3 ];
+  for ( int k = 0; k < 3; ++k ) {
+    int from = ( k + 1 ) % 3;
+    int to = ( k + 2 ) % 3;
+    ea[ k ] = -( vy[ to ] - vy[ from ] );
+    eb[ k ] = vx[ to ] - vx[ from ];
+    ec[ k ] = ( vy[ to ] - vy[ from ] ) * vx[ from ] -
+              ( vx[ to ] - vx[ from ] ) * vy[ from ];
+  }
+  // 1 / W = sum( iw[ k ] * E[ k ] ) / area.
+  float za = 0.0f, zb = 0.0f, zc = 0.0f;
+  for ( int k = 0; k < 3; ++k ) {
+    za += viw[ k ] * ea[ k ];
+    zb += viw[ k ] * eb[ k ];
+    zc += viw[ k ] * ec[ k ];
+  }
+  za /= area;
+  zb /= area;
+  zc /= area;
+
+  float min_x = std::min( vx[ 0 ], std::min( vx[ 1 ], vx[ 2 ] ) );
+  float max_x = std::max( vx[ 0 ], std::max( vx[ 1 ], vx[ 2 ] ) );
+  // Start on a multiple of 4; the buffer's width is one too.
+  int x_start = ( int )std::max( 0.0f, min_x ) & ~3;
+  int x_end = ( int )std::min( BRLA_OCCLUSION_RES_X - 1.0f, max_x );
+  int row_start = std::max( y0, t.min_y );
+  int row_end = std::min( y1 - 1, t.max_y );
+
+  for ( int y = row_start; y <= row_end; ++y ) {
+    float py = y + 0.5f;
+    float* row = &depth[ y * BRLA_OCCLUSION_RES_X ];
+    float r0 = eb[ 0 ] * py + ec[ 0 ];
+    float r1 = eb[ 1 ] * py + ec[ 1 ];
+    float r2 = eb[ 2 ] * py + ec[ 2 ];
+    float rz = zb * py + zc;
+#ifdef BRLA_USE_SSE
+    __m128 zero = _mm_setzero_ps();
+    __m128 a0 = _mm_set1_ps( ea[ 0 ] );
+    __m128 a1 = _mm_set1_ps( ea[ 1 ] );
+    __m128 a2 = _mm_set1_ps( ea[ 2 ] );
+    __m128 az = _mm_set1_ps( za );
+    __m128 lane = _mm_set_ps( 3.5f, 2.5f, 1.5f, 0.5f );
+    for ( int x = x_start; x <= x_end; x += 4 ) {
+      __m128 px = _mm_add_ps( _mm_set1_ps( ( float )x ), lane );
+      __m128 e0 = _mm_add_ps( _mm_mul_ps( a0, px ), _mm_set1_ps( r0 ) );
+      __m128 e1 = _mm_add_ps( _mm_mul_ps( a1, px ), _mm_set1_ps( r1 ) );
+      __m128 e2 = _mm_add_ps( _mm_mul_ps( a2, px ), _mm_set1_ps( r2 ) );
+      __m128 inside = _mm_and_ps( _mm_cmpge_ps( e0, zero ),
+                      _mm_and_ps( _mm_cmpge_ps( e1, zero ),
+                                  _mm_cmpge_ps( e2, zero ) ) );
+      if ( !_mm_movemask_ps( inside ) ) { continue; }
+      __m128 z = _mm_add_ps( _mm_mul_ps( az, px ), _mm_set1_ps( rz ) );
+      __m128 cur = _mm_loadu_ps( row + x );
+      __m128 nearest = _mm_max_ps( cur, z );
+      _mm_storeu_ps( row + x,
+                     _mm_or_ps( _mm_and_ps( inside, nearest ),
+                                _mm_andnot_ps( inside, cur ) ) );
+    }
+#else
+    for ( int x = x_start; x <= x_end; ++x ) {
+      float px = x + 0.5f;
+      if ( ea[ 0 ] * px + r0 < 0.0f ||
+           ea[ 1 ] * px + r1 < 0.0f ||
+           ea[ 2 ] * px + r2 < 0.0f ) {
+        continue;
+      }
+      float z = za * px + rz;
+      if ( z > row[ x ] ) { row[ x ] = z; }
+    }
+#endif
+  }
+}
+
+/**
+ * Check whether any part of a world-space box might be visible
+ * past the occluders. The box's corners are projected to find the
+ * pixels it covers and its nearest depth; it is hidden only if
+ * every one of those pixels holds a nearer occluder. Boxes which
+ * cross the near plane are always treated as visible.
+ */
+bool occlusion_buffer::is_visible( const aabb& box ) {
+  const float* mat = view_proj.m;
+  float min_x = FLT_MAX, max_x = -FLT_MAX;
+  float min_y = FLT_MAX, max_y = -FLT_MAX;
+  float max_iw = 0.0f;
+  for ( int c = 0; c < 8; ++c ) {
+    float p_x = ( c & 1 ) ? box.max_pt.v[ 0 ] : box.min_pt.v[ 0 ];
+    float p_y = ( c & 2 ) ? box.max_pt.v[ 1 ] : box.min_pt.v[ 1 ];
+    float p_z = ( c & 4 ) ? box.max_pt.v[ 2 ] : box.min_pt.v[ 2 ];
+    float c_w = mat[ 12 ] * p_x + mat[ 13 ] * p_y +
+                mat[ 14 ] * p_z + mat[ 15 ];
+    if ( c_w < BRLA_OCCLUSION_MIN_W ) { return true; }
+    float iw = 1.0f / c_w;
+    float c_x = mat[ 0 ] * p_x + mat[ 1 ] * p_y + mat[ 2 ] * p_z + mat[ 3 ];
+    float c_y = mat[ 4 ] * p_x + mat[ 5 ] * p_y + mat[ 6 ] * p_z + mat[ 7 ];
+    float s_x = ( c_x * iw * 0.5f + 0.5f ) * BRLA_OCCLUSION_RES_X;
+    float s_y = ( c_y * iw * 0.5f + 0.5f ) * BRLA_OCCLUSION_RES_Y;
+    min_x = std::min( min_x, s_x );
+    max_x = std::max( max_x, s_x );
+    min_y = std::min( min_y, s_y );
+    max_y = std::max( max_y, s_y );
+    max_iw = std::max( max_iw, iw );
+  }
+  // Clamp before converting, since the corners may project
+  // far outside of the buffer.
+  if ( max_x < 0.0f || min_x >= BRLA_OCCLUSION_RES_X ||
+       max_y < 0.0f || min_y >= BRLA_OCCLUSION_RES_Y ) {
+    return true;
+  }
+  int x0 = ( int )std::max( 0.0f, min_x );
+  int x1 = ( int )std::min( BRLA_OCCLUSION_RES_X - 1.0f, max_x );
+  int y0 = ( int )std::max( 0.0f, min_y );
+  int y1 = ( int )std::min( BRLA_OCCLUSION_RES_Y - 1.0f, max_y );
+
+  for ( int y = y0; y <= y1; ++y ) {
+    const float* row = &depth[ y * BRLA_OCCLUSION_RES_X ];
+#ifdef BRLA_USE_SSE
+    __m128 box_iw = _mm_set1_ps( max_iw );
+    __m128 lo = _mm_set1_ps( ( float )x0 );
+    __m128 hi = _mm_set1_ps( ( float )x1 );
+    __m128 lane = _mm_set_ps( 3.0f, 2.0f, 1.0f, 0.0f );
+    for ( int x = x0 & ~3; x <= x1; x += 4 ) {
+      __m128 px = _mm_add_ps( _mm_set1_ps( ( float )x ), lane );
+      __m128 in_rect = _mm_and_ps( _mm_cmpge_ps( px, lo ),
+                                   _mm_cmple_ps( px, hi ) );
+      __m128 open = _mm_cmple_ps( _mm_loadu_ps( row + x ), box_iw );
+      if ( _mm_movemask_ps( _mm_and_ps( in_rect, open ) ) ) {
+        return true;
+      }
+    }
+#else
+    for ( int x = x0; x <= x1; ++x ) {
+      if ( row[ x ] <= max_iw ) { return true; }
+    }
+#endif
+  }
+  return false;
+}
+
+/**
+ * Append the game objects which are not hidden behind the
+ * occluders to 'visible', keeping their order. The objects are
+ * tested in parallel batches; occluders always pass.
+ */
+void occlusion_buffer::cull( const vector<unity*>& objs,
+                             vector<unity*>& visible ) {
+  int n = objs.size();
+  if ( num_tris == 0 ) {
+    for ( int i = 0; i < n; ++i ) {
+      if ( objs[ i ] ) { visible.push_back( objs[ i ] ); }
+    }
+    return;
+  }
+  results.resize( n );
+  int batches = ( n + BRLA_OCCLUSION_TEST_BATCH - 1 ) /
+                BRLA_OCCLUSION_TEST_BATCH;
+  g->jobs->parallel_for( batches, [ this, &objs, n ]( int b ) {
+    int start = b * BRLA_OCCLUSION_TEST_BATCH;
+    int end = std::min( n, start + BRLA_OCCLUSION_TEST_BATCH );
+    for ( int i = start; i < end; ++i ) {
+      unity* u = objs[ i ];
+      results[ i ] = u && ( u->occluder || is_visible( u->world_bounds ) );
+    }
+  } );
+  for ( int i = 0; i < n; ++i ) {
+    if ( results[ i ] ) { visible.push_back( objs[ i ] ); }
+  }
+}
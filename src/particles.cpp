@@ -0,0 +1,250 @@
+#include "particles.h"
+
+/**
+ * Particle manager constructor: allocate both particle buffers for
+ * the whole emitter pool, and the Vertex Array Objects to read them.
+ */
+particle_manager::particle_manager( int particles_per_emitter ) {
+  per_emitter = particles_per_emitter;
+  GLsizeiptr size = ( GLsizeiptr )per_emitter * BRLA_MAX_EMITTERS *
+                    BRLA_PARTICLE_FLOATS * sizeof( GLfloat );
+  // Zeroed particles have a tag which no emitter uses,
+  // so they are all born the first time they are simulated.
+  vector<GLfloat> zeroes( size / sizeof( GLfloat ), 0.0f );
+  glGenBuffers( 2, buffers );
+  glGenVertexArrays( 2, vaos );
+  for ( int i = 0; i < 2; ++i ) {
+    glBindVertexArray( vaos[ i ] );
+    glBindBuffer( GL_ARRAY_BUFFER, buffers[ i ] );
+    glBufferData( GL_ARRAY_BUFFER, size, &zeroes[ 0 ], GL_DYNAMIC_COPY );
+    GLsizei stride = BRLA_PARTICLE_FLOATS * sizeof( GLfloat );
+    glEnableVertexAttribArray( 0 );
+    glVertexAttribPointer( 0, 4, GL_FLOAT, GL_FALSE, stride, 0 );
+    glEnableVertexAttribArray( 1 );
+    glVertexAttribPointer( 1, 4, GL_FLOAT, GL_FALSE, stride,
+                           ( void* )( 4 * sizeof( GLfloat ) ) );
+  }
+  glBindVertexArray( 0 );
+
+  // Hand out the lowest slots first, to keep 'num_slots' small.
+  free_slots.reserve( BRLA_MAX_EMITTERS );
+  for ( int i = BRLA_MAX_EMITTERS - 1; i >= 0; --i ) {
+    emitters[ i ].slot = i;
+    free_slots.push_back( i );
+  }
+  memset( particles_ubo_buf, 0, sizeof( particles_ubo_buf ) );
+}
+
+/** Particle manager destructor: delete the OpenGL objects. */
+particle_manager::~particle_manager() {
+  glDeleteVertexArrays( 2, vaos );
+  glDeleteBuffers( 2, buffers );
+}
+
+/**
+ * Start an emitter at a fixed world-space position, with 'count'
+ * particles alive at once. Returns null if the pool is empty.
+ */
+particle_emitter* particle_manager::add_emitter( v3 pos, int count ) {
+  if ( free_slots.empty() ) {
+    log_error( "[WARNING] Out of particle emitters (%d).\n",
+               BRLA_MAX_EMITTERS );
+    return 0;
+  }
+  particle_emitter* e = &emitters[ free_slots.back() ];
+  free_slots.pop_back();
+  int gen = e->gen + 1;
+  int slot = e->slot;
+  *e = particle_emitter();
+  e->slot = slot;
+  e->gen = gen;
+  e->active = true;
+  e->offset = pos;
+  e->pos = pos;
+  e->count = std::min( std::max( count, 0 ), per_emitter );
+  e->start_time = sim_time;
+  if ( slot + 1 > num_slots ) { num_slots = slot + 1; }
+  return e;
+}
+
+/**
+ * Start an emitter which follows a game object, at 'offset' in
+ * the object's local space.
+ */
+particle_emitter* particle_manager::add_emitter( unity* parent,
+                                                 v3 offset,
+                                                 int count ) {
+  particle_emitter* e = add_emitter( offset, count );
+  if ( e ) { e->parent = parent; }
+  return e;
+}
+
+/**
+ * Stop an emitter, and return it to the pool. Its particles
+ * disappear the next time that the particles are simulated.
+ */
+void particle_manager::remove_emitter( particle_emitter* e ) {
+  if ( !e || !e->active ) { return; }
+  e->active = false;
+  e->parent = 0;
+  e->count = 0;
+  free_slots.push_back( e->slot );
+  while ( num_slots > 0 && !emitters[ num_slots - 1 ].active ) {
+    num_slots -= 1;
+  }
+}
+
+/** Remove every emitter attached to a game object. */
+void particle_manager::detach( unity* u ) {
+  for ( int i = 0; i < num_slots; ++i ) {
+    if ( emitters[ i ].active && emitters[ i ].parent == u ) {
+      remove_emitter( &emitters[ i ] );
+    }
+  }
+}
+
+/**
+ * Write the active emitters' settings to the particle Uniform
+ * Buffer Object. The whole block is bound, since a range smaller
+ * than the block the shaders declare is not allowed. This happens
+ * every frame, even while the particles are not simulated, since
+ * the ring buffer region holding the last values is soon reused.
+ */
+void particle_manager::write_particles_ubo() {
+  for ( int i = 0; i < num_slots; ++i ) {
+    particle_emitter& e = emitters[ i ];
+    GLfloat* out = &particles_ubo_buf[ 4 + i * BRLA_EMITTER_FLOATS ];
+    for ( int j = 0; j < 3; ++j ) {
+      out[ j ] = e.pos.v[ j ];
+      out[ 4 + j ] = e.velocity.v[ j ];
+      out[ 12 + j ] = e.color.v[ j ];
+    }
+    out[ 3 ] = e.active ? ( float )e.count : 0.0f;
+    out[ 7 ] = e.lifetime;
+    out[ 8 ] = e.spread;
+    out[ 9 ] = e.gravity;
+    out[ 10 ] = ( float )( sim_time - e.start_time );
+    out[ 11 ] = ( float )e.gen;
+    out[ 15 ] = e.size;
+  }
+  g->write_ubo( particles_ubo,
+                particles_ubo_buf,
+                sizeof( particles_ubo_buf ) );
+}
+
+/**
+ * Simulate every particle for one time step, with a transform
+ * feedback pass from the current particle buffer into the other.
+ * Attached emitters first move to their game objects' positions.
+ */
+void particle_manager::update( float dt ) {
+  sim_time += dt;
+  if ( num_slots == 0 ) { return; }
+  for ( int i = 0; i < num_slots; ++i ) {
+    particle_emitter& e = emitters[ i ];
+    if ( e.active && e.parent ) {
+      // The offset is in model space, which is not quantized.
+      e.pos = v3( e.parent->scaled_transform * v4( e.offset, 1.0f ) );
+    }
+  }
+  particles_ubo_buf[ 0 ] = dt;
+  particles_ubo_buf[ 1 ] = ( float )per_emitter;
+  write_particles_ubo();
+
+  GLuint last_shader = g->s_man->cur_shader;
+  g->s_man->swap_shader( g->particles_update_shader_key );
+  glEnable( GL_RASTERIZER_DISCARD );
+  glBindVertexArray( vaos[ cur ] );
+  glBindBufferBase( GL_TRANSFORM_FEEDBACK_BUFFER, 0, buffers[ 1 - cur ] );
+  glBeginTransformFeedback( GL_POINTS );
+  glDrawArrays( GL_POINTS, 0, num_slots * per_emitter );
+  glEndTransformFeedback();
+  glBindBufferBase( GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0 );
+  glDisable( GL_RASTERIZER_DISCARD );
+  g->s_man->swap_shader( last_shader );
+  cur = 1 - cur;
+}
+
+/**
+ * Draw every particle as a point sprite, blended over the scene.
+ * They are tested against the scene's depth values, but do not
+ * write their own.
+ */
+void particle_manager::draw() {
+  if ( num_slots == 0 ) { return; }
+  GLuint last_shader = g->s_man->cur_shader;
+  g->s_man->swap_shader( g->particles_shader_key );
+  glEnable( GL_PROGRAM_POINT_SIZE );
+  glEnable( GL_BLEND );
+  glDepthMask( GL_FALSE );
+  glBindVertexArray( vaos[ cur ] );
+  glDrawArrays( GL_POINTS, 0, num_slots * per_emitter );
+  glDepthMask( GL_TRUE );
+  glDisable( GL_BLEND );
+  glDisable( GL_PROGRAM_POINT_SIZE );
+  g->s_man->swap_shader( last_shader );
+}
+
+/**
+ * Benchmark the particle system: for a range of emitter and
+ * particle counts, time the GPU simulation and drawing passes over
+ * a number of frames, and log the average time of each. Run with
+ * '-p'; uses the main window's framebuffer and camera.
+ */
+void bench_particles() {
+  const int emitter_counts[] = { 1, 16, 64, BRLA_MAX_EMITTERS };
+  const int particle_counts[] = { 256, 1024, 4096 };
+  const int warm_up_frames = 10;
+  const int frames = 100;
+  const float dt = 1.0f / 60.0f;
+  GLuint queries[ 2 ];
+  glGenQueries( 2, queries );
+  g->c_man->active_camera->update_cam_pos();
+  g->write_frame_ubos();
+
+  log( "Particle benchmark: %d frames each.\n", frames );
+  for ( int pc = 0; pc < 3; ++pc ) {
+    particle_manager* pm = new particle_manager( particle_counts[ pc ] );
+    for ( int ec = 0; ec < 4; ++ec ) {
+      while ( pm->num_slots < emitter_counts[ ec ] ) {
+        particle_emitter* e =
+          pm->add_emitter( v3( pm->num_slots * 0.5f, 0.0f, -5.0f ),
+                           particle_counts[ pc ] );
+        if ( !e ) { break; }
+      }
+      for ( int i = 0; i < warm_up_frames; ++i ) {
+        pm->update( dt );
+        pm->draw();
+        g->ubo_ring->advance_frame();
+        g->write_frame_ubos();
+      }
+      glFinish();
+
+      GLuint64 update_ns = 0;
+      GLuint64 draw_ns = 0;
+      for ( int i = 0; i < frames; ++i ) {
+        GLuint64 elapsed = 0;
+        glBeginQuery( GL_TIME_ELAPSED, queries[ 0 ] );
+        pm->update( dt );
+        glEndQuery( GL_TIME_ELAPSED );
+        glBeginQuery( GL_TIME_ELAPSED, queries[ 1 ] );
+        pm->draw();
+        glEndQuery( GL_TIME_ELAPSED );
+        glGetQueryObjectui64v( queries[ 0 ], GL_QUERY_RESULT, &elapsed );
+        update_ns += elapsed;
+        glGetQueryObjectui64v( queries[ 1 ], GL_QUERY_RESULT, &elapsed );
+        draw_ns += elapsed;
+        g->ubo_ring->advance_frame();
+        g->write_frame_ubos();
+      }
+      log( "%4d emitters x %5d particles: "
+           "update %.3f ms, draw %.3f ms\n",
+           emitter_counts[ ec ],
+           particle_counts[ pc ],
+           update_ns / ( frames * 1000000.0 ),
+           draw_ns / ( frames * 1000000.0 ) );
+    }
+    delete pm;
+  }
+  glDeleteQueries( 2, queries );
+}
@@ -566,28 +566,49 @@ cone_p_obj::cone_p_obj( float radius,
   gen_phys_obj( mass, pos, rot );
 }
 
-/** Physics object constructor: 'bounding volume hierarchy' shape. */
+/**
+ * Physics object constructor: 'bounding volume hierarchy' shape.
+ * If the level loader already built a shape for this mesh on a
+ * worker thread, that one is used instead of building it here.
+ */
 bvh_tri_p_obj::bvh_tri_p_obj( mesh* m,
                               float mass,
                               btVector3 pos,
                               btQuaternion rot) {
-  // Create the core 'btTriangleMesh' collision shape, and
-  // populate it with the mesh vertex positions.
+  c_shape = g->p_man->take_prebuilt_shape( m );
+  if ( !c_shape ) { c_shape = build_bvh_shape( m ); }
+  // Call the shared 'generate new physics object' method.
+  gen_phys_obj( mass, pos, rot );
+}
+
+/**
+ * Build a 'bounding volume hierarchy' triangle mesh collision
+ * shape from a mesh's CPU-side vertex data. This does not touch
+ * the physics world or OpenGL, so it can be called from a worker
+ * thread, as long as the mesh is not deleted in the meantime.
+ */
+btCollisionShape* build_bvh_shape( mesh* m ) {
+  // Point a triangle mesh interface at the mesh's own indexed
+  // vertex data, instead of copying every triangle.
+  // The mesh must outlive this physics object.
   // TODO: Where are these memory allocations deleted?
-  btTriangleMesh* tri_mesh = new btTriangleMesh();
-  for ( int i = 0; i < m->num_vertices * 3; i += 9 ) {
-    tri_mesh->addTriangle(
-      btVector3( m->points[ i ],
-                 m->points[ i + 1 ],
-                 m->points[ i + 2 ] ),
-      btVector3( m->points[ i + 3 ],
-                 m->points[ i + 4 ],
-                 m->points[ i + 5 ] ),
-      btVector3( m->points[ i + 6 ],
-                 m->points[ i + 7 ],
-                 m->points[ i + 8 ] ),
-      true );
+  btIndexedMesh indexed_mesh;
+  indexed_mesh.m_numTriangles = m->num_indices / 3;
+  indexed_mesh.m_triangleIndexBase = (const unsigned char*)m->indices;
+  indexed_mesh.m_numVertices = m->num_vertices;
+  indexed_mesh.m_vertexBase = (const unsigned char*)m->vertices;
+  indexed_mesh.m_vertexStride = BRLA_VERTEX_FLOATS * sizeof( GLfloat );
+  indexed_mesh.m_vertexType = PHY_FLOAT;
+  PHY_ScalarType index_type = PHY_INTEGER;
+  int index_size = sizeof( uint32_t );
+  if ( m->index_type == GL_UNSIGNED_SHORT ) {
+    index_type = PHY_SHORT;
+    index_size = sizeof( uint16_t );
   }
+  indexed_mesh.m_triangleIndexStride = 3 * index_size;
+  btTriangleIndexVertexArray* tri_mesh =
+    new btTriangleIndexVertexArray();
+  tri_mesh->addIndexedMesh( indexed_mesh, index_type );
   // Create the 'bounding volume hierarchy' triangle mesh shape
   // from the triangle mesh data.
   btBvhTriangleMeshShape* tri_shape =
@@ -596,9 +617,7 @@ bvh_tri_p_obj::bvh_tri_p_obj( mesh* m,
   btTriangleInfoMap* tri_norms = new btTriangleInfoMap();
   btGenerateInternalEdgeInfo( tri_shape, tri_norms );
   tri_shape->setUserPointer( tri_norms );
-  c_shape = tri_shape;
-  // Call the shared 'generate new physics object' method.
-  gen_phys_obj( mass, pos, rot );
+  return tri_shape;
 }
 
 /**
@@ -636,6 +655,7 @@ physics_manager::physics_manager() {
  * simulation or something here - is there a process for that?
  */
 physics_manager::~physics_manager() {
+  clear_prebuilt_shapes();
   if ( phys_world )         { delete phys_world; }
   if ( solver )             { delete solver; }
   if ( broadphase )         { delete broadphase; }
@@ -660,6 +680,42 @@ void physics_manager::update() {
                               BRLA_PHYS_TIME_STEP );
 }
 
+/**
+ * Hand a collision shape which was built ahead of time for a
+ * mesh to the physics manager; the next physics object created
+ * from that mesh takes it, instead of building its own.
+ */
+void physics_manager::add_prebuilt_shape( mesh* m,
+                                          btCollisionShape* shape ) {
+  prebuilt_shapes[ m ].push_back( shape );
+}
+
+/**
+ * Take a collision shape which was built ahead of time for
+ * a mesh, if there are any left. Returns 0 otherwise.
+ * The caller takes ownership of the shape.
+ */
+btCollisionShape* physics_manager::take_prebuilt_shape( mesh* m ) {
+  auto s_iter = prebuilt_shapes.find( m );
+  if ( s_iter == prebuilt_shapes.end() ) { return 0; }
+  btCollisionShape* shape = s_iter->second.back();
+  s_iter->second.pop_back();
+  if ( s_iter->second.empty() ) { prebuilt_shapes.erase( s_iter ); }
+  return shape;
+}
+
+/** Delete any prebuilt collision shapes which were not used. */
+void physics_manager::clear_prebuilt_shapes() {
+  for ( auto s_iter = prebuilt_shapes.begin();
+        s_iter != prebuilt_shapes.end();
+        ++s_iter ) {
+    for ( int i = 0; i < s_iter->second.size(); ++i ) {
+      delete s_iter->second[ i ];
+    }
+  }
+  prebuilt_shapes.clear();
+}
+
 /**
  * Physics simulation draw step: draw the debugging
  * wireframe information.
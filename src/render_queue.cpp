@@ -0,0 +1,319 @@
+#include "render_queue.h"
+
+/**
+ * Render queue constructor. Currently empty, the scratch
+ * arrays grow as packets are submitted.
+ */
+render_queue::render_queue() {}
+
+/** Render queue destructor. Delete the GPU timer queries. */
+render_queue::~render_queue() {
+  for ( int f = 0; f < BRLA_TIMER_FRAMES; ++f ) {
+    if ( !timers[ f ].queries.empty() ) {
+      glDeleteQueries( timers[ f ].queries.size(),
+                       &timers[ f ].queries[ 0 ] );
+    }
+  }
+}
+
+/**
+ * Build the sort key for a game object in a given render pass,
+ * drawn with a given shader program. The depth is the squared
+ * distance from the active camera as a fraction of the far plane's,
+ * so nearer objects sort first within each state group.
+ */
+uint64_t render_queue::make_key( int pass, GLuint program, unity* u ) {
+  uint64_t tex = u->tex ? u->tex->tex : 0;
+  uint64_t depth = 0;
+  camera* a_cam = g->c_man->active_camera;
+  if ( a_cam ) {
+    // 'cam_pos' is stored negated.
+    float d2 = distance2( u->cur_center, a_cam->cam_pos * -1.0f );
+    float d = d2 / ( g->far * g->far );
+    if ( d > 1.0f ) { d = 1.0f; }
+    depth = ( uint64_t )( d * BRLA_KEY_DEPTH_MASK );
+  }
+  return ( ( ( uint64_t )pass & BRLA_KEY_PASS_MASK )
+             << BRLA_KEY_PASS_SHIFT ) |
+         ( ( ( uint64_t )program & BRLA_KEY_PROGRAM_MASK )
+             << BRLA_KEY_PROGRAM_SHIFT ) |
+         ( ( tex & BRLA_KEY_TEXTURE_MASK )
+             << BRLA_KEY_TEXTURE_SHIFT ) |
+         ( ( ( uint64_t )u->m->vao & BRLA_KEY_VAO_MASK )
+             << BRLA_KEY_VAO_SHIFT ) |
+         ( depth & BRLA_KEY_DEPTH_MASK );
+}
+
+/**
+ * Queue a game object to be drawn in the given render pass,
+ * with the currently-active shader program.
+ * Objects without a mesh are ignored.
+ */
+void render_queue::submit( int pass, unity* u ) {
+  if ( !u || !u->m ) { return; }
+  GLuint program = g->s_man->cur_shader;
+  draw_packet p;
+  p.key = make_key( pass, program, u );
+  p.program = program;
+  p.u = u;
+  packets.push_back( p );
+}
+
+/**
+ * Queue the game objects which are at least partly inside of
+ * a view frustum. The rest are counted as culled. If an occlusion
+ * buffer drawn from the same view is given, objects which it hides
+ * are also skipped, and counted as occluded.
+ */
+void render_queue::submit_visible( int pass, frustum view,
+                                   const vector<unity*>& objs,
+                                   occlusion_buffer* occ ) {
+  visible_buf.clear();
+  view.cull( objs, visible_buf );
+  int candidates = 0;
+  for ( int i = 0; i < objs.size(); ++i ) {
+    if ( objs[ i ] && objs[ i ]->m ) { candidates += 1; }
+  }
+  stats.culled += candidates - visible_buf.size();
+
+  vector<unity*>* to_draw = &visible_buf;
+  if ( occ ) {
+    unoccluded_buf.clear();
+    occ->cull( visible_buf, unoccluded_buf );
+    stats.occluded += visible_buf.size() - unoccluded_buf.size();
+    to_draw = &unoccluded_buf;
+  }
+  for ( int i = 0; i < to_draw->size(); ++i ) {
+    submit( pass, ( *to_draw )[ i ] );
+  }
+}
+
+/**
+ * Sort the queued packets by key, with an LSD radix sort over
+ * the key's 8 bytes. Bytes which every key shares are skipped,
+ * which is usually most of the high ones.
+ */
+void render_queue::sort() {
+  int n = packets.size();
+  if ( n < 2 ) { return; }
+  sort_buf.resize( n );
+  draw_packet* src = &packets[ 0 ];
+  draw_packet* dst = &sort_buf[ 0 ];
+  int counts[ 256 ];
+  for ( int shift = 0; shift < 64; shift += 8 ) {
+    memset( counts, 0, sizeof( counts ) );
+    for ( int i = 0; i < n; ++i ) {
+      counts[ ( src[ i ].key >> shift ) & 0xFF ] += 1;
+    }
+    // Skip this byte if every key has the same value for it.
+    if ( counts[ ( src[ 0 ].key >> shift ) & 0xFF ] == n ) {
+      continue;
+    }
+    // Turn the counts into starting offsets.
+    int sum = 0;
+    for ( int b = 0; b < 256; ++b ) {
+      int c = counts[ b ];
+      counts[ b ] = sum;
+      sum += c;
+    }
+    for ( int i = 0; i < n; ++i ) {
+      dst[ counts[ ( src[ i ].key >> shift ) & 0xFF ]++ ] = src[ i ];
+    }
+    draw_packet* tmp = src;
+    src = dst;
+    dst = tmp;
+  }
+  // Make sure that the sorted packets end up in 'packets'.
+  if ( src != &packets[ 0 ] ) { packets.swap( sort_buf ); }
+}
+
+/**
+ * Queue a depth pre-pass: a copy of every queued opaque packet,
+ * drawn first with the given depth-only shader program. The opaque
+ * pass then only shades the nearest fragment of each pixel, since
+ * 'execute' draws it with an equal depth test. Call this after the
+ * opaque packets are submitted, so they are only culled once.
+ */
+void render_queue::add_depth_prepass( GLuint depth_program ) {
+  int n = packets.size();
+  for ( int i = 0; i < n; ++i ) {
+    draw_packet p = packets[ i ];
+    if ( ( ( p.key >> BRLA_KEY_PASS_SHIFT ) & BRLA_KEY_PASS_MASK ) !=
+         BRLA_PASS_OPAQUE ) {
+      continue;
+    }
+    // Keep the mesh and depth bits. The depth program does not
+    // sample textures, so leave them out to batch more draws.
+    p.key &= ~( ( BRLA_KEY_PASS_MASK << BRLA_KEY_PASS_SHIFT ) |
+                ( BRLA_KEY_PROGRAM_MASK << BRLA_KEY_PROGRAM_SHIFT ) |
+                ( BRLA_KEY_TEXTURE_MASK << BRLA_KEY_TEXTURE_SHIFT ) );
+    p.key |= ( ( uint64_t )BRLA_PASS_DEPTH << BRLA_KEY_PASS_SHIFT ) |
+             ( ( ( uint64_t )depth_program & BRLA_KEY_PROGRAM_MASK )
+                 << BRLA_KEY_PROGRAM_SHIFT );
+    p.program = depth_program;
+    packets.push_back( p );
+  }
+}
+
+/**
+ * Start timing a render pass on the GPU, with a timestamp query.
+ * Passes may be drawn in several parts; their times are added up.
+ */
+void render_queue::begin_pass_timer( int pass ) {
+  pass_timers& t = timers[ timer_frame ];
+  if ( t.count * 2 >= t.queries.size() ) {
+    GLuint q[ 2 ];
+    glGenQueries( 2, q );
+    t.queries.push_back( q[ 0 ] );
+    t.queries.push_back( q[ 1 ] );
+    t.passes.push_back( 0 );
+  }
+  t.passes[ t.count ] = pass;
+  glQueryCounter( t.queries[ t.count * 2 ], GL_TIMESTAMP );
+}
+
+/** Finish timing the render pass started by 'begin_pass_timer'. */
+void render_queue::end_pass_timer() {
+  pass_timers& t = timers[ timer_frame ];
+  glQueryCounter( t.queries[ t.count * 2 + 1 ], GL_TIMESTAMP );
+  t.count += 1;
+}
+
+/**
+ * Add up the GPU time of each render pass from the oldest frame's
+ * timer queries, then reuse them for the next frame. Results which
+ * are somehow not ready yet are skipped, rather than waited for.
+ */
+void render_queue::read_pass_timers( double* pass_ms ) {
+  timer_frame = ( timer_frame + 1 ) % BRLA_TIMER_FRAMES;
+  pass_timers& t = timers[ timer_frame ];
+  for ( int i = 0; i < t.count; ++i ) {
+    GLint available = 0;
+    glGetQueryObjectiv( t.queries[ i * 2 + 1 ],
+                        GL_QUERY_RESULT_AVAILABLE,
+                        &available );
+    if ( !available ) { continue; }
+    GLuint64 start_ns = 0;
+    GLuint64 end_ns = 0;
+    glGetQueryObjectui64v( t.queries[ i * 2 ],
+                           GL_QUERY_RESULT,
+                           &start_ns );
+    glGetQueryObjectui64v( t.queries[ i * 2 + 1 ],
+                           GL_QUERY_RESULT,
+                           &end_ns );
+    pass_ms[ t.passes[ i ] ] += ( end_ns - start_ns ) / 1000000.0;
+  }
+  t.count = 0;
+}
+
+/**
+ * Sort and draw the queued packets, then empty the queue.
+ * Every model matrix is written to the shared instance buffer
+ * at once, in sorted order; each run of packets with the same
+ * program / texture / mesh is then drawn with one call.
+ * If a depth pre-pass was queued, the opaque pass after it is
+ * drawn with an equal depth test and without depth writes.
+ */
+void render_queue::execute() {
+  camera* a_cam = g->c_man->active_camera;
+  if ( !a_cam || packets.empty() ) {
+    packets.clear();
+    return;
+  }
+  sort();
+
+  // Write every model matrix to the instance buffer at once.
+  int n = packets.size();
+  instance_buf.resize( n * BRLA_INSTANCE_FLOATS );
+  for ( int i = 0; i < n; ++i ) {
+    memcpy( &instance_buf[ i * BRLA_INSTANCE_FLOATS ],
+            transpose( packets[ i ].u->transform ).m,
+            BRLA_INSTANCE_FLOATS * sizeof( GLfloat ) );
+  }
+  int base = g->m_man->write_instances( &instance_buf[ 0 ], n );
+
+  // Other code may have changed the bound texture / VAO since
+  // the last time the queue ran, so bind them at least once.
+  texture* bound_tex = 0;
+  bool tex_bound = false;
+  GLuint bound_vao = 0;
+  bool vao_bound = false;
+  int cur_pass = -1;
+  bool prepassed = false;
+  int group_start = 0;
+  while ( group_start < n ) {
+    draw_packet& p = packets[ group_start ];
+    int pass = ( p.key >> BRLA_KEY_PASS_SHIFT ) & BRLA_KEY_PASS_MASK;
+    if ( pass != cur_pass ) {
+      if ( cur_pass >= 0 ) { end_pass_timer(); }
+      begin_pass_timer( pass );
+      if ( pass == BRLA_PASS_DEPTH ) {
+        // Only write depth values in the pre-pass.
+        glColorMask( GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE );
+        prepassed = true;
+      }
+      else if ( prepassed ) {
+        // Shade only the fragments which the pre-pass kept.
+        glColorMask( GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE );
+        glDepthFunc( GL_EQUAL );
+        glDepthMask( GL_FALSE );
+      }
+      cur_pass = pass;
+    }
+    bool use_tex = ( pass != BRLA_PASS_DEPTH );
+    int group_end = group_start + 1;
+    while ( group_end < n &&
+            packets[ group_end ].program == p.program &&
+            ( !use_tex || packets[ group_end ].u->tex == p.u->tex ) &&
+            packets[ group_end ].u->m == p.u->m ) {
+      group_end += 1;
+    }
+
+    if ( p.program != g->s_man->cur_shader ) {
+      g->s_man->swap_shader( p.program );
+      stats.program_switches += 1;
+      // The sampler uniform is per-program, so set it again.
+      tex_bound = false;
+    }
+    if ( use_tex && p.u->tex &&
+         ( !tex_bound || p.u->tex != bound_tex ) ) {
+      p.u->bind_texture();
+      bound_tex = p.u->tex;
+      tex_bound = true;
+      stats.texture_binds += 1;
+    }
+    if ( !vao_bound || p.u->m->vao != bound_vao ) {
+      glBindVertexArray( p.u->m->vao );
+      bound_vao = p.u->m->vao;
+      vao_bound = true;
+      stats.vao_binds += 1;
+    }
+    glDrawElementsInstancedBaseInstance( GL_TRIANGLES,
+                                         p.u->m->num_indices,
+                                         p.u->m->index_type,
+                                         0,
+                                         group_end - group_start,
+                                         base + group_start );
+    stats.draws += 1;
+    group_start = group_end;
+  }
+  end_pass_timer();
+  if ( prepassed ) {
+    // Restore the default depth / color write state.
+    glColorMask( GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE );
+    glDepthFunc( GL_LESS );
+    glDepthMask( GL_TRUE );
+  }
+  packets.clear();
+}
+
+/**
+ * Finish counting a frame's work: keep its counts in 'last_stats'
+ * and start counting the next frame from zero. The GPU pass times
+ * in 'last_stats' are from the oldest frame still in flight.
+ */
+void render_queue::end_frame() {
+  last_stats = stats;
+  read_pass_timers( last_stats.pass_ms );
+  stats = render_stats();
+}
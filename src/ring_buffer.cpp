@@ -0,0 +1,170 @@
+#include "ring_buffer.h"
+
+/**
+ * Ring buffer constructor: create a buffer for the given binding
+ * target with room for 'frame_bytes' per frame, and sub-ranges
+ * aligned to a multiple of 'align' bytes.
+ */
+ring_buffer::ring_buffer( GLenum buf_target,
+                          GLsizeiptr frame_bytes,
+                          GLint align ) {
+  target = buf_target;
+  alignment = ( align > 0 ) ? align : 1;
+  for ( int i = 0; i < BRLA_RING_FRAMES; ++i ) { fences[ i ] = 0; }
+  create( frame_bytes );
+}
+
+/** Ring buffer destructor: delete the fences and the buffer. */
+ring_buffer::~ring_buffer() { destroy(); }
+
+/**
+ * Allocate the buffer's storage, and map it persistently
+ * if the driver supports that.
+ */
+void ring_buffer::create( GLsizeiptr frame_bytes ) {
+  region_size = ( ( frame_bytes + alignment - 1 ) / alignment ) *
+                alignment;
+  GLsizeiptr total = region_size * BRLA_RING_FRAMES;
+  glGenBuffers( 1, &buffer );
+  glBindBuffer( target, buffer );
+  if ( GLEW_ARB_buffer_storage ) {
+    GLbitfield flags = GL_MAP_WRITE_BIT |
+                       GL_MAP_PERSISTENT_BIT |
+                       GL_MAP_COHERENT_BIT;
+    glBufferStorage( target, total, NULL, flags );
+    mapped = ( unsigned char* )glMapBufferRange( target, 0, total, flags );
+    if ( !mapped ) {
+      log_error( "[WARNING] Could not map a ring buffer persistently; "
+                 "mapping each write instead.\n" );
+    }
+  }
+  else {
+    glBufferData( target, total, NULL, GL_STREAM_DRAW );
+  }
+  region = 0;
+  offset = 0;
+}
+
+/** Wait for the GPU to finish with every region, then delete it. */
+void ring_buffer::destroy() {
+  for ( int i = 0; i < BRLA_RING_FRAMES; ++i ) { wait( i ); }
+  if ( buffer ) {
+    if ( mapped ) {
+      glBindBuffer( target, buffer );
+      glUnmapBuffer( target );
+      mapped = 0;
+    }
+    glDeleteBuffers( 1, &buffer );
+    buffer = 0;
+  }
+}
+
+/**
+ * Block until the GPU has finished with a region,
+ * if it was fenced, and then delete its fence.
+ */
+void ring_buffer::wait( int r ) {
+  if ( !fences[ r ] ) { return; }
+  GLenum status = GL_TIMEOUT_EXPIRED;
+  while ( status == GL_TIMEOUT_EXPIRED ) {
+    status = glClientWaitSync( fences[ r ],
+                               GL_SYNC_FLUSH_COMMANDS_BIT,
+                               BRLA_RING_WAIT_NS );
+  }
+  if ( status == GL_WAIT_FAILED ) {
+    log_error( "[ERROR] Ring buffer fence wait failed.\n" );
+  }
+  glDeleteSync( fences[ r ] );
+  fences[ r ] = 0;
+}
+
+/**
+ * Helper method to claim the next aligned sub-range of this frame's
+ * region, and return a pointer to write it through. 'buf_offset' is
+ * set to the sub-range's byte offset from the start of the buffer.
+ * Returns null if the region does not have room for it; otherwise
+ * 'unmap_range' must be called once the sub-range is written.
+ */
+unsigned char* ring_buffer::map_range( GLsizeiptr size,
+                                       GLintptr& buf_offset ) {
+  GLsizeiptr start = ( ( offset + alignment - 1 ) / alignment ) *
+                     alignment;
+  if ( start + size > region_size ) { return 0; }
+  buf_offset = region * region_size + start;
+  unsigned char* dst = 0;
+  if ( mapped ) { dst = mapped + buf_offset; }
+  else {
+    glBindBuffer( target, buffer );
+    dst = ( unsigned char* )glMapBufferRange( target, buf_offset, size,
+                                              GL_MAP_WRITE_BIT |
+                                              GL_MAP_INVALIDATE_RANGE_BIT |
+                                              GL_MAP_UNSYNCHRONIZED_BIT );
+    if ( !dst ) { return 0; }
+  }
+  offset = start + size;
+  return dst;
+}
+
+/** Helper method to finish writing a sub-range from 'map_range'. */
+void ring_buffer::unmap_range() {
+  if ( !mapped ) { glUnmapBuffer( target ); }
+}
+
+/**
+ * Copy data into the next aligned sub-range of this frame's region.
+ * Returns the sub-range's byte offset from the start of the buffer,
+ * or -1 if the region does not have room for it.
+ */
+GLintptr ring_buffer::write( const void* data, GLsizeiptr size ) {
+  GLintptr buf_offset = 0;
+  unsigned char* dst = map_range( size, buf_offset );
+  if ( !dst ) { return -1; }
+  memcpy( dst, data, size );
+  unmap_range();
+  return buf_offset;
+}
+
+/**
+ * Copy rows of image data into the next aligned sub-range of this
+ * frame's region, last row first. Images are stored top row first,
+ * but OpenGL reads textures bottom row first, so this flips them
+ * as part of the copy that the upload needs anyway.
+ * Returns the same as 'write'.
+ */
+GLintptr ring_buffer::write_rows_flipped( const unsigned char* data,
+                                          GLsizeiptr row_size,
+                                          int rows ) {
+  GLintptr buf_offset = 0;
+  unsigned char* dst = map_range( row_size * rows, buf_offset );
+  if ( !dst ) { return -1; }
+  for ( int r = 0; r < rows; ++r ) {
+    memcpy( dst + r * row_size,
+            data + ( rows - 1 - r ) * row_size,
+            row_size );
+  }
+  unmap_range();
+  return buf_offset;
+}
+
+/**
+ * Finish writing the current frame's region: fence the commands
+ * which read it, then move on to the next region, waiting for the
+ * GPU to finish reading that one from 'BRLA_RING_FRAMES' ago.
+ */
+void ring_buffer::advance_frame() {
+  if ( fences[ region ] ) { glDeleteSync( fences[ region ] ); }
+  fences[ region ] = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+  region = ( region + 1 ) % BRLA_RING_FRAMES;
+  wait( region );
+  offset = 0;
+}
+
+/**
+ * Replace the buffer with a larger one, with room for at least
+ * 'frame_bytes' per frame. This waits for the GPU, so it should
+ * be rare; callers must re-bind the new buffer object.
+ */
+void ring_buffer::grow( GLsizeiptr frame_bytes ) {
+  destroy();
+  create( frame_bytes );
+}
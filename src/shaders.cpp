@@ -1,10 +1,65 @@
 #include "shaders.h"
 
+/** Uniform names, indexed by 'shader_uniforms' handles. */
+static const char* uniform_names[ BRLA_NUM_UNIFORMS ] = {
+  "texture_sampler",
+  "shadow_depth_map_sampler",
+  "depth_tex_sampler",
+  "px_scale",
+  "cluster_sampler",
+  "gbuf_albedo_sampler",
+  "gbuf_normal_sampler"
+};
+
+/** UBO block names, indexed by 'shader_ubo_blocks' handles. */
+static const char* ubo_block_names[ BRLA_NUM_UBO_BLOCKS ] = {
+  "world_ubo",
+  "cam_ubo",
+  "phong_ubo",
+  "cluster_ubo",
+  "shadow_views_ubo",
+  "particles_ubo",
+  "shadow_lights_ubo"
+};
+
+/**
+ * Add bytes to a 64-bit FNV-1a hash.
+ */
+static uint64_t hash_bytes( uint64_t hash, const void* data, size_t len ) {
+  const unsigned char* bytes = ( const unsigned char* )data;
+  for ( size_t i = 0; i < len; ++i ) {
+    hash ^= bytes[ i ];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
 /**
- * Shader manager constructor. Currently empty,
- * the class doesn't need to initialize anything internally.
+ * Add a string to a 64-bit FNV-1a hash, including its
+ * terminator so that adjacent strings cannot run together.
  */
-shader_manager::shader_manager() {}
+static uint64_t hash_string( uint64_t hash, const char* str ) {
+  return hash_bytes( hash, str, strlen( str ) + 1 );
+}
+
+/**
+ * Shader manager constructor. Check whether the driver can save
+ * program binaries, and hash the renderer / driver version, which
+ * every cached binary is tied to. If the driver can compile shaders
+ * on background threads, let it use as many as it likes.
+ */
+shader_manager::shader_manager() {
+  parallel_compile = GLEW_KHR_parallel_shader_compile;
+  if ( parallel_compile ) { glMaxShaderCompilerThreadsKHR( 0xFFFFFFFF ); }
+  GLint num_formats = 0;
+  glGetIntegerv( GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats );
+  binary_cache = ( num_formats > 0 );
+  const char* renderer = ( const char* )glGetString( GL_RENDERER );
+  const char* version = ( const char* )glGetString( GL_VERSION );
+  driver_hash = 0xcbf29ce484222325ULL;
+  driver_hash = hash_string( driver_hash, renderer ? renderer : "" );
+  driver_hash = hash_string( driver_hash, version ? version : "" );
+}
 
 /**
  * Shader manager destructor. Deletes any shader programs in
@@ -15,6 +70,12 @@ shader_manager::~shader_manager() {
   // not be attempted in this state, but we _are_ about to
   // delete all of the currently-compiled shader programs.
   glUseProgram( 0 );
+  // Delete the shaders of programs which were never used.
+  for ( auto p_iter = pending.begin();
+        p_iter != pending.end();
+        ++p_iter ) {
+    release_shaders( p_iter->second );
+  }
   // Delete all of the currently-compiled shader programs. :)
   for ( auto sh_iter = shader_map.begin();
         sh_iter != shader_map.end();
@@ -25,37 +86,51 @@ shader_manager::~shader_manager() {
 }
 
 /**
- * Helper method to load a shader by filename, and compile it.
- * This method is protected, because it should only be called
- * by the shader manager as part of the process of compiling
- * a full shader program.
+ * Add a '#define' to the source of every shader program which is
+ * built after this is called. This is for limits which are only
+ * known once the OpenGL context exists.
  */
-void shader_manager::load_shader( const char* s_fn, GLuint s ) {
-  // TODO: Use the 'util.h' 'read_from_file' method?
-  // Open the shader file for reading with an input stream.
-  std::ifstream file;
-  file.open( s_fn, std::ios::in );
-  if ( !file ) { printf( "Couldn't open file\n" ); return; }
-  // Read the contents of the file.
-  unsigned long len = get_file_length( file );
-  char* contents = new char[ len + 1 ];
-  const char* c_contents;
-  file.read( contents, len );
-  // Better safe than sorry; null-terminate the C-string.
-  contents[ len ] = '\0';
-  c_contents = contents;
+void shader_manager::add_define( string name, int value ) {
+  defines += "#define " + name + " " + std::to_string( value ) + "\n";
+}
 
-  // Try to compile the shader.
-  glShaderSource( s, 1, &c_contents, NULL );
-  glCompileShader( s );
+/**
+ * Helper method to read a shader stage's source file, and insert
+ * the '#define's after its '#version' line. A '#line' directive
+ * follows them, so that compile logs still match the file's lines.
+ * Returns false if the file could not be read.
+ */
+bool shader_manager::load_source( shader_stage& stage ) {
+  stage.src = read_from_file( stage.fn.c_str() );
+  if ( stage.src.empty() ) {
+    log_error( "ERROR: Couldn't open shader file '%s'\n",
+               stage.fn.c_str() );
+    return false;
+  }
+  if ( !defines.empty() ) {
+    size_t eol = stage.src.find( '\n' );
+    if ( eol != string::npos ) {
+      stage.src.insert( eol + 1, defines + "#line 2\n" );
+    }
+  }
+  return true;
+}
 
+/**
+ * Helper method to log a shader stage's errors, if it did not
+ * compile. This method is protected, because it should only be
+ * called by the shader manager as part of the process of
+ * building a full shader program.
+ */
+void shader_manager::check_compile( const shader_stage& stage,
+                                    GLuint s ) {
   // Log shader errors if compilation failed.
   // TODO: Make a separate method for this or use 'log_shader_errors'?
   int params = -1;
   glGetShaderiv( s, GL_COMPILE_STATUS, &params );
   if ( GL_TRUE != params ) {
     log_error( "ERROR: GLSL shader '%s'(%i) did not compile\n",
-               s_fn, s );
+               stage.fn.c_str(), s );
     int actual_length = 0;
     char glsl_log[ GL_SHADER_LOG_LEN ];
     glGetShaderInfoLog( s, GL_SHADER_LOG_LEN,
@@ -77,35 +152,339 @@ void shader_manager::load_shader( const char* s_fn, GLuint s ) {
 void shader_manager::add_shader_prog( string key,
                                       string vert_fn,
                                       string frag_fn ) {
-  // Shaders are small enough and few enough that I'm not
-  // going to worry about re-using individual v/f shaders.
-  // Compile the vertex and fragment shaders.
-  GLuint vert_shader = glCreateShader( GL_VERTEX_SHADER );
-  load_shader( vert_fn.c_str(), vert_shader );
-  GLuint frag_shader = glCreateShader( GL_FRAGMENT_SHADER );
-  load_shader( frag_fn.c_str(), frag_shader );
-
-  // Create a new shader program, attach the vertex / fragment
-  // shaders, and link them. TODO: Error checking with cleanup
-  // and early returns?
-  GLuint shader_prog = glCreateProgram();
-  glAttachShader( shader_prog, vert_shader );
-  glAttachShader( shader_prog, frag_shader );
-  glLinkProgram( shader_prog );
+  add_shader_prog( key, vert_fn, "", frag_fn );
+}
 
-  // Log shader errors, if any.
-  g->log_shader_errors( shader_prog );
+/**
+ * Compile a shader program consisting of a vertex shader, a
+ * geometry shader, and a fragment shader, then store it in the
+ * shader manager's hash map of available shader programs with
+ * the given string key. The geometry shader is left out if its
+ * filename is empty.
+ */
+void shader_manager::add_shader_prog( string key,
+                                      string vert_fn,
+                                      string geom_fn,
+                                      string frag_fn ) {
+  vector<shader_stage> stages;
+  stages.push_back( { GL_VERTEX_SHADER, vert_fn, "" } );
+  if ( !geom_fn.empty() ) {
+    stages.push_back( { GL_GEOMETRY_SHADER, geom_fn, "" } );
+  }
+  stages.push_back( { GL_FRAGMENT_SHADER, frag_fn, "" } );
+  add_prog( key, stages, 0 );
+}
 
-  // Unlink and delete the vertex/fragment shaders.
-  // (This does not delete the shader program itself)
-  glDetachShader( shader_prog, vert_shader );
-  glDetachShader( shader_prog, frag_shader );
-  glDeleteShader( vert_shader );
-  glDeleteShader( frag_shader );
+/**
+ * Compile a 'transform feedback' shader program, which has only
+ * a vertex shader. The named vertex shader outputs are captured,
+ * interleaved, into the bound transform feedback buffer instead
+ * of being drawn. Store it in the shader manager's hash map of
+ * available shader programs with the given string key.
+ */
+void shader_manager::add_feedback_prog( string key,
+                                        string vert_fn,
+                                        const vector<string>& varyings ) {
+  vector<shader_stage> stages;
+  stages.push_back( { GL_VERTEX_SHADER, vert_fn, "" } );
+  add_prog( key, stages, &varyings );
+}
+
+/**
+ * Helper method to start building a shader program from its stages'
+ * source files, with the given transform feedback outputs if any,
+ * and map it with the given key. If a program binary was saved for
+ * the same sources and driver, it is loaded instead of compiling the
+ * stages. Either way, the program's status is not checked until it
+ * is first used, or 'finish_programs' is called; so the driver can
+ * build every program at once, instead of one after another.
+ */
+void shader_manager::add_prog( string key,
+                               vector<shader_stage>& stages,
+                               const vector<string>* varyings ) {
+  // Hash the driver, the sources, and the feedback outputs.
+  uint64_t hash = driver_hash;
+  for ( int i = 0; i < stages.size(); ++i ) {
+    load_source( stages[ i ] );
+    hash = hash_bytes( hash, &stages[ i ].type, sizeof( GLenum ) );
+    hash = hash_string( hash, stages[ i ].src.c_str() );
+  }
+  if ( varyings ) {
+    for ( int i = 0; i < varyings->size(); ++i ) {
+      hash = hash_string( hash, ( *varyings )[ i ].c_str() );
+    }
+  }
+
+  pending_program p;
+  p.hash = hash;
+  p.stages = stages;
+  if ( varyings ) { p.varyings = *varyings; }
+  p.prog = load_program_binary( hash );
+  if ( p.prog ) { p.from_binary = true; }
+  else {
+    p.prog = glCreateProgram();
+    submit_compile( p );
+  }
 
   // Map the shader program in the shader manager.
   evict_mapping( key );
-  shader_map[ key ] = shader_prog;
+  shader_map[ key ] = p.prog;
+  pending[ p.prog ] = p;
+}
+
+/**
+ * Helper method to compile a pending program's stages and link
+ * them, without waiting for either step to finish.
+ */
+void shader_manager::submit_compile( pending_program& p ) {
+  // Shaders are small enough and few enough that I'm not
+  // going to worry about re-using individual shaders.
+  // Compile each stage, attach them, and link them.
+  for ( int i = 0; i < p.stages.size(); ++i ) {
+    GLuint s = glCreateShader( p.stages[ i ].type );
+    const char* c_contents = p.stages[ i ].src.c_str();
+    glShaderSource( s, 1, &c_contents, NULL );
+    glCompileShader( s );
+    glAttachShader( p.prog, s );
+    p.shaders.push_back( s );
+  }
+  if ( !p.varyings.empty() ) {
+    vector<const char*> names;
+    for ( int i = 0; i < p.varyings.size(); ++i ) {
+      names.push_back( p.varyings[ i ].c_str() );
+    }
+    glTransformFeedbackVaryings( p.prog,
+                                 names.size(),
+                                 &names[ 0 ],
+                                 GL_INTERLEAVED_ATTRIBS );
+  }
+  if ( binary_cache ) {
+    glProgramParameteri( p.prog,
+                         GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+                         GL_TRUE );
+  }
+  glLinkProgram( p.prog );
+}
+
+/**
+ * Helper method to detach and delete a pending program's
+ * individual shaders. (This does not delete the program itself)
+ */
+void shader_manager::release_shaders( pending_program& p ) {
+  for ( int i = 0; i < p.shaders.size(); ++i ) {
+    glDetachShader( p.prog, p.shaders[ i ] );
+    glDeleteShader( p.shaders[ i ] );
+  }
+  p.shaders.clear();
+}
+
+/**
+ * Check whether the driver has finished building a pending
+ * program, without waiting for it. Without the parallel shader
+ * compile extension, there is no way to ask, so this is true.
+ */
+bool shader_manager::program_ready( GLuint shader_prog ) {
+  if ( !parallel_compile ) { return true; }
+  GLint done = GL_TRUE;
+  glGetProgramiv( shader_prog, GL_COMPLETION_STATUS_KHR, &done );
+  return done == GL_TRUE;
+}
+
+/**
+ * Finish building a pending program, waiting for the driver if
+ * necessary: log any compile / link errors, save its binary to the
+ * cache, and look up its uniforms and UBO blocks. A cached binary
+ * which the driver rejects is compiled from source instead.
+ */
+void shader_manager::finish_program( GLuint shader_prog ) {
+  auto p_iter = pending.find( shader_prog );
+  if ( p_iter == pending.end() ) { return; }
+  pending_program p = p_iter->second;
+  pending.erase( p_iter );
+
+  if ( p.from_binary ) {
+    GLint linked = GL_FALSE;
+    glGetProgramiv( p.prog, GL_LINK_STATUS, &linked );
+    if ( linked == GL_TRUE ) {
+      binary_hits += 1;
+      reflect( p.prog );
+      return;
+    }
+    // Usually a driver update; the same program object
+    // is linked again from the sources.
+    log( "[INFO] Cached shader program binary was rejected; "
+         "recompiling.\n" );
+    submit_compile( p );
+  }
+
+  for ( int i = 0; i < p.shaders.size(); ++i ) {
+    check_compile( p.stages[ i ], p.shaders[ i ] );
+  }
+  // Log shader errors, if any.
+  g->log_shader_errors( p.prog );
+  release_shaders( p );
+  save_program_binary( p.prog, p.hash );
+  binary_misses += 1;
+  // Look up its uniforms and UBO blocks once, up front.
+  reflect( p.prog );
+}
+
+/**
+ * Sync point: finish building every pending program. Programs
+ * which the driver has already built are finished first, so that
+ * their binaries are saved while the others are still building.
+ */
+void shader_manager::finish_programs() {
+  while ( !pending.empty() ) {
+    GLuint next = pending.begin()->first;
+    for ( auto p_iter = pending.begin();
+          p_iter != pending.end();
+          ++p_iter ) {
+      if ( program_ready( p_iter->first ) ) {
+        next = p_iter->first;
+        break;
+      }
+    }
+    finish_program( next );
+  }
+  log( "Shader programs: %d loaded from the binary cache, "
+       "%d compiled.\n",
+       binary_hits,
+       binary_misses );
+}
+
+/**
+ * Helper method to get the path of a program binary cache file.
+ */
+string shader_manager::binary_path( uint64_t hash ) {
+  char name[ 32 ];
+  snprintf( name, sizeof( name ), "%016llx%s",
+            ( unsigned long long )hash, BRLA_PROGRAM_CACHE_EXT );
+  return binary_cache_dir + name;
+}
+
+/**
+ * Helper method to create a program from a cached program binary.
+ * Returns 0 if there is no binary for the given hash; then the
+ * program should be compiled.
+ */
+GLuint shader_manager::load_program_binary( uint64_t hash ) {
+  if ( !binary_cache ) { return 0; }
+  FILE* file = fopen( binary_path( hash ).c_str(), "rb" );
+  if ( !file ) { return 0; }
+  program_cache_header hdr;
+  bool ok = ( fread( &hdr, sizeof( hdr ), 1, file ) == 1 &&
+              hdr.magic == BRLA_PROGRAM_CACHE_MAGIC &&
+              hdr.version == BRLA_PROGRAM_CACHE_VERSION &&
+              hdr.hash == hash &&
+              hdr.length > 0 );
+  vector<char> binary;
+  if ( ok ) {
+    binary.resize( hdr.length );
+    ok = ( fread( &binary[ 0 ], hdr.length, 1, file ) == 1 );
+  }
+  fclose( file );
+  if ( !ok ) { return 0; }
+
+  // Whether the driver accepted it is checked in 'finish_program'.
+  GLuint shader_prog = glCreateProgram();
+  glProgramBinary( shader_prog, hdr.format, &binary[ 0 ], hdr.length );
+  return shader_prog;
+}
+
+/**
+ * Helper method to save a newly-linked program's binary to the
+ * cache, so that it can be loaded on the next launch.
+ */
+void shader_manager::save_program_binary( GLuint shader_prog,
+                                          uint64_t hash ) {
+  if ( !binary_cache ) { return; }
+  GLint linked = GL_FALSE;
+  GLint length = 0;
+  glGetProgramiv( shader_prog, GL_LINK_STATUS, &linked );
+  glGetProgramiv( shader_prog, GL_PROGRAM_BINARY_LENGTH, &length );
+  if ( linked != GL_TRUE || length <= 0 ) { return; }
+  vector<char> binary( length );
+  program_cache_header hdr;
+  hdr.magic = BRLA_PROGRAM_CACHE_MAGIC;
+  hdr.version = BRLA_PROGRAM_CACHE_VERSION;
+  hdr.hash = hash;
+  GLenum format = 0;
+  glGetProgramBinary( shader_prog, length, &length, &format, &binary[ 0 ] );
+  hdr.format = format;
+  hdr.length = length;
+
+  // Create the cache directory, if it does not exist yet.
+#ifdef _WIN32
+  _mkdir( binary_cache_dir.c_str() );
+#else
+  mkdir( binary_cache_dir.c_str(), 0755 );
+#endif
+  FILE* file = fopen( binary_path( hash ).c_str(), "wb" );
+  if ( !file ) {
+    log_error( "[WARNING] Couldn't write shader program cache '%s'\n",
+               binary_path( hash ).c_str() );
+    return;
+  }
+  fwrite( &hdr, sizeof( hdr ), 1, file );
+  fwrite( &binary[ 0 ], length, 1, file );
+  fclose( file );
+}
+
+/**
+ * Helper method to record a newly-linked shader program's uniform
+ * locations and UBO block indices in the 'reflections' map.
+ * The blocks' binding points are fixed with 'layout(binding = N)'
+ * in the GLSL, matching the 'shader_ubo_blocks' handles.
+ * Samplers which always read the same texture unit are also
+ * pointed at it here, since that is per-program state.
+ */
+void shader_manager::reflect( GLuint shader_prog ) {
+  shader_reflection refl;
+  for ( int i = 0; i < BRLA_NUM_UNIFORMS; ++i ) {
+    refl.uniforms[ i ] =
+      glGetUniformLocation( shader_prog, uniform_names[ i ] );
+  }
+  for ( int i = 0; i < BRLA_NUM_UBO_BLOCKS; ++i ) {
+    GLuint block_index =
+      glGetUniformBlockIndex( shader_prog, ubo_block_names[ i ] );
+    if ( block_index == GL_INVALID_INDEX ) {
+      refl.blocks[ i ] = -1;
+      continue;
+    }
+    refl.blocks[ i ] = ( GLint )block_index;
+  }
+  if ( refl.uniforms[ BRLA_UNIFORM_SHADOW_SAMPLER ] >= 0 ) {
+    glProgramUniform1i( shader_prog,
+                        refl.uniforms[ BRLA_UNIFORM_SHADOW_SAMPLER ],
+                        g->t_man->num_textures +
+                        BRLA_SHADOW_DEPTH_TEX_IND );
+  }
+  if ( refl.uniforms[ BRLA_UNIFORM_CLUSTER_SAMPLER ] >= 0 ) {
+    glProgramUniform1i( shader_prog,
+                        refl.uniforms[ BRLA_UNIFORM_CLUSTER_SAMPLER ],
+                        g->t_man->num_textures +
+                        BRLA_CLUSTER_TEX_IND );
+  }
+  if ( refl.uniforms[ BRLA_UNIFORM_DEPTH_SAMPLER ] >= 0 ) {
+    glProgramUniform1i( shader_prog,
+                        refl.uniforms[ BRLA_UNIFORM_DEPTH_SAMPLER ],
+                        g->t_man->num_textures +
+                        BRLA_GBUF_DEPTH_TEX_IND );
+  }
+  if ( refl.uniforms[ BRLA_UNIFORM_GBUF_ALBEDO_SAMPLER ] >= 0 ) {
+    glProgramUniform1i( shader_prog,
+                        refl.uniforms[ BRLA_UNIFORM_GBUF_ALBEDO_SAMPLER ],
+                        g->t_man->num_textures +
+                        BRLA_GBUF_ALBEDO_TEX_IND );
+  }
+  if ( refl.uniforms[ BRLA_UNIFORM_GBUF_NORMAL_SAMPLER ] >= 0 ) {
+    glProgramUniform1i( shader_prog,
+                        refl.uniforms[ BRLA_UNIFORM_GBUF_NORMAL_SAMPLER ],
+                        g->t_man->num_textures +
+                        BRLA_GBUF_NORMAL_TEX_IND );
+  }
+  reflections[ shader_prog ] = refl;
 }
 
 /**
@@ -123,10 +502,17 @@ void shader_manager::evict_mapping( string key ) {
     // deactivate it before deletion.
     if ( cur_shader == sh_iter->second ) {
       cur_shader = 0;
+      cur_reflection = 0;
       glUseProgram( 0 );
     }
 
-    // Delete the shader program and remove it from the hash map.
+    // Delete the shader program and remove it from the hash maps.
+    auto p_iter = pending.find( shader_prog );
+    if ( p_iter != pending.end() ) {
+      release_shaders( p_iter->second );
+      pending.erase( p_iter );
+    }
+    reflections.erase( shader_prog );
     glDeleteProgram( shader_prog );
     shader_map.erase( key );
   }
@@ -146,22 +532,21 @@ GLuint shader_manager::get( string key ) {
 
 /**
  * Helper method to switch active shaders, given the OpenGL ID
- * of the new shader.
+ * of the new shader. If the program is still being built, this
+ * waits for it. The shared Uniform Buffer Objects stay bound
+ * to fixed binding points and are written once per frame by
+ * 'game::write_frame_ubos', so this is only a program switch.
  */
 void shader_manager::swap_shader( GLuint shader ) {
+  // Finish building the program, if this is its first use.
+  if ( !pending.empty() ) { finish_program( shader ); }
   // Update the shader manager's record of the current shader program.
   cur_shader = shader;
+  auto r_iter = reflections.find( shader );
+  if ( r_iter == reflections.end() ) { cur_reflection = 0; }
+  else { cur_reflection = &r_iter->second; }
   // Tell OpenGL to use the new shader program.
   glUseProgram( shader );
-
-  // Update Uniform Buffer Objects in the new shader program.
-  g->write_world_ubo();
-  // Update shader values associated with the camera and lighting,
-  // but only if an active camera exists.
-  if (g->c_man->active_camera) {
-    g->c_man->update_cam_ubo();
-    g->l_man->update();
-  }
 }
 
 /**
@@ -171,3 +556,22 @@ void shader_manager::swap_shader( GLuint shader ) {
 void shader_manager::swap_shader( string key ) {
   swap_shader( get( key ) );
 }
+
+/**
+ * Retrieve the location of a uniform in the current shader program,
+ * given a 'shader_uniforms' handle. Returns -1 if the program
+ * does not use that uniform, like 'glGetUniformLocation' would.
+ */
+GLint shader_manager::uniform( int handle ) {
+  if ( !cur_reflection ) { return -1; }
+  return cur_reflection->uniforms[ handle ];
+}
+
+/**
+ * Check whether the current shader program uses a UBO block,
+ * given a 'shader_ubo_blocks' handle.
+ */
+bool shader_manager::has_block( int handle ) {
+  if ( !cur_reflection ) { return false; }
+  return cur_reflection->blocks[ handle ] >= 0;
+}
@@ -0,0 +1,213 @@
+#include "shadow_atlas.h"
+
+/**
+ * Compact every other bit of a Z-order index into one coordinate.
+ */
+static int morton_coord( unsigned int m ) {
+  m &= 0x55555555;
+  m = ( m | ( m >> 1 ) ) & 0x33333333;
+  m = ( m | ( m >> 2 ) ) & 0x0F0F0F0F;
+  m = ( m | ( m >> 4 ) ) & 0x00FF00FF;
+  m = ( m | ( m >> 8 ) ) & 0x0000FFFF;
+  return ( int )m;
+}
+
+/**
+ * Shadow atlas constructor: create the depth texture and the
+ * framebuffer which draws into it. The texture stays bound to the
+ * shadow map texture unit, which the shaders' samplers point at.
+ */
+shadow_atlas::shadow_atlas( int atlas_res ) {
+  res = atlas_res;
+
+  glGenFramebuffers( 1, &fbuf );
+  glBindFramebuffer( GL_FRAMEBUFFER, fbuf );
+
+  glGenTextures( 1, &depth_tex );
+  glActiveTexture( GL_TEXTURE0 +
+                   g->t_man->num_textures +
+                   BRLA_SHADOW_DEPTH_TEX_IND );
+  glBindTexture( GL_TEXTURE_2D, depth_tex );
+  glTexImage2D( GL_TEXTURE_2D,
+                0,
+                GL_DEPTH_COMPONENT24,
+                res,
+                res,
+                0,
+                GL_DEPTH_COMPONENT,
+                GL_UNSIGNED_INT,
+                NULL );
+  // Nearest filtering keeps samples from bleeding between tiles.
+  glTexParameteri( GL_TEXTURE_2D,
+                   GL_TEXTURE_MIN_FILTER,
+                   GL_NEAREST );
+  glTexParameteri( GL_TEXTURE_2D,
+                   GL_TEXTURE_MAG_FILTER,
+                   GL_NEAREST );
+  glTexParameteri( GL_TEXTURE_2D,
+                   GL_TEXTURE_WRAP_S,
+                   GL_CLAMP_TO_EDGE );
+  glTexParameteri( GL_TEXTURE_2D,
+                   GL_TEXTURE_WRAP_T,
+                   GL_CLAMP_TO_EDGE );
+
+  glFramebufferTexture2D( GL_FRAMEBUFFER,
+                          GL_DEPTH_ATTACHMENT,
+                          GL_TEXTURE_2D,
+                          depth_tex,
+                          0 );
+  GLenum draw_bufs[] = { GL_NONE };
+  glDrawBuffers( 1, draw_bufs );
+  glReadBuffer( GL_NONE );
+  GLenum status = glCheckFramebufferStatus( GL_FRAMEBUFFER );
+  if ( GL_FRAMEBUFFER_COMPLETE != status ) {
+    log_error( "[ERROR (shadow_atlas)] Incomplete framebuffer. "
+               "Status code: %i\n",
+               status );
+  }
+  glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+
+  // Each tile drawn in a layered pass needs its own viewport.
+  GLint num_viewports = 0;
+  glGetIntegerv( GL_MAX_VIEWPORTS, &num_viewports );
+  max_views = std::max( 1, std::min( ( int )num_viewports,
+                                     BRLA_MAX_SHADOW_VIEWS ) );
+  memset( shadow_views_ubo_buf, 0, sizeof( shadow_views_ubo_buf ) );
+}
+
+/** Shadow atlas destructor: delete the OpenGL objects. */
+shadow_atlas::~shadow_atlas() {
+  if ( depth_tex ) { glDeleteTextures( 1, &depth_tex ); }
+  if ( fbuf ) { glDeleteFramebuffers( 1, &fbuf ); }
+}
+
+/**
+ * Give atlas tiles to the shadow casters among the buffered lights.
+ * A light's importance is its falloff distance over its distance
+ * from the camera, which tracks how much of the screen it can
+ * light; it asks for a tile in proportion, rounded up to a power
+ * of two. Lights without a tile are drawn unshadowed.
+ */
+void shadow_atlas::allocate( phong_light** lights, int count, v3 c_pos ) {
+  requests.clear();
+  for ( int i = 0; i < count; ++i ) {
+    fb_depth_pass* fb = lights[ i ]->shadow_depth_fb;
+    if ( !fb ) { continue; }
+    fb->tile_size = 0;
+    if ( lights[ i ]->cast_shadows ) { requests.push_back( lights[ i ] ); }
+  }
+  int n = requests.size();
+  if ( n == 0 ) { return; }
+
+  // Sort the requests by importance, most important first.
+  std::sort( requests.begin(), requests.end(),
+             [ &c_pos ]( phong_light* l1, phong_light* l2 ) {
+    float d1 = std::max( distance( c_pos, v3( l1->pos ) ), 0.001f );
+    float d2 = std::max( distance( c_pos, v3( l2->pos ) ), 0.001f );
+    return l1->falloff / d1 > l2->falloff / d2;
+  } );
+  if ( n > BRLA_MAX_SHADOWED_LIGHTS ) {
+    n = BRLA_MAX_SHADOWED_LIGHTS;
+    requests.resize( n );
+  }
+
+  sizes.resize( n );
+  long long total = 0;
+  for ( int i = 0; i < n; ++i ) {
+    float d = std::max( distance( c_pos, v3( requests[ i ]->pos ) ),
+                        0.001f );
+    float coverage = std::min( requests[ i ]->falloff / d, 1.0f );
+    int size = BRLA_SHADOW_TILE_MAX;
+    while ( size > BRLA_SHADOW_TILE_MIN &&
+            size * 0.5f >= BRLA_SHADOW_TILE_MAX * coverage ) {
+      size /= 2;
+    }
+    sizes[ i ] = size;
+    total += ( long long )size * size;
+  }
+
+  // Shrink the least important tiles until they all fit,
+  // and then drop them if that is not enough.
+  long long budget = ( long long )res * res;
+  for ( int i = n - 1; i >= 0 && total > budget; --i ) {
+    while ( sizes[ i ] > BRLA_SHADOW_TILE_MIN && total > budget ) {
+      total -= ( long long )sizes[ i ] * sizes[ i ] * 3 / 4;
+      sizes[ i ] /= 2;
+    }
+  }
+  for ( int i = n - 1; i >= 0 && total > budget; --i ) {
+    total -= ( long long )sizes[ i ] * sizes[ i ];
+    sizes[ i ] = 0;
+  }
+
+  // Place the tiles from largest to smallest along a Z-order curve,
+  // in units of the smallest tile.
+  order.resize( n );
+  for ( int i = 0; i < n; ++i ) { order[ i ] = i; }
+  std::stable_sort( order.begin(), order.end(),
+                    [ this ]( int i1, int i2 ) {
+    return sizes[ i1 ] > sizes[ i2 ];
+  } );
+  unsigned int cursor = 0;
+  for ( int i = 0; i < n; ++i ) {
+    int size = sizes[ order[ i ] ];
+    if ( size == 0 ) { break; }
+    fb_depth_pass* fb = requests[ order[ i ] ]->shadow_depth_fb;
+    fb->tile_x = morton_coord( cursor ) * BRLA_SHADOW_TILE_MIN;
+    fb->tile_y = morton_coord( cursor >> 1 ) * BRLA_SHADOW_TILE_MIN;
+    fb->tile_size = size;
+    int units = size / BRLA_SHADOW_TILE_MIN;
+    cursor += units * units;
+  }
+}
+
+/**
+ * Prepare to draw a layered pass into several lights' tiles: bind
+ * the atlas framebuffer, clear just those tiles' depth values, and
+ * point viewport / scissor box 'i' at the tile of 'views[ i ]'.
+ * Then write each view's shadow matrix to the shadow views UBO.
+ * 'count' must not be more than 'max_views'.
+ */
+void shadow_atlas::begin_views( fb_depth_pass** views, int count ) {
+  glBindFramebuffer( GL_FRAMEBUFFER, fbuf );
+  glEnable( GL_SCISSOR_TEST );
+  // 'glClear' only uses the first scissor box,
+  // so clear the tiles one at a time.
+  for ( int i = 0; i < count; ++i ) {
+    fb_depth_pass* fb = views[ i ];
+    glScissorIndexed( 0, fb->tile_x, fb->tile_y,
+                      fb->tile_size, fb->tile_size );
+    glClear( GL_DEPTH_BUFFER_BIT );
+  }
+  for ( int i = 0; i < count; ++i ) {
+    fb_depth_pass* fb = views[ i ];
+    glViewportIndexedf( i, fb->tile_x, fb->tile_y,
+                        fb->tile_size, fb->tile_size );
+    glScissorIndexed( i, fb->tile_x, fb->tile_y,
+                      fb->tile_size, fb->tile_size );
+    camera* s_cam = fb->shadow_cam;
+    fill_float_buffer(
+      shadow_views_ubo_buf,
+      transpose( s_cam->persp_matrix * s_cam->c_view_matrix ).m,
+      4 + i * 16,
+      16 );
+  }
+  // The whole block is bound, since a range smaller than the
+  // block the shader declares is not allowed.
+  shadow_views_ubo_buf[ 0 ] = ( float )count;
+  g->write_ubo( shadow_views_ubo,
+                shadow_views_ubo_buf,
+                sizeof( shadow_views_ubo_buf ) );
+}
+
+/**
+ * Finish a layered pass, and bind the regular framebuffer again.
+ * 'glViewport' and 'glScissor' reset every indexed viewport and
+ * scissor box, so the next regular draw does not see the tiles.
+ */
+void shadow_atlas::end_views() {
+  glDisable( GL_SCISSOR_TEST );
+  glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+  glViewport( 0, 0, g->g_win_w, g->g_win_h );
+  glScissor( 0, 0, g->g_win_w, g->g_win_h );
+}
@@ -23,12 +23,19 @@ atlas_px_range::atlas_px_range( const char* k,
 }
 
 /**
- * Constructor for a texture object.
+ * Constructor for a texture object. If 'upload' is false, the
+ * image is only decoded, and 'bind' must be called later on the
+ * thread which owns the OpenGL context; so that form of the
+ * constructor is safe to call from a worker thread.
+ * 'keep' sets 'keep_pixels'.
  */
-texture::texture( const char* filename, GLenum gl_tex_slot ) {
+texture::texture( const char* filename, GLenum gl_tex_slot, bool upload,
+                  bool keep ) {
   tex_slot = gl_tex_slot;
   tex_sampler = 0.0f;
-  load_texture( filename );
+  keep_pixels = keep;
+  if ( upload ) { load_texture( filename ); }
+  else { decode_texture( filename ); }
 }
 
 /**
@@ -39,28 +46,56 @@ texture::~texture() {
     glDeleteTextures( 1, &tex );
   }
   if ( tex_buffer ) {
-    delete [] tex_buffer;
+    stbi_image_free( tex_buffer );
   }
+  release_levels();
 }
 
 /**
- * Load a texture using the stb_image library.
+ * Decode a texture file and its mip chain into 'levels', without
+ * touching OpenGL. Returns false on failure.
+ * If the texture has an up-to-date cache file, which may hold
+ * cooked, block compressed levels, its levels are mapped from that.
+ * Otherwise the file is decoded into 'tex_buffer' using the
+ * stb_image library, the smaller levels are filtered from it, and
+ * an uncompressed cache is (re-)built. The pixels are kept top row
+ * first, as they are in the file; they are flipped as they are
+ * copied for the upload instead.
  */
-void texture::load_texture(const char* filename) {
-  // Load the texture from a file.
-  unsigned char* m_tex_buffer = stbi_load( filename,
-                                           &tex_x, &tex_y, &tex_n,
-                                           tex_channels );
-  if ( !m_tex_buffer ) {
+bool texture::decode_texture( const char* filename ) {
+  // Use the texture cache if possible.
+  int format = BRLA_TEX_FORMAT_RGBA8;
+  bool cooked = false;
+  cache = load_texture_cache( filename, levels, format );
+  if ( cache && texture_format_compressed( format ) &&
+       ( keep_pixels || !texture_format_supported( format ) ) ) {
+    // Compressed levels can't be read on the CPU, or this driver
+    // can't sample them; use the source file, but keep the cache.
+    release_levels();
+    cooked = true;
+  }
+  if ( cache ) {
+    tex_format = format;
+    tex_x = levels[ 0 ].w;
+    tex_y = levels[ 0 ].h;
+    tex_n = tex_channels;
+    return true;
+  }
+
+  // Load the texture from a file. 'tex_n' is the file's number of
+  // channels; the pixels always have 'tex_channels' of them.
+  tex_buffer = stbi_load( filename,
+                          &tex_x, &tex_y, &tex_n,
+                          tex_channels );
+  if ( !tex_buffer ) {
     log_error( "[ERROR] STB Image Could not load file: %s\n",
                filename );
-    return;
+    return false;
+  }
+  build_mip_chain( tex_buffer, tex_x, tex_y, mip_buffer, levels );
+  if ( !cooked ) {
+    write_texture_cache( filename, BRLA_TEX_FORMAT_RGBA8, levels );
   }
-  // Shim the malloc'd buffer; I use new.
-  tex_buffer = new unsigned char[ tex_x * tex_y * tex_n ];
-  memcpy( &tex_buffer[ 0 ], &m_tex_buffer[ 0 ],
-          tex_x * tex_y * tex_n );
-  free( m_tex_buffer );
   // This is a handy math trick I found in Anton's OpenGL Tutorials;
   // If x is a power of 2, there's only 1 1 in the whole number.
   // So x-1 will be 0...01...1.
@@ -75,9 +110,15 @@ void texture::load_texture(const char* filename) {
     }
   }
 
-  // Flip the texture vertically, and bind it as the active texture.
-  flip_tex_V(tex_buffer, tex_x, tex_y, tex_n);
-  bind();
+  return true;
+}
+
+/**
+ * Load a texture using the stb_image library,
+ * and bind it as the active texture.
+ */
+void texture::load_texture( const char* filename ) {
+  if ( decode_texture( filename ) ) { bind(); }
 }
 
 /**
@@ -174,19 +215,35 @@ void texture::load_uniform_font_atlas() {
 }
 
 /**
- * Bind the current texture to slot #0, and set some
- * basic texture parameters.
+ * Bind the current texture to slot #0, upload every level of its
+ * decoded mip chain through the texture manager's staging buffer,
+ * and set its filtering parameters. The CPU-side pixels are freed
+ * afterwards; except for the full-size level if 'keep_pixels' is
+ * set, which is left in 'tex_buffer'.
  */
 void texture::bind() {
-  int mipmap_LOD = 0;
+  int num_levels = std::max( 1, ( int )levels.size() );
   glGenTextures( 1, &tex );
   // TODO: Use 'tex_slot' instead of 'GL_TEXTURE0'?
   //glActiveTexture( tex_slot );
   glActiveTexture( GL_TEXTURE0 );
   glBindTexture( GL_TEXTURE_2D, tex );
-  glTexImage2D( GL_TEXTURE_2D, mipmap_LOD, GL_SRGB_ALPHA,
-                tex_x, tex_y, 0, GL_RGBA, GL_UNSIGNED_BYTE,
-                tex_buffer );
+  glTexStorage2D( GL_TEXTURE_2D, num_levels,
+                  texture_gl_format( tex_format ), tex_x, tex_y );
+  for ( int i = 0; i < levels.size(); ++i ) {
+    g->t_man->upload_level( tex_format, i, levels[ i ] );
+  }
+  // 'decode_texture' never keeps compressed levels for these.
+  if ( keep_pixels && !tex_buffer && !levels.empty() ) {
+    // Copy the full-size level out of the cache before it is closed.
+    tex_buffer = ( unsigned char* )malloc( levels[ 0 ].size );
+    memcpy( tex_buffer, levels[ 0 ].data, levels[ 0 ].size );
+  }
+  else if ( !keep_pixels && tex_buffer ) {
+    stbi_image_free( tex_buffer );
+    tex_buffer = 0;
+  }
+  release_levels();
   glTexParameteri( GL_TEXTURE_2D,
                    GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
   glTexParameteri( GL_TEXTURE_2D,
@@ -198,19 +255,31 @@ void texture::bind() {
   glTexParameteri( GL_TEXTURE_2D,
                    GL_TEXTURE_MIN_FILTER, GL_NEAREST );
   */
-  // Bilinear mipmap filtering; smoothed, but sometimes 'muddy', look.
+  // Trilinear filtering across the precomputed mip levels.
   glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
-  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
-  /*
-  glTexParameteri( GL_TEXTURE_2D,
-                   GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
-  glGenerateMipmap( GL_TEXTURE_2D );
-  */
+  glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                   ( num_levels > 1 ) ? GL_LINEAR_MIPMAP_LINEAR :
+                                        GL_LINEAR );
   // Enable max supported level of anisotropic filtering.
-  GLfloat max_anisotropic = 0.0f;
-  glGetFloatv( GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &max_anisotropic );
-  glTexParameterf( GL_TEXTURE_2D,
-                   GL_TEXTURE_MAX_ANISOTROPY_EXT, max_anisotropic );
+  if ( GLEW_EXT_texture_filter_anisotropic ) {
+    GLfloat max_anisotropic = 0.0f;
+    glGetFloatv( GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &max_anisotropic );
+    glTexParameterf( GL_TEXTURE_2D,
+                     GL_TEXTURE_MAX_ANISOTROPY_EXT, max_anisotropic );
+  }
+}
+
+/**
+ * Release the decoded mip chain: close the cache mapping, if any,
+ * and free the smaller levels. 'tex_buffer' is not touched.
+ */
+void texture::release_levels() {
+  levels.clear();
+  vector<unsigned char>().swap( mip_buffer );
+  if ( cache ) {
+    delete cache;
+    cache = 0;
+  }
 }
 
 /**
@@ -227,6 +296,14 @@ texture_manager::texture_manager() {
   num_textures -= 1;
   // And 1 for a shadow depth buffer.
   num_textures -= 1;
+  // And 1 for the clustered lighting data.
+  num_textures -= 1;
+  // And 1 for the deferred renderer's G-buffer normals.
+  num_textures -= 1;
+
+  staging = new ring_buffer( GL_PIXEL_UNPACK_BUFFER,
+                             BRLA_TEX_STAGING_SIZE,
+                             BRLA_TEX_STAGING_ALIGN );
 }
 
 /**
@@ -241,6 +318,46 @@ texture_manager::~texture_manager() {
       tex_iter->second = 0;
     }
   }
+  if ( staging ) { delete staging; }
+}
+
+/**
+ * Upload one mip level into the texture which is bound to
+ * 'GL_TEXTURE_2D'. The level is copied into this frame's region of
+ * the staging buffer, and the texture reads it from there; so the
+ * copy into driver memory and the transfer to the GPU happen
+ * without blocking this thread. RGBA pixels are stored top row
+ * first, and are flipped as they are copied; compressed blocks are
+ * already bottom row first, and are copied as-is.
+ * If the region is full, the staging buffer grows; that waits for
+ * the GPU, but only until it is big enough for a frame's uploads.
+ */
+void texture_manager::upload_level( int format, int level,
+                                    const texture_level& lvl ) {
+  bool compressed = texture_format_compressed( format );
+  GLsizeiptr row_size = lvl.w * 4;
+  GLintptr offset = -1;
+  for ( int attempt = 0; attempt < 2 && offset < 0; ++attempt ) {
+    if ( attempt > 0 ) {
+      GLsizeiptr new_size = staging->region_size * 2;
+      while ( new_size < ( GLsizeiptr )lvl.size ) { new_size *= 2; }
+      staging->grow( new_size );
+    }
+    offset = compressed ?
+             staging->write( lvl.data, lvl.size ) :
+             staging->write_rows_flipped( lvl.data, row_size, lvl.h );
+  }
+  glBindBuffer( GL_PIXEL_UNPACK_BUFFER, staging->buffer );
+  if ( compressed ) {
+    glCompressedTexSubImage2D( GL_TEXTURE_2D, level, 0, 0, lvl.w, lvl.h,
+                               texture_gl_format( format ), lvl.size,
+                               ( void* )offset );
+  }
+  else {
+    glTexSubImage2D( GL_TEXTURE_2D, level, 0, 0, lvl.w, lvl.h,
+                     GL_RGBA, GL_UNSIGNED_BYTE, ( void* )offset );
+  }
+  glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
 }
 
 /**
@@ -255,10 +372,13 @@ void texture_manager::add_mapping( string key, texture* tex ) {
 /**
  * Add a texture mapping to the texture manager by filename.
  * This method loads the texture and adds it to the manager in
- * one step, using the filename as the string key.
+ * one step, using the filename as the string key. If 'keep_pixels'
+ * is set, the decoded pixels stay in the texture's 'tex_buffer'.
  */
-texture* texture_manager::add_mapping_by_fn( string fn ) {
-  texture* tex = new texture( fn.c_str(), GL_TEXTURE0 );
+texture* texture_manager::add_mapping_by_fn( string fn, bool keep_pixels ) {
+  texture* tex = new texture( fn.c_str(), GL_TEXTURE0, false,
+                              keep_pixels );
+  if ( !tex->levels.empty() ) { tex->bind(); }
   evict_mapping( fn );
   tex_fn_map[ fn ] = tex;
   return tex;
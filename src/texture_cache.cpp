@@ -0,0 +1,427 @@
+#include "texture_cache.h"
+
+// Included after this module's header, which 'texture.h' needs
+// to be complete before the rest of the engine's headers are.
+// 'util.h' also decides whether SSE is used.
+#include "mesh_cache.h"
+#include "util.h"
+
+/**
+ * Lookup tables for converting between 8-bit sRGB and linear values.
+ * They are built once, the first time that they are used.
+ */
+struct srgb_tables {
+  /** Linear value of each 8-bit sRGB value. */
+  float to_linear[ 256 ];
+  /** 8-bit sRGB value of 'BRLA_SRGB_LUT_SIZE' steps of [0, 1]. */
+  unsigned char to_srgb[ BRLA_SRGB_LUT_SIZE ];
+
+  /** Build both tables with the exact sRGB transfer functions. */
+  srgb_tables() {
+    for ( int i = 0; i < 256; ++i ) {
+      float c = i / 255.0f;
+      to_linear[ i ] = ( c <= 0.04045f ) ?
+                       c / 12.92f :
+                       powf( ( c + 0.055f ) / 1.055f, 2.4f );
+    }
+    for ( int i = 0; i < BRLA_SRGB_LUT_SIZE; ++i ) {
+      float l = i / ( float )( BRLA_SRGB_LUT_SIZE - 1 );
+      float c = ( l <= 0.0031308f ) ?
+                l * 12.92f :
+                1.055f * powf( l, 1.0f / 2.4f ) - 0.055f;
+      to_srgb[ i ] = ( unsigned char )( c * 255.0f + 0.5f );
+    }
+  }
+};
+
+/**
+ * Get the sRGB lookup tables. Function-local statics are only
+ * initialized once, even when worker threads race to use them.
+ */
+static const srgb_tables& get_srgb_tables() {
+  static srgb_tables tables;
+  return tables;
+}
+
+/**
+ * Round a byte offset up to the texture cache's level alignment.
+ */
+static uint64_t align_tex_cache_offset( uint64_t offset ) {
+  return ( offset + ( BRLA_TEX_CACHE_ALIGN - 1 ) ) &
+         ~( (uint64_t)BRLA_TEX_CACHE_ALIGN - 1 );
+}
+
+/**
+ * Convert 8-bit sRGB RGBA pixels to linear floats. Alpha is
+ * already linear, so it is only scaled to [0, 1].
+ */
+static void decode_srgb( const unsigned char* pixels, int num_px,
+                         float* out ) {
+  const srgb_tables& t = get_srgb_tables();
+  for ( int i = 0; i < num_px * 4; i += 4 ) {
+    out[ i ] = t.to_linear[ pixels[ i ] ];
+    out[ i + 1 ] = t.to_linear[ pixels[ i + 1 ] ];
+    out[ i + 2 ] = t.to_linear[ pixels[ i + 2 ] ];
+    out[ i + 3 ] = pixels[ i + 3 ] / 255.0f;
+  }
+}
+
+/**
+ * Convert linear float RGBA pixels back to 8-bit sRGB.
+ */
+static void encode_srgb( const float* lin, int num_px,
+                         unsigned char* out ) {
+  const srgb_tables& t = get_srgb_tables();
+  const float scale = ( float )( BRLA_SRGB_LUT_SIZE - 1 );
+  for ( int i = 0; i < num_px * 4; i += 4 ) {
+    for ( int c = 0; c < 3; ++c ) {
+      int ind = ( int )( lin[ i + c ] * scale + 0.5f );
+      ind = std::max( 0, std::min( ind, BRLA_SRGB_LUT_SIZE - 1 ) );
+      out[ i + c ] = t.to_srgb[ ind ];
+    }
+    int a = ( int )( lin[ i + 3 ] * 255.0f + 0.5f );
+    out[ i + 3 ] = ( unsigned char )std::max( 0, std::min( a, 255 ) );
+  }
+}
+
+/**
+ * Halve a level of linear float RGBA pixels with a 2x2 box filter.
+ * Odd rows / columns are clamped to the edge, so a 5-pixel side
+ * becomes 2 pixels without reading past the end of a row.
+ * Each pixel is one SSE register, so a whole output pixel is
+ * four vector loads, three adds and a multiply.
+ */
+static void downsample_linear( const float* src, int w, int h,
+                               float* dst, int dst_w, int dst_h ) {
+#ifdef BRLA_USE_SSE
+  const __m128 quarter = _mm_set1_ps( 0.25f );
+#endif
+  for ( int y = 0; y < dst_h; ++y ) {
+    const float* r0 = src + std::min( y * 2, h - 1 ) * w * 4;
+    const float* r1 = src + std::min( y * 2 + 1, h - 1 ) * w * 4;
+    float* out = dst + y * dst_w * 4;
+    for ( int x = 0; x < dst_w; ++x ) {
+      int x0 = std::min( x * 2, w - 1 ) * 4;
+      int x1 = std::min( x * 2 + 1, w - 1 ) * 4;
+#ifdef BRLA_USE_SSE
+      __m128 sum = _mm_add_ps(
+        _mm_add_ps( _mm_loadu_ps( r0 + x0 ), _mm_loadu_ps( r0 + x1 ) ),
+        _mm_add_ps( _mm_loadu_ps( r1 + x0 ), _mm_loadu_ps( r1 + x1 ) ) );
+      _mm_storeu_ps( out + x * 4, _mm_mul_ps( sum, quarter ) );
+#else
+      for ( int c = 0; c < 4; ++c ) {
+        out[ x * 4 + c ] = ( r0[ x0 + c ] + r0[ x1 + c ] +
+                             r1[ x0 + c ] + r1[ x1 + c ] ) * 0.25f;
+      }
+#endif
+    }
+  }
+}
+
+/**
+ * Get the number of mip levels in a full chain for a texture of
+ * the given size, down to 1x1.
+ */
+int mip_level_count( int w, int h ) {
+  int count = 1;
+  int size = std::max( w, h );
+  while ( size > 1 && count < BRLA_TEX_MAX_LEVELS ) {
+    size /= 2;
+    count += 1;
+  }
+  return count;
+}
+
+/**
+ * Build the full mip chain of an RGBA8 sRGB image.
+ * The image becomes level 0, and each smaller level is filtered in
+ * linear space from the one above it, since averaging sRGB values
+ * directly darkens every level. The filtering stays in floats for
+ * the whole chain, so rounding does not add up from level to level.
+ * Smaller levels are written into 'mip_buffer', which 'levels'
+ * then point into; so both must outlive 'levels', as does 'pixels'.
+ */
+void build_mip_chain( const unsigned char* pixels, int w, int h,
+                      vector<unsigned char>& mip_buffer,
+                      vector<texture_level>& levels ) {
+  int num_levels = mip_level_count( w, h );
+  levels.resize( num_levels );
+  levels[ 0 ].w = w;
+  levels[ 0 ].h = h;
+  levels[ 0 ].data = pixels;
+  levels[ 0 ].size = ( size_t )w * h * 4;
+  // Lay out the smaller levels in one buffer.
+  size_t total = 0;
+  vector<size_t> offsets( num_levels, 0 );
+  for ( int i = 1; i < num_levels; ++i ) {
+    levels[ i ].w = std::max( 1, levels[ i - 1 ].w / 2 );
+    levels[ i ].h = std::max( 1, levels[ i - 1 ].h / 2 );
+    levels[ i ].size = ( size_t )levels[ i ].w * levels[ i ].h * 4;
+    offsets[ i ] = total;
+    total += levels[ i ].size;
+  }
+  mip_buffer.resize( total );
+  if ( num_levels < 2 ) { return; }
+
+  vector<float> lin( ( size_t )w * h * 4 );
+  vector<float> half( levels[ 1 ].size );
+  decode_srgb( pixels, w * h, &lin[ 0 ] );
+  for ( int i = 1; i < num_levels; ++i ) {
+    texture_level& prev = levels[ i - 1 ];
+    texture_level& cur = levels[ i ];
+    downsample_linear( &lin[ 0 ], prev.w, prev.h,
+                       &half[ 0 ], cur.w, cur.h );
+    encode_srgb( &half[ 0 ], cur.w * cur.h,
+                 &mip_buffer[ offsets[ i ] ] );
+    cur.data = &mip_buffer[ offsets[ i ] ];
+    lin.swap( half );
+  }
+}
+
+/**
+ * Get the file path of the binary cache for a given texture file.
+ * The cache lives next to the source file, with an extra extension.
+ */
+string texture_cache_fn( const char* tex_fn ) {
+  return string( tex_fn ) + BRLA_TEX_CACHE_EXT;
+}
+
+/**
+ * Write a texture's mip chain to its binary cache file, given the
+ * format which its levels are already in.
+ * The data is written to a temporary file first, so that an
+ * interrupted write never leaves a truncated cache behind.
+ * Returns false if the cache could not be written.
+ */
+bool write_texture_cache( const char* tex_fn, int format,
+                          const vector<texture_level>& levels ) {
+  if ( levels.empty() || levels.size() > BRLA_TEX_MAX_LEVELS ) {
+    return false;
+  }
+  texture_cache_header hdr;
+  memset( &hdr, 0, sizeof( hdr ) );
+  hdr.magic = BRLA_TEX_CACHE_MAGIC;
+  hdr.version = BRLA_TEX_CACHE_VERSION;
+  hdr.width = levels[ 0 ].w;
+  hdr.height = levels[ 0 ].h;
+  hdr.format = format;
+  hdr.num_levels = levels.size();
+  // Record the source file's state, to detect stale caches.
+  if ( !stat_file( tex_fn, hdr.src_mtime, hdr.src_size ) ) {
+    log_error( "Couldn't read texture file: %s\n", tex_fn );
+    return false;
+  }
+  hdr.src_hash = hash_file( tex_fn );
+
+  // Lay out each level at an aligned offset.
+  uint64_t pos = sizeof( hdr );
+  for ( int i = 0; i < levels.size(); ++i ) {
+    hdr.level_offsets[ i ] = align_tex_cache_offset( pos );
+    pos = hdr.level_offsets[ i ] + levels[ i ].size;
+  }
+
+  // Write the header and levels, padding between them.
+  string cache_fn = texture_cache_fn( tex_fn );
+  string tmp_fn = cache_fn + ".tmp";
+  FILE* file = fopen( tmp_fn.c_str(), "wb" );
+  if ( !file ) {
+    log_error( "Couldn't open file for writing: %s\n", tmp_fn.c_str() );
+    return false;
+  }
+  const char zeros[ BRLA_TEX_CACHE_ALIGN ] = { 0 };
+  bool ok = ( fwrite( &hdr, 1, sizeof( hdr ), file ) == sizeof( hdr ) );
+  pos = sizeof( hdr );
+  for ( int i = 0; i < levels.size() && ok; ++i ) {
+    uint64_t pad = hdr.level_offsets[ i ] - pos;
+    if ( pad > 0 ) {
+      ok = ( fwrite( zeros, 1, pad, file ) == pad );
+    }
+    ok = ok && ( fwrite( levels[ i ].data, 1, levels[ i ].size, file ) ==
+                 levels[ i ].size );
+    pos = hdr.level_offsets[ i ] + levels[ i ].size;
+  }
+  ok = ( fclose( file ) == 0 ) && ok;
+  if ( !ok ) {
+    log_error( "Couldn't write texture cache: %s\n", tmp_fn.c_str() );
+    remove( tmp_fn.c_str() );
+    return false;
+  }
+  // Replace the old cache file, if any.
+  remove( cache_fn.c_str() );
+  if ( rename( tmp_fn.c_str(), cache_fn.c_str() ) != 0 ) {
+    log_error( "Couldn't write texture cache: %s\n", cache_fn.c_str() );
+    remove( tmp_fn.c_str() );
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Load a texture's mip chain from its binary cache file, if the
+ * cache exists and is up-to-date; see 'cache_source_current'.
+ * The cache is memory-mapped, and 'levels' point into the mapping,
+ * so the caller must keep the returned mapping open for as long as
+ * it uses them. 'format' is set to the levels' format, which the
+ * caller should check the driver supports.
+ * Returns null if there is no valid cache.
+ */
+mapped_file* load_texture_cache( const char* tex_fn,
+                                 vector<texture_level>& levels,
+                                 int& format ) {
+  string cache_fn = texture_cache_fn( tex_fn );
+  mapped_file* cache = new mapped_file();
+  if ( !cache->open( cache_fn.c_str() ) ) {
+    delete cache;
+    return 0;
+  }
+
+  // Check the header.
+  texture_cache_header hdr;
+  if ( cache->len < sizeof( hdr ) ) {
+    delete cache;
+    return 0;
+  }
+  memcpy( &hdr, cache->data, sizeof( hdr ) );
+  if ( hdr.magic != BRLA_TEX_CACHE_MAGIC ||
+       hdr.version != BRLA_TEX_CACHE_VERSION ) {
+    delete cache;
+    return 0;
+  }
+
+  // Check whether the source file has changed.
+  if ( !cache_source_current( tex_fn, cache_fn.c_str(),
+                              &hdr, sizeof( hdr ), hdr.src_mtime,
+                              hdr.src_size, hdr.src_hash ) ) {
+    delete cache;
+    return 0;
+  }
+
+  // Make sure that the chain is complete and fits inside of the file.
+  bool valid = ( hdr.format < BRLA_NUM_TEX_FORMATS &&
+                 hdr.width > 0 && hdr.height > 0 &&
+                 hdr.num_levels ==
+                   mip_level_count( hdr.width, hdr.height ) );
+  levels.resize( valid ? hdr.num_levels : 0 );
+  int w = hdr.width;
+  int h = hdr.height;
+  for ( int i = 0; i < levels.size() && valid; ++i ) {
+    levels[ i ].w = w;
+    levels[ i ].h = h;
+    levels[ i ].size = texture_level_size( hdr.format, w, h );
+    levels[ i ].data = ( const unsigned char* )cache->data +
+                       hdr.level_offsets[ i ];
+    valid = ( hdr.level_offsets[ i ] + levels[ i ].size <= cache->len );
+    w = std::max( 1, w / 2 );
+    h = std::max( 1, h / 2 );
+  }
+  if ( !valid ) {
+    log_error( "Corrupt texture cache: %s\n", cache_fn.c_str() );
+    levels.clear();
+    delete cache;
+    return 0;
+  }
+  format = hdr.format;
+  return cache;
+}
+
+/**
+ * Decode a texture file, build its mip chain, block compress every
+ * level, and write its binary cache, without creating any OpenGL
+ * objects. Opaque textures become BC1 and others BC3, unless 'bc7'
+ * is set, in which case every texture becomes BC7; which only
+ * drivers with 'ARB_texture_compression_bptc' can load. Each level
+ * is flipped before it is compressed, since blocks can not be
+ * flipped as they are uploaded. Returns false on failure.
+ */
+bool cook_texture( const char* tex_fn, bool bc7 ) {
+  int w, h, n;
+  unsigned char* pixels = stbi_load( tex_fn, &w, &h, &n, 4 );
+  if ( !pixels ) {
+    log_error( "[ERROR] STB Image Could not load file: %s\n", tex_fn );
+    return false;
+  }
+  vector<unsigned char> mip_buffer;
+  vector<texture_level> levels;
+  build_mip_chain( pixels, w, h, mip_buffer, levels );
+  int format = bc7 ? BRLA_TEX_FORMAT_BC7 :
+               has_alpha( pixels, w * h ) ? BRLA_TEX_FORMAT_BC3 :
+                                           BRLA_TEX_FORMAT_BC1;
+
+  // Lay out the compressed levels in one buffer.
+  vector<texture_level> blocks( levels );
+  vector<size_t> offsets( levels.size(), 0 );
+  size_t total = 0;
+  for ( int i = 0; i < blocks.size(); ++i ) {
+    blocks[ i ].size = texture_level_size( format,
+                                           blocks[ i ].w, blocks[ i ].h );
+    offsets[ i ] = total;
+    total += blocks[ i ].size;
+  }
+  vector<unsigned char> block_buffer( total );
+  vector<unsigned char> flipped( levels[ 0 ].size );
+  for ( int i = 0; i < levels.size(); ++i ) {
+    size_t row_size = ( size_t )levels[ i ].w * 4;
+    for ( int r = 0; r < levels[ i ].h; ++r ) {
+      memcpy( &flipped[ r * row_size ],
+              levels[ i ].data + ( levels[ i ].h - 1 - r ) * row_size,
+              row_size );
+    }
+    compress_level( format, &flipped[ 0 ], levels[ i ].w, levels[ i ].h,
+                    &block_buffer[ offsets[ i ] ] );
+    blocks[ i ].data = &block_buffer[ offsets[ i ] ];
+  }
+  bool ok = write_texture_cache( tex_fn, format, blocks );
+  stbi_image_free( pixels );
+  return ok;
+}
+
+/**
+ * Check the block compressors by round-tripping blocks which hold
+ * two colors whose channels vary against each other, like a red /
+ * green edge, in every compressed format. A good encoder keeps both
+ * colors; one which loses the block's axis writes a flat block.
+ * Logs each format's largest channel error, and returns false if
+ * any of them is more than 'BRLA_TEX_CHECK_TOLERANCE'.
+ */
+bool check_texture_compress() {
+  // Two colors per block, alternating every two columns.
+  const unsigned char pairs[][ 2 ][ 4 ] = {
+    { { 255, 0, 0, 255 }, { 0, 255, 0, 255 } },
+    { { 0, 0, 255, 255 }, { 255, 255, 0, 255 } },
+    { { 0, 255, 255, 255 }, { 255, 0, 255, 255 } },
+    { { 255, 255, 255, 0 }, { 0, 0, 0, 255 } }
+  };
+  const int num_pairs = sizeof( pairs ) / sizeof( pairs[ 0 ] );
+  int w = BRLA_TEX_BLOCK_DIM * num_pairs;
+  int h = BRLA_TEX_BLOCK_DIM;
+  vector<unsigned char> pixels( w * h * 4 );
+  for ( int y = 0; y < h; ++y ) {
+    for ( int x = 0; x < w; ++x ) {
+      const unsigned char* c =
+        pairs[ x / BRLA_TEX_BLOCK_DIM ][ ( x / 2 ) % 2 ];
+      memcpy( &pixels[ ( y * w + x ) * 4 ], c, 4 );
+    }
+  }
+
+  bool ok = true;
+  vector<unsigned char> decoded( w * h * 4 );
+  for ( int f = BRLA_TEX_FORMAT_BC1; f < BRLA_NUM_TEX_FORMATS; ++f ) {
+    vector<unsigned char> blocks( texture_level_size( f, w, h ) );
+    compress_level( f, &pixels[ 0 ], w, h, &blocks[ 0 ] );
+    decompress_level( f, &blocks[ 0 ], w, h, &decoded[ 0 ] );
+    // BC1 is opaque, so its alpha is not compared.
+    int channels = ( f == BRLA_TEX_FORMAT_BC1 ) ? 3 : 4;
+    int max_err = 0;
+    for ( int i = 0; i < w * h; ++i ) {
+      for ( int c = 0; c < channels; ++c ) {
+        max_err = std::max( max_err, abs( decoded[ i * 4 + c ] -
+                                          pixels[ i * 4 + c ] ) );
+      }
+    }
+    bool passed = ( max_err <= BRLA_TEX_CHECK_TOLERANCE );
+    log( "Texture format %d: largest error %d (%s)\n",
+         f, max_err, passed ? "ok" : "FAILED" );
+    if ( !passed ) { ok = false; }
+  }
+  return ok;
+}
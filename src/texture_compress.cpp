@@ -0,0 +1,509 @@
+#include "texture_compress.h"
+
+/** Interpolation weights of BC7's 4-bit indices, out of 64. */
+static const int bc7_weights[ 16 ] = { 0, 4, 9, 13, 17, 21, 26, 30,
+                                       34, 38, 43, 47, 51, 55, 60, 64 };
+
+/**
+ * Copy one 4x4 block of RGBA pixels out of a level. Blocks which
+ * hang over the level's edge repeat its last row / column.
+ */
+static void fetch_block( const unsigned char* pixels, int w, int h,
+                         int bx, int by, unsigned char block[ 16 ][ 4 ] ) {
+  for ( int y = 0; y < BRLA_TEX_BLOCK_DIM; ++y ) {
+    int py = std::min( by * BRLA_TEX_BLOCK_DIM + y, h - 1 );
+    for ( int x = 0; x < BRLA_TEX_BLOCK_DIM; ++x ) {
+      int px = std::min( bx * BRLA_TEX_BLOCK_DIM + x, w - 1 );
+      memcpy( block[ y * BRLA_TEX_BLOCK_DIM + x ],
+              &pixels[ ( py * w + px ) * 4 ], 4 );
+    }
+  }
+}
+
+/**
+ * Find the two pixels of a block which lie furthest apart along
+ * the principal axis of its first 'channels' channels; the block's
+ * colors are then interpolated between those two endpoints.
+ * The axis is found with a few rounds of power iteration on the
+ * block's covariance matrix, starting from the covariance row of
+ * the channel which varies the most. A fixed starting axis like
+ * ( 1, 1, 1 ) can be orthogonal to the answer, when the channels
+ * vary against each other (a red / green edge, say). If the axis
+ * still collapses, the diagonal of the block's bounds is used.
+ */
+static void block_extremes( const unsigned char block[ 16 ][ 4 ],
+                            int channels, int& lo, int& hi ) {
+  float mean[ 4 ] = { 0.0f, 0.0f, 0.0f, 0.0f };
+  for ( int i = 0; i < 16; ++i ) {
+    for ( int c = 0; c < channels; ++c ) { mean[ c ] += block[ i ][ c ]; }
+  }
+  for ( int c = 0; c < channels; ++c ) { mean[ c ] /= 16.0f; }
+  float cov[ 4 ][ 4 ] = { { 0.0f } };
+  for ( int i = 0; i < 16; ++i ) {
+    float d[ 4 ];
+    for ( int c = 0; c < channels; ++c ) {
+      d[ c ] = block[ i ][ c ] - mean[ c ];
+    }
+    for ( int r = 0; r < channels; ++r ) {
+      for ( int c = 0; c < channels; ++c ) {
+        cov[ r ][ c ] += d[ r ] * d[ c ];
+      }
+    }
+  }
+  int widest = 0;
+  for ( int c = 1; c < channels; ++c ) {
+    if ( cov[ c ][ c ] > cov[ widest ][ widest ] ) { widest = c; }
+  }
+  float axis[ 4 ] = { 0.0f, 0.0f, 0.0f, 0.0f };
+  for ( int c = 0; c < channels; ++c ) { axis[ c ] = cov[ widest ][ c ]; }
+  // A flat block has no axis; any direction will do.
+  bool collapsed = ( cov[ widest ][ widest ] < 1e-6f );
+  for ( int iter = 0; iter < 8 && !collapsed; ++iter ) {
+    float next[ 4 ] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    float largest = 0.0f;
+    for ( int r = 0; r < channels; ++r ) {
+      for ( int c = 0; c < channels; ++c ) {
+        next[ r ] += cov[ r ][ c ] * axis[ c ];
+      }
+      largest = std::max( largest, fabsf( next[ r ] ) );
+    }
+    if ( largest < 1e-6f ) {
+      // Only rounding can get here, since the block is not flat.
+      unsigned char b_min[ 4 ] = { 255, 255, 255, 255 };
+      unsigned char b_max[ 4 ] = { 0, 0, 0, 0 };
+      for ( int i = 0; i < 16; ++i ) {
+        for ( int c = 0; c < channels; ++c ) {
+          b_min[ c ] = std::min( b_min[ c ], block[ i ][ c ] );
+          b_max[ c ] = std::max( b_max[ c ], block[ i ][ c ] );
+        }
+      }
+      for ( int c = 0; c < channels; ++c ) {
+        axis[ c ] = ( float )( b_max[ c ] - b_min[ c ] );
+      }
+      break;
+    }
+    for ( int c = 0; c < channels; ++c ) { axis[ c ] = next[ c ] / largest; }
+  }
+  float t_lo = 1e30f;
+  float t_hi = -1e30f;
+  lo = hi = 0;
+  for ( int i = 0; i < 16; ++i ) {
+    float t = 0.0f;
+    for ( int c = 0; c < channels; ++c ) { t += block[ i ][ c ] * axis[ c ]; }
+    if ( t < t_lo ) { t_lo = t; lo = i; }
+    if ( t > t_hi ) { t_hi = t; hi = i; }
+  }
+}
+
+/** Round an RGB color to 5:6:5 bits. */
+static uint16_t pack_565( const unsigned char* c ) {
+  return ( uint16_t )( ( ( c[ 0 ] * 31 + 127 ) / 255 ) << 11 |
+                       ( ( c[ 1 ] * 63 + 127 ) / 255 ) << 5 |
+                       ( ( c[ 2 ] * 31 + 127 ) / 255 ) );
+}
+
+/** Expand a 5:6:5 color back to 8 bits per channel. */
+static void unpack_565( uint16_t v, int c[ 3 ] ) {
+  int r = ( v >> 11 ) & 31;
+  int g = ( v >> 5 ) & 63;
+  int b = v & 31;
+  c[ 0 ] = ( r << 3 ) | ( r >> 2 );
+  c[ 1 ] = ( g << 2 ) | ( g >> 4 );
+  c[ 2 ] = ( b << 3 ) | ( b >> 2 );
+}
+
+/**
+ * Encode a block's RGB channels as an 8-byte BC1 color block, in
+ * its 4-color mode. This is also the color half of a BC3 block.
+ */
+static void encode_bc1_block( const unsigned char block[ 16 ][ 4 ],
+                              unsigned char* out ) {
+  int lo, hi;
+  block_extremes( block, 3, lo, hi );
+  uint16_t c0 = pack_565( block[ hi ] );
+  uint16_t c1 = pack_565( block[ lo ] );
+  // The 4-color mode is selected by the first endpoint being larger.
+  if ( c0 < c1 ) { std::swap( c0, c1 ); }
+  uint32_t indices = 0;
+  if ( c0 != c1 ) {
+    int pal[ 4 ][ 3 ];
+    unpack_565( c0, pal[ 0 ] );
+    unpack_565( c1, pal[ 1 ] );
+    for ( int c = 0; c < 3; ++c ) {
+      pal[ 2 ][ c ] = ( 2 * pal[ 0 ][ c ] + pal[ 1 ][ c ] ) / 3;
+      pal[ 3 ][ c ] = ( pal[ 0 ][ c ] + 2 * pal[ 1 ][ c ] ) / 3;
+    }
+    for ( int i = 0; i < 16; ++i ) {
+      int best = 0;
+      int best_err = 1 << 30;
+      for ( int p = 0; p < 4; ++p ) {
+        int err = 0;
+        for ( int c = 0; c < 3; ++c ) {
+          int d = block[ i ][ c ] - pal[ p ][ c ];
+          err += d * d;
+        }
+        if ( err < best_err ) { best_err = err; best = p; }
+      }
+      indices |= ( uint32_t )best << ( i * 2 );
+    }
+  }
+  out[ 0 ] = c0 & 0xFF;
+  out[ 1 ] = c0 >> 8;
+  out[ 2 ] = c1 & 0xFF;
+  out[ 3 ] = c1 >> 8;
+  for ( int b = 0; b < 4; ++b ) {
+    out[ 4 + b ] = ( indices >> ( b * 8 ) ) & 0xFF;
+  }
+}
+
+/**
+ * Encode a block's alpha channel as an 8-byte BC3 alpha block, in
+ * its 8-value mode, between the block's lowest and highest alpha.
+ */
+static void encode_bc3_alpha( const unsigned char block[ 16 ][ 4 ],
+                              unsigned char* out ) {
+  int a0 = 0;
+  int a1 = 255;
+  for ( int i = 0; i < 16; ++i ) {
+    a0 = std::max( a0, ( int )block[ i ][ 3 ] );
+    a1 = std::min( a1, ( int )block[ i ][ 3 ] );
+  }
+  uint64_t indices = 0;
+  if ( a0 != a1 ) {
+    int pal[ 8 ];
+    pal[ 0 ] = a0;
+    pal[ 1 ] = a1;
+    for ( int i = 1; i < 7; ++i ) {
+      pal[ i + 1 ] = ( ( 7 - i ) * a0 + i * a1 ) / 7;
+    }
+    for ( int i = 0; i < 16; ++i ) {
+      int best = 0;
+      int best_err = 1 << 30;
+      for ( int p = 0; p < 8; ++p ) {
+        int err = abs( block[ i ][ 3 ] - pal[ p ] );
+        if ( err < best_err ) { best_err = err; best = p; }
+      }
+      indices |= ( uint64_t )best << ( i * 3 );
+    }
+  }
+  out[ 0 ] = a0;
+  out[ 1 ] = a1;
+  for ( int b = 0; b < 6; ++b ) {
+    out[ 2 + b ] = ( indices >> ( b * 8 ) ) & 0xFF;
+  }
+}
+
+/**
+ * Round an 8-bit RGBA endpoint to BC7 mode 6's 7 bits per channel
+ * plus a shared low bit, picking whichever low bit is closer.
+ */
+static void quantize_bc7_endpoint( const unsigned char* c,
+                                   int q[ 4 ], int& p_bit ) {
+  int best_err = 1 << 30;
+  for ( int p = 0; p < 2; ++p ) {
+    int t[ 4 ];
+    int err = 0;
+    for ( int ch = 0; ch < 4; ++ch ) {
+      t[ ch ] = std::min( ( c[ ch ] - p + 1 ) >> 1, 127 );
+      t[ ch ] = std::max( t[ ch ], 0 );
+      int d = ( ( t[ ch ] << 1 ) | p ) - c[ ch ];
+      err += d * d;
+    }
+    if ( err < best_err ) {
+      best_err = err;
+      memcpy( q, t, sizeof( t ) );
+      p_bit = p;
+    }
+  }
+}
+
+/** Write the low 'count' bits of 'value' at bit 'pos' of a block. */
+static void put_bits( unsigned char* out, int& pos, int value, int count ) {
+  for ( int b = 0; b < count; ++b, ++pos ) {
+    if ( ( value >> b ) & 1 ) { out[ pos >> 3 ] |= 1 << ( pos & 7 ); }
+  }
+}
+
+/**
+ * Encode a block as a 16-byte BC7 block, in mode 6: one RGBA
+ * endpoint pair with 7 bits per channel plus a low bit each, and
+ * 4-bit indices. That is the mode which suits smooth, unpartitioned
+ * blocks best, and it never needs a partition search.
+ */
+static void encode_bc7_block( const unsigned char block[ 16 ][ 4 ],
+                              unsigned char* out ) {
+  int lo, hi;
+  block_extremes( block, 4, lo, hi );
+  int q[ 2 ][ 4 ];
+  int p_bits[ 2 ];
+  quantize_bc7_endpoint( block[ lo ], q[ 0 ], p_bits[ 0 ] );
+  quantize_bc7_endpoint( block[ hi ], q[ 1 ], p_bits[ 1 ] );
+  int pal[ 16 ][ 4 ];
+  for ( int ch = 0; ch < 4; ++ch ) {
+    int e0 = ( q[ 0 ][ ch ] << 1 ) | p_bits[ 0 ];
+    int e1 = ( q[ 1 ][ ch ] << 1 ) | p_bits[ 1 ];
+    for ( int p = 0; p < 16; ++p ) {
+      pal[ p ][ ch ] = ( ( 64 - bc7_weights[ p ] ) * e0 +
+                         bc7_weights[ p ] * e1 + 32 ) >> 6;
+    }
+  }
+  int indices[ 16 ];
+  for ( int i = 0; i < 16; ++i ) {
+    int best_err = 1 << 30;
+    for ( int p = 0; p < 16; ++p ) {
+      int err = 0;
+      for ( int ch = 0; ch < 4; ++ch ) {
+        int d = block[ i ][ ch ] - pal[ p ][ ch ];
+        err += d * d;
+      }
+      if ( err < best_err ) { best_err = err; indices[ i ] = p; }
+    }
+  }
+  // The first index is stored without its top bit, so it must be
+  // in the lower half; if not, swap the endpoints. The weights are
+  // symmetric, so that just mirrors every index.
+  if ( indices[ 0 ] & 8 ) {
+    for ( int ch = 0; ch < 4; ++ch ) {
+      std::swap( q[ 0 ][ ch ], q[ 1 ][ ch ] );
+    }
+    std::swap( p_bits[ 0 ], p_bits[ 1 ] );
+    for ( int i = 0; i < 16; ++i ) { indices[ i ] = 15 - indices[ i ]; }
+  }
+  memset( out, 0, 16 );
+  int pos = 0;
+  put_bits( out, pos, 1 << 6, 7 );
+  for ( int ch = 0; ch < 4; ++ch ) {
+    put_bits( out, pos, q[ 0 ][ ch ], 7 );
+    put_bits( out, pos, q[ 1 ][ ch ], 7 );
+  }
+  put_bits( out, pos, p_bits[ 0 ], 1 );
+  put_bits( out, pos, p_bits[ 1 ], 1 );
+  put_bits( out, pos, indices[ 0 ], 3 );
+  for ( int i = 1; i < 16; ++i ) { put_bits( out, pos, indices[ i ], 4 ); }
+}
+
+/**
+ * Decode an 8-byte BC1 color block into a block's RGB channels,
+ * in either of its modes. Alpha is left alone.
+ */
+static void decode_bc1_block( const unsigned char* in,
+                              unsigned char block[ 16 ][ 4 ] ) {
+  uint16_t c0 = in[ 0 ] | ( in[ 1 ] << 8 );
+  uint16_t c1 = in[ 2 ] | ( in[ 3 ] << 8 );
+  int pal[ 4 ][ 3 ];
+  unpack_565( c0, pal[ 0 ] );
+  unpack_565( c1, pal[ 1 ] );
+  for ( int c = 0; c < 3; ++c ) {
+    if ( c0 > c1 ) {
+      pal[ 2 ][ c ] = ( 2 * pal[ 0 ][ c ] + pal[ 1 ][ c ] ) / 3;
+      pal[ 3 ][ c ] = ( pal[ 0 ][ c ] + 2 * pal[ 1 ][ c ] ) / 3;
+    }
+    else {
+      pal[ 2 ][ c ] = ( pal[ 0 ][ c ] + pal[ 1 ][ c ] ) / 2;
+      pal[ 3 ][ c ] = 0;
+    }
+  }
+  for ( int i = 0; i < 16; ++i ) {
+    int p = ( in[ 4 + i / 4 ] >> ( ( i % 4 ) * 2 ) ) & 3;
+    for ( int c = 0; c < 3; ++c ) { block[ i ][ c ] = pal[ p ][ c ]; }
+  }
+}
+
+/**
+ * Decode an 8-byte BC3 alpha block into a block's alpha channel,
+ * in either of its modes.
+ */
+static void decode_bc3_alpha( const unsigned char* in,
+                              unsigned char block[ 16 ][ 4 ] ) {
+  int a0 = in[ 0 ];
+  int a1 = in[ 1 ];
+  int pal[ 8 ] = { a0, a1, 0, 0, 0, 0, 0, 255 };
+  if ( a0 > a1 ) {
+    for ( int i = 1; i < 7; ++i ) {
+      pal[ i + 1 ] = ( ( 7 - i ) * a0 + i * a1 ) / 7;
+    }
+  }
+  else {
+    for ( int i = 1; i < 5; ++i ) {
+      pal[ i + 1 ] = ( ( 5 - i ) * a0 + i * a1 ) / 5;
+    }
+  }
+  uint64_t indices = 0;
+  for ( int b = 0; b < 6; ++b ) {
+    indices |= ( uint64_t )in[ 2 + b ] << ( b * 8 );
+  }
+  for ( int i = 0; i < 16; ++i ) {
+    block[ i ][ 3 ] = pal[ ( indices >> ( i * 3 ) ) & 7 ];
+  }
+}
+
+/** Read 'count' bits at bit 'pos' of a block, lowest bit first. */
+static int get_bits( const unsigned char* in, int& pos, int count ) {
+  int value = 0;
+  for ( int b = 0; b < count; ++b, ++pos ) {
+    value |= ( ( in[ pos >> 3 ] >> ( pos & 7 ) ) & 1 ) << b;
+  }
+  return value;
+}
+
+/**
+ * Decode a 16-byte BC7 block into a block's RGBA channels. Only
+ * mode 6 is decoded, since that is the only mode which is written;
+ * other modes decode to transparent black. Returns false for them.
+ */
+static bool decode_bc7_block( const unsigned char* in,
+                              unsigned char block[ 16 ][ 4 ] ) {
+  memset( block, 0, 16 * 4 );
+  int pos = 0;
+  if ( get_bits( in, pos, 7 ) != 1 << 6 ) { return false; }
+  int e[ 2 ][ 4 ];
+  for ( int ch = 0; ch < 4; ++ch ) {
+    e[ 0 ][ ch ] = get_bits( in, pos, 7 ) << 1;
+    e[ 1 ][ ch ] = get_bits( in, pos, 7 ) << 1;
+  }
+  int p0 = get_bits( in, pos, 1 );
+  int p1 = get_bits( in, pos, 1 );
+  for ( int ch = 0; ch < 4; ++ch ) {
+    e[ 0 ][ ch ] |= p0;
+    e[ 1 ][ ch ] |= p1;
+  }
+  for ( int i = 0; i < 16; ++i ) {
+    int w = bc7_weights[ get_bits( in, pos, ( i == 0 ) ? 3 : 4 ) ];
+    for ( int ch = 0; ch < 4; ++ch ) {
+      block[ i ][ ch ] = ( ( 64 - w ) * e[ 0 ][ ch ] +
+                           w * e[ 1 ][ ch ] + 32 ) >> 6;
+    }
+  }
+  return true;
+}
+
+/**
+ * Check whether a format is block compressed.
+ */
+bool texture_format_compressed( int format ) {
+  return format != BRLA_TEX_FORMAT_RGBA8;
+}
+
+/**
+ * Get the OpenGL internal format of a texture format.
+ * Every format is sampled as sRGB.
+ */
+GLenum texture_gl_format( int format ) {
+  switch ( format ) {
+    case BRLA_TEX_FORMAT_BC1: return GL_COMPRESSED_SRGB_S3TC_DXT1_EXT;
+    case BRLA_TEX_FORMAT_BC3: return GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT;
+    case BRLA_TEX_FORMAT_BC7: return GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM;
+    default: return GL_SRGB8_ALPHA8;
+  }
+}
+
+/**
+ * Check whether the driver can sample a texture format.
+ */
+bool texture_format_supported( int format ) {
+  switch ( format ) {
+    case BRLA_TEX_FORMAT_BC1:
+    case BRLA_TEX_FORMAT_BC3:
+      return GLEW_EXT_texture_compression_s3tc && GLEW_EXT_texture_sRGB;
+    case BRLA_TEX_FORMAT_BC7:
+      return GLEW_ARB_texture_compression_bptc;
+    default:
+      return true;
+  }
+}
+
+/**
+ * Get the size in bytes of one mip level in a texture format.
+ * Compressed levels are padded out to whole blocks.
+ */
+size_t texture_level_size( int format, int w, int h ) {
+  if ( !texture_format_compressed( format ) ) {
+    return ( size_t )w * h * 4;
+  }
+  size_t blocks_x = ( w + BRLA_TEX_BLOCK_DIM - 1 ) / BRLA_TEX_BLOCK_DIM;
+  size_t blocks_y = ( h + BRLA_TEX_BLOCK_DIM - 1 ) / BRLA_TEX_BLOCK_DIM;
+  size_t blocks = blocks_x * blocks_y;
+  return blocks * ( ( format == BRLA_TEX_FORMAT_BC1 ) ? 8 : 16 );
+}
+
+/**
+ * Check whether any RGBA pixels are not fully opaque.
+ */
+bool has_alpha( const unsigned char* pixels, int num_px ) {
+  for ( int i = 0; i < num_px; ++i ) {
+    if ( pixels[ i * 4 + 3 ] != 255 ) { return true; }
+  }
+  return false;
+}
+
+/**
+ * Compress one level of RGBA pixels into a block compressed format,
+ * one 4x4 block at a time in row order. The blocks keep the rows in
+ * the same order as 'pixels'. 'out' must hold
+ * 'texture_level_size( format, w, h )' bytes.
+ */
+void compress_level( int format, const unsigned char* pixels,
+                     int w, int h, unsigned char* out ) {
+  int blocks_x = ( w + BRLA_TEX_BLOCK_DIM - 1 ) / BRLA_TEX_BLOCK_DIM;
+  int blocks_y = ( h + BRLA_TEX_BLOCK_DIM - 1 ) / BRLA_TEX_BLOCK_DIM;
+  unsigned char block[ 16 ][ 4 ];
+  for ( int by = 0; by < blocks_y; ++by ) {
+    for ( int bx = 0; bx < blocks_x; ++bx ) {
+      fetch_block( pixels, w, h, bx, by, block );
+      if ( format == BRLA_TEX_FORMAT_BC1 ) {
+        encode_bc1_block( block, out );
+        out += 8;
+      }
+      else if ( format == BRLA_TEX_FORMAT_BC3 ) {
+        encode_bc3_alpha( block, out );
+        encode_bc1_block( block, out + 8 );
+        out += 16;
+      }
+      else {
+        encode_bc7_block( block, out );
+        out += 16;
+      }
+    }
+  }
+}
+
+/**
+ * Decompress one level of a block compressed format back into RGBA
+ * pixels, in the same row order that 'compress_level' was given.
+ * BC1 pixels are opaque. This is the inverse of 'compress_level',
+ * used to check the encoders; it is not needed to draw textures.
+ */
+void decompress_level( int format, const unsigned char* in,
+                       int w, int h, unsigned char* pixels ) {
+  int blocks_x = ( w + BRLA_TEX_BLOCK_DIM - 1 ) / BRLA_TEX_BLOCK_DIM;
+  int blocks_y = ( h + BRLA_TEX_BLOCK_DIM - 1 ) / BRLA_TEX_BLOCK_DIM;
+  unsigned char block[ 16 ][ 4 ];
+  for ( int by = 0; by < blocks_y; ++by ) {
+    for ( int bx = 0; bx < blocks_x; ++bx ) {
+      if ( format == BRLA_TEX_FORMAT_BC1 ) {
+        decode_bc1_block( in, block );
+        for ( int i = 0; i < 16; ++i ) { block[ i ][ 3 ] = 255; }
+        in += 8;
+      }
+      else if ( format == BRLA_TEX_FORMAT_BC3 ) {
+        decode_bc3_alpha( in, block );
+        decode_bc1_block( in + 8, block );
+        in += 16;
+      }
+      else {
+        decode_bc7_block( in, block );
+        in += 16;
+      }
+      // Skip the pixels of blocks which hang over the level's edge.
+      for ( int y = 0; y < BRLA_TEX_BLOCK_DIM; ++y ) {
+        int py = by * BRLA_TEX_BLOCK_DIM + y;
+        for ( int x = 0; x < BRLA_TEX_BLOCK_DIM; ++x ) {
+          int px = bx * BRLA_TEX_BLOCK_DIM + x;
+          if ( px >= w || py >= h ) { continue; }
+          memcpy( &pixels[ ( py * w + px ) * 4 ],
+                  block[ y * BRLA_TEX_BLOCK_DIM + x ], 4 );
+        }
+      }
+    }
+  }
+}
@@ -1,18 +1,75 @@
 #include "unity.h"
 
+/** Asset files and collision shapes of the built-in types. */
+static const unity_assets builtin_assets[] = {
+  { "u_flowerpot",
+    "meshes/flowerpot.dae",
+    "textures/png/flowerpot.png",
+    BRLA_PHYS_CYL,
+    BRLA_VERTEX_FULL },
+  // Dense mesh; store it in the quantized vertex format.
+  { "u_test_terrain",
+    "meshes/test_terrain_2.dae",
+    "textures/png/test_terrain_2.png",
+    BRLA_PHYS_STATIC_BVH_TRI,
+    BRLA_VERTEX_COMPACT },
+  { "u_player_mesh",
+    "meshes/player_mesh.dae",
+    "textures/png/player_mesh.png",
+    BRLA_PHYS_CAP,
+    BRLA_VERTEX_FULL },
+  { "u_light_ind",
+    "meshes/light_ind.dae",
+    "textures/png/light_ind.png",
+    BRLA_PHYS_STATIC_SPH,
+    BRLA_VERTEX_FULL },
+  { "u_c_microscope",
+    "meshes/c_microscope.dae",
+    "textures/png/c_microscope.png",
+    BRLA_PHYS_BOX,
+    BRLA_VERTEX_FULL },
+  { "u_c_circuit_1",
+    "meshes/c_circuit_1.dae",
+    "textures/png/c_circuit_1.png",
+    BRLA_PHYS_BOX,
+    BRLA_VERTEX_FULL },
+  { "u_c_toolbox",
+    "meshes/c_toolbox.dae",
+    "textures/png/c_toolbox.png",
+    BRLA_PHYS_BOX,
+    BRLA_VERTEX_FULL }
+};
+
+/**
+ * Look up the asset files of a built-in game object type.
+ * Returns 0 if the type is not recognized.
+ */
+const unity_assets* find_unity_assets( string type ) {
+  int count = sizeof( builtin_assets ) / sizeof( builtin_assets[ 0 ] );
+  for ( int i = 0; i < count; ++i ) {
+    if ( type == builtin_assets[ i ].type ) { return &builtin_assets[ i ]; }
+  }
+  return 0;
+}
+
 /**
  * Shared destructor for the 'unity' game object class.
- * Delete the physics object, the mesh instance,
- * and any attached scripts.
+ * Delete the physics object and any attached scripts, and
+ * release this object's reference to its shared mesh.
  */
 unity::~unity() {
-  if ( m ) {
-    delete m;
-  }
+  // Stop any particle emitters which follow this object.
+  if ( g->pt_man ) { g->pt_man->detach( this ); }
+  // Delete the physics object first, since it may refer
+  // to the mesh's vertex data.
   if ( p_obj ) {
     g->p_man->phys_world->removeRigidBody( p_obj->rigid_body );
     delete p_obj;
   }
+  if ( m ) {
+    g->m_man->release( mesh_fn, v_format );
+    m = 0;
+  }
   for ( int i =0; i < scripts.size(); ++i ) {
     if ( scripts[ i ] ) {
       delete scripts[ i ];
@@ -20,6 +77,20 @@ unity::~unity() {
   }
 }
 
+/**
+ * Internal class method to set a game object's type, and its
+ * asset files / collision shape from the built-in asset table.
+ */
+void unity::use_assets( string u_type ) {
+  type = u_type;
+  const unity_assets* a = find_unity_assets( u_type );
+  if ( !a ) { return; }
+  mesh_fn = a->mesh_fn;
+  texture_fn = a->texture_fn;
+  phys_type = a->phys_type;
+  v_format = a->v_format;
+}
+
 /**
  * Internal class method to generate a game object's data
  * structures once its core attributes such as the
@@ -30,12 +101,17 @@ void unity::gen_unity( v3 u_pos, quat u_rot ) {
   if ( texture_fn != "" && !( g->t_man->get( texture_fn ) ) ) {
     g->t_man->add_mapping_by_fn( texture_fn );
   }
+  tex = g->t_man->get( texture_fn );
 
-  // Load an instance of the mesh data.
-  m = load_mesh( mesh_fn.c_str() );
+  // Take a reference to the shared mesh data, loading it if needed.
+  m = g->m_man->acquire( mesh_fn, v_format );
+  if ( !m ) { return; }
   // Set default position / scale values.
   cur_center = v3( 0, 0, 0 );
   cur_scale = v3( 1, 1, 1 );
+  transform = m->dequant;
+  scaled_transform = scale_matrix( cur_scale );
+  world_bounds = m->bounding_box;
 
   // Generate the physics object.
   float mass = 1.0f;
@@ -63,12 +139,12 @@ void unity::gen_unity( v3 u_pos, quat u_rot ) {
   // take the longest dimension between X / Y / Z and
   // set the collision sphere's radius to half of that.
   if ( phys_type == BRLA_PHYS_SPH ) {
-    float sph_r = m->bounding_box.x_w / 2;
-    if ( m->bounding_box.y_h / 2 > sph_r ) {
-      sph_r = m->bounding_box.y_h / 2;
+    float sph_r = m->phys_bounds.x_w / 2;
+    if ( m->phys_bounds.y_h / 2 > sph_r ) {
+      sph_r = m->phys_bounds.y_h / 2;
     }
-    if (m->bounding_box.z_d / 2 > sph_r) {
-      sph_r = m->bounding_box.z_d / 2;
+    if (m->phys_bounds.z_d / 2 > sph_r) {
+      sph_r = m->phys_bounds.z_d / 2;
     }
     p_obj = new sphere_p_obj( sph_r, mass, b_pos );
   }
@@ -77,50 +153,50 @@ void unity::gen_unity( v3 u_pos, quat u_rot ) {
   // width / length / height. Divide by 2 since the
   // library's constructor expects 'half-extents'.
   else if ( phys_type == BRLA_PHYS_BOX ) {
-    float box_w = m->bounding_box.x_w / 2;
-    float box_h = m->bounding_box.y_h / 2;
-    float box_d = m->bounding_box.z_d / 2;
+    float box_w = m->phys_bounds.x_w / 2;
+    float box_h = m->phys_bounds.y_h / 2;
+    float box_d = m->phys_bounds.z_d / 2;
     p_obj = new box_p_obj( box_w, box_h, box_d, mass, b_pos, b_rot );
   }
   // If the object uses a 'cylinder' shape, take its height along
   // the Y-axis and give it a radius equal to ( X + Z ) / 4.
   else if ( phys_type == BRLA_PHYS_CYL ) {
-    float cyl_h = m->bounding_box.y_h / 2;
-    float cyl_r = ( m->bounding_box.x_w + m->bounding_box.z_d ) / 4;
+    float cyl_h = m->phys_bounds.y_h / 2;
+    float cyl_r = ( m->phys_bounds.x_w + m->phys_bounds.z_d ) / 4;
     p_obj = new cylinder_p_obj( cyl_r, cyl_h, mass, b_pos, b_rot );
   }
   // If the object uses a 'capsule' shape, set the height along
   // the longest axis, and pick the second-longest axis to
   // set the radius from.
   else if ( phys_type == BRLA_PHYS_CAP ) {
-    aabb bb = m->bounding_box;
+    aabb bb = m->phys_bounds;
     float cap_r = 0.0f;
     float cap_h = 0.0f;
     int axis_type = BRLA_PHYS_Y;
     if ( bb.x_w >= bb.y_h && bb.x_w >= bb.z_d ) {
       // X is up, make Y or Z the radius.
-      cap_r = m->bounding_box.z_d / 2;
-      if ( m->bounding_box.y_h / 2 > cap_r ) {
-        cap_r = m->bounding_box.y_h / 2;
+      cap_r = m->phys_bounds.z_d / 2;
+      if ( m->phys_bounds.y_h / 2 > cap_r ) {
+        cap_r = m->phys_bounds.y_h / 2;
       }
-      cap_h = m->bounding_box.x_w - cap_r * 2;
+      cap_h = m->phys_bounds.x_w - cap_r * 2;
       axis_type = BRLA_PHYS_X;
     }
     else if ( bb.y_h >= bb.x_w && bb.y_h >= bb.z_d ) {
       // Y is up, make X or Y the radius.
-      cap_r = m->bounding_box.x_w / 2;
-      if ( m->bounding_box.z_d / 2 > cap_r ) {
-        cap_r = m->bounding_box.z_d / 2;
+      cap_r = m->phys_bounds.x_w / 2;
+      if ( m->phys_bounds.z_d / 2 > cap_r ) {
+        cap_r = m->phys_bounds.z_d / 2;
       }
-      cap_h = m->bounding_box.y_h - cap_r * 2;
+      cap_h = m->phys_bounds.y_h - cap_r * 2;
     }
     else {
       // Z is up, make X or Y the radius.
-      cap_r = m->bounding_box.x_w / 2;
-      if ( m->bounding_box.y_h / 2 > cap_r ) {
-        cap_r = m->bounding_box.y_h / 2;
+      cap_r = m->phys_bounds.x_w / 2;
+      if ( m->phys_bounds.y_h / 2 > cap_r ) {
+        cap_r = m->phys_bounds.y_h / 2;
       }
-      cap_h = m->bounding_box.z_d - cap_r * 2;
+      cap_h = m->phys_bounds.z_d - cap_r * 2;
       axis_type = BRLA_PHYS_Z;
     }
     p_obj = new capsule_p_obj( cap_r, cap_h, mass,
@@ -160,42 +236,49 @@ void unity::update() {
       p_t[ 2 ], p_t[ 6 ], p_t[ 10 ], p_t[ 14 ],
       p_t[ 3 ], p_t[ 7 ], p_t[ 11 ], p_t[ 15 ]
     );
-    m->transform = phys_gl_transform;
-    cur_center = v3( m->transform.t_x(),
-                     m->transform.t_y(),
-                     m->transform.t_z() );
+    // Apply the mesh's dequantization and this object's scale
+    // before its rotation / translation. The mesh's bounds are
+    // stored in dequantized units already.
+    scaled_transform = phys_gl_transform * scale_matrix( cur_scale );
+    transform = scaled_transform * m->dequant;
+    world_bounds = transform_aabb( scaled_transform, m->bounding_box );
+    cur_center = v3( phys_gl_transform.t_x(),
+                     phys_gl_transform.t_y(),
+                     phys_gl_transform.t_z() );
   }
 }
 
-/** Draw the game object. */
+/**
+ * Draw the game object on its own, as a single instance.
+ * Groups of game objects should be submitted to the
+ * global 'render_queue' instead.
+ */
 void unity::draw() {
   // Make sure that there is a valid camera object.
   camera* a_cam = g->c_man->active_camera;
-  if ( !a_cam ) { return; }
-
-  // Apply the model transformation.
-  glBindBuffer( GL_UNIFORM_BUFFER, g->c_man->cam_block_buffer );
-  glBindBufferBase( GL_UNIFORM_BUFFER,
-                    g->c_man->cam_ubo,
-                    g->c_man->cam_block_buffer );
-  glBufferSubData( GL_UNIFORM_BUFFER,
-                   0,
-                   sizeof( float ) * 16,
-                   transpose( m->transform ).m );
+  if ( !a_cam || !m ) { return; }
 
+  // Write the model transformation to the instance buffer.
+  int base = g->m_man->write_instances( transpose( transform ).m, 1 );
   // Apply the texture sampler.
-  texture* m_tex = g->t_man->get( texture_fn );
-  if ( m_tex ) {
-    int tex_loc = glGetUniformLocation( g->s_man->cur_shader,
-                                        "texture_sampler" );
-    glActiveTexture( GL_TEXTURE0 );
-    glBindTexture( GL_TEXTURE_2D, m_tex->tex );
-    glUniform1i( tex_loc, m_tex->tex_sampler );
-  }
+  bind_texture();
   // Bind the Vertex Array Object.
   glBindVertexArray( m->vao );
-  // Draw the mesh vertex data.
-  glDrawArrays( GL_TRIANGLES, 0, m->num_vertices );
+  // Draw the indexed mesh.
+  glDrawElementsInstancedBaseInstance( GL_TRIANGLES,
+                                       m->num_indices,
+                                       m->index_type,
+                                       0, 1, base );
+}
+
+/** Bind this game object's texture, if it has one. */
+void unity::bind_texture() {
+  if ( tex ) {
+    int tex_loc = g->s_man->uniform( BRLA_UNIFORM_TEXTURE_SAMPLER );
+    glActiveTexture( GL_TEXTURE0 );
+    glBindTexture( GL_TEXTURE_2D, tex->tex );
+    glUniform1i( tex_loc, tex->tex_sampler );
+  }
 }
 
 /** Set a given script as this object's 'on-use' script. */
@@ -389,15 +472,18 @@ void unity::rotate_by( quat dr ) {
  * along the X / Y / Z axes.
  */
 void unity::scale( v3 new_scale ) {
-  // Find the scaling ratio, and apply it to the mesh vertices.
-  v3 ds = new_scale / cur_scale;
-  m->scale_by( ds );
-  // Scale the physics object too.
+  // The mesh is shared, so the scale goes into this object's
+  // model matrix rather than into the vertex data.
   cur_scale = new_scale;
-  btVector3 new_phys_scale = btVector3( new_scale.v[ 0 ],
-                                        new_scale.v[ 1 ],
-                                        new_scale.v[ 2 ] );
-  p_obj->c_shape->setLocalScaling( new_phys_scale );
+  // Scale the physics object too.
+  if ( p_obj ) {
+    btVector3 new_phys_scale = btVector3( new_scale.v[ 0 ],
+                                          new_scale.v[ 1 ],
+                                          new_scale.v[ 2 ] );
+    p_obj->c_shape->setLocalScaling( new_phys_scale );
+  }
+  // Re-calculate the model matrix with the new scale.
+  update();
 }
 
 /**
@@ -575,13 +661,16 @@ void unity_manager::update() {
 
 /**
  * Perform the game loop's 'draw' step for the game objects
- * in this manager's array of active objects.
+ * in this manager's array of active objects. Those inside the
+ * active camera's view frustum and not hidden by occluders are queued with the current shader
+ * program in the global render queue, which draws them once
+ * everything has been submitted.
  */
 void unity_manager::draw() {
-  // Just draw each object if it exists.
-  for ( int i = 0; i < unities.size(); ++i ) {
-    if ( unities[ i ] ) { unities[ i ]->draw(); }
-  }
+  camera* a_cam = g->c_man->active_camera;
+  if ( !a_cam ) { return; }
+  g->r_queue->submit_visible( BRLA_PASS_OPAQUE, frustum( a_cam ),
+                              unities, g->o_buf );
 }
 
 /**
@@ -607,70 +696,51 @@ void unity_manager::for_each( function<void( unity* u )> action,
 
 /** Constructor for a 'flowerpot' game object. */
 u_flowerpot::u_flowerpot( v3 pos, quat rot ) {
-  type = "u_flowerpot";
-  texture_fn = "textures/png/flowerpot.png";
-  mesh_fn = "meshes/flowerpot.dae";
-  phys_type = BRLA_PHYS_CYL;
+  use_assets( "u_flowerpot" );
 
   gen_unity( pos, rot );
 }
 
 /** Constructor for a test terrain game object. */
 u_test_terrain::u_test_terrain( v3 pos, quat rot ) {
-  type = "u_test_terrain";
-  texture_fn = "textures/png/test_terrain_2.png";
-  mesh_fn = "meshes/test_terrain_2.dae";
-  phys_type = BRLA_PHYS_STATIC_BVH_TRI;
+  use_assets( "u_test_terrain" );
+  // Hills hide whatever is behind them.
+  occluder = true;
 
   gen_unity( pos, rot );
 }
 
 /** Constructor for the temporary player character game object. */
 u_player_mesh::u_player_mesh( v3 pos, quat rot ) {
-  type = "u_player_mesh";
-  texture_fn = "textures/png/player_mesh.png";
-  mesh_fn = "meshes/player_mesh.dae";
-  phys_type = BRLA_PHYS_CAP;
+  use_assets( "u_player_mesh" );
 
   gen_unity( pos, rot );
 }
 
 /** Constructor for a lighting indicator game object. */
 u_light_ind::u_light_ind( v3 pos, quat rot ) {
-  type = "u_light_ind";
-  texture_fn = "textures/png/light_ind.png";
-  mesh_fn = "meshes/light_ind.dae";
-  phys_type = BRLA_PHYS_STATIC_SPH;
+  use_assets( "u_light_ind" );
 
   gen_unity( pos, rot );
 }
 
 /** Constructor for a 'microscope' game object. */
 u_c_microscope::u_c_microscope( v3 pos, quat rot ) {
-  type = "u_c_microscope";
-  texture_fn = "textures/png/c_microscope.png";
-  mesh_fn = "meshes/c_microscope.dae";
-  phys_type = BRLA_PHYS_BOX;
+  use_assets( "u_c_microscope" );
 
   gen_unity( pos, rot );
 }
 
 /** Constructor for a 'circuit board' game object. */
 u_c_circuit_1::u_c_circuit_1( v3 pos, quat rot ) {
-  type = "u_c_circuit_1";
-  texture_fn = "textures/png/c_circuit_1.png";
-  mesh_fn = "meshes/c_circuit_1.dae";
-  phys_type = BRLA_PHYS_BOX;
+  use_assets( "u_c_circuit_1" );
 
   gen_unity( pos, rot );
 }
 
 /** Constructor for a 'toolbox' game object. */
 u_c_toolbox::u_c_toolbox( v3 pos, quat rot ) {
-	type = "u_c_toolbox";
-	texture_fn = "textures/png/c_toolbox.png";
-	mesh_fn = "meshes/c_toolbox.dae";
-	phys_type = BRLA_PHYS_BOX;
+  use_assets( "u_c_toolbox" );
 
-	gen_unity( pos, rot );
+  gen_unity( pos, rot );
 }
@@ -32,67 +32,147 @@ void fill_float_buffer( float* dest, float* dat,
 }
 
 /**
- * Load a mesh from a file into a 'mesh' data structure.
- * The returned pointer, if not null, must be freed by the caller.
- * In practice, game objects ('unities') will usually
- * take ownerhsip of these pointers.
+ * Import a mesh file using the AssImp library, and collapse it
+ * into flat arrays of vertex positions, normals, and texture
+ * coordinates. On success, the caller owns the returned arrays.
+ * Returns false if the mesh could not be loaded.
  */
-mesh* load_mesh( const char* filename ) {
+bool import_mesh( const char* filename, int& num_verts,
+                  GLfloat*& points, GLfloat*& normals,
+                  GLfloat*& tex_coords ) {
   // Open the file using the AssImp library.
   const aiScene* scene = aiImportFile( filename,
                                        aiProcess_Triangulate );
-  // Log an error and return null if the mesh could not be loaded.
+  // Log an error and return if the mesh could not be loaded.
   if ( !scene ) {
     log_error( "Error loading mesh file: %s\n", filename );
-    return 0;
+    return false;
   }
 
   // Allocate arrays to store the mesh's vertex positions, normals,
-  // and texture coordinates. These arrays are de-allocated by the
-  // mesh object in its destructor.
+  // and texture coordinates.
   aiNode* root_node = scene->mRootNode;
-  int num_verts = count_vertices( root_node, scene, 0 );
-  GLfloat* points = new GLfloat     [ num_verts * 3 ];
-  GLfloat* normals = new GLfloat    [ num_verts * 3 ];
-  GLfloat* tex_coords = new GLfloat [ num_verts * 2 ];
+  num_verts = count_vertices( root_node, scene, 0 );
+  points = new GLfloat     [ num_verts * 3 ];
+  normals = new GLfloat    [ num_verts * 3 ];
+  tex_coords = new GLfloat [ num_verts * 2 ];
   // Traverse and load the mesh's tree structure recursively.
   import_node( root_node, scene, points, normals, tex_coords, 0 );
 
-  // One more pass over the vertices to generate the AABB.
-  // (Axis-Aligned Bounding Box, used for physics and first-pass
-  //  approximations to reduce the amount of geometry processing.)
-  // TODO: I should probably just make this part of the import above,
-  // but I don't feel like passing around half a dozen more args or
-  // making a new class/struct right now.
-  float min_x = 0.0f;
-  float max_x = 0.0f;
-  float min_y = 0.0f;
-  float max_y = 0.0f;
-  float min_z = 0.0f;
-  float max_z = 0.0f;
-  for ( int i = 0; i < num_verts * 3; i += 3 ) {
-    float px = points[ i ];
-    float py = points[ i + 1 ];
-    float pz = points[ i + 2 ];
-    if ( px < min_x ) { min_x = px; }
-    if ( px > max_x ) { max_x = px; }
-    if ( py < min_y ) { min_y = py; }
-    if ( py > max_y ) { max_y = py; }
-    if ( pz < min_z ) { min_z = pz; }
-    if ( pz > max_z ) { max_z = pz; }
-  }
-  float mag_x = max_x - min_x;
-  float mag_y = max_y - min_y;
-  float mag_z = max_z - min_z;
-
-  // Create the actual AABB and Mesh objects.
-  aabb bounding_box = aabb( mag_x, mag_y, mag_z );
-  mesh* m = new mesh( num_verts, points, normals,
-                      tex_coords, bounding_box, id4() );
-
-  // Done; close the AssImp file representation and return the Mesh.
+  // Done; close the AssImp file representation.
   aiReleaseImport( scene );
-  return m;
+  return true;
+}
+
+/**
+ * Find the minimum and maximum X / Y / Z extents of an array of
+ * vertex positions, for generating an AABB.
+ * (Axis-Aligned Bounding Box, used for physics and first-pass
+ *  approximations to reduce the amount of geometry processing.)
+ * The extents are seeded from the first vertex, so they fit the
+ * mesh tightly even if it does not surround its origin; they are
+ * all 0 if there are no vertices.
+ */
+void mesh_extents( int num_verts, GLfloat* points, int stride,
+                   float* min_ext, float* max_ext ) {
+  for ( int i = 0; i < 3; ++i ) {
+    min_ext[ i ] = ( num_verts > 0 ) ? points[ i ] : 0.0f;
+    max_ext[ i ] = min_ext[ i ];
+  }
+  for ( int i = stride; i < num_verts * stride; i += stride ) {
+    for ( int j = 0; j < 3; ++j ) {
+      float pv = points[ i + j ];
+      if ( pv < min_ext[ j ] ) { min_ext[ j ] = pv; }
+      if ( pv > max_ext[ j ] ) { max_ext[ j ] = pv; }
+    }
+  }
+}
+
+/**
+ * Import a mesh file and prepare it for rendering: weld duplicate
+ * vertices into an indexed, interleaved triangle list, reorder the
+ * triangles for the vertex cache and overdraw, then reorder the
+ * vertices for fetch locality. Logs the vertex counts and average
+ * cache miss ratios before and after.
+ * Returns false if the mesh could not be loaded.
+ */
+bool build_mesh_geometry( const char* filename, mesh_geometry& geo ) {
+  int num_verts = 0;
+  GLfloat* points = 0;
+  GLfloat* normals = 0;
+  GLfloat* tex_coords = 0;
+  if ( !import_mesh( filename, num_verts,
+                     points, normals, tex_coords ) ) {
+    return false;
+  }
+  weld_vertices( num_verts, points, normals, tex_coords, geo );
+  delete [] points;
+  delete [] normals;
+  delete [] tex_coords;
+
+  // Un-indexed triangles miss the cache on every vertex.
+  float welded_acmr = calc_acmr( geo.indices, geo.num_vertices(),
+                                 BRLA_VERTEX_CACHE_SIZE );
+  optimize_vertex_cache( geo, BRLA_VERTEX_CACHE_SIZE );
+  optimize_vertex_fetch( geo );
+  float opt_acmr = calc_acmr( geo.indices, geo.num_vertices(),
+                              BRLA_VERTEX_CACHE_SIZE );
+  log( "Mesh %s: %i -> %i vertices, %i-bit indices, "
+       "ACMR 3.00 -> %.2f (welded) -> %.2f (optimized)\n",
+       filename, num_verts, geo.num_vertices(),
+       index_size_for( geo.num_vertices() ) * 8,
+       welded_acmr, opt_acmr );
+  return true;
+}
+
+/**
+ * Load a mesh from a file into a 'mesh' data structure.
+ * If the mesh has an up-to-date binary cache, that is mapped
+ * into memory instead of parsing the source file. Otherwise,
+ * the mesh is imported and optimized, and its cache is (re-)built.
+ * 'v_format' selects the vertex layout used on the GPU.
+ * The returned pointer, if not null, must be freed by the caller.
+ * In practice, the 'mesh_manager' takes ownership of these
+ * pointers and shares them between game objects.
+ */
+mesh* load_mesh( const char* filename, int v_format ) {
+  // Use the binary mesh cache if possible.
+  mesh* m = load_mesh_cache( filename, v_format );
+  if ( m ) { return m; }
+
+  // Import and optimize the mesh data.
+  mesh_geometry geo;
+  if ( !build_mesh_geometry( filename, geo ) ||
+       geo.indices.empty() ) {
+    return 0;
+  }
+
+  // Write the cache, and load the mesh back from it so that it
+  // is laid out the same way as on the next run.
+  if ( write_mesh_cache( filename, geo ) ) {
+    m = load_mesh_cache( filename, v_format );
+    if ( m ) { return m; }
+  }
+
+  // The cache couldn't be used; create the mesh from copies of
+  // the arrays, which are de-allocated by the mesh's destructor.
+  int num_verts = geo.num_vertices();
+  GLfloat* vertices = new GLfloat[ geo.vertices.size() ];
+  memcpy( vertices, &geo.vertices[ 0 ],
+          geo.vertices.size() * sizeof( GLfloat ) );
+  int index_size = index_size_for( num_verts );
+  char* indices = new char[ geo.indices.size() * index_size ];
+  pack_indices( geo.indices, index_size, indices );
+  float min_ext[ 3 ];
+  float max_ext[ 3 ];
+  mesh_extents( num_verts, vertices, BRLA_VERTEX_FLOATS,
+                min_ext, max_ext );
+  aabb bounding_box = aabb( v3( min_ext[ 0 ], min_ext[ 1 ], min_ext[ 2 ] ),
+                            v3( max_ext[ 0 ], max_ext[ 1 ], max_ext[ 2 ] ) );
+  return new mesh( num_verts, vertices, geo.indices.size(),
+                   ( index_size == 2 ) ? GL_UNSIGNED_SHORT :
+                                         GL_UNSIGNED_INT,
+                   indices, bounding_box, v_format );
 }
 
 /**
@@ -100,33 +180,25 @@ mesh* load_mesh( const char* filename ) {
  * information used by this engine to a JSON-formatted file.
  */
 void export_mesh_json( const char* mesh_fn, const char* json_fn ) {
-  // Open the file using the AssImp library.
-  // TODO: Move this shared mesh-import logic into a separate method.
-  const aiScene* scene = aiImportFile( mesh_fn,
-                                       aiProcess_Triangulate );
-  // Log an error and return null if the mesh could not be loaded.
-  if ( !scene ) {
-    log_error( "Couldn't load mesh file: %s\n", mesh_fn );
+  // Import the core mesh data.
+  int num_verts = 0;
+  GLfloat* points = 0;
+  GLfloat* normals = 0;
+  GLfloat* tex_coords = 0;
+  if ( !import_mesh( mesh_fn, num_verts,
+                     points, normals, tex_coords ) ) {
     return;
   }
 
-  // Allocate arrays to store the mesh's vertex positions, normals,
-  // and texture coordinates. These arrays are de-allocated by the
-  // mesh object in its destructor.
-  aiNode* root_node = scene->mRootNode;
-  int num_verts = count_vertices( root_node, scene, 0 );
-  GLfloat* points = new GLfloat     [ num_verts * 3 ];
-  GLfloat* normals = new GLfloat    [ num_verts * 3 ];
-  GLfloat* tex_coords = new GLfloat [ num_verts * 2 ];
-  // Traverse and load the mesh's tree structure.
-  import_node( root_node, scene, points, normals, tex_coords, 0 );
-
   // Export the core mesh data to JSON.
   // Open the target JSON file.
   FILE* file = fopen( json_fn, "w" );
   // Log an error and return if the target file couldn't be opened.
   if ( !file ) {
     log_error( "Couldn't open file for writing: %s\n", json_fn );
+    delete [] points;
+    delete [] normals;
+    delete [] tex_coords;
     return;
   }
 
@@ -160,6 +232,9 @@ void export_mesh_json( const char* mesh_fn, const char* json_fn ) {
 
   // Done; close the JSON file.
   fclose( file );
+  delete [] points;
+  delete [] normals;
+  delete [] tex_coords;
 }
 
 /**
@@ -266,9 +341,11 @@ int count_vertices( const aiNode* cur_node,
  * AssImp mesh import helper method: recursively import vertex
  * position, normal, and texture information for a given 'node'
  * and its children in AssImp's mesh tree import structure.
+ * 'index' is the first vertex to write to; returns the
+ * vertex index after the last one written.
  */
-void import_node( const aiNode* cur_node, const aiScene* scene,
-                  GLfloat* p, GLfloat* n, GLfloat* t, int index ) {
+int import_node( const aiNode* cur_node, const aiScene* scene,
+                 GLfloat* p, GLfloat* n, GLfloat* t, int index ) {
   // Track the current index in position/normal/texture arrays.
   int new_index = index;
   // Import the mesh data from each AssImp 'mesh' in the current node.
@@ -288,8 +365,8 @@ void import_node( const aiNode* cur_node, const aiScene* scene,
     // Store each vertex's position / normal / texture coordinates
     // in the corresponding GLFloat arrays.
     for ( int j = 0; j < mesh_vertices; ++j ) {
-      int b_i = new_index + ( j * 3 );
-      int t_i = new_index + ( j * 2 );
+      int b_i = ( new_index + j ) * 3;
+      int t_i = ( new_index + j ) * 2;
 
       // Position values.
       if ( m->HasPositions() ) {
@@ -352,9 +429,12 @@ void import_node( const aiNode* cur_node, const aiScene* scene,
   // Done with this node, now process any child nodes in the mesh.
   const int num_children = cur_node->mNumChildren;
   for ( int i = 0; i < num_children; ++i ) {
-    import_node( cur_node->mChildren[ i ],
-                 scene, p, n, t, new_index );
+    new_index = import_node( cur_node->mChildren[ i ],
+                             scene, p, n, t, new_index );
   }
+
+  // Return the index after this node's vertices.
+  return new_index;
 }
 
 /**